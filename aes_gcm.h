@@ -0,0 +1,438 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define AES_GCM_HARDWARE 1
+#include <immintrin.h>
+#endif
+
+// AES-256-GCM (NIST SP 800-38D) with a 96-bit nonce and a 128-bit tag,
+// encrypting and decrypting in place. Where the CPU has AES-NI and PCLMULQDQ
+// (checked once, when the key is set) the block cipher runs on AESENC, four or
+// eight counter blocks side by side, and GHASH on carry-less multiplies,
+// folding up to four blocks per reduction. Otherwise a portable byte-wise implementation is used;
+// it is slow, but gives the same results.
+
+namespace aes_gcm_detail {
+
+constexpr uint8_t SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+constexpr size_t ROUNDS = 14;
+
+inline uint8_t xtime(uint8_t x) {
+    return static_cast<uint8_t>((x << 1) ^ ((x >> 7) * 0x1b));
+}
+
+// FIPS-197 key schedule. The round keys come out in the byte order AESENC
+// takes them in, so both implementations share it.
+inline void expand_key(const uint8_t key[32], uint8_t round_keys[(ROUNDS + 1) * 16]) {
+    memcpy(round_keys, key, 32);
+    uint8_t rcon = 1;
+    for (size_t i = 8; i < (ROUNDS + 1) * 4; i++) {
+        uint8_t t[4];
+        memcpy(t, round_keys + (i - 1) * 4, 4);
+        if (i % 8 == 0) {
+            uint8_t first = t[0];
+            t[0] = static_cast<uint8_t>(SBOX[t[1]] ^ rcon);
+            t[1] = SBOX[t[2]];
+            t[2] = SBOX[t[3]];
+            t[3] = SBOX[first];
+            rcon = xtime(rcon);
+        } else if (i % 8 == 4) {
+            for (int j = 0; j < 4; j++) {
+                t[j] = SBOX[t[j]];
+            }
+        }
+        for (int j = 0; j < 4; j++) {
+            round_keys[i * 4 + j] = round_keys[(i - 8) * 4 + j] ^ t[j];
+        }
+    }
+}
+
+inline void encrypt_block(const uint8_t* round_keys, const uint8_t in[16], uint8_t out[16]) {
+    uint8_t s[16];
+    for (int i = 0; i < 16; i++) {
+        s[i] = in[i] ^ round_keys[i];
+    }
+    for (size_t round = 1; round <= ROUNDS; round++) {
+        // SubBytes and ShiftRows; byte r + 4c is row r of column c
+        uint8_t t[16];
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                t[r + 4 * c] = SBOX[s[r + 4 * ((c + r) & 3)]];
+            }
+        }
+        if (round < ROUNDS) {
+            for (int c = 0; c < 4; c++) {
+                uint8_t* col = t + 4 * c;
+                uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+                uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+                col[0] = a0 ^ all ^ xtime(a0 ^ a1);
+                col[1] = a1 ^ all ^ xtime(a1 ^ a2);
+                col[2] = a2 ^ all ^ xtime(a2 ^ a3);
+                col[3] = a3 ^ all ^ xtime(a3 ^ a0);
+            }
+        }
+        for (int i = 0; i < 16; i++) {
+            s[i] = t[i] ^ round_keys[round * 16 + i];
+        }
+    }
+    memcpy(out, s, 16);
+}
+
+inline uint64_t load_be64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+inline void store_be64(uint8_t* p, uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = static_cast<uint8_t>(v);
+        v >>= 8;
+    }
+}
+
+// Y = Y * H in GF(2^128), bit-serial (SP 800-38D algorithm 1)
+inline void gf_multiply(uint64_t& y_hi, uint64_t& y_lo, uint64_t h_hi, uint64_t h_lo) {
+    uint64_t z_hi = 0, z_lo = 0;
+    uint64_t v_hi = h_hi, v_lo = h_lo;
+    for (int i = 0; i < 128; i++) {
+        uint64_t bit = i < 64 ? (y_hi >> (63 - i)) & 1 : (y_lo >> (127 - i)) & 1;
+        uint64_t mask = 0 - bit;
+        z_hi ^= v_hi & mask;
+        z_lo ^= v_lo & mask;
+        uint64_t carry = v_lo & 1;
+        v_lo = (v_lo >> 1) | (v_hi << 63);
+        v_hi = (v_hi >> 1) ^ ((0 - carry) & 0xe100000000000000ULL);
+    }
+    y_hi = z_hi;
+    y_lo = z_lo;
+}
+
+}  // namespace aes_gcm_detail
+
+class AesGcm256 {
+public:
+    static constexpr size_t KEY_SIZE = 32;
+    static constexpr size_t NONCE_SIZE = 12;
+    static constexpr size_t TAG_SIZE = 16;
+
+    void set_key(const uint8_t key[KEY_SIZE]) {
+        aes_gcm_detail::expand_key(key, round_keys_);
+        uint8_t h[16] = {};
+        aes_gcm_detail::encrypt_block(round_keys_, h, h);
+        h_hi_ = aes_gcm_detail::load_be64(h);
+        h_lo_ = aes_gcm_detail::load_be64(h + 8);
+#if defined(AES_GCM_HARDWARE)
+        hardware_ = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+        if (hardware_) {
+            init_hash_powers(h);
+        }
+#endif
+    }
+
+    bool hardware() const { return hardware_; }
+
+    // Encrypt data in place and write its tag
+    void seal(const uint8_t nonce[NONCE_SIZE], const uint8_t* aad, size_t aad_length,
+              uint8_t* data, size_t length, uint8_t tag[TAG_SIZE]) const {
+        crypt(nonce, aad, aad_length, data, length, true, tag);
+    }
+
+    // Decrypt data in place if tag matches. Otherwise data is left as it was
+    // and false is returned.
+    bool open(const uint8_t nonce[NONCE_SIZE], const uint8_t* aad, size_t aad_length,
+              uint8_t* data, size_t length, const uint8_t tag[TAG_SIZE]) const {
+        uint8_t expected[TAG_SIZE];
+        crypt(nonce, aad, aad_length, data, length, false, expected);
+        uint8_t diff = 0;
+        for (size_t i = 0; i < TAG_SIZE; i++) {
+            diff |= expected[i] ^ tag[i];
+        }
+        if (diff != 0) {
+            // CTR mode is its own inverse
+            crypt(nonce, aad, aad_length, data, length, true, expected);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    alignas(16) uint8_t round_keys_[(aes_gcm_detail::ROUNDS + 1) * 16];
+    uint64_t h_hi_ = 0;
+    uint64_t h_lo_ = 0;
+    alignas(16) uint8_t hash_powers_[4][16];  // H^1..H^4, byte-reversed, for PCLMULQDQ
+    bool hardware_ = false;
+
+    // CTR over data and GHASH over the ciphertext: the output when encrypting,
+    // the input when not. tag receives the computed tag either way.
+    void crypt(const uint8_t nonce[NONCE_SIZE], const uint8_t* aad, size_t aad_length,
+               uint8_t* data, size_t length, bool encrypt, uint8_t tag[TAG_SIZE]) const {
+#if defined(AES_GCM_HARDWARE)
+        if (hardware_) {
+            crypt_hardware(nonce, aad, aad_length, data, length, encrypt, tag);
+            return;
+        }
+#endif
+        crypt_portable(nonce, aad, aad_length, data, length, encrypt, tag);
+    }
+
+    void ghash_portable(uint64_t& y_hi, uint64_t& y_lo, const uint8_t* data, size_t length) const {
+        for (size_t pos = 0; pos < length; pos += 16) {
+            uint8_t block[16] = {};
+            memcpy(block, data + pos, length - pos < 16 ? length - pos : 16);
+            y_hi ^= aes_gcm_detail::load_be64(block);
+            y_lo ^= aes_gcm_detail::load_be64(block + 8);
+            aes_gcm_detail::gf_multiply(y_hi, y_lo, h_hi_, h_lo_);
+        }
+    }
+
+    void crypt_portable(const uint8_t nonce[NONCE_SIZE], const uint8_t* aad, size_t aad_length,
+                        uint8_t* data, size_t length, bool encrypt, uint8_t tag[TAG_SIZE]) const {
+        uint8_t counter[16];
+        memcpy(counter, nonce, NONCE_SIZE);
+        uint64_t y_hi = 0, y_lo = 0;
+        ghash_portable(y_hi, y_lo, aad, aad_length);
+        if (!encrypt) {
+            ghash_portable(y_hi, y_lo, data, length);
+        }
+        uint32_t block_number = 2;
+        for (size_t pos = 0; pos < length; pos += 16, block_number++) {
+            counter[12] = static_cast<uint8_t>(block_number >> 24);
+            counter[13] = static_cast<uint8_t>(block_number >> 16);
+            counter[14] = static_cast<uint8_t>(block_number >> 8);
+            counter[15] = static_cast<uint8_t>(block_number);
+            uint8_t stream[16];
+            aes_gcm_detail::encrypt_block(round_keys_, counter, stream);
+            size_t n = length - pos < 16 ? length - pos : 16;
+            for (size_t i = 0; i < n; i++) {
+                data[pos + i] ^= stream[i];
+            }
+        }
+        if (encrypt) {
+            ghash_portable(y_hi, y_lo, data, length);
+        }
+        y_hi ^= static_cast<uint64_t>(aad_length) * 8;
+        y_lo ^= static_cast<uint64_t>(length) * 8;
+        aes_gcm_detail::gf_multiply(y_hi, y_lo, h_hi_, h_lo_);
+
+        uint8_t s[16];
+        aes_gcm_detail::store_be64(s, y_hi);
+        aes_gcm_detail::store_be64(s + 8, y_lo);
+        counter[12] = 0;
+        counter[13] = 0;
+        counter[14] = 0;
+        counter[15] = 1;
+        aes_gcm_detail::encrypt_block(round_keys_, counter, tag);
+        for (int i = 0; i < 16; i++) {
+            tag[i] ^= s[i];
+        }
+    }
+
+#if defined(AES_GCM_HARDWARE)
+    // GHASH blocks are byte-reversed on load so that the field elements sit in
+    // the registers as plain 128-bit integers (Intel's carry-less multiply
+    // white paper, algorithm 5)
+    __attribute__((target("ssse3"))) static __m128i reverse(__m128i x) {
+        return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    }
+
+    // Unreduced 256-bit product, accumulated into lo/hi
+    __attribute__((target("pclmul"))) static void multiply_add(__m128i a, __m128i b, __m128i& lo, __m128i& hi) {
+        __m128i low = _mm_clmulepi64_si128(a, b, 0x00);
+        __m128i high = _mm_clmulepi64_si128(a, b, 0x11);
+        __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+        lo = _mm_xor_si128(lo, _mm_xor_si128(low, _mm_slli_si128(middle, 8)));
+        hi = _mm_xor_si128(hi, _mm_xor_si128(high, _mm_srli_si128(middle, 8)));
+    }
+
+    // Shift the 256-bit product left one bit (the operands are bit-reflected)
+    // and reduce it modulo x^128 + x^7 + x^2 + x + 1
+    __attribute__((target("sse2"))) static __m128i reduce(__m128i lo, __m128i hi) {
+        __m128i lo_carry = _mm_srli_epi32(lo, 31);
+        __m128i hi_carry = _mm_srli_epi32(hi, 31);
+        lo = _mm_slli_epi32(lo, 1);
+        hi = _mm_slli_epi32(hi, 1);
+        __m128i across = _mm_srli_si128(lo_carry, 12);
+        hi_carry = _mm_slli_si128(hi_carry, 4);
+        lo_carry = _mm_slli_si128(lo_carry, 4);
+        lo = _mm_or_si128(lo, lo_carry);
+        hi = _mm_or_si128(_mm_or_si128(hi, hi_carry), across);
+
+        __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+        __m128i spill = _mm_srli_si128(a, 4);
+        lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+        __m128i b = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+        b = _mm_xor_si128(b, spill);
+        return _mm_xor_si128(hi, _mm_xor_si128(lo, b));
+    }
+
+    __attribute__((target("pclmul,sse2"))) static __m128i multiply(__m128i a, __m128i b) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        multiply_add(a, b, lo, hi);
+        return reduce(lo, hi);
+    }
+
+    __attribute__((target("pclmul,ssse3"))) void init_hash_powers(const uint8_t h[16]) {
+        __m128i h1 = reverse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h)));
+        __m128i power = h1;
+        for (int i = 0; i < 4; i++) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(hash_powers_[i]), power);
+            power = multiply(power, h1);
+        }
+    }
+
+    // y = (y + x0) H^n + x1 H^(n-1) + ... + x(n-1) H, n <= 4, with a single
+    // reduction
+    __attribute__((target("pclmul,ssse3"))) __m128i ghash_blocks(__m128i y, const __m128i* x, size_t n) const {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        for (size_t i = 0; i < n; i++) {
+            __m128i block = reverse(x[i]);
+            if (i == 0) {
+                block = _mm_xor_si128(block, y);
+            }
+            multiply_add(block, _mm_load_si128(reinterpret_cast<const __m128i*>(hash_powers_[n - 1 - i])), lo, hi);
+        }
+        return reduce(lo, hi);
+    }
+
+    __attribute__((target("pclmul,ssse3"))) __m128i ghash_bytes(__m128i y, const uint8_t* data, size_t length) const {
+        __m128i x[4];
+        size_t n = 0;
+        for (size_t pos = 0; pos < length; pos += 16) {
+            if (length - pos >= 16) {
+                x[n] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+            } else {
+                alignas(16) uint8_t block[16] = {};
+                memcpy(block, data + pos, length - pos);
+                x[n] = _mm_load_si128(reinterpret_cast<const __m128i*>(block));
+            }
+            if (++n == 4) {
+                y = ghash_blocks(y, x, n);
+                n = 0;
+            }
+        }
+        return n > 0 ? ghash_blocks(y, x, n) : y;
+    }
+
+    __attribute__((target("sse4.1"))) static __m128i counter_block(__m128i j0, uint32_t block_number) {
+        return _mm_insert_epi32(j0, static_cast<int>(__builtin_bswap32(block_number)), 3);
+    }
+
+    // N counter blocks through the cipher side by side, so the AESENC
+    // latency of one block hides behind the others
+    template <size_t N>
+    __attribute__((target("aes"))) static void encrypt_lanes(__m128i* s, const __m128i* rk) {
+        for (size_t i = 0; i < N; i++) {
+            s[i] = _mm_xor_si128(s[i], rk[0]);
+        }
+        for (size_t r = 1; r < aes_gcm_detail::ROUNDS; r++) {
+            for (size_t i = 0; i < N; i++) {
+                s[i] = _mm_aesenc_si128(s[i], rk[r]);
+            }
+        }
+        for (size_t i = 0; i < N; i++) {
+            s[i] = _mm_aesenclast_si128(s[i], rk[aes_gcm_detail::ROUNDS]);
+        }
+    }
+
+    // Data goes through in batches of four or eight blocks. The first batch
+    // also carries the tag's counter block, so a short message costs a single
+    // pass of the cipher.
+    __attribute__((target("aes,pclmul,sse4.1,ssse3")))
+    void crypt_hardware(const uint8_t nonce[NONCE_SIZE], const uint8_t* aad, size_t aad_length,
+                        uint8_t* data, size_t length, bool encrypt, uint8_t tag[TAG_SIZE]) const {
+        __m128i rk[aes_gcm_detail::ROUNDS + 1];
+        for (size_t r = 0; r <= aes_gcm_detail::ROUNDS; r++) {
+            rk[r] = _mm_load_si128(reinterpret_cast<const __m128i*>(round_keys_ + r * 16));
+        }
+        alignas(16) uint8_t j0_bytes[16] = {};
+        memcpy(j0_bytes, nonce, NONCE_SIZE);
+        __m128i j0 = _mm_load_si128(reinterpret_cast<const __m128i*>(j0_bytes));
+
+        __m128i y = ghash_bytes(_mm_setzero_si128(), aad, aad_length);
+        __m128i tag_mask = _mm_setzero_si128();
+        bool first = true;
+        uint32_t block_number = 2;
+        size_t pos = 0;
+        while (first || pos < length) {
+            size_t lane0 = first ? 1 : 0;
+            size_t remaining = (length - pos + 15) / 16;
+            size_t lanes = lane0 + remaining > 4 ? 8 : 4;
+            size_t blocks = remaining < lanes - lane0 ? remaining : lanes - lane0;
+
+            __m128i s[8];
+            if (first) {
+                s[0] = counter_block(j0, 1);
+            }
+            for (size_t i = lane0; i < lanes; i++) {
+                s[i] = counter_block(j0, block_number + static_cast<uint32_t>(i - lane0));
+            }
+            if (lanes == 8) {
+                encrypt_lanes<8>(s, rk);
+            } else {
+                encrypt_lanes<4>(s, rk);
+            }
+            if (first) {
+                tag_mask = s[0];
+                first = false;
+            }
+
+            __m128i ciphertext[8];
+            for (size_t i = 0; i < blocks; i++, pos += 16) {
+                __m128i stream = s[lane0 + i];
+                if (length - pos >= 16) {
+                    __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+                    __m128i out = _mm_xor_si128(in, stream);
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(data + pos), out);
+                    ciphertext[i] = encrypt ? out : in;
+                    continue;
+                }
+                // GHASH sees the final partial block zero padded
+                size_t n = length - pos;
+                alignas(16) uint8_t block[16] = {};
+                memcpy(block, data + pos, n);
+                __m128i in = _mm_load_si128(reinterpret_cast<const __m128i*>(block));
+                _mm_store_si128(reinterpret_cast<__m128i*>(block), _mm_xor_si128(in, stream));
+                memcpy(data + pos, block, n);
+                memset(block + n, 0, 16 - n);
+                ciphertext[i] = encrypt ? _mm_load_si128(reinterpret_cast<const __m128i*>(block)) : in;
+                pos = length - 16;  // the loop step lands pos on length
+            }
+            for (size_t i = 0; i < blocks; i += 4) {
+                y = ghash_blocks(y, ciphertext + i, blocks - i < 4 ? blocks - i : 4);
+            }
+            block_number += static_cast<uint32_t>(blocks);
+        }
+
+        __m128i lengths = _mm_set_epi64x(static_cast<long long>(aad_length * 8), static_cast<long long>(length * 8));
+        y = multiply(_mm_xor_si128(y, lengths), _mm_load_si128(reinterpret_cast<const __m128i*>(hash_powers_[0])));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(tag), _mm_xor_si128(reverse(y), tag_mask));
+    }
+#endif
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Exchange time in microseconds. Runs off the host's steady clock from a
+// chosen starting point, optionally faster than real time so that a whole
+// trading day can be replayed in minutes.
+class ExchangeClock {
+public:
+    explicit ExchangeClock(uint64_t start_us = 0, double speed = 1.0) {
+        set(start_us, speed);
+    }
+
+    // Restart the clock at start_us
+    void set(uint64_t start_us, double speed = 1.0) {
+        base_us_ = start_us;
+        speed_ = speed > 0.0 ? speed : 1.0;
+        wall_base_ = std::chrono::steady_clock::now();
+    }
+
+    // Change the acceleration factor without a jump in exchange time
+    void set_speed(double speed) {
+        set(now(), speed);
+    }
+
+    uint64_t now() const {
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - wall_base_).count();
+        return base_us_ + static_cast<uint64_t>(static_cast<double>(elapsed) * speed_);
+    }
+
+    double speed() const { return speed_; }
+
+    // Current wall-clock time as microseconds since the epoch
+    static uint64_t system_now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    uint64_t base_us_ = 0;
+    double speed_ = 1.0;
+    std::chrono::steady_clock::time_point wall_base_;
+};
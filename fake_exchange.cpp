@@ -3,14 +3,45 @@
 #include <cstring>
 #include <chrono>
 #include <iostream>
+#include <fstream>
 #include <map>
+#include <atomic>
+#include <thread>
+#include <cerrno>
+#include <sys/random.h>
 
 // FakeNSEExchange Implementation
-FakeNSEExchange::FakeNSEExchange() {
+FakeNSEExchange::FakeNSEExchange()
+    : exchange_clock_(ExchangeClock::system_now()),
+      timer_wheel_(1000, exchange_clock_.now()) {
     memset(&current_market_status_, 0, sizeof(current_market_status_));
     memset(&current_ex_market_status_, 0, sizeof(current_ex_market_status_));
     memset(&current_pl_market_status_, 0, sizeof(current_pl_market_status_));
     markets_are_opening_ = false;
+    trade_request_limit_ = 0;
+    trade_request_day_ = 0;
+    spread_implied_matching_ = false;
+    preopen_session_active_ = false;
+    next_fill_number_ = 1;
+    session_phase_ = SessionPhase::Closed;
+    index_broadcast_interval_ = 0;
+    index_broadcast_timer_ = TimerWheel::INVALID_TIMER;
+    enhanced_market_feed_ = false;
+    market_feed_interval_ = 0;
+    market_feed_timer_ = TimerWheel::INVALID_TIMER;
+    price_band_width_bps_ = 1000;
+    next_freeze_id_ = 1;
+    freeze_decision_delay_ = 0;
+    self_trade_key_ = SelfTradeKey::Off;
+    self_trade_action_ = SelfTradeAction::CancelIncoming;
+    packet_framing_ = false;
+    output_connection_ = 0;
+    request_trader_ = 0;
+    heartbeat_interval_ = 30ULL * 1000000ULL;
+    idle_timeout_ = 90ULL * 1000000ULL;
+    next_gateway_ = 0;
+    session_key_seed_ = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    session_encryption_ = false;
 }
 
 // FakeNSEExchange Destructor
@@ -18,7 +49,8 @@ FakeNSEExchange::~FakeNSEExchange() = default;
 
 // Set the message callback for sending responses
 void FakeNSEExchange::set_message_callback(std::function<void(const uint8_t*, size_t)> callback) {
-    message_callback_ = callback;
+    client_callback_ = callback;
+    install_message_callback();
 }
 
 // Set the market status based on the provided parameters
@@ -111,6 +143,14 @@ bool FakeNSEExchange::is_valid_modification(const MS_OE_REQUEST& original_order,
     if (modification->Volume <= 0) {
         return false;
     }
+    // Cancelled or fully traded orders cannot be modified, and the new volume
+    // must leave something open beyond what has already traded
+    if (original_order.Volume == 0 || original_order.TotalVolumeRemaining == 0) {
+        return false;
+    }
+    if (modification->Volume <= original_order.VolumeFilledToday) {
+        return false;
+    }
     if (modification->Price <= 0 && !original_order.OrderFlags.Market) {
         return false;
     }
@@ -209,32 +249,47 @@ bool FakeNSEExchange::is_contract_match(const MS_OE_REQUEST* order, const CONTRA
     return true;
 }
 
-std::string FakeNSEExchange::generate_trade_request_key(int32_t fill_number, int32_t trader_id, const std::string& operation) {
-    return operation + "_" + std::to_string(fill_number) + "_" + std::to_string(trader_id);
+// Pack (fill number, trader, operation) into a single 64-bit key:
+// fill number in the high 32 bits, 31 bits of trader ID, operation in the low bit
+uint64_t FakeNSEExchange::generate_trade_request_key(int32_t fill_number, int32_t trader_id, TradeRequestOp operation) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(fill_number)) << 32) |
+           (static_cast<uint64_t>(static_cast<uint32_t>(trader_id) & 0x7FFFFFFFu) << 1) |
+           static_cast<uint64_t>(operation);
 }
 
-bool FakeNSEExchange::is_duplicate_trade_request(int32_t fill_number, int32_t trader_id, const std::string& operation) {
-    std::string key = generate_trade_request_key(fill_number, trader_id, operation);
-    
-    if (operation == "modify") {
-        return trade_modification_requests_.find(key) != trade_modification_requests_.end();
-    } else if (operation == "cancel") {
-        return trade_cancellation_requests_.find(key) != trade_cancellation_requests_.end();
+bool FakeNSEExchange::is_duplicate_trade_request(int32_t fill_number, int32_t trader_id, TradeRequestOp operation) const {
+    uint64_t key = generate_trade_request_key(fill_number, trader_id, operation);
+    return trade_requests_.contains(key) || trade_requests_previous_.contains(key);
+}
+
+void FakeNSEExchange::mark_trade_request(int32_t fill_number, int32_t trader_id, TradeRequestOp operation) {
+    // Bounded mode: retire the full generation and start a fresh one in its storage
+    if (trade_request_limit_ != 0 && trade_requests_.size() >= trade_request_limit_) {
+        std::swap(trade_requests_, trade_requests_previous_);
+        trade_requests_.clear();
     }
-    
-    return false;
+    trade_requests_.insert(generate_trade_request_key(fill_number, trader_id, operation));
 }
 
-void FakeNSEExchange::mark_trade_request(int32_t fill_number, int32_t trader_id, const std::string& operation) {
-    std::string key = generate_trade_request_key(fill_number, trader_id, operation);
-    
-    if (operation == "modify") {
-        trade_modification_requests_.insert(key);
-    } else if (operation == "cancel") {
-        trade_cancellation_requests_.insert(key);
+// Trade requests are only de-duplicated within a trading day
+void FakeNSEExchange::roll_trade_request_day(uint64_t ts) {
+    uint64_t day = ts / 86400000000ULL;
+    if (day != trade_request_day_) {
+        trade_request_day_ = day;
+        reset_trade_requests();
     }
 }
 
+void FakeNSEExchange::reset_trade_requests() {
+    trade_requests_.clear();
+    trade_requests_previous_.clear();
+}
+
+void FakeNSEExchange::set_trade_request_dedup_limit(size_t max_entries) {
+    trade_request_limit_ = max_entries;
+    std::cout << "Set trade request dedup limit to: " << (max_entries == 0 ? std::string("UNBOUNDED") : std::to_string(max_entries)) << std::endl;
+}
+
 bool FakeNSEExchange::is_trade_owner(const MS_TRADE_INQ_DATA& trade, int32_t trader_id, const std::string& broker_id) {
     // Check if trader ID matches (as per documentation)
     if (trade.TraderId == trader_id) {
@@ -318,6 +373,9 @@ bool FakeNSEExchange::is_valid_trade_modification(const MS_TRADE_INQ_DATA* req)
 // Parses the incoming buffer and dispatches messages to appropriate handlers
 size_t FakeNSEExchange::parse(const uint8_t* buf, size_t buflen, uint64_t ts, bool& error) {
     error = false;
+    if (packet_framing_) {
+        return parse_packets(buf, buflen, ts, error);
+    }
     size_t total_seen = 0;
     
     while (total_seen < buflen) {
@@ -366,8 +424,59 @@ size_t FakeNSEExchange::try_parse_message(const uint8_t* buf, size_t remaining,
         header->MessageLength > remaining) {
         return 0;
     }
+    request_trader_ = header->TraderId;
     
     switch (header->TransactionCode) {
+        case TransactionCodes::GR_REQUEST: {
+            if (header->MessageLength < sizeof(MS_GR_REQUEST)) {
+                error = true;
+                return 0;
+            }
+            const MS_GR_REQUEST* req = reinterpret_cast<const MS_GR_REQUEST*>(buf);
+            handle_gr_request(req, ts);
+            break;
+        }
+
+        case TransactionCodes::SECURE_BOX_REGISTRATION_REQUEST_IN: {
+            if (header->MessageLength < sizeof(MS_SECURE_BOX_REGISTRATION_REQUEST_IN)) {
+                error = true;
+                return 0;
+            }
+            const MS_SECURE_BOX_REGISTRATION_REQUEST_IN* req = reinterpret_cast<const MS_SECURE_BOX_REGISTRATION_REQUEST_IN*>(buf);
+            handle_secure_box_registration(req, ts);
+            break;
+        }
+
+        case TransactionCodes::BOX_SIGN_ON_REQUEST_IN: {
+            if (header->MessageLength < sizeof(MS_BOX_SIGN_ON_REQUEST_IN)) {
+                error = true;
+                return 0;
+            }
+            const MS_BOX_SIGN_ON_REQUEST_IN* req = reinterpret_cast<const MS_BOX_SIGN_ON_REQUEST_IN*>(buf);
+            handle_box_sign_on_request(req, ts);
+            break;
+        }
+
+        case TransactionCodes::BOX_SIGN_OFF: {
+            if (header->MessageLength < sizeof(MS_BOX_SIGN_OFF)) {
+                error = true;
+                return 0;
+            }
+            const MS_BOX_SIGN_OFF* req = reinterpret_cast<const MS_BOX_SIGN_OFF*>(buf);
+            handle_box_sign_off(req, ts);
+            break;
+        }
+
+        case TransactionCodes::HEARTBEAT: {
+            if (header->MessageLength < sizeof(HEARTBEAT)) {
+                error = true;
+                return 0;
+            }
+            const HEARTBEAT* req = reinterpret_cast<const HEARTBEAT*>(buf);
+            handle_heartbeat(req, ts);
+            break;
+        }
+
         case TransactionCodes::SIGNON_REQUEST_IN: {
             if (header->MessageLength < sizeof(MS_SIGNON_REQUEST_IN)) {
                 error = true;
@@ -583,6 +692,7 @@ void FakeNSEExchange::handle_signon_request(const MS_SIGNON_REQUEST_IN* req, uin
     
     if (sign_on_successful) {
         logged_in_traders_.insert(req->Header.TraderId);
+        trader_connections_[req->Header.TraderId] = output_connection_;
         
         // Send successful sign-on response
         send_signon_response(req, ts, ErrorCodes::SUCCESS);
@@ -647,6 +757,7 @@ void FakeNSEExchange::handle_signoff_request(const MS_SIGNOFF* req, uint64_t ts)
     
     // Remove trader from logged in set and store the logoff time
     logged_in_traders_.erase(req->Header.TraderId);
+    trader_connections_.erase(req->Header.TraderId);
     trader_last_logoff_time_[req->Header.TraderId] = static_cast<int32_t>(ts / 1000000);
     std::cout << "Trader " << req->Header.TraderId << " successfully logged off" << std::endl;
     
@@ -1095,6 +1206,12 @@ void FakeNSEExchange::handle_order_entry_request(const MS_OE_REQUEST* req, uint6
         }
     }
     
+    if (!is_within_price_band(req->TokenNo, req->Price, req->OrderFlags.Market)) {
+        std::cout << "Order rejected - price " << req->Price << " outside the price band" << std::endl;
+        send_order_response(req, ts, TransactionCodes::ORDER_ERROR_OUT, ErrorCodes::OE_PRICE_EXCEEDS_DAY_MIN_MAX);
+        return;
+    }
+    
     // Simulate different order scenarios
     
     // Check if market is open
@@ -1104,98 +1221,96 @@ void FakeNSEExchange::handle_order_entry_request(const MS_OE_REQUEST* req, uint6
         send_order_response(req, ts, TransactionCodes::PRICE_CONFIRMATION, ErrorCodes::SUCCESS);
     }
     
-    // Simulate order processing outcomes (randomly for demo)
-    int outcome = rand() % 100;
-    
-    if (outcome < 70) {
-        std::cout << "Order confirmed normally" << std::endl;
-        send_order_response(req, ts, TransactionCodes::ORDER_CONFIRMATION_OUT, ErrorCodes::SUCCESS, ReasonCodes::NORMAL_CONFIRMATION);
-        
-    } else if (outcome < 85) {
+    // Orders beyond the contract's freeze limits wait for approval instead of matching
+    int16_t reason = freeze_reason(req->TokenNo, req->Volume, req->Price, req->OrderFlags.Market);
+    if (reason != 0) {
         std::cout << "Order frozen - awaiting exchange approval" << std::endl;
-        
-        // Determine freeze type
-        int16_t freeze_reason = (outcome % 2 == 0) ? ReasonCodes::PRICE_FREEZE : ReasonCodes::QUANTITY_FREEZE;
-        send_order_response(req, ts, TransactionCodes::FREEZE_TO_CONTROL, ErrorCodes::SUCCESS, freeze_reason);
-        
-        // Simulate approval/rejection after freeze
-        bool freeze_approved = (rand() % 2 == 0);
-        if (freeze_approved) {
-            std::cout << "Freeze approved - sending confirmation" << std::endl;
-            send_order_response(req, ts, TransactionCodes::ORDER_CONFIRMATION_OUT, ErrorCodes::SUCCESS, freeze_reason);
-        } else {
-            std::cout << "Freeze rejected - sending error" << std::endl;
-            if (freeze_reason == ReasonCodes::PRICE_FREEZE) {
-                send_order_response(req, ts, TransactionCodes::ORDER_ERROR_OUT, ErrorCodes::OE_PRICE_FREEZE_CAN, freeze_reason);
-            } else {
-                send_order_response(req, ts, TransactionCodes::ORDER_ERROR_OUT, ErrorCodes::OE_QTY_FREEZE_CAN, freeze_reason);
-            }
-        }
-        
-    } else {
-        std::cout << "Order rejected due to validation error" << std::endl;
-        send_order_response(req, ts, TransactionCodes::ORDER_ERROR_OUT, ErrorCodes::INVALID_ORDER);
+        PendingFreeze pending;
+        pending.order = *req;
+        pending.order.OrderNumber = generate_order_number(ts);
+        pending.order.EntryDateTime = static_cast<int32_t>(ts / 1000000);
+        pending.order.LastModified = static_cast<int32_t>(ts / 1000000);
+        pending.order.TotalVolumeRemaining = req->Volume;
+        pending.order.VolumeFilledToday = 0;
+        pending.order.ReasonCode = reason;
+        memset(&pending.modification, 0, sizeof(pending.modification));
+        pending.reason = reason;
+        send_order_response(&pending.order, ts, TransactionCodes::FREEZE_TO_CONTROL, ErrorCodes::SUCCESS, reason);
+        park_frozen_order(pending, ts);
+        return;
     }
+    
+    std::cout << "Order confirmed normally" << std::endl;
+    double order_number = send_order_response(req, ts, TransactionCodes::ORDER_CONFIRMATION_OUT, ErrorCodes::SUCCESS, ReasonCodes::NORMAL_CONFIRMATION);
+    match_order(order_number, ts);
 }
 
-void FakeNSEExchange::send_order_response(const MS_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code) {
-    MS_OE_REQUEST response;
-    memset(&response, 0, sizeof(response));
-    
-    // Copy original request structure and modify header
-    response = *req;
-    response.Header.TransactionCode = transaction_code;
-    response.Header.ErrorCode = error_code;
-    response.Header.MessageLength = sizeof(MS_OE_REQUEST);
-    
-    // Set reason code
-    response.ReasonCode = reason_code;
-    
-    // Set entry date time for confirmed orders
-    if (transaction_code == TransactionCodes::ORDER_CONFIRMATION_OUT || 
-        transaction_code == TransactionCodes::PRICE_CONFIRMATION) {
-        response.EntryDateTime = static_cast<int32_t>(ts / 1000000);
-    }
-    
-    // Generate order number and activity reference for confirmed orders
-    if (transaction_code == TransactionCodes::ORDER_CONFIRMATION_OUT) {
-        response.OrderNumber = generate_order_number(ts);
-        response.LastActivityReference = generate_activity_reference(ts);
-        response.LastModified = static_cast<int32_t>(ts / 1000000);
-        
-        // Store order
-        active_orders_[response.OrderNumber] = response;
-        std::cout << "Stored order " << response.OrderNumber << std::endl;
+// Returns the order number assigned to a confirmed order, 0 otherwise
+double FakeNSEExchange::send_order_response(const MS_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code) {
+    TraderRoute route(*this, req->Header.TraderId);
+    bool confirmed = transaction_code == TransactionCodes::ORDER_CONFIRMATION_OUT;
+    bool priced = confirmed || transaction_code == TransactionCodes::PRICE_CONFIRMATION;
+
+    // Everything that differs from the request is worked out first; the
+    // response itself is the request with those fields written over it
+    double order_number = 0;
+    uint64_t activity_reference = 0;
+    if (confirmed) {
+        order_number = generate_order_number(ts);
+        activity_reference = generate_activity_reference(ts);
     }
-    
+
     // Handle market order pricing
-    if (transaction_code == TransactionCodes::PRICE_CONFIRMATION && req->OrderFlags.Market) {
-        int32_t market_price = 10000 + (rand() % 1000);
-        
+    bool market_priced = transaction_code == TransactionCodes::PRICE_CONFIRMATION && req->OrderFlags.Market;
+    int32_t market_price = 0;
+    if (market_priced) {
+        market_price = 10000 + (rand() % 1000);
+        std::cout << "Market order priced at: " << market_price << " (Buy: negative, Sell: positive)" << std::endl;
         if (req->BuySellIndicator == 1) {
-            response.Price = -market_price;
-        } else {
-            response.Price = market_price;
+            market_price = -market_price;
         }
-        
-        // Clear market flag and set the price
-        response.OrderFlags.Market = 0;
-        
-        std::cout << "Market order priced at: " << (response.Price < 0 ? -response.Price : response.Price) 
-                  << " (Buy: negative, Sell: positive)" << std::endl;
     }
-    
+
     // Set closeout flag
+    bool closeout = false;
     if (transaction_code == TransactionCodes::ORDER_CONFIRMATION_OUT || 
         transaction_code == TransactionCodes::ORDER_CANCEL_CONFIRMATION ||
         transaction_code == TransactionCodes::ORDER_ERROR_OUT) {
         
         std::string broker_id(req->BrokerId, 5);
         broker_id.erase(broker_id.find_last_not_of(' ') + 1);
-        
-        if (is_broker_in_closeout(broker_id)) {
+        closeout = is_broker_in_closeout(broker_id);
+    }
+
+    auto fill = [&](MS_OE_REQUEST& response) {
+        response = *req;
+        response.Header.TransactionCode = transaction_code;
+        response.Header.ErrorCode = error_code;
+        response.Header.MessageLength = sizeof(MS_OE_REQUEST);
+        response.ReasonCode = reason_code;
+        if (priced) {
+            response.EntryDateTime = static_cast<int32_t>(ts / 1000000);
+        }
+        if (confirmed) {
+            response.OrderNumber = order_number;
+            response.LastActivityReference = activity_reference;
+            response.LastModified = static_cast<int32_t>(ts / 1000000);
+            response.TotalVolumeRemaining = response.Volume;
+            response.VolumeFilledToday = 0;
+        }
+        if (market_priced) {
+            response.Price = market_price;
+            response.OrderFlags.Market = 0;
+        }
+        if (closeout) {
             response.CloseoutFlag = 'C';
         }
+    };
+
+    // Store order
+    if (confirmed) {
+        fill(active_orders_[order_number]);
+        std::cout << "Stored order " << order_number << std::endl;
     }
     
     // Log the response
@@ -1203,20 +1318,19 @@ void FakeNSEExchange::send_order_response(const MS_OE_REQUEST* req, uint64_t ts,
               << ", ErrorCode=" << error_code 
               << ", ReasonCode=" << reason_code;
     
-    if (transaction_code == TransactionCodes::ORDER_CONFIRMATION_OUT) {
-        std::cout << ", OrderNumber=" << response.OrderNumber;
+    if (confirmed) {
+        std::cout << ", OrderNumber=" << order_number;
     }
     
-    if (response.CloseoutFlag == 'C') {
+    if (closeout || req->CloseoutFlag == 'C') {
         std::cout << ", CloseoutFlag=C";
     }
     
     std::cout << std::endl;
     
-    // Send response via callback
-    if (message_callback_) {
-        message_callback_(reinterpret_cast<const uint8_t*>(&response), sizeof(response));
-    }
+    emit_message<MS_OE_REQUEST>(fill);
+    
+    return order_number;
 }
 
 void FakeNSEExchange::handle_price_modification_request(const PRICE_MOD* req, uint64_t ts) {
@@ -1266,24 +1380,27 @@ void FakeNSEExchange::handle_price_modification_request(const PRICE_MOD* req, ui
         return;
     }
     
-    // Simulate if modification will result in freeze
-    bool will_freeze = (rand() % 100) < 20;
+    if (!is_within_price_band(original_order.TokenNo, req->Price, original_order.OrderFlags.Market)) {
+        std::cout << "Modification rejected - price " << req->Price << " outside the price band" << std::endl;
+        send_modification_response(req, ts, TransactionCodes::ORDER_MOD_REJ_OUT, ErrorCodes::OE_PRICE_EXCEEDS_DAY_MIN_MAX);
+        return;
+    }
     
-    if (will_freeze) {
+    int16_t reason = freeze_reason(original_order.TokenNo, req->Volume, req->Price, original_order.OrderFlags.Market);
+    if (reason != 0) {
         std::cout << "Order modification frozen - awaiting exchange approval" << std::endl;
-        
-        // Send freeze response
         send_modification_response(req, ts, TransactionCodes::FREEZE_TO_CONTROL, ErrorCodes::SUCCESS);
         
-        // Simulate approval/rejection
-        bool freeze_approved = (rand() % 2 == 0);
-        if (freeze_approved) {
-            std::cout << "Modification freeze approved - processing modification" << std::endl;
-            process_successful_modification(original_order, req, ts);
-        } else {
-            std::cout << "Modification freeze rejected" << std::endl;
-            send_modification_response(req, ts, TransactionCodes::ORDER_MOD_REJ_OUT, ErrorCodes::OE_ORD_CANNOT_MODIFY);
-        }
+        // The order keeps trading on its current terms until the modification is decided
+        PendingFreeze pending;
+        pending.is_modification = true;
+        pending.order = original_order;
+        pending.order.Price = req->Price;
+        pending.order.Volume = req->Volume;
+        pending.order.ReasonCode = reason;
+        pending.modification = *req;
+        pending.reason = reason;
+        park_frozen_order(pending, ts);
     } else {
         // Process successful modification
         std::cout << "Order modification accepted" << std::endl;
@@ -1297,49 +1414,52 @@ void FakeNSEExchange::process_successful_modification(MS_OE_REQUEST& original_or
     
     if (loses_priority) {
         std::cout << "Order will lose time priority due to modification" << std::endl;
+        unbook_order(original_order);
+    } else if (is_bookable(original_order)) {
+        // Quantity reduction at the same price keeps its place in the queue
+        int32_t reduction = original_order.Volume - req->Volume;
+        order_books_[original_order.TokenNo].reduce(original_order.BuySellIndicator == 1, original_order.Price, reduction);
+        market_watch_tokens_.mark(original_order.TokenNo);
     }
     
     // Update the original order with new parameters
     original_order.Price = req->Price;
     original_order.Volume = req->Volume;
+    original_order.TotalVolumeRemaining = req->Volume - original_order.VolumeFilledToday;
     original_order.LastModified = static_cast<int32_t>(ts / 1000000);
     original_order.LastActivityReference = generate_activity_reference(ts);
     
     // Send successful modification response
     send_modification_response(req, ts, TransactionCodes::ORDER_MOD_CONFIRM_OUT, ErrorCodes::SUCCESS);
+    
+    // A requeued order may now cross the opposite side
+    if (loses_priority) {
+        match_order(original_order.OrderNumber, ts);
+    }
 }
 
 void FakeNSEExchange::send_modification_response(const PRICE_MOD* req, uint64_t ts, int16_t transaction_code, int16_t error_code) {
-    MS_OE_REQUEST response;
-    memset(&response, 0, sizeof(response));
-    
+    TraderRoute route(*this, req->Header.TraderId);
     // Get the original order for response
+    const MS_OE_REQUEST* original = nullptr;
     if (transaction_code == TransactionCodes::ORDER_MOD_CONFIRM_OUT) {
         auto order_iter = active_orders_.find(req->OrderNumber);
         if (order_iter != active_orders_.end()) {
-            response = order_iter->second;
+            original = &order_iter->second;
         }
     }
+    bool success = transaction_code == TransactionCodes::ORDER_MOD_CONFIRM_OUT && error_code == ErrorCodes::SUCCESS;
     
-    // Set header fields
-    response.Header = req->Header;
-    response.Header.TransactionCode = transaction_code;
-    response.Header.ErrorCode = error_code;
-    response.Header.MessageLength = sizeof(MS_OE_REQUEST);
-    
-    if (transaction_code == TransactionCodes::ORDER_MOD_CONFIRM_OUT && error_code == ErrorCodes::SUCCESS) {
-        // Success case
-        response.OrderNumber = req->OrderNumber;
-        response.Price = req->Price;
-        response.Volume = req->Volume;
-        response.LastModified = static_cast<int32_t>(ts / 1000000);
-        response.LastActivityReference = generate_activity_reference(ts);
+    uint64_t activity_reference = 0;
+    bool closeout = false;
+    if (success) {
+        activity_reference = generate_activity_reference(ts);
         
         // Set closeout flag if applicable
-        std::string broker_id(response.BrokerId, 5);
-        broker_id.erase(broker_id.find_last_not_of(' ') + 1);
-        if (is_broker_in_closeout(broker_id)) {
-            response.CloseoutFlag = 'C';
+        if (original) {
+            std::string broker_id(original->BrokerId, 5);
+            broker_id.erase(broker_id.find_last_not_of(' ') + 1);
+            closeout = is_broker_in_closeout(broker_id);
         }
         
         std::cout << "Sending successful modification confirmation to trader: " << req->Header.TraderId 
@@ -1347,9 +1467,6 @@ void FakeNSEExchange::send_modification_response(const PRICE_MOD* req, uint64_t
                   << ", New Price: " << req->Price 
                   << ", New Volume: " << req->Volume << std::endl;
     } else {
-        // Error case
-        response.OrderNumber = req->OrderNumber;
-        
         std::cout << "Sending modification rejection to trader: " << req->Header.TraderId 
                   << ", OrderNumber: " << req->OrderNumber 
                   << ", ErrorCode: " << error_code << std::endl;
@@ -1360,10 +1477,30 @@ void FakeNSEExchange::send_modification_response(const PRICE_MOD* req, uint64_t
         std::cout << "Modification frozen for order: " << req->OrderNumber << std::endl;
     }
     
-    // Send response via callback
-    if (message_callback_) {
-        message_callback_(reinterpret_cast<const uint8_t*>(&response), sizeof(response));
-    }
+    emit_message<MS_OE_REQUEST>([&](MS_OE_REQUEST& response) {
+        if (original) {
+            response = *original;
+        } else {
+            memset(&response, 0, sizeof(response));
+        }
+        
+        // Set header fields
+        response.Header = req->Header;
+        response.Header.TransactionCode = transaction_code;
+        response.Header.ErrorCode = error_code;
+        response.Header.MessageLength = sizeof(MS_OE_REQUEST);
+        response.OrderNumber = req->OrderNumber;
+        
+        if (success) {
+            response.Price = req->Price;
+            response.Volume = req->Volume;
+            response.LastModified = static_cast<int32_t>(ts / 1000000);
+            response.LastActivityReference = activity_reference;
+            if (closeout) {
+                response.CloseoutFlag = 'C';
+            }
+        }
+    });
 }
 
 void FakeNSEExchange::handle_order_cancellation_request(const MS_OE_REQUEST* req, uint64_t ts) {
@@ -1418,7 +1555,7 @@ void FakeNSEExchange::handle_order_cancellation_request(const MS_OE_REQUEST* req
     }
     
     // Check if order is already cancelled or fully executed
-    if (original_order.Volume == 0) {
+    if (original_order.Volume == 0 || original_order.TotalVolumeRemaining == 0) {
         std::cout << "Order " << req->OrderNumber << " is already cancelled or fully executed" << std::endl;
         send_cancellation_response(req, ts, TransactionCodes::ORDER_CXL_REJ_OUT, ErrorCodes::OE_ORD_CANNOT_CANCEL);
         return;
@@ -1443,8 +1580,10 @@ void FakeNSEExchange::process_successful_cancellation(MS_OE_REQUEST& original_or
     original_order.LastActivityReference = generate_activity_reference(ts);
     
     // Mark order as cancelled
-    int32_t cancelled_volume = original_order.Volume;
+    unbook_order(original_order);
+    int32_t cancelled_volume = original_order.TotalVolumeRemaining;
     original_order.Volume = 0;
+    original_order.TotalVolumeRemaining = 0;
     
     std::cout << "Cancelled " << cancelled_volume << " shares for order " << original_order.OrderNumber << std::endl;
     
@@ -1453,54 +1592,58 @@ void FakeNSEExchange::process_successful_cancellation(MS_OE_REQUEST& original_or
 }
 
 void FakeNSEExchange::send_cancellation_response(const MS_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code) {
-    MS_OE_REQUEST response;
-    memset(&response, 0, sizeof(response));
-    
+    TraderRoute route(*this, req->Header.TraderId);
     // Get the original order for response
+    const MS_OE_REQUEST* original = req;
     if (transaction_code == TransactionCodes::ORDER_CANCEL_CONFIRM_OUT) {
         auto order_iter = active_orders_.find(req->OrderNumber);
-        if (order_iter != active_orders_.end()) {
-            response = order_iter->second;
-        }
-    } else {
-        response = *req;
+        original = order_iter != active_orders_.end() ? &order_iter->second : nullptr;
     }
+    bool success = transaction_code == TransactionCodes::ORDER_CANCEL_CONFIRM_OUT && error_code == ErrorCodes::SUCCESS;
     
-    // Set header fields
-    response.Header = req->Header;
-    response.Header.TransactionCode = transaction_code;
-    response.Header.ErrorCode = error_code;
-    response.Header.MessageLength = sizeof(MS_OE_REQUEST);
-    
-    if (transaction_code == TransactionCodes::ORDER_CANCEL_CONFIRM_OUT && error_code == ErrorCodes::SUCCESS) {
-        // Success case
-        response.OrderNumber = req->OrderNumber;
-        response.LastModified = static_cast<int32_t>(ts / 1000000);
-        response.LastActivityReference = generate_activity_reference(ts);
-        response.Volume = 0;
+    uint64_t activity_reference = 0;
+    bool closeout = false;
+    if (success) {
+        activity_reference = generate_activity_reference(ts);
         
         // Set closeout flag if applicable
-        std::string broker_id(response.BrokerId, 5);
-        broker_id.erase(broker_id.find_last_not_of(' ') + 1);
-        if (is_broker_in_closeout(broker_id)) {
-            response.CloseoutFlag = 'C';
+        if (original) {
+            std::string broker_id(original->BrokerId, 5);
+            broker_id.erase(broker_id.find_last_not_of(' ') + 1);
+            closeout = is_broker_in_closeout(broker_id);
         }
         
         std::cout << "Sending successful cancellation confirmation to trader: " << req->Header.TraderId 
                   << ", OrderNumber: " << req->OrderNumber << std::endl;
     } else {
-        // Error case
-        response.OrderNumber = req->OrderNumber;
-        
         std::cout << "Sending cancellation rejection to trader: " << req->Header.TraderId 
                   << ", OrderNumber: " << req->OrderNumber 
                   << ", ErrorCode: " << error_code << std::endl;
     }
     
-    // Send response via callback
-    if (message_callback_) {
-        message_callback_(reinterpret_cast<const uint8_t*>(&response), sizeof(response));
-    }
+    emit_message<MS_OE_REQUEST>([&](MS_OE_REQUEST& response) {
+        if (original) {
+            response = *original;
+        } else {
+            memset(&response, 0, sizeof(response));
+        }
+        
+        // Set header fields
+        response.Header = req->Header;
+        response.Header.TransactionCode = transaction_code;
+        response.Header.ErrorCode = error_code;
+        response.Header.MessageLength = sizeof(MS_OE_REQUEST);
+        response.OrderNumber = req->OrderNumber;
+        
+        if (success) {
+            response.LastModified = static_cast<int32_t>(ts / 1000000);
+            response.LastActivityReference = activity_reference;
+            response.Volume = 0;
+            if (closeout) {
+                response.CloseoutFlag = 'C';
+            }
+        }
+    });
 }
 
 void FakeNSEExchange::handle_kill_switch_request(const MS_OE_REQUEST* req, uint64_t ts) {
@@ -1563,8 +1706,8 @@ int32_t FakeNSEExchange::process_kill_switch_cancellation(const MS_OE_REQUEST* r
     for (auto& order_pair : active_orders_) {
         MS_OE_REQUEST& order = order_pair.second;
         
-        // Skip already cancelled orders
-        if (order.Volume == 0) {
+        // Skip already cancelled or fully traded orders
+        if (order.Volume == 0 || order.TotalVolumeRemaining == 0) {
             continue;
         }
         
@@ -1610,8 +1753,10 @@ int32_t FakeNSEExchange::process_kill_switch_cancellation(const MS_OE_REQUEST* r
             MS_OE_REQUEST& order = order_iter->second;
             
             // Update order cancellation details
-            int32_t cancelled_volume = order.Volume;
+            unbook_order(order);
+            int32_t cancelled_volume = order.TotalVolumeRemaining;
             order.Volume = 0;
+            order.TotalVolumeRemaining = 0;
             order.LastModified = static_cast<int32_t>(ts / 1000000);
             order.LastActivityReference = generate_activity_reference(ts);
             
@@ -1629,29 +1774,24 @@ int32_t FakeNSEExchange::process_kill_switch_cancellation(const MS_OE_REQUEST* r
 }
 
 void FakeNSEExchange::send_kill_switch_response(const MS_OE_REQUEST* req, uint64_t ts, int16_t error_code, int32_t cancelled_count) {
+    TraderRoute route(*this, req->Header.TraderId);
     if (error_code == ErrorCodes::SUCCESS) {
         std::cout << "Kill switch completed successfully for trader: " << req->Header.TraderId 
                   << ", cancelled " << cancelled_count << " orders" << std::endl;
         return;
     }
     
-    // For error cases, send ORDER_ERROR_OUT response
-    MS_OE_REQUEST response;
-    memset(&response, 0, sizeof(response));
-    
-    // Copy from request and set response details
-    response = *req;
-    response.Header.TransactionCode = TransactionCodes::ORDER_ERROR_OUT;
-    response.Header.ErrorCode = error_code;
-    response.Header.MessageLength = sizeof(MS_OE_REQUEST);
-    
     std::cout << "Sending kill switch error response to trader: " << req->Header.TraderId 
               << ", ErrorCode: " << error_code << std::endl;
     
-    // Send error response via callback
-    if (message_callback_) {
-        message_callback_(reinterpret_cast<const uint8_t*>(&response), sizeof(response));
-    }
+    // For error cases, send ORDER_ERROR_OUT response: the request with the
+    // header fields set
+    emit_message<MS_OE_REQUEST>([&](MS_OE_REQUEST& response) {
+        response = *req;
+        response.Header.TransactionCode = TransactionCodes::ORDER_ERROR_OUT;
+        response.Header.ErrorCode = error_code;
+        response.Header.MessageLength = sizeof(MS_OE_REQUEST);
+    });
 }
 
 void FakeNSEExchange::handle_trade_modification_request(const MS_TRADE_INQ_DATA* req, uint64_t ts) {
@@ -1667,7 +1807,8 @@ void FakeNSEExchange::handle_trade_modification_request(const MS_TRADE_INQ_DATA*
     }
     
     // Check for duplicate request
-    if (is_duplicate_trade_request(req->FillNumber, req->Header.TraderId, "modify")) {
+    roll_trade_request_day(ts);
+    if (is_duplicate_trade_request(req->FillNumber, req->Header.TraderId, TradeRequestOp::Modify)) {
         std::cout << "Duplicate trade modification request for FillNumber: " << req->FillNumber << std::endl;
         send_trade_modification_response(req, ts, ErrorCodes::e_dup_request);
         return;
@@ -1741,13 +1882,14 @@ void FakeNSEExchange::handle_trade_modification_request(const MS_TRADE_INQ_DATA*
     }
     
     // Mark request as processed
-    mark_trade_request(req->FillNumber, req->Header.TraderId, "modify");
+    mark_trade_request(req->FillNumber, req->Header.TraderId, TradeRequestOp::Modify);
     
     // Send successful response
     send_trade_modification_response(req, ts, ErrorCodes::SUCCESS);
 }
 
 void FakeNSEExchange::send_trade_modification_response(const MS_TRADE_INQ_DATA* req, uint64_t ts, int16_t error_code) {
+    TraderRoute route(*this, req->Header.TraderId);
     MS_TRADE_INQ_DATA response;
     memset(&response, 0, sizeof(response));
     
@@ -1789,7 +1931,8 @@ void FakeNSEExchange::handle_trade_cancellation_request(const MS_TRADE_INQ_DATA*
     }
     
     // Check for duplicate request
-    if (is_duplicate_trade_request(req->FillNumber, req->Header.TraderId, "cancel")) {
+    roll_trade_request_day(ts);
+    if (is_duplicate_trade_request(req->FillNumber, req->Header.TraderId, TradeRequestOp::Cancel)) {
         std::cout << "Duplicate trade cancellation request for FillNumber: " << req->FillNumber << std::endl;
         send_trade_cancellation_response(req, ts, ErrorCodes::e_dup_trd_cxl_request);
         return;
@@ -1821,13 +1964,14 @@ void FakeNSEExchange::handle_trade_cancellation_request(const MS_TRADE_INQ_DATA*
     std::cout << "Note: Both parties must request cancellation for it to be processed" << std::endl;
     
     // Mark request as processed
-    mark_trade_request(req->FillNumber, req->Header.TraderId, "cancel");
+    mark_trade_request(req->FillNumber, req->Header.TraderId, TradeRequestOp::Cancel);
     
     // Send acknowledgment response
     send_trade_cancellation_response(req, ts, ErrorCodes::SUCCESS);
 }
 
 void FakeNSEExchange::send_trade_cancellation_response(const MS_TRADE_INQ_DATA* req, uint64_t ts, int16_t error_code) {
+    TraderRoute route(*this, req->Header.TraderId);
     MS_TRADE_INQ_DATA response;
     memset(&response, 0, sizeof(response));
     
@@ -1964,33 +2108,71 @@ void FakeNSEExchange::handle_spread_order_entry_request(const MS_SPD_OE_REQUEST*
         return;
     }
     
-    // Continue with order processing...
-    int outcome = rand() % 100;
-    if (outcome < 70) {
-        std::cout << "Spread order confirmed normally" << std::endl;
-        
-        // Generate order number and store the order
-        double order_number = generate_order_number(ts);
-        MS_SPD_OE_REQUEST stored_order = *req;
-        stored_order.OrderNumber1 = order_number;
-        stored_order.EntryDateTime1 = static_cast<int32_t>(ts / 1000000);
-        stored_order.LastModified1 = static_cast<int32_t>(ts / 1000000);
-        stored_order.LastActivityReference = generate_activity_reference(ts);
-        
-        // Store the order in active spread orders
-        active_spread_orders_[order_number] = stored_order;
-        
-        send_spread_order_response(req, ts, TransactionCodes::SP_ORDER_CONFIRMATION, ErrorCodes::SUCCESS);
-    } else if (outcome < 85) {
+    // Leg prices must be within their contracts' price bands; legs priced at
+    // 0 trade on the difference
+    if (!is_within_price_band(req->Token1, req->Price1, req->Price1 <= 0) ||
+        !is_within_price_band(req->MS_SPD_LEG_INFO_leg2.Token2, req->MS_SPD_LEG_INFO_leg2.Price2,
+                              req->MS_SPD_LEG_INFO_leg2.Price2 <= 0)) {
+        std::cout << "Spread order rejected - leg price outside the price band" << std::endl;
+        send_spread_order_response(req, ts, TransactionCodes::SP_ORDER_ERROR, ErrorCodes::OE_PRICE_EXCEEDS_DAY_MIN_MAX);
+        return;
+    }
+    
+    MS_SPD_OE_REQUEST stored_order = *req;
+    stored_order.OrderNumber1 = generate_order_number(ts);
+    stored_order.EntryDateTime1 = static_cast<int32_t>(ts / 1000000);
+    stored_order.LastModified1 = static_cast<int32_t>(ts / 1000000);
+    stored_order.LastActivityReference = generate_activity_reference(ts);
+    stored_order.TotalVolRemaining1 = stored_order.Volume1;
+    stored_order.VolumeFilledToday1 = 0;
+    stored_order.MS_SPD_LEG_INFO_leg2.TotalVolRemaining2 = stored_order.MS_SPD_LEG_INFO_leg2.Volume2;
+    stored_order.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2 = 0;
+    
+    // A leg beyond its contract's freeze limits holds the whole spread for
+    // approval. Legs priced at 0 trade on the difference and have no price to
+    // freeze on.
+    const MS_SPD_LEG_INFO& leg2 = req->MS_SPD_LEG_INFO_leg2;
+    int16_t reason = freeze_reason(req->Token1, req->Volume1, req->Price1, req->Price1 <= 0);
+    bool first_leg_frozen = (reason != 0);
+    if (!first_leg_frozen) {
+        reason = freeze_reason(leg2.Token2, leg2.Volume2, leg2.Price2, leg2.Price2 <= 0);
+    }
+    if (reason != 0) {
         std::cout << "Spread order frozen - awaiting exchange approval" << std::endl;
-        send_spread_order_response(req, ts, TransactionCodes::FREEZE_TO_CONTROL, ErrorCodes::SUCCESS, ReasonCodes::PRICE_FREEZE);
-    } else {
-        std::cout << "Spread order rejected due to validation error" << std::endl;
-        send_spread_order_response(req, ts, TransactionCodes::SP_ORDER_ERROR, ErrorCodes::INVALID_ORDER);
+        PendingFreeze pending;
+        pending.is_spread = true;
+        pending.spread_order = stored_order;
+        pending.spread_order.ReasonCode1 = reason;
+        memset(&pending.order, 0, sizeof(pending.order));
+        pending.order.Header = req->Header;
+        pending.order.OrderNumber = stored_order.OrderNumber1;
+        pending.order.TokenNo = first_leg_frozen ? req->Token1 : leg2.Token2;
+        pending.order.ContractDesc = first_leg_frozen ? req->ContractDesc : leg2.ContractDesc;
+        // A second leg without an explicit side trades opposite to the first
+        int16_t leg2_side = (leg2.BuySell2 == 1 || leg2.BuySell2 == 2) ? leg2.BuySell2 : ((req->BuySell1 == 1) ? 2 : 1);
+        pending.order.BuySellIndicator = first_leg_frozen ? req->BuySell1 : leg2_side;
+        pending.order.Volume = first_leg_frozen ? req->Volume1 : leg2.Volume2;
+        pending.order.TotalVolumeRemaining = pending.order.Volume;
+        pending.order.Price = first_leg_frozen ? req->Price1 : leg2.Price2;
+        memcpy(pending.order.BrokerId, req->BrokerId1, sizeof(pending.order.BrokerId));
+        memcpy(pending.order.AccountNumber, req->AccountNumber1, sizeof(pending.order.AccountNumber));
+        memcpy(pending.order.PAN, req->PAN, sizeof(pending.order.PAN));
+        pending.order.ReasonCode = reason;
+        memset(&pending.modification, 0, sizeof(pending.modification));
+        pending.reason = reason;
+        send_spread_order_response(&pending.spread_order, ts, TransactionCodes::FREEZE_TO_CONTROL, ErrorCodes::SUCCESS, reason);
+        park_frozen_order(pending, ts);
+        return;
     }
+    
+    std::cout << "Spread order confirmed normally" << std::endl;
+    active_spread_orders_[stored_order.OrderNumber1] = stored_order;
+    send_spread_order_response(&stored_order, ts, TransactionCodes::SP_ORDER_CONFIRMATION, ErrorCodes::SUCCESS);
+    match_spread_order(stored_order.OrderNumber1, ts);
 }
 
 void FakeNSEExchange::send_spread_order_response(const MS_SPD_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code) {
+    TraderRoute route(*this, req->Header.TraderId);
     MS_SPD_OE_REQUEST response;
     memset(&response, 0, sizeof(response));
     
@@ -2008,8 +2190,8 @@ void FakeNSEExchange::send_spread_order_response(const MS_SPD_OE_REQUEST* req, u
         response.EntryDateTime1 = static_cast<int32_t>(ts / 1000000);
     }
     
-    // Generate order number and activity reference for confirmed orders
-    if (transaction_code == TransactionCodes::SP_ORDER_CONFIRMATION) {
+    // Generate order number and activity reference for confirmed orders not already stored
+    if (transaction_code == TransactionCodes::SP_ORDER_CONFIRMATION && response.OrderNumber1 == 0) {
         response.OrderNumber1 = generate_order_number(ts);
         response.LastActivityReference = generate_activity_reference(ts);
         response.LastModified1 = static_cast<int32_t>(ts / 1000000);
@@ -2122,8 +2304,13 @@ void FakeNSEExchange::handle_spread_order_modification_request(const MS_SPD_OE_R
     
     // Process successful modification
     std::cout << "Spread order modification accepted" << std::endl;
-    process_successful_spread_modification(original_order, req, ts);
+    bool requeued = process_successful_spread_modification(original_order, req, ts);
     send_spread_order_response(req, ts, TransactionCodes::SP_ORDER_MOD_CON_OUT, ErrorCodes::SUCCESS);
+    
+    // A requeued order may now cross the opposite side
+    if (requeued) {
+        match_spread_order(req->OrderNumber1, ts);
+    }
 }
 
 void FakeNSEExchange::handle_spread_order_cancellation_request(const MS_SPD_OE_REQUEST* req, uint64_t ts) {
@@ -2179,7 +2366,8 @@ void FakeNSEExchange::handle_spread_order_cancellation_request(const MS_SPD_OE_R
         return;
     }
     
-    // Remove the order from active orders
+    // Remove the order from its book and from active orders
+    unbook_spread_order(original_order);
     active_spread_orders_.erase(order_iter);
     
     std::cout << "Spread order cancellation successful" << std::endl;
@@ -2205,6 +2393,14 @@ bool FakeNSEExchange::is_valid_spread_modification(const MS_SPD_OE_REQUEST& orig
         return false;
     }
     
+    // As for outright orders, a fully traded order cannot be modified and the
+    // new volumes must leave something open beyond what has already traded
+    if (original_order.TotalVolRemaining1 <= 0 ||
+        modification->Volume1 <= original_order.VolumeFilledToday1 ||
+        modification->MS_SPD_LEG_INFO_leg2.Volume2 <= original_order.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2) {
+        return false;
+    }
+    
     // Quantities must be multiples of regular lot
     const int32_t REGULAR_LOT = 1;
     if (modification->Volume1 % REGULAR_LOT != 0 || modification->MS_SPD_LEG_INFO_leg2.Volume2 % REGULAR_LOT != 0) {
@@ -2226,15 +2422,29 @@ bool FakeNSEExchange::is_valid_spread_activity_reference(const MS_SPD_OE_REQUEST
     return modify_req->LastActivityReference != 0;
 }
 
-void FakeNSEExchange::process_successful_spread_modification(MS_SPD_OE_REQUEST& original_order, const MS_SPD_OE_REQUEST* req, uint64_t ts) {
+// Returns true when the order lost its queue position and has to be matched again
+bool FakeNSEExchange::process_successful_spread_modification(MS_SPD_OE_REQUEST& original_order, const MS_SPD_OE_REQUEST* req, uint64_t ts) {
+    // Same rules as outright orders: a new price difference or a larger quantity loses time priority
+    bool loses_priority = (req->PriceDiff != original_order.PriceDiff) || (req->Volume1 > original_order.Volume1);
+    int32_t new_remaining = std::max(0, req->Volume1 - original_order.VolumeFilledToday1);
+    
+    if (loses_priority) {
+        unbook_spread_order(original_order);
+    } else if (original_order.TotalVolRemaining1 > 0) {
+        OrderBook* book = spread_books_.find(spread_pair_key(original_order.Token1, original_order.MS_SPD_LEG_INFO_leg2.Token2));
+        if (book) {
+            book->reduce(original_order.BuySell1 == 1, original_order.PriceDiff, original_order.TotalVolRemaining1 - new_remaining);
+        }
+    }
+    
     // Update modifiable fields
     original_order.Volume1 = req->Volume1;
     original_order.MS_SPD_LEG_INFO_leg2.Volume2 = req->MS_SPD_LEG_INFO_leg2.Volume2;
     original_order.PriceDiff = req->PriceDiff;
     
-    // Update remaining volumes
-    original_order.TotalVolRemaining1 = req->Volume1;
-    original_order.MS_SPD_LEG_INFO_leg2.TotalVolRemaining2 = req->MS_SPD_LEG_INFO_leg2.Volume2;
+    // Update remaining volumes net of what has already traded
+    original_order.TotalVolRemaining1 = new_remaining;
+    original_order.MS_SPD_LEG_INFO_leg2.TotalVolRemaining2 = std::max(0, req->MS_SPD_LEG_INFO_leg2.Volume2 - original_order.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2);
     
     // Update modification timestamps
     original_order.LastModified1 = static_cast<int32_t>(ts / 1000000);
@@ -2246,6 +2456,8 @@ void FakeNSEExchange::process_successful_spread_modification(MS_SPD_OE_REQUEST&
     std::cout << "Spread order successfully modified - New Volume1: " << original_order.Volume1
               << ", New Volume2: " << original_order.MS_SPD_LEG_INFO_leg2.Volume2
               << ", New PriceDiff: " << original_order.PriceDiff << std::endl;
+    
+    return loses_priority;
 }
 
 // Spread Combination Master Update Broadcast Implementation
@@ -2319,8 +2531,7 @@ void FakeNSEExchange::broadcast_periodic_spread_combination_update(const MS_SPD_
 
 // Helper methods for spread combination management
 void FakeNSEExchange::add_spread_combination(int32_t token1, int32_t token2, const MS_SPD_UPDATE_INFO& combination_info) {
-    std::pair<int32_t, int32_t> key = std::make_pair(token1, token2);
-    spread_combinations_[key] = combination_info;
+    spread_combinations_[spread_pair_key(token1, token2)] = combination_info;
     
     std::cout << "Added spread combination: Token1=" << token1 << ", Token2=" << token2 
               << ", ReferencePrice=" << combination_info.ReferencePrice << std::endl;
@@ -2332,12 +2543,10 @@ void FakeNSEExchange::add_spread_combination(int32_t token1, int32_t token2, con
 }
 
 void FakeNSEExchange::update_spread_combination(int32_t token1, int32_t token2, const MS_SPD_UPDATE_INFO& updated_info, uint64_t ts) {
-    std::pair<int32_t, int32_t> key = std::make_pair(token1, token2);
-    
-    auto it = spread_combinations_.find(key);
-    if (it != spread_combinations_.end()) {
+    MS_SPD_UPDATE_INFO* it = spread_combinations_.find(spread_pair_key(token1, token2));
+    if (it) {
         // Update existing combination
-        MS_SPD_UPDATE_INFO& existing = it->second;
+        MS_SPD_UPDATE_INFO& existing = *it;
         
         // Update modifiable fields
         existing.ReferencePrice = updated_info.ReferencePrice;
@@ -2362,14 +2571,13 @@ void FakeNSEExchange::update_spread_combination(int32_t token1, int32_t token2,
 }
 
 bool FakeNSEExchange::is_valid_spread_combination(int32_t token1, int32_t token2) const {
-    std::pair<int32_t, int32_t> key = std::make_pair(token1, token2);
-    auto it = spread_combinations_.find(key);
+    const MS_SPD_UPDATE_INFO* it = spread_combinations_.find(spread_pair_key(token1, token2));
     
-    if (it == spread_combinations_.end()) {
+    if (!it) {
         return false;
     }
     
-    const MS_SPD_UPDATE_INFO& combination = it->second;
+    const MS_SPD_UPDATE_INFO& combination = *it;
 
     // Check if combination is eligible and not deleted
     bool is_eligible = (combination.SPDEligibility.Eligibility == 1);
@@ -2539,30 +2747,30 @@ void FakeNSEExchange::handle_2l_order_entry_request(const MS_SPD_OE_REQUEST* req
         return;
     }
 
+    // Each leg's price must be within its contract's price band
+    if (!is_within_price_band(req->Token1, req->Price1, req->OrderFlags.Market) ||
+        !is_within_price_band(req->MS_SPD_LEG_INFO_leg2.Token2, req->MS_SPD_LEG_INFO_leg2.Price2,
+                              req->MS_SPD_LEG_INFO_leg2.OrderFlags.Market)) {
+        std::cout << "2L order rejected - leg price outside the price band" << std::endl;
+        send_2l_order_response(req, ts, TransactionCodes::TWOL_ORDER_ERROR, ErrorCodes::OE_PRICE_EXCEEDS_DAY_MIN_MAX);
+        return;
+    }
+
     // Process 2L order - IOC by default
     std::cout << "Processing 2L order as IOC" << std::endl;
 
-    // Simulate order processing (70% full match, 20% partial match, 10% error)
-    int outcome = rand() % 100;
-
-    if (outcome < 70) {
-        // Full match - send confirmation
-        std::cout << "2L order fully matched" << std::endl;
-        send_2l_order_response(req, ts, TransactionCodes::TWOL_ORDER_CONFIRMATION, ErrorCodes::SUCCESS);
-
-    } else if (outcome < 90) {
-        // Partial match - send confirmation then cancellation for unmatched
-        std::cout << "2L order partially matched" << std::endl;
-        send_2l_order_response(req, ts, TransactionCodes::TWOL_ORDER_CONFIRMATION, ErrorCodes::SUCCESS);
+    MS_SPD_OE_REQUEST order = *req;
+    order.OrderNumber1 = generate_order_number(ts);
+    order.EntryDateTime1 = static_cast<int32_t>(ts / 1000000);
+    order.LastModified1 = static_cast<int32_t>(ts / 1000000);
+    order.LastActivityReference = generate_activity_reference(ts);
 
-        // Send cancellation for unmatched portion
-        std::cout << "Sending cancellation for unmatched portion" << std::endl;
-        send_2l_order_response(req, ts, TransactionCodes::TWOL_ORDER_CXL_CONFIRMATION, ErrorCodes::SUCCESS);
+    int32_t filled = execute_multileg_ioc(order, 2, ts);
 
-    } else {
-        // No match - send cancellation only
-        std::cout << "2L order not matched - IOC cancellation" << std::endl;
-        send_2l_order_response(req, ts, TransactionCodes::TWOL_ORDER_CXL_CONFIRMATION, ErrorCodes::SUCCESS);
+    // IOC - cancel whatever could not trade
+    if (filled < order.Volume1) {
+        std::cout << "2L order IOC cancellation for " << (order.Volume1 - filled) << std::endl;
+        send_2l_order_response(&order, ts, TransactionCodes::TWOL_ORDER_CXL_CONFIRMATION, ErrorCodes::SUCCESS);
     }
 }
 
@@ -2653,35 +2861,38 @@ void FakeNSEExchange::handle_3l_order_entry_request(const MS_SPD_OE_REQUEST* req
         return;
     }
 
+    // Each leg's price must be within its contract's price band
+    if (!is_within_price_band(req->Token1, req->Price1, req->OrderFlags.Market) ||
+        !is_within_price_band(req->MS_SPD_LEG_INFO_leg2.Token2, req->MS_SPD_LEG_INFO_leg2.Price2,
+                              req->MS_SPD_LEG_INFO_leg2.OrderFlags.Market) ||
+        !is_within_price_band(req->MS_SPD_LEG_INFO_leg3.Token2, req->MS_SPD_LEG_INFO_leg3.Price2,
+                              req->MS_SPD_LEG_INFO_leg3.OrderFlags.Market)) {
+        std::cout << "3L order rejected - leg price outside the price band" << std::endl;
+        send_3l_order_response(req, ts, TransactionCodes::THRL_ORDER_ERROR, ErrorCodes::OE_PRICE_EXCEEDS_DAY_MIN_MAX);
+        return;
+    }
+
     // Process 3L order - IOC by default
     std::cout << "Processing 3L order as IOC" << std::endl;
 
-    // Simulate order processing (70% full match, 20% partial match, 10% error)
-    int outcome = rand() % 100;
-
-    if (outcome < 70) {
-        // Full match - send confirmation
-        std::cout << "3L order fully matched" << std::endl;
-        send_3l_order_response(req, ts, TransactionCodes::THRL_ORDER_CONFIRMATION, ErrorCodes::SUCCESS);
+    MS_SPD_OE_REQUEST order = *req;
+    order.OrderNumber1 = generate_order_number(ts);
+    order.EntryDateTime1 = static_cast<int32_t>(ts / 1000000);
+    order.LastModified1 = static_cast<int32_t>(ts / 1000000);
+    order.LastActivityReference = generate_activity_reference(ts);
 
-    } else if (outcome < 90) {
-        // Partial match - send confirmation then cancellation for unmatched
-        std::cout << "3L order partially matched" << std::endl;
-        send_3l_order_response(req, ts, TransactionCodes::THRL_ORDER_CONFIRMATION, ErrorCodes::SUCCESS);
+    int32_t filled = execute_multileg_ioc(order, 3, ts);
 
-        // Send cancellation for unmatched portion
-        std::cout << "Sending cancellation for unmatched portion" << std::endl;
-        send_3l_order_response(req, ts, TransactionCodes::THRL_ORDER_CXL_CONFIRMATION, ErrorCodes::SUCCESS);
-
-    } else {
-        // No match - send cancellation only
-        std::cout << "3L order not matched - IOC cancellation" << std::endl;
-        send_3l_order_response(req, ts, TransactionCodes::THRL_ORDER_CXL_CONFIRMATION, ErrorCodes::SUCCESS);
+    // IOC - cancel whatever could not trade
+    if (filled < order.Volume1) {
+        std::cout << "3L order IOC cancellation for " << (order.Volume1 - filled) << std::endl;
+        send_3l_order_response(&order, ts, TransactionCodes::THRL_ORDER_CXL_CONFIRMATION, ErrorCodes::SUCCESS);
     }
 }
 
 // 2L Order Response Sender
 void FakeNSEExchange::send_2l_order_response(const MS_SPD_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code) {
+    TraderRoute route(*this, req->Header.TraderId);
     MS_SPD_OE_REQUEST response;
     memset(&response, 0, sizeof(response));
 
@@ -2694,30 +2905,17 @@ void FakeNSEExchange::send_2l_order_response(const MS_SPD_OE_REQUEST* req, uint6
     // Set reason code
     response.ReasonCode1 = reason_code;
 
-    // Generate order number and activity reference for confirmed orders
+    // Generate order number and activity reference for confirmed orders not already numbered;
+    // fill quantities come from the execution against the leg books
     if (transaction_code == TransactionCodes::TWOL_ORDER_CONFIRMATION) {
-        response.OrderNumber1 = generate_order_number(ts);
-        response.EntryDateTime1 = static_cast<int32_t>(ts / 1000000);
-        response.LastModified1 = static_cast<int32_t>(ts / 1000000);
-        response.LastActivityReference = generate_activity_reference(ts);
-
-        // Simulate partial fill (50% of cases when matched)
-        if (rand() % 2 == 0) {
-            response.VolumeFilledToday1 = response.Volume1 / 2;
-            response.TotalVolRemaining1 = response.Volume1 - response.VolumeFilledToday1;
-            response.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2 = response.MS_SPD_LEG_INFO_leg2.Volume2 / 2;
-            response.MS_SPD_LEG_INFO_leg2.TotalVolRemaining2 = response.MS_SPD_LEG_INFO_leg2.Volume2 - response.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2;
-            response.OrderFlags.Traded = 1;
-        } else {
-            // Full fill
-            response.VolumeFilledToday1 = response.Volume1;
-            response.TotalVolRemaining1 = 0;
-            response.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2 = response.MS_SPD_LEG_INFO_leg2.Volume2;
-            response.MS_SPD_LEG_INFO_leg2.TotalVolRemaining2 = 0;
-            response.OrderFlags.Traded = 1;
+        if (response.OrderNumber1 == 0) {
+            response.OrderNumber1 = generate_order_number(ts);
+            response.EntryDateTime1 = static_cast<int32_t>(ts / 1000000);
+            response.LastModified1 = static_cast<int32_t>(ts / 1000000);
+            response.LastActivityReference = generate_activity_reference(ts);
         }
 
-        std::cout << "Generated 2L order number: " << response.OrderNumber1 << std::endl;
+        std::cout << "2L order number: " << response.OrderNumber1 << std::endl;
     }
 
     // Handle cancellation response
@@ -2746,6 +2944,7 @@ void FakeNSEExchange::send_2l_order_response(const MS_SPD_OE_REQUEST* req, uint6
 
 // 3L Order Response Sender
 void FakeNSEExchange::send_3l_order_response(const MS_SPD_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code) {
+    TraderRoute route(*this, req->Header.TraderId);
     MS_SPD_OE_REQUEST response;
     memset(&response, 0, sizeof(response));
 
@@ -2758,34 +2957,17 @@ void FakeNSEExchange::send_3l_order_response(const MS_SPD_OE_REQUEST* req, uint6
     // Set reason code
     response.ReasonCode1 = reason_code;
 
-    // Generate order number and activity reference for confirmed orders
+    // Generate order number and activity reference for confirmed orders not already numbered;
+    // fill quantities come from the execution against the leg books
     if (transaction_code == TransactionCodes::THRL_ORDER_CONFIRMATION) {
-        response.OrderNumber1 = generate_order_number(ts);
-        response.EntryDateTime1 = static_cast<int32_t>(ts / 1000000);
-        response.LastModified1 = static_cast<int32_t>(ts / 1000000);
-        response.LastActivityReference = generate_activity_reference(ts);
-
-        // Simulate partial fill (50% of cases when matched)
-        if (rand() % 2 == 0) {
-            response.VolumeFilledToday1 = response.Volume1 / 2;
-            response.TotalVolRemaining1 = response.Volume1 - response.VolumeFilledToday1;
-            response.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2 = response.MS_SPD_LEG_INFO_leg2.Volume2 / 2;
-            response.MS_SPD_LEG_INFO_leg2.TotalVolRemaining2 = response.MS_SPD_LEG_INFO_leg2.Volume2 - response.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2;
-            response.MS_SPD_LEG_INFO_leg3.VolumeFilledToday2 = response.MS_SPD_LEG_INFO_leg3.Volume2 / 2;
-            response.MS_SPD_LEG_INFO_leg3.TotalVolRemaining2 = response.MS_SPD_LEG_INFO_leg3.Volume2 - response.MS_SPD_LEG_INFO_leg3.VolumeFilledToday2;
-            response.OrderFlags.Traded = 1;
-        } else {
-            // Full fill
-            response.VolumeFilledToday1 = response.Volume1;
-            response.TotalVolRemaining1 = 0;
-            response.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2 = response.MS_SPD_LEG_INFO_leg2.Volume2;
-            response.MS_SPD_LEG_INFO_leg2.TotalVolRemaining2 = 0;
-            response.MS_SPD_LEG_INFO_leg3.VolumeFilledToday2 = response.MS_SPD_LEG_INFO_leg3.Volume2;
-            response.MS_SPD_LEG_INFO_leg3.TotalVolRemaining2 = 0;
-            response.OrderFlags.Traded = 1;
+        if (response.OrderNumber1 == 0) {
+            response.OrderNumber1 = generate_order_number(ts);
+            response.EntryDateTime1 = static_cast<int32_t>(ts / 1000000);
+            response.LastModified1 = static_cast<int32_t>(ts / 1000000);
+            response.LastActivityReference = generate_activity_reference(ts);
         }
 
-        std::cout << "Generated 3L order number: " << response.OrderNumber1 << std::endl;
+        std::cout << "3L order number: " << response.OrderNumber1 << std::endl;
     }
 
     // Handle cancellation response
@@ -2813,32 +2995,2616 @@ void FakeNSEExchange::send_3l_order_response(const MS_SPD_OE_REQUEST* req, uint6
     }
 }
 
-// ===== Chapter 7: Unsolicited Messages Implementation =====
+// ===== NNF Packet Framing =====
 
-// Send Stop Loss Notification (Transaction Code 2212)
-void FakeNSEExchange::send_stop_loss_notification(const MS_OE_REQUEST& order, uint64_t ts) {
-    MS_TRADE_CONFIRM notification;
-    memset(&notification, 0, sizeof(notification));
+void FakeNSEExchange::set_packet_framing(bool enabled, NnfPacketCodec::ErrorPolicy policy) {
+    packet_framing_ = enabled;
+    packet_codec_.set_error_policy(policy);
+    packet_codec_.reset();
+    install_message_callback();
+    std::cout << "NNF packet framing " << (enabled ? "enabled" : "disabled") << std::endl;
+}
 
-    // Set header
-    notification.Header.TransactionCode = TransactionCodes::ON_STOP_NOTIFICATION;
-    notification.Header.LogTime = static_cast<int32_t>(ts / 1000000);
-    notification.Header.TraderId = order.TraderId;
-    notification.Header.ErrorCode = 0;
-    notification.Header.Timestamp = ts;
-    notification.Header.MessageLength = sizeof(MS_TRADE_CONFIRM);
+void FakeNSEExchange::install_message_callback() {
+    if (connection_callback_) {
+        message_callback_ = [this](const uint8_t* message, size_t length) {
+            if (output_connection_ == UNROUTED) {
+                return;
+            }
+            note_sent(output_connection_);
+            connection_callback_(output_connection_, message, length);
+        };
+    } else if (packet_framing_ && client_callback_) {
+        message_callback_ = [this](const uint8_t* message, size_t length) { send_packet(message, length); };
+    } else {
+        message_callback_ = client_callback_;
+    }
+}
 
-    // Set order details
-    notification.ResponseOrderNumber = order.OrderNumber;
-    memcpy(notification.BrokerId, order.BrokerId, sizeof(notification.BrokerId));
-    notification.TraderNumber = order.TraderId;
-    memcpy(notification.AccountNumber, order.AccountNumber, sizeof(notification.AccountNumber));
-    notification.BuySellIndicator = order.BuySellIndicator;
-    notification.OriginalVolume = order.Volume;
-    notification.DisclosedVolume = order.DisclosedVolume;
-    notification.RemainingVolume = order.TotalVolumeRemaining;
-    notification.DisclosedVolumeRemaining = order.DisclosedVolumeRemaining;
-    notification.Price = order.Price;
+// Anything sent stands in for the connection's next heartbeat
+void FakeNSEExchange::note_sent(ConnectionId connection) {
+    if (connection != 0) {
+        auto state = connection_states_.find(connection);
+        if (state != connection_states_.end()) {
+            state->second.sent_since_heartbeat = true;
+        }
+    }
+}
+
+// Wrap an outbound message in its packet and hand it to the client
+void FakeNSEExchange::send_packet(const uint8_t* message, size_t length) {
+    if (length > packet_codec_.max_message_size()) {
+        std::cout << "Message too large for an NNF packet: " << length << " bytes" << std::endl;
+        return;
+    }
+    // Handlers may send from inside the client's callback, so no shared buffer
+    uint8_t packet[1024];
+    if (packet_codec_.packet_size(length) <= sizeof(packet)) {
+        size_t size = packet_codec_.encode(message, length, packet);
+        client_callback_(packet, size);
+        return;
+    }
+    std::vector<uint8_t> large_packet(packet_codec_.packet_size(length));
+    size_t size = packet_codec_.encode(message, length, large_packet.data());
+    client_callback_(large_packet.data(), size);
+}
+
+// Split a read into packets and verify them all, then handle the messages.
+// Under the reject policy a bad packet sets error after the good packets
+// ahead of it have been handled.
+size_t FakeNSEExchange::parse_packets(const uint8_t* buf, size_t buflen, uint64_t ts, bool& error) {
+    NnfPacketCodec::Status status;
+    inbound_frames_.clear();
+    size_t consumed = packet_codec_.decode(buf, buflen, inbound_frames_, status);
+
+    if (status != NnfPacketCodec::Status::Ok) {
+        const char* reason = "bad length";
+        if (status == NnfPacketCodec::Status::BadSequence) {
+            reason = "sequence mismatch";
+        } else if (status == NnfPacketCodec::Status::BadChecksum) {
+            reason = "checksum mismatch";
+        }
+        bool reject = packet_codec_.error_policy() == NnfPacketCodec::ErrorPolicy::Reject;
+        std::cout << "NNF packet " << (reject ? "rejected" : "dropped") << ": " << reason
+                  << " (expected sequence " << packet_codec_.expected_inbound_sequence() << ")" << std::endl;
+        error = reject;
+    }
+
+    for (const NnfPacketCodec::Frame& frame : inbound_frames_) {
+        bool message_error = false;
+        size_t seen = try_parse_message(frame.message, frame.length, ts, message_error);
+        if (message_error) {
+            error = true;
+            return static_cast<size_t>(frame.message - buf) - NnfPacketCodec::HEADER_SIZE;
+        }
+        if (seen == 0) {
+            std::cout << "Unhandled message in NNF packet " << frame.sequence << std::endl;
+        }
+    }
+    return consumed;
+}
+
+// ===== Gateway Router and Box Sign-On =====
+
+size_t FakeNSEExchange::parse(ConnectionId connection, const uint8_t* buf, size_t buflen, uint64_t ts, bool& error) {
+    if (connection != 0) {
+        track_connection(connection, ts).last_received = ts;
+    }
+    ConnectionId previous_connection = output_connection_;
+    output_connection_ = connection;
+    size_t seen = parse(buf, buflen, ts, error);
+    output_connection_ = previous_connection;
+    return seen;
+}
+
+// The connection the trader signed on from. A trader with none still gets
+// the reply to their own request on the connection it came in on; anything
+// else for them is dropped, never broadcast.
+FakeNSEExchange::ConnectionId FakeNSEExchange::trader_connection(int32_t trader_id) const {
+    auto it = trader_connections_.find(trader_id);
+    if (it != trader_connections_.end()) {
+        return it->second;
+    }
+    if (output_connection_ != 0 && output_connection_ != UNROUTED && trader_id == request_trader_) {
+        return output_connection_;
+    }
+    return UNROUTED;
+}
+
+void FakeNSEExchange::set_connection_callback(ConnectionCallback callback) {
+    connection_callback_ = callback;
+    install_message_callback();
+}
+
+void FakeNSEExchange::connection_opened(ConnectionId connection, uint64_t ts) {
+    track_connection(connection, ts);
+}
+
+// Sign off the traders that came in on the connection and release its box
+void FakeNSEExchange::connection_closed(ConnectionId connection, uint64_t ts) {
+    auto state = connection_states_.find(connection);
+    if (state != connection_states_.end()) {
+        timer_wheel_.cancel(state->second.heartbeat_timer);
+        timer_wheel_.cancel(state->second.idle_timer);
+        connection_states_.erase(state);
+    }
+    for (auto& entry : boxes_) {
+        BoxSession& box = entry.second;
+        if (box.signed_on && box.connection == connection) {
+            box.signed_on = false;
+            box.connection = 0;
+            std::cout << "Box " << entry.first << " disconnected at " << ts / 1000000 << std::endl;
+        }
+    }
+    for (auto it = trader_connections_.begin(); it != trader_connections_.end(); ) {
+        if (it->second == connection) {
+            logged_in_traders_.erase(it->first);
+            trader_last_logoff_time_[it->first] = static_cast<int32_t>(ts / 1000000);
+            std::cout << "Trader " << it->first << " signed off on disconnect" << std::endl;
+            it = trader_connections_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool FakeNSEExchange::is_bulk_request(const uint8_t* message, size_t length) {
+    int16_t transaction_code;
+    if (length < sizeof(transaction_code)) {
+        return false;
+    }
+    memcpy(&transaction_code, message, sizeof(transaction_code));
+    switch (transaction_code) {
+        case TransactionCodes::UPDATE_LOCAL_DATABASE:
+        case TransactionCodes::MESSAGE_DOWNLOAD:
+        case TransactionCodes::EXCHANGE_PORTFOLIO_REQUEST:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void FakeNSEExchange::set_session_timeouts(uint64_t heartbeat_interval_us, uint64_t idle_timeout_us) {
+    heartbeat_interval_ = heartbeat_interval_us;
+    idle_timeout_ = idle_timeout_us;
+    uint64_t now = timer_wheel_.now();
+    for (auto& entry : connection_states_) {
+        ConnectionState& state = entry.second;
+        timer_wheel_.cancel(state.heartbeat_timer);
+        timer_wheel_.cancel(state.idle_timer);
+        state.heartbeat_timer = TimerWheel::INVALID_TIMER;
+        state.idle_timer = TimerWheel::INVALID_TIMER;
+        if (heartbeat_interval_ > 0) {
+            schedule_heartbeat(entry.first, now + heartbeat_interval_);
+        }
+        if (idle_timeout_ > 0) {
+            schedule_idle_check(entry.first, state.last_received + idle_timeout_);
+        }
+    }
+}
+
+void FakeNSEExchange::set_disconnect_callback(DisconnectCallback callback) {
+    disconnect_callback_ = callback;
+}
+
+// Heartbeats only count as activity, which parse() has already recorded;
+// they are too frequent to log
+void FakeNSEExchange::handle_heartbeat(const HEARTBEAT* req, uint64_t ts) {
+    (void)req;
+    (void)ts;
+}
+
+FakeNSEExchange::ConnectionState& FakeNSEExchange::track_connection(ConnectionId connection, uint64_t ts) {
+    auto found = connection_states_.find(connection);
+    if (found != connection_states_.end()) {
+        return found->second;
+    }
+    ConnectionState& state = connection_states_[connection];
+    state.last_received = ts;
+    state.sent_since_heartbeat = false;
+    state.heartbeat_timer = TimerWheel::INVALID_TIMER;
+    state.idle_timer = TimerWheel::INVALID_TIMER;
+    if (heartbeat_interval_ > 0) {
+        schedule_heartbeat(connection, ts + heartbeat_interval_);
+    }
+    if (idle_timeout_ > 0) {
+        schedule_idle_check(connection, ts + idle_timeout_);
+    }
+    return state;
+}
+
+// Heartbeat only if nothing else went out on the connection since last time
+void FakeNSEExchange::schedule_heartbeat(ConnectionId connection, uint64_t when) {
+    connection_states_[connection].heartbeat_timer = timer_wheel_.schedule_at(when, [this, connection](uint64_t now) {
+        auto state = connection_states_.find(connection);
+        if (state == connection_states_.end()) {
+            return;
+        }
+        state->second.heartbeat_timer = TimerWheel::INVALID_TIMER;
+        if (!state->second.sent_since_heartbeat) {
+            send_heartbeat(connection, now);
+        }
+        state->second.sent_since_heartbeat = false;
+        if (heartbeat_interval_ > 0) {
+            schedule_heartbeat(connection, now + heartbeat_interval_);
+        }
+    });
+}
+
+// The check moves itself to the idle deadline of the latest message, so one
+// timer per connection covers any amount of traffic
+void FakeNSEExchange::schedule_idle_check(ConnectionId connection, uint64_t when) {
+    connection_states_[connection].idle_timer = timer_wheel_.schedule_at(when, [this, connection](uint64_t now) {
+        auto state = connection_states_.find(connection);
+        if (state == connection_states_.end()) {
+            return;
+        }
+        state->second.idle_timer = TimerWheel::INVALID_TIMER;
+        if (idle_timeout_ == 0) {
+            return;
+        }
+        uint64_t deadline = state->second.last_received + idle_timeout_;
+        if (now < deadline) {
+            schedule_idle_check(connection, deadline);
+            return;
+        }
+        std::cout << "Connection " << connection << " idle for " << (now - state->second.last_received) / 1000000
+                  << "s - disconnecting" << std::endl;
+        connection_closed(connection, now);
+        if (disconnect_callback_) {
+            disconnect_callback_(connection);
+        }
+    });
+}
+
+void FakeNSEExchange::send_heartbeat(ConnectionId connection, uint64_t ts) {
+    HEARTBEAT heartbeat;
+    memset(&heartbeat, 0, sizeof(heartbeat));
+    heartbeat.Header.TransactionCode = TransactionCodes::HEARTBEAT;
+    heartbeat.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+    heartbeat.Header.Timestamp = ts;
+    heartbeat.Header.MessageLength = sizeof(HEARTBEAT);
+
+    ConnectionId previous_connection = output_connection_;
+    output_connection_ = connection;
+    if (message_callback_) {
+        message_callback_(reinterpret_cast<const uint8_t*>(&heartbeat), sizeof(heartbeat));
+    }
+    output_connection_ = previous_connection;
+}
+
+void FakeNSEExchange::add_gateway_endpoint(const std::string& ip, int32_t port) {
+    GatewayEndpoint endpoint;
+    endpoint.ip = ip;
+    endpoint.port = port;
+    gateway_endpoints_.push_back(endpoint);
+}
+
+void FakeNSEExchange::set_gateway_selector(GatewaySelector selector) {
+    gateway_selector_ = selector;
+}
+
+void FakeNSEExchange::set_session_cipher_callback(SessionCipherCallback callback) {
+    session_cipher_callback_ = callback;
+}
+
+void FakeNSEExchange::handle_gr_request(const MS_GR_REQUEST* req, uint64_t ts) {
+    std::cout << "GR request from box " << req->BoxID
+              << ", BrokerID: " << std::string(req->BrokerID, sizeof(req->BrokerID)) << std::endl;
+
+    auto existing = boxes_.find(req->BoxID);
+    if (existing != boxes_.end() && existing->second.signed_on) {
+        std::cout << "Box " << req->BoxID << " is already signed on" << std::endl;
+        send_gr_response(req, nullptr, ts, ErrorCodes::e$invalid_box_id);
+        return;
+    }
+
+    GatewayEndpoint endpoint;
+    bool found = false;
+    if (gateway_selector_) {
+        found = gateway_selector_(req->BoxID, endpoint);
+    } else if (!gateway_endpoints_.empty()) {
+        endpoint = gateway_endpoints_[next_gateway_++ % gateway_endpoints_.size()];
+        found = true;
+    }
+    if (!found) {
+        send_gr_response(req, nullptr, ts, ErrorCodes::e$no_gateway_available);
+        return;
+    }
+
+    uint8_t crypto_key[NnfPacketCodec::KEY_SIZE] = {};
+    uint8_t crypto_iv[NnfPacketCodec::IV_SIZE] = {};
+    if (session_encryption_ &&
+        !(fill_session_bytes(crypto_key, sizeof(crypto_key)) && fill_session_bytes(crypto_iv, sizeof(crypto_iv)))) {
+        std::cout << "No random source for the session keys of box " << req->BoxID << std::endl;
+        send_gr_response(req, nullptr, ts, ErrorCodes::e$no_gateway_available);
+        return;
+    }
+
+    BoxSession& box = boxes_[req->BoxID];
+    box.broker_id.assign(req->BrokerID, sizeof(req->BrokerID));
+    uint64_t key = mix_hash64(session_key_seed_ ^ (static_cast<uint64_t>(static_cast<uint16_t>(req->BoxID)) << 48) ^ ts);
+    session_key_seed_ = key;
+    memcpy(box.session_key, &key, sizeof(box.session_key));
+    box.encrypted = session_encryption_;
+    memcpy(box.crypto_key, crypto_key, sizeof(box.crypto_key));
+    memcpy(box.crypto_iv, crypto_iv, sizeof(box.crypto_iv));
+    box.gateway = endpoint;
+    box.registered = false;
+    box.signed_on = false;
+    box.connection = 0;
+
+    std::cout << "Box " << req->BoxID << " routed to gateway " << endpoint.ip << ":" << endpoint.port << std::endl;
+    send_gr_response(req, &box, ts, ErrorCodes::SUCCESS);
+}
+
+void FakeNSEExchange::send_gr_response(const MS_GR_REQUEST* req, const BoxSession* box, uint64_t ts, int16_t error_code) {
+    MS_GR_RESPONSE_NEW response;
+    memset(&response, 0, sizeof(response));
+
+    response.Header = req->Header;
+    response.Header.TransactionCode = TransactionCodes::GR_RESPONSE;
+    response.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+    response.Header.ErrorCode = error_code;
+    response.Header.MessageLength = sizeof(MS_GR_RESPONSE_NEW);
+    response.BoxID = req->BoxID;
+    memcpy(response.BrokerID, req->BrokerID, sizeof(response.BrokerID));
+
+    if (box) {
+        // Dotted quad, NUL terminated within the field
+        const std::string& ip = box->gateway.ip;
+        memcpy(response.IPAddress, ip.data(), std::min(ip.size(), sizeof(response.IPAddress) - 1));
+        response.Port = box->gateway.port;
+        memcpy(response.SessionKey, box->session_key, sizeof(response.SessionKey));
+        memcpy(response.CryptographicKey, box->crypto_key, sizeof(response.CryptographicKey));
+        memcpy(response.CryptographicIV, box->crypto_iv, sizeof(response.CryptographicIV));
+    } else {
+        std::cout << "Sending GR error response to box " << req->BoxID << ", ErrorCode: " << error_code << std::endl;
+    }
+
+    if (message_callback_) {
+        message_callback_(reinterpret_cast<const uint8_t*>(&response), sizeof(response));
+    }
+}
+
+// AES keys and IVs come from the kernel's random source, never from the
+// session key's hash chain, which anyone who knows the start time can
+// replay. Returns false if the kernel could not supply them.
+bool FakeNSEExchange::fill_session_bytes(uint8_t* out, size_t length) {
+    size_t filled = 0;
+    while (filled < length) {
+        ssize_t got = getrandom(out + filled, length - filled, 0);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cout << "getrandom failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        filled += static_cast<size_t>(got);
+    }
+    return true;
+}
+
+void FakeNSEExchange::handle_secure_box_registration(const MS_SECURE_BOX_REGISTRATION_REQUEST_IN* req, uint64_t ts) {
+    std::cout << "Secure box registration from box " << req->BoxId << std::endl;
+
+    auto box = boxes_.find(req->BoxId);
+    if (box == boxes_.end()) {
+        send_secure_box_registration_response(req, ts, ErrorCodes::e$invalid_box_id);
+        return;
+    }
+    box->second.registered = true;
+    send_secure_box_registration_response(req, ts, ErrorCodes::SUCCESS);
+}
+
+void FakeNSEExchange::send_secure_box_registration_response(const MS_SECURE_BOX_REGISTRATION_REQUEST_IN* req, uint64_t ts, int16_t error_code) {
+    MS_SECURE_BOX_REGISTRATION_RESPONSE_OUT response;
+    memset(&response, 0, sizeof(response));
+
+    response.Header = req->Header;
+    response.Header.TransactionCode = TransactionCodes::SECURE_BOX_REGISTRATION_RESPONSE_OUT;
+    response.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+    response.Header.ErrorCode = error_code;
+    response.Header.MessageLength = sizeof(MS_SECURE_BOX_REGISTRATION_RESPONSE_OUT);
+
+    if (message_callback_) {
+        message_callback_(reinterpret_cast<const uint8_t*>(&response), sizeof(response));
+    }
+}
+
+void FakeNSEExchange::handle_box_sign_on_request(const MS_BOX_SIGN_ON_REQUEST_IN* req, uint64_t ts) {
+    std::cout << "Box sign-on request from box " << req->BoxId
+              << ", BrokerID: " << std::string(req->BrokerId, sizeof(req->BrokerId)) << std::endl;
+
+    auto box = boxes_.find(req->BoxId);
+    if (box == boxes_.end()) {
+        send_box_sign_on_response(req, ts, ErrorCodes::e$invalid_box_id);
+        return;
+    }
+    if (!box->second.registered) {
+        send_box_sign_on_response(req, ts, ErrorCodes::e$box_not_registered);
+        return;
+    }
+    if (memcmp(box->second.session_key, req->SessionKey, sizeof(req->SessionKey)) != 0) {
+        send_box_sign_on_response(req, ts, ErrorCodes::e$invalid_session_key);
+        return;
+    }
+
+    box->second.signed_on = true;
+    box->second.connection = output_connection_;
+    send_box_sign_on_response(req, ts, ErrorCodes::SUCCESS);
+
+    if (box->second.encrypted) {
+        if (session_cipher_callback_ && output_connection_ != 0) {
+            std::cout << "Box " << req->BoxId << " session encrypted" << std::endl;
+            session_cipher_callback_(output_connection_, box->second.crypto_key, box->second.crypto_iv);
+        } else {
+            std::cout << "Box " << req->BoxId << ": no front end to encrypt the session, staying in the clear" << std::endl;
+        }
+    }
+}
+
+void FakeNSEExchange::send_box_sign_on_response(const MS_BOX_SIGN_ON_REQUEST_IN* req, uint64_t ts, int16_t error_code) {
+    MS_BOX_SIGN_ON_REQUEST_OUT response;
+    memset(&response, 0, sizeof(response));
+
+    response.Header = req->Header;
+    response.Header.TransactionCode = TransactionCodes::BOX_SIGN_ON_REQUEST_OUT;
+    response.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+    response.Header.ErrorCode = error_code;
+    response.Header.MessageLength = sizeof(MS_BOX_SIGN_ON_REQUEST_OUT);
+    response.BoxId = req->BoxId;
+
+    if (error_code == ErrorCodes::SUCCESS) {
+        std::cout << "Box " << req->BoxId << " signed on" << std::endl;
+    } else {
+        std::cout << "Sending box sign-on error response to box " << req->BoxId << ", ErrorCode: " << error_code << std::endl;
+    }
+
+    if (message_callback_) {
+        message_callback_(reinterpret_cast<const uint8_t*>(&response), sizeof(response));
+    }
+}
+
+void FakeNSEExchange::handle_box_sign_off(const MS_BOX_SIGN_OFF* req, uint64_t ts) {
+    std::cout << "Box sign-off from box " << req->BoxId << std::endl;
+
+    auto box = boxes_.find(req->BoxId);
+    if (box == boxes_.end() || !box->second.signed_on) {
+        send_box_sign_off_response(req, ts, ErrorCodes::e$invalid_box_id);
+        return;
+    }
+    // The session key is single use; the box goes back through the router
+    boxes_.erase(box);
+    send_box_sign_off_response(req, ts, ErrorCodes::SUCCESS);
+}
+
+void FakeNSEExchange::send_box_sign_off_response(const MS_BOX_SIGN_OFF* req, uint64_t ts, int16_t error_code) {
+    MS_BOX_SIGN_OFF response;
+    memset(&response, 0, sizeof(response));
+
+    response.Header = req->Header;
+    response.Header.TransactionCode = TransactionCodes::BOX_SIGN_OFF;
+    response.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+    response.Header.ErrorCode = error_code;
+    response.Header.MessageLength = sizeof(MS_BOX_SIGN_OFF);
+    response.BoxId = req->BoxId;
+
+    if (message_callback_) {
+        message_callback_(reinterpret_cast<const uint8_t*>(&response), sizeof(response));
+    }
+}
+
+// ===== Order Matching =====
+
+void FakeNSEExchange::set_spread_implied_matching(bool enabled) {
+    spread_implied_matching_ = enabled;
+    std::cout << "Spread implied matching " << (enabled ? "ENABLED" : "DISABLED") << std::endl;
+}
+
+void FakeNSEExchange::set_previous_close(int32_t token, const CONTRACT_DESC& contract, int32_t price) {
+    market_stats_.previous_close[market_stats_.slot(token, contract)] = price;
+    update_price_band(token, price);
+}
+
+void FakeNSEExchange::set_open_interest(int32_t token, const CONTRACT_DESC& contract, int64_t open_interest) {
+    market_stats_.set_open_interest(market_stats_.slot(token, contract), open_interest);
+}
+
+uint64_t FakeNSEExchange::spread_pair_key(int32_t token1, int32_t token2) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(token1)) << 32) | static_cast<uint32_t>(token2);
+}
+
+bool FakeNSEExchange::is_crossing(bool is_buy, int32_t order_price, int32_t level_price) {
+    return is_buy ? (level_price <= order_price) : (level_price >= order_price);
+}
+
+// Market orders only trade on entry and stop-loss orders wait for a trigger,
+// so neither rests in the book
+bool FakeNSEExchange::is_bookable(const MS_OE_REQUEST& order) {
+    return !order.OrderFlags.Market && !order.OrderFlags.SL;
+}
+
+void FakeNSEExchange::book_order(const MS_OE_REQUEST& order) {
+    if (!is_bookable(order) || order.TotalVolumeRemaining <= 0) {
+        return;
+    }
+    order_books_[order.TokenNo].add(order.BuySellIndicator == 1, order.Price, order.OrderNumber, order.TotalVolumeRemaining,
+                                    owner_id(order));
+    market_watch_tokens_.mark(order.TokenNo);
+}
+
+void FakeNSEExchange::unbook_order(const MS_OE_REQUEST& order) {
+    auto book_iter = order_books_.find(order.TokenNo);
+    if (book_iter == order_books_.end() || order.TotalVolumeRemaining <= 0) {
+        return;
+    }
+    if (book_iter->second.remove(order.BuySellIndicator == 1, order.Price, order.OrderNumber, order.TotalVolumeRemaining)) {
+        market_watch_tokens_.mark(order.TokenNo);
+    }
+}
+
+void FakeNSEExchange::apply_order_fill(MS_OE_REQUEST& order, int32_t quantity) {
+    order.TotalVolumeRemaining -= quantity;
+    order.VolumeFilledToday += quantity;
+    order.DisclosedVolumeRemaining = std::max(order.DisclosedVolumeRemaining - quantity, 0);
+    order.OrderFlags.Traded = 1;
+}
+
+// What a resting order can give a counter order still wanting this much: 0
+// from an all-or-none order larger than that, otherwise up to its disclosed
+// tranche. Every path that trades against resting orders sizes fills here.
+int32_t FakeNSEExchange::resting_fill_quantity(const MS_OE_REQUEST& resting, int64_t wanted) {
+    if (resting.OrderFlags.AON && resting.TotalVolumeRemaining > wanted) {
+        return 0;
+    }
+    int32_t available = resting.TotalVolumeRemaining;
+    if (resting.DisclosedVolume > 0) {
+        available = std::min(available, resting.DisclosedVolumeRemaining);
+    }
+    return static_cast<int32_t>(std::max<int64_t>(std::min<int64_t>(wanted, available), 0));
+}
+
+// Take a fill off a resting order and its level. A filled order leaves the
+// book; an iceberg whose tranche runs out shows the next one from the back of
+// the queue. Touches only this book, so books can be filled concurrently.
+// Returns true if the order left its queue position, which can drop the level.
+bool FakeNSEExchange::fill_resting_order(OrderBook& book, bool is_buy, int32_t price, uint32_t owner,
+                                         MS_OE_REQUEST& resting, int32_t quantity) {
+    apply_order_fill(resting, quantity);
+    if (resting.TotalVolumeRemaining == 0) {
+        book.remove(is_buy, price, resting.OrderNumber, quantity);
+        return true;
+    }
+    book.reduce(is_buy, price, quantity);
+    if (resting.DisclosedVolume > 0 && resting.DisclosedVolumeRemaining == 0) {
+        book.remove(is_buy, price, resting.OrderNumber, resting.TotalVolumeRemaining);
+        replenish_disclosed_volume(resting);
+        book.add(is_buy, price, resting.OrderNumber, resting.TotalVolumeRemaining, owner);
+        return true;
+    }
+    return false;
+}
+
+FakeNSEExchange::TradeSide FakeNSEExchange::make_trade_side(const MS_OE_REQUEST& order) const {
+    TradeSide side;
+    side.order_number = order.OrderNumber;
+    side.trader_id = order.Header.TraderId;
+    side.broker_id = order.BrokerId;
+    side.account_number = order.AccountNumber;
+    side.participant = order.Settlor;
+    side.pan = order.PAN;
+    side.buy_sell = order.BuySellIndicator;
+    side.book_type = order.BookType;
+    side.open_close = order.OpenClose;
+    side.algo_id = order.AlgoID;
+    side.volume = order.Volume;
+    side.remaining_volume = order.TotalVolumeRemaining;
+    side.volume_filled_today = order.VolumeFilledToday;
+    side.price = order.Price;
+    side.good_till_date = order.GoodTillDate;
+    side.order_flags = order.OrderFlags;
+    side.additional_flags = order.AdditionalOrderFlags;
+    return side;
+}
+
+// Match an incoming or requeued order against the opposite side of its book
+// in price-time priority, then rest whatever is left at its limit price
+void FakeNSEExchange::match_order(double order_number, uint64_t ts) {
+    auto order_iter = active_orders_.find(order_number);
+    if (order_iter == active_orders_.end()) {
+        return;
+    }
+    
+    MS_OE_REQUEST& order = order_iter->second;
+    
+    // During the pre-open call auction orders only accumulate; those that
+    // cannot rest are remembered so the close of the auction can cancel them
+    if (preopen_session_active_) {
+        if (order.OrderFlags.IOC || !is_bookable(order)) {
+            preopen_unbookable_orders_.push_back(order.OrderNumber);
+        }
+        replenish_disclosed_volume(order);
+        book_order(order);
+        return;
+    }
+    
+    bool is_buy = (order.BuySellIndicator == 1);
+    OrderBook& book = order_books_[order.TokenNo];
+    
+    // Resting orders without an owner carry 0, so an incoming order without
+    // one gets an id that matches nothing
+    uint32_t incoming_owner = owner_id(order);
+    if (incoming_owner == 0) {
+        incoming_owner = std::numeric_limits<uint32_t>::max();
+    }
+    
+    // All-or-none (fill-or-kill with IOC) and minimum-fill orders need enough
+    // depth before they trade at all. Depth is what match_against_levels would
+    // actually fill: too large all-or-none orders are passed over, and the
+    // walk ends at the owner's own orders unless those get cancelled.
+    int32_t required = 0;
+    if (order.OrderFlags.AON) {
+        required = order.TotalVolumeRemaining;
+    } else if (order.OrderFlags.MF && order.MinimumFillAONVolume > 0) {
+        required = std::min(order.MinimumFillAONVolume, order.TotalVolumeRemaining);
+    }
+    if (required > 0) {
+        bool stop_at_own = (self_trade_action_ != SelfTradeAction::CancelResting);
+        int64_t depth = is_buy
+            ? executable_volume(book.asks, true, order.Price, order.OrderFlags.Market, order.TotalVolumeRemaining,
+                                incoming_owner, stop_at_own, nullptr)
+            : executable_volume(book.bids, false, order.Price, order.OrderFlags.Market, order.TotalVolumeRemaining,
+                                incoming_owner, stop_at_own, nullptr);
+        if (depth < required) {
+            if (order.OrderFlags.IOC || !order.OrderFlags.AON || !is_bookable(order)) {
+                std::cout << "Order " << order.OrderNumber << " cannot fill " << required << " - cancelled" << std::endl;
+                cancel_order_remainder(order, ErrorCodes::e$fok_order_cancelled, ts);
+                return;
+            }
+            // All-or-none orders without IOC wait in the book for a large enough counter order
+            replenish_disclosed_volume(order);
+            book_order(order);
+            return;
+        }
+    }
+    
+    bool still_open = is_buy ? match_against_levels(order, book.asks, incoming_owner, ts)
+                             : match_against_levels(order, book.bids, incoming_owner, ts);
+    if (!still_open || order.TotalVolumeRemaining == 0) {
+        return;
+    }
+    
+    // Whatever cannot rest in the book is cancelled rather than left open
+    if (order.OrderFlags.IOC || !is_bookable(order)) {
+        std::cout << (order.OrderFlags.IOC ? "IOC" : "Unbookable") << " order " << order.OrderNumber << " remainder "
+                  << order.TotalVolumeRemaining << " cancelled" << std::endl;
+        cancel_order_remainder(order, ErrorCodes::SUCCESS, ts);
+        return;
+    }
+    
+    replenish_disclosed_volume(order);
+    book_order(order);
+}
+
+// Walk the opposite side's levels best first while they cross the order.
+// Within a level orders trade in time priority, except that resting
+// all-or-none orders larger than what is left are passed over. Returns false
+// if the incoming order was cancelled by self-trade prevention.
+template <typename Levels>
+bool FakeNSEExchange::match_against_levels(MS_OE_REQUEST& order, Levels& levels, uint32_t incoming_owner, uint64_t ts) {
+    bool is_buy = (order.BuySellIndicator == 1);
+    OrderBook& book = order_books_[order.TokenNo];
+    auto level_iter = levels.begin();
+    size_t position = 0;
+    
+    while (order.TotalVolumeRemaining > 0 && level_iter != levels.end()) {
+        int32_t level_price = level_iter->first;
+        PriceLevel& level = level_iter->second;
+        
+        if (!order.OrderFlags.Market && !is_crossing(is_buy, order.Price, level_price)) {
+            break;
+        }
+        if (position >= level.orders.size()) {
+            ++level_iter;
+            position = 0;
+            continue;
+        }
+        
+        // Removing an order can drop its level, so the level is looked up
+        // again after every removal
+        double resting_number = level.orders[position];
+        auto resting_iter = active_orders_.find(resting_number);
+        if (resting_iter == active_orders_.end()) {
+            // Stale entry; drop it and keep going
+            book.remove(!is_buy, level_price, resting_number, 0);
+            level_iter = levels.lower_bound(level_price);
+            continue;
+        }
+        MS_OE_REQUEST& resting = resting_iter->second;
+        
+        if (level.owners[position] == incoming_owner) {
+            std::cout << "Self trade prevented between orders " << order.OrderNumber
+                      << " and " << resting_number << std::endl;
+            if (self_trade_action_ != SelfTradeAction::CancelIncoming) {
+                cancel_order_remainder(resting, ErrorCodes::e$order_cancelled_for_self_trade, ts);
+            }
+            if (self_trade_action_ != SelfTradeAction::CancelResting) {
+                cancel_order_remainder(order, ErrorCodes::e$order_cancelled_for_self_trade, ts);
+                return false;
+            }
+            level_iter = levels.lower_bound(level_price);
+            continue;
+        }
+        
+        // Trades happen at the resting order's price, up to its disclosed tranche
+        int32_t quantity = resting_fill_quantity(resting, order.TotalVolumeRemaining);
+        if (quantity == 0) {
+            position++;
+            continue;
+        }
+        apply_order_fill(order, quantity);
+        if (fill_resting_order(book, !is_buy, level_price, level.owners[position], resting, quantity)) {
+            level_iter = levels.lower_bound(level_price);
+        }
+        
+        TradeSide incoming_side = make_trade_side(order);
+        TradeSide resting_side = make_trade_side(resting);
+        report_fill(order.TokenNo, order.ContractDesc,
+                    is_buy ? incoming_side : resting_side,
+                    is_buy ? resting_side : incoming_side,
+                    quantity, level_price, ts);
+    }
+    return true;
+}
+
+// Show the next disclosed tranche of an iceberg order
+void FakeNSEExchange::replenish_disclosed_volume(MS_OE_REQUEST& order) {
+    if (order.DisclosedVolume > 0) {
+        order.DisclosedVolumeRemaining = std::min(order.DisclosedVolume, order.TotalVolumeRemaining);
+    }
+}
+
+void FakeNSEExchange::apply_spread_fill(MS_SPD_OE_REQUEST& order, int32_t quantity) {
+    order.TotalVolRemaining1 -= quantity;
+    order.VolumeFilledToday1 += quantity;
+    order.MS_SPD_LEG_INFO_leg2.TotalVolRemaining2 -= quantity;
+    order.MS_SPD_LEG_INFO_leg2.VolumeFilledToday2 += quantity;
+    order.OrderFlags.Traded = 1;
+}
+
+// leg is 0 for the first leg, 1 and 2 for MS_SPD_LEG_INFO_leg2/leg3
+FakeNSEExchange::TradeSide FakeNSEExchange::make_spread_leg_side(const MS_SPD_OE_REQUEST& order, int leg) const {
+    TradeSide side;
+    side.order_number = order.OrderNumber1;
+    side.trader_id = order.Header.TraderId;
+    side.broker_id = order.BrokerId1;
+    side.account_number = order.AccountNumber1;
+    side.participant = order.Settlor1;
+    side.pan = order.PAN;
+    side.book_type = order.BookType1;
+    side.algo_id = order.AlgoID;
+    side.good_till_date = order.GoodTillDate1;
+    if (leg > 0) {
+        const MS_SPD_LEG_INFO& info = (leg == 1) ? order.MS_SPD_LEG_INFO_leg2 : order.MS_SPD_LEG_INFO_leg3;
+        // Legs without an explicit side trade opposite to the first leg
+        side.buy_sell = (info.BuySell2 == 1 || info.BuySell2 == 2) ? info.BuySell2 : ((order.BuySell1 == 1) ? 2 : 1);
+        side.open_close = info.OpenClose2[0];
+        side.volume = info.Volume2;
+        side.remaining_volume = info.TotalVolRemaining2;
+        side.volume_filled_today = info.VolumeFilledToday2;
+        side.price = info.Price2;
+        side.order_flags = info.OrderFlags;
+        side.additional_flags = info.AdditionalOrderFlags;
+    } else {
+        side.buy_sell = order.BuySell1;
+        side.open_close = order.OpenClose1;
+        side.volume = order.Volume1;
+        side.remaining_volume = order.TotalVolRemaining1;
+        side.volume_filled_today = order.VolumeFilledToday1;
+        side.price = order.Price1;
+        side.order_flags = order.OrderFlags;
+        side.additional_flags = order.AdditionalOrderFlags;
+    }
+    return side;
+}
+
+// Spread orders rest on their price difference (Token1 - Token2); buying the
+// spread buys the first leg and sells the second
+void FakeNSEExchange::book_spread_order(const MS_SPD_OE_REQUEST& order) {
+    if (order.TotalVolRemaining1 <= 0) {
+        return;
+    }
+    OrderBook& book = spread_books_[spread_pair_key(order.Token1, order.MS_SPD_LEG_INFO_leg2.Token2)];
+    book.add(order.BuySell1 == 1, order.PriceDiff, order.OrderNumber1, order.TotalVolRemaining1);
+}
+
+void FakeNSEExchange::unbook_spread_order(const MS_SPD_OE_REQUEST& order) {
+    OrderBook* book = spread_books_.find(spread_pair_key(order.Token1, order.MS_SPD_LEG_INFO_leg2.Token2));
+    if (!book || order.TotalVolRemaining1 <= 0) {
+        return;
+    }
+    book->remove(order.BuySell1 == 1, order.PriceDiff, order.OrderNumber1, order.TotalVolRemaining1);
+}
+
+// Reference price for a token (spread leg anchoring, auction tie-breaks):
+// last traded price, else the middle of the book, else whichever side is present
+int32_t FakeNSEExchange::reference_price(int32_t token) const {
+    auto ltp_iter = last_traded_prices_.find(token);
+    if (ltp_iter != last_traded_prices_.end()) {
+        return ltp_iter->second;
+    }
+    
+    auto book_iter = order_books_.find(token);
+    if (book_iter == order_books_.end()) {
+        return 0;
+    }
+    const OrderBook& book = book_iter->second;
+    if (!book.bids.empty() && !book.asks.empty()) {
+        return book.bids.begin()->first + (book.asks.begin()->first - book.bids.begin()->first) / 2;
+    }
+    if (!book.bids.empty()) {
+        return book.bids.begin()->first;
+    }
+    if (!book.asks.empty()) {
+        return book.asks.begin()->first;
+    }
+    return 0;
+}
+
+void FakeNSEExchange::match_spread_order(double order_number, uint64_t ts) {
+    auto order_iter = active_spread_orders_.find(order_number);
+    if (order_iter == active_spread_orders_.end()) {
+        return;
+    }
+    
+    MS_SPD_OE_REQUEST& order = order_iter->second;
+    if (preopen_session_active_) {
+        book_spread_order(order);
+        return;
+    }
+    
+    int32_t token1 = order.Token1;
+    int32_t token2 = order.MS_SPD_LEG_INFO_leg2.Token2;
+    bool is_buy = (order.BuySell1 == 1);
+    uint64_t key = spread_pair_key(token1, token2);
+    
+    while (order.TotalVolRemaining1 > 0) {
+        // Best opposite resting spread order, if any
+        OrderBook* book = spread_books_.find(key);
+        bool has_spread_price = book && (is_buy ? !book->asks.empty() : !book->bids.empty());
+        int32_t spread_price = 0;
+        if (has_spread_price) {
+            spread_price = is_buy ? book->asks.begin()->first : book->bids.begin()->first;
+        }
+        
+        // Implied prices win only when strictly better than resting spread orders
+        if (spread_implied_matching_ && match_spread_against_legs(order, spread_price, has_spread_price, ts)) {
+            continue;
+        }
+        
+        if (!has_spread_price || !is_crossing(is_buy, order.PriceDiff, spread_price)) {
+            break;
+        }
+        
+        PriceLevel& level = is_buy ? book->asks.begin()->second : book->bids.begin()->second;
+        double resting_number = level.orders.front();
+        auto resting_iter = active_spread_orders_.find(resting_number);
+        if (resting_iter == active_spread_orders_.end()) {
+            book->remove(!is_buy, spread_price, resting_number, 0);
+            continue;
+        }
+        MS_SPD_OE_REQUEST& resting = resting_iter->second;
+        if (resting.TotalVolRemaining1 <= 0) {
+            book->remove(!is_buy, spread_price, resting_number, 0);
+            continue;
+        }
+        
+        int32_t quantity = std::min(order.TotalVolRemaining1, resting.TotalVolRemaining1);
+        apply_spread_fill(order, quantity);
+        apply_spread_fill(resting, quantity);
+        if (resting.TotalVolRemaining1 == 0) {
+            book->remove(!is_buy, spread_price, resting_number, quantity);
+        } else {
+            book->reduce(!is_buy, spread_price, quantity);
+        }
+        
+        // Anchor the far leg and derive the near leg from the traded difference
+        int32_t leg2_price = reference_price(token2);
+        if (leg2_price <= 0) {
+            leg2_price = resting.MS_SPD_LEG_INFO_leg2.Price2 > 0 ? resting.MS_SPD_LEG_INFO_leg2.Price2 : std::max(0, -spread_price);
+        }
+        int32_t leg1_price = leg2_price + spread_price;
+        
+        const MS_SPD_OE_REQUEST& buyer = is_buy ? order : resting;
+        const MS_SPD_OE_REQUEST& seller = is_buy ? resting : order;
+        
+        std::cout << "Spread trade " << token1 << "/" << token2 << " - Qty: " << quantity
+                  << ", PriceDiff: " << spread_price << std::endl;
+        record_spread_trade(order, spread_price, quantity);
+        
+        report_fill(token1, buyer.ContractDesc, make_spread_leg_side(buyer, 0), make_spread_leg_side(seller, 0),
+                    quantity, leg1_price, ts);
+        report_fill(token2, buyer.MS_SPD_LEG_INFO_leg2.ContractDesc, make_spread_leg_side(seller, 1), make_spread_leg_side(buyer, 1),
+                    quantity, leg2_price, ts);
+    }
+    
+    book_spread_order(order);
+}
+
+// Trade a spread order against the best outright orders of both legs when the
+// implied price difference crosses it and beats the best resting spread order.
+// Only the front order of each leg's best level is considered, under the
+// outright rules: an all-or-none order larger than the trade blocks the
+// implied price and an iceberg gives one tranche. The spread's owner never
+// trades with its own leg orders: they are cancelled when prevention cancels
+// resting orders and otherwise block the implied price; the spread order
+// itself is kept. Returns true if a fill was made or a leg order was cancelled.
+bool FakeNSEExchange::match_spread_against_legs(MS_SPD_OE_REQUEST& order, int32_t best_spread_price, bool has_spread_price, uint64_t ts) {
+    int32_t token1 = order.Token1;
+    int32_t token2 = order.MS_SPD_LEG_INFO_leg2.Token2;
+    bool is_buy = (order.BuySell1 == 1);
+    
+    auto book1_iter = order_books_.find(token1);
+    auto book2_iter = order_books_.find(token2);
+    if (book1_iter == order_books_.end() || book2_iter == order_books_.end()) {
+        return false;
+    }
+    OrderBook& book1 = book1_iter->second;
+    OrderBook& book2 = book2_iter->second;
+    
+    // Buying the spread lifts the near-leg offer and hits the far-leg bid
+    if (is_buy ? (book1.asks.empty() || book2.bids.empty()) : (book1.bids.empty() || book2.asks.empty())) {
+        return false;
+    }
+    int32_t leg1_price = is_buy ? book1.asks.begin()->first : book1.bids.begin()->first;
+    int32_t leg2_price = is_buy ? book2.bids.begin()->first : book2.asks.begin()->first;
+    int32_t implied_price = leg1_price - leg2_price;
+    
+    if (!is_crossing(is_buy, order.PriceDiff, implied_price)) {
+        return false;
+    }
+    if (has_spread_price && !(is_buy ? implied_price < best_spread_price : implied_price > best_spread_price)) {
+        return false;
+    }
+    
+    PriceLevel& level1 = is_buy ? book1.asks.begin()->second : book1.bids.begin()->second;
+    PriceLevel& level2 = is_buy ? book2.bids.begin()->second : book2.asks.begin()->second;
+    auto leg1_iter = active_orders_.find(level1.orders.front());
+    auto leg2_iter = active_orders_.find(level2.orders.front());
+    if (leg1_iter == active_orders_.end() || leg2_iter == active_orders_.end()) {
+        return false;
+    }
+    MS_OE_REQUEST& leg1_order = leg1_iter->second;
+    MS_OE_REQUEST& leg2_order = leg2_iter->second;
+    uint32_t leg1_owner = level1.owners.front();
+    uint32_t leg2_owner = level2.owners.front();
+    
+    uint32_t spread_owner = owner_id(order.BrokerId1, order.AccountNumber1, order.PAN);
+    if (spread_owner != 0 && (leg1_owner == spread_owner || leg2_owner == spread_owner)) {
+        MS_OE_REQUEST& own_order = (leg1_owner == spread_owner) ? leg1_order : leg2_order;
+        std::cout << "Self trade prevented between spread order " << order.OrderNumber1
+                  << " and " << own_order.OrderNumber << std::endl;
+        if (self_trade_action_ == SelfTradeAction::CancelIncoming) {
+            return false;
+        }
+        cancel_order_remainder(own_order, ErrorCodes::e$order_cancelled_for_self_trade, ts);
+        return true;
+    }
+    
+    // Both legs trade the same quantity, so an all-or-none leg must fit whole
+    int32_t quantity = resting_fill_quantity(leg2_order, resting_fill_quantity(leg1_order, order.TotalVolRemaining1));
+    if (quantity == 0 || resting_fill_quantity(leg1_order, quantity) != quantity) {
+        return false;
+    }
+    apply_spread_fill(order, quantity);
+    fill_resting_order(book1, !is_buy, leg1_price, leg1_owner, leg1_order, quantity);
+    fill_resting_order(book2, is_buy, leg2_price, leg2_owner, leg2_order, quantity);
+    
+    std::cout << "Implied spread trade " << token1 << "/" << token2 << " - Qty: " << quantity
+              << ", PriceDiff: " << implied_price << std::endl;
+    record_spread_trade(order, implied_price, quantity);
+    
+    TradeSide spread_leg1 = make_spread_leg_side(order, 0);
+    TradeSide spread_leg2 = make_spread_leg_side(order, 1);
+    TradeSide outright1 = make_trade_side(leg1_order);
+    TradeSide outright2 = make_trade_side(leg2_order);
+    report_fill(token1, order.ContractDesc, is_buy ? spread_leg1 : outright1, is_buy ? outright1 : spread_leg1,
+                quantity, leg1_price, ts);
+    report_fill(token2, order.MS_SPD_LEG_INFO_leg2.ContractDesc, is_buy ? outright2 : spread_leg2, is_buy ? spread_leg2 : outright2,
+                quantity, leg2_price, ts);
+    return true;
+}
+
+void FakeNSEExchange::record_spread_trade(const MS_SPD_OE_REQUEST& order, int32_t price_diff, int32_t quantity) {
+    int32_t token1 = order.Token1;
+    int32_t token2 = order.MS_SPD_LEG_INFO_leg2.Token2;
+    uint32_t slot = spread_stats_.slot(spread_pair_key(token1, token2), token1, token2,
+                                       order.ContractDesc, order.MS_SPD_LEG_INFO_leg2.ContractDesc);
+    spread_stats_.record_trade(slot, price_diff, quantity);
+}
+
+// Volume an order could take from the opposite side within its limit price,
+// walked order by order exactly as take_liquidity trades it (all-or-none
+// orders passed over when too large, icebergs a tranche at a time) without
+// touching the book. Orders are read in place; only icebergs whose tranche
+// runs out are copied, to be walked again from the back of their level. The
+// walk ends at cap, or at the taker's own orders if stop_at_own; otherwise
+// those are passed over and, if own_orders is given, collected.
+template <typename Levels>
+int64_t FakeNSEExchange::executable_volume(const Levels& levels, bool is_buy, int32_t price, bool is_market, int64_t cap,
+                                           uint32_t taker_owner, bool stop_at_own, std::vector<double>* own_orders) {
+    int64_t wanted = cap;
+    std::vector<MS_OE_REQUEST> requeued;
+    for (const auto& level_pair : levels) {
+        if (wanted <= 0 || (!is_market && !is_crossing(is_buy, price, level_pair.first))) {
+            break;
+        }
+        const PriceLevel& level = level_pair.second;
+        requeued.clear();
+        for (size_t i = 0; i < level.orders.size() && wanted > 0; i++) {
+            auto resting_iter = active_orders_.find(level.orders[i]);
+            if (resting_iter == active_orders_.end()) {
+                continue;
+            }
+            const MS_OE_REQUEST& resting = resting_iter->second;
+            if (level.owners[i] == taker_owner) {
+                if (stop_at_own) {
+                    return cap - wanted;
+                }
+                if (own_orders) {
+                    own_orders->push_back(resting.OrderNumber);
+                }
+                continue;
+            }
+            int32_t quantity = resting_fill_quantity(resting, wanted);
+            wanted -= quantity;
+            if (quantity > 0 && resting.DisclosedVolume > 0 && resting.TotalVolumeRemaining > quantity &&
+                resting.DisclosedVolumeRemaining == quantity) {
+                requeued.push_back(resting);
+                apply_order_fill(requeued.back(), quantity);
+                replenish_disclosed_volume(requeued.back());
+            }
+        }
+        
+        // Icebergs showing their next tranche, in the order they rejoined
+        for (size_t i = 0; i < requeued.size() && wanted > 0; i++) {
+            int32_t quantity = resting_fill_quantity(requeued[i], wanted);
+            if (quantity == 0) {
+                continue;
+            }
+            wanted -= quantity;
+            MS_OE_REQUEST resting = requeued[i];
+            apply_order_fill(resting, quantity);
+            if (resting.TotalVolumeRemaining > 0 && resting.DisclosedVolumeRemaining == 0) {
+                replenish_disclosed_volume(resting);
+                requeued.push_back(resting);
+            }
+        }
+    }
+    return cap - wanted;
+}
+
+// Trade quantity against the opposite side of a book under the outright
+// rules. The caller sizes quantity with executable_volume beforehand and
+// cancels any own orders on the way, which also keeps the fills inside the
+// taker's limit price.
+template <typename Levels>
+void FakeNSEExchange::take_liquidity(Levels& levels, OrderBook& book, const CONTRACT_DESC& contract, bool is_buy,
+                                     int32_t quantity, TradeSide taker, uint32_t taker_owner, uint64_t ts) {
+    auto level_iter = levels.begin();
+    size_t position = 0;
+    
+    while (quantity > 0 && level_iter != levels.end()) {
+        int32_t level_price = level_iter->first;
+        PriceLevel& level = level_iter->second;
+        if (position >= level.orders.size()) {
+            ++level_iter;
+            position = 0;
+            continue;
+        }
+        
+        double resting_number = level.orders[position];
+        auto resting_iter = active_orders_.find(resting_number);
+        if (resting_iter == active_orders_.end()) {
+            book.remove(!is_buy, level_price, resting_number, 0);
+            level_iter = levels.lower_bound(level_price);
+            continue;
+        }
+        MS_OE_REQUEST& resting = resting_iter->second;
+        if (level.owners[position] == taker_owner) {
+            break;
+        }
+        
+        int32_t fill_quantity = resting_fill_quantity(resting, quantity);
+        if (fill_quantity == 0) {
+            position++;
+            continue;
+        }
+        if (fill_resting_order(book, !is_buy, level_price, level.owners[position], resting, fill_quantity)) {
+            level_iter = levels.lower_bound(level_price);
+        }
+        
+        quantity -= fill_quantity;
+        taker.remaining_volume -= fill_quantity;
+        taker.volume_filled_today += fill_quantity;
+        
+        TradeSide resting_side = make_trade_side(resting);
+        report_fill(resting.TokenNo, contract, is_buy ? taker : resting_side, is_buy ? resting_side : taker,
+                    fill_quantity, level_price, ts);
+    }
+}
+
+// Execute a 2L/3L order as IOC against the outright books of its legs. Every
+// leg trades the same quantity, so the executable quantity is the smallest
+// depth available within each leg's limit, and nothing trades unless all legs
+// can. Fill and remaining quantities are written back into the order, and an
+// order that trades is confirmed (2125/2126) before its leg trades go out;
+// the caller cancels the remainder.
+int32_t FakeNSEExchange::execute_multileg_ioc(MS_SPD_OE_REQUEST& order, int leg_count, uint64_t ts) {
+    // IOC needs continuous matching; in pre-open the whole order is cancelled
+    if (preopen_session_active_) {
+        return 0;
+    }
+    
+    MS_SPD_LEG_INFO* leg_info[3] = { nullptr, &order.MS_SPD_LEG_INFO_leg2, &order.MS_SPD_LEG_INFO_leg3 };
+    int32_t tokens[3] = { order.Token1, order.MS_SPD_LEG_INFO_leg2.Token2, order.MS_SPD_LEG_INFO_leg3.Token2 };
+    const CONTRACT_DESC* contracts[3] = { &order.ContractDesc, &order.MS_SPD_LEG_INFO_leg2.ContractDesc, &order.MS_SPD_LEG_INFO_leg3.ContractDesc };
+    
+    // Start from an untraded order
+    order.VolumeFilledToday1 = 0;
+    order.TotalVolRemaining1 = order.Volume1;
+    for (int i = 1; i < leg_count; i++) {
+        leg_info[i]->VolumeFilledToday2 = 0;
+        leg_info[i]->TotalVolRemaining2 = leg_info[i]->Volume2;
+    }
+    
+    TradeSide takers[3];
+    for (int i = 0; i < leg_count; i++) {
+        takers[i] = make_spread_leg_side(order, i);
+    }
+    
+    // Orders without an owner carry 0, as in match_order
+    uint32_t taker_owner = owner_id(order.BrokerId1, order.AccountNumber1, order.PAN);
+    if (taker_owner == 0) {
+        taker_owner = std::numeric_limits<uint32_t>::max();
+    }
+    // An IOC order cancelled at its own resting order simply stops there
+    bool stop_at_own = (self_trade_action_ != SelfTradeAction::CancelResting);
+    
+    // Size the execution across all legs before touching any book. Which
+    // all-or-none orders fit depends on the quantity, so sizing repeats until
+    // every leg can fill the same quantity; the last pass finds the owner's
+    // orders the legs will reach.
+    int64_t quantity = order.Volume1;
+    std::vector<double> own_orders;
+    bool settled = false;
+    while (!settled && quantity > 0) {
+        settled = true;
+        own_orders.clear();
+        for (int i = 0; i < leg_count; i++) {
+            bool is_buy = (takers[i].buy_sell == 1);
+            bool is_market = (i == 0) ? order.OrderFlags.Market : leg_info[i]->OrderFlags.Market;
+            OrderBook& book = order_books_[tokens[i]];
+            int64_t leg_quantity = is_buy
+                ? executable_volume(book.asks, true, takers[i].price, is_market, quantity, taker_owner, stop_at_own, &own_orders)
+                : executable_volume(book.bids, false, takers[i].price, is_market, quantity, taker_owner, stop_at_own, &own_orders);
+            if (leg_quantity < quantity) {
+                quantity = leg_quantity;
+                settled = false;
+            }
+        }
+    }
+    int32_t fill_quantity = static_cast<int32_t>(std::max<int64_t>(quantity, 0));
+    
+    order.VolumeFilledToday1 = fill_quantity;
+    order.TotalVolRemaining1 = order.Volume1 - fill_quantity;
+    for (int i = 1; i < leg_count; i++) {
+        leg_info[i]->VolumeFilledToday2 = fill_quantity;
+        leg_info[i]->TotalVolRemaining2 = leg_info[i]->Volume2 - fill_quantity;
+    }
+    
+    if (fill_quantity > 0) {
+        // The order is confirmed ahead of its leg trades
+        order.OrderFlags.Traded = 1;
+        std::cout << leg_count << "L order matched " << fill_quantity << " of " << order.Volume1 << std::endl;
+        if (leg_count == 2) {
+            send_2l_order_response(&order, ts, TransactionCodes::TWOL_ORDER_CONFIRMATION, ErrorCodes::SUCCESS);
+        } else {
+            send_3l_order_response(&order, ts, TransactionCodes::THRL_ORDER_CONFIRMATION, ErrorCodes::SUCCESS);
+        }
+        
+        for (double own_number : own_orders) {
+            auto own_iter = active_orders_.find(own_number);
+            if (own_iter != active_orders_.end() && own_iter->second.TotalVolumeRemaining > 0) {
+                std::cout << "Self trade prevented between orders " << order.OrderNumber1
+                          << " and " << own_number << std::endl;
+                cancel_order_remainder(own_iter->second, ErrorCodes::e$order_cancelled_for_self_trade, ts);
+            }
+        }
+        for (int i = 0; i < leg_count; i++) {
+            OrderBook& book = order_books_[tokens[i]];
+            if (takers[i].buy_sell == 1) {
+                take_liquidity(book.asks, book, *contracts[i], true, fill_quantity, takers[i], taker_owner, ts);
+            } else {
+                take_liquidity(book.bids, book, *contracts[i], false, fill_quantity, takers[i], taker_owner, ts);
+            }
+        }
+    }
+    
+    return fill_quantity;
+}
+
+void FakeNSEExchange::start_preopen_session(uint64_t ts) {
+    preopen_session_active_ = true;
+    std::cout << "Pre-open session started at " << ts / 1000000 << " - orders will accumulate without matching" << std::endl;
+}
+
+// Close the pre-open call auction: find each crossed book's equilibrium price
+// and uncross it there, market orders included. Books and their orders are
+// disjoint per token, so the books are uncrossed on worker threads; fills are
+// reported afterwards, in token order, from this thread. The equilibrium
+// volume can include orders that cannot trade with each other (all-or-none
+// sizes, self trades), so books left crossed are then matched as in the
+// continuous session.
+void FakeNSEExchange::end_preopen_session(uint64_t ts) {
+    if (!preopen_session_active_) {
+        return;
+    }
+    auto started = std::chrono::steady_clock::now();
+    
+    // Market orders never rest in the book; they join the auction of their
+    // token in entry order
+    std::map<int32_t, AuctionMarketOrders> market_orders;
+    for (double order_number : preopen_unbookable_orders_) {
+        auto order_iter = active_orders_.find(order_number);
+        if (order_iter == active_orders_.end()) {
+            continue;
+        }
+        const MS_OE_REQUEST& order = order_iter->second;
+        if (!order.OrderFlags.Market || order.OrderFlags.SL || order.TotalVolumeRemaining <= 0) {
+            continue;
+        }
+        AuctionMarketOrders& market = market_orders[order.TokenNo];
+        if (order.BuySellIndicator == 1) {
+            market.buys.emplace_back(order_number, owner_id(order));
+            market.buy_volume += order.TotalVolumeRemaining;
+        } else {
+            market.sells.emplace_back(order_number, owner_id(order));
+            market.sell_volume += order.TotalVolumeRemaining;
+        }
+    }
+    
+    std::vector<int32_t> tokens;
+    for (const auto& book_pair : order_books_) {
+        const OrderBook& book = book_pair.second;
+        if ((!book.bids.empty() && !book.asks.empty() && book.bids.begin()->first >= book.asks.begin()->first) ||
+            market_orders.count(book_pair.first)) {
+            tokens.push_back(book_pair.first);
+        }
+    }
+    for (const auto& market_pair : market_orders) {
+        if (!order_books_.count(market_pair.first)) {
+            tokens.push_back(market_pair.first);
+        }
+    }
+    std::sort(tokens.begin(), tokens.end());
+    
+    size_t token_count = tokens.size();
+    std::vector<OrderBook*> books(token_count);
+    std::vector<int32_t> reference_prices(token_count);
+    std::vector<AuctionMarketOrders> markets(token_count);
+    for (size_t i = 0; i < token_count; i++) {
+        reference_prices[i] = reference_price(tokens[i]);
+        books[i] = &order_books_[tokens[i]];
+        auto market_iter = market_orders.find(tokens[i]);
+        if (market_iter != market_orders.end()) {
+            markets[i] = std::move(market_iter->second);
+        }
+    }
+    
+    std::vector<int32_t> prices(token_count, 0);
+    std::vector<std::vector<AuctionFill>> fills(token_count);
+    std::atomic<size_t> next_book(0);
+    
+    auto uncross_worker = [&]() {
+        AuctionScratch scratch;
+        for (size_t i = next_book++; i < token_count; i = next_book++) {
+            int64_t volume = 0;
+            if (find_equilibrium_price(*books[i], reference_prices[i], scratch, prices[i], volume,
+                                       markets[i].buy_volume, markets[i].sell_volume)) {
+                uncross_book(*books[i], prices[i], volume, markets[i], fills[i]);
+            }
+        }
+    };
+    
+    // Small auctions are not worth starting threads for
+    const size_t TOKENS_PER_WORKER = 64;
+    size_t worker_count = std::max<size_t>(1, std::thread::hardware_concurrency());
+    worker_count = std::min(worker_count, (token_count + TOKENS_PER_WORKER - 1) / TOKENS_PER_WORKER);
+    
+    std::vector<std::thread> workers;
+    for (size_t w = 1; w < worker_count; w++) {
+        workers.emplace_back(uncross_worker);
+    }
+    uncross_worker();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    
+    preopen_session_active_ = false;
+    
+    size_t fill_count = 0;
+    for (size_t i = 0; i < token_count; i++) {
+        for (const AuctionFill& fill : fills[i]) {
+            auto buy_iter = active_orders_.find(fill.buy_order_number);
+            auto sell_iter = active_orders_.find(fill.sell_order_number);
+            if (buy_iter == active_orders_.end() || sell_iter == active_orders_.end()) {
+                continue;
+            }
+            
+            TradeSide buy_side = make_trade_side(buy_iter->second);
+            buy_side.remaining_volume = fill.buy_remaining;
+            buy_side.volume_filled_today = fill.buy_filled;
+            TradeSide sell_side = make_trade_side(sell_iter->second);
+            sell_side.remaining_volume = fill.sell_remaining;
+            sell_side.volume_filled_today = fill.sell_filled;
+            
+            report_fill(tokens[i], buy_iter->second.ContractDesc, buy_side, sell_side, fill.quantity, prices[i], ts);
+            fill_count++;
+        }
+    }
+    
+    // Whatever cannot rest in the book is cancelled rather than left open
+    for (double order_number : preopen_unbookable_orders_) {
+        auto order_iter = active_orders_.find(order_number);
+        if (order_iter == active_orders_.end() || order_iter->second.TotalVolumeRemaining <= 0) {
+            continue;
+        }
+        MS_OE_REQUEST& order = order_iter->second;
+        std::cout << (order.OrderFlags.IOC ? "IOC" : "Unbookable") << " order " << order.OrderNumber << " remainder "
+                  << order.TotalVolumeRemaining << " cancelled after the uncross" << std::endl;
+        cancel_order_remainder(order, ErrorCodes::SUCCESS, ts);
+    }
+    preopen_unbookable_orders_.clear();
+    
+    size_t rematched = 0;
+    for (int32_t token : tokens) {
+        rematched += rematch_crossed_bids(token, ts);
+    }
+    
+    auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started).count();
+    std::cout << "Pre-open session ended - uncrossed " << token_count << " books with "
+              << fill_count << " fills using " << worker_count << " worker(s), " << rematched
+              << " crossed bids matched again, in " << elapsed_us << "us" << std::endl;
+}
+
+// Match again, in price-time priority, the bids of a book still crossed
+// after the uncross. Bids that could neither trade nor run into their own
+// asks keep their place; the rest leave the book and come back as incoming
+// orders. Returns the number of bids matched again.
+size_t FakeNSEExchange::rematch_crossed_bids(int32_t token, uint64_t ts) {
+    auto book_iter = order_books_.find(token);
+    if (book_iter == order_books_.end()) {
+        return 0;
+    }
+    OrderBook& book = book_iter->second;
+    if (book.bids.empty() || book.asks.empty() || book.bids.begin()->first < book.asks.begin()->first) {
+        return 0;
+    }
+    
+    std::vector<double> crossed;
+    for (const auto& level_pair : book.bids) {
+        if (level_pair.first < book.asks.begin()->first) {
+            break;
+        }
+        crossed.insert(crossed.end(), level_pair.second.orders.begin(), level_pair.second.orders.end());
+    }
+    
+    size_t rematched = 0;
+    std::vector<double> own_orders;
+    for (double order_number : crossed) {
+        auto order_iter = active_orders_.find(order_number);
+        if (order_iter == active_orders_.end() || order_iter->second.TotalVolumeRemaining <= 0 ||
+            book.asks.empty() || book.asks.begin()->first > order_iter->second.Price) {
+            continue;
+        }
+        MS_OE_REQUEST& order = order_iter->second;
+        uint32_t owner = owner_id(order);
+        if (owner == 0) {
+            owner = std::numeric_limits<uint32_t>::max();
+        }
+        own_orders.clear();
+        int64_t depth = executable_volume(book.asks, true, order.Price, false, order.TotalVolumeRemaining,
+                                          owner, false, &own_orders);
+        bool can_trade = order.OrderFlags.AON ? depth >= order.TotalVolumeRemaining : depth > 0;
+        if (!can_trade && own_orders.empty()) {
+            continue;
+        }
+        unbook_order(order);
+        match_order(order_number, ts);
+        rematched++;
+    }
+    return rematched;
+}
+
+// Trade the crossed part of a book at the equilibrium price. Market orders
+// go first, in time priority: market buys take market sells and then asks,
+// and market sells left over take bids. Each bid in price-time priority then
+// takes asks as an incoming order would: icebergs on either side trade a
+// tranche and rejoin the back of their level, all-or-none orders trade whole
+// or not at all, and an owner's order passes over its own (nothing is
+// cancelled here). Touches only this book and its own orders, so different
+// books can be uncrossed concurrently.
+void FakeNSEExchange::uncross_book(OrderBook& book, int32_t price, int64_t volume, const AuctionMarketOrders& market,
+                                   std::vector<AuctionFill>& fills) {
+    // A market order is not in the book, so only the order itself is filled
+    auto market_quantity = [&](const MS_OE_REQUEST& order) -> int32_t {
+        if (order.TotalVolumeRemaining <= 0 || (order.OrderFlags.AON && order.TotalVolumeRemaining > volume)) {
+            return 0;
+        }
+        return static_cast<int32_t>(std::min<int64_t>(order.TotalVolumeRemaining, volume));
+    };
+    
+    for (const auto& market_buy : market.buys) {
+        auto buy_iter = active_orders_.find(market_buy.first);
+        if (volume <= 0 || buy_iter == active_orders_.end()) {
+            continue;
+        }
+        MS_OE_REQUEST& buy = buy_iter->second;
+        uint32_t buy_key = (market_buy.second != 0) ? market_buy.second : std::numeric_limits<uint32_t>::max();
+        int32_t wanted = market_quantity(buy);
+        
+        // An all-or-none buy needs market sells and asks to cover it together
+        if (wanted > 0 && buy.OrderFlags.AON) {
+            int64_t available = executable_volume(book.asks, true, price, false, wanted, buy_key, false, nullptr);
+            for (const auto& market_sell : market.sells) {
+                auto sell_iter = active_orders_.find(market_sell.first);
+                if (sell_iter != active_orders_.end() && market_sell.second != buy_key) {
+                    available += resting_fill_quantity(sell_iter->second, wanted);
+                }
+            }
+            if (available < wanted) {
+                continue;
+            }
+        }
+        
+        for (const auto& market_sell : market.sells) {
+            auto sell_iter = active_orders_.find(market_sell.first);
+            if (wanted <= 0 || sell_iter == active_orders_.end() || market_sell.second == buy_key) {
+                continue;
+            }
+            MS_OE_REQUEST& sell = sell_iter->second;
+            int32_t quantity = std::min(market_quantity(sell), wanted);
+            if (quantity == 0 || (sell.OrderFlags.AON && quantity < sell.TotalVolumeRemaining)) {
+                continue;
+            }
+            apply_order_fill(buy, quantity);
+            apply_order_fill(sell, quantity);
+            wanted -= quantity;
+            volume -= quantity;
+            fills.push_back({buy.OrderNumber, sell.OrderNumber, quantity,
+                             buy.TotalVolumeRemaining, buy.VolumeFilledToday,
+                             sell.TotalVolumeRemaining, sell.VolumeFilledToday});
+        }
+        volume -= uncross_order(book.asks, book, buy, buy_key, price, wanted, fills,
+                                [&](int32_t quantity) { apply_order_fill(buy, quantity); });
+    }
+    
+    for (const auto& market_sell : market.sells) {
+        auto sell_iter = active_orders_.find(market_sell.first);
+        if (volume <= 0 || sell_iter == active_orders_.end()) {
+            continue;
+        }
+        MS_OE_REQUEST& sell = sell_iter->second;
+        uint32_t sell_key = (market_sell.second != 0) ? market_sell.second : std::numeric_limits<uint32_t>::max();
+        int32_t wanted = market_quantity(sell);
+        if (wanted > 0 && sell.OrderFlags.AON &&
+            executable_volume(book.bids, false, price, false, wanted, sell_key, false, nullptr) < wanted) {
+            continue;
+        }
+        volume -= uncross_order(book.bids, book, sell, sell_key, price, wanted, fills,
+                                [&](int32_t quantity) { apply_order_fill(sell, quantity); });
+    }
+    
+    auto bid_iter = book.bids.begin();
+    size_t bid_position = 0;
+    
+    while (volume > 0 && bid_iter != book.bids.end() && bid_iter->first >= price) {
+        int32_t bid_price = bid_iter->first;
+        PriceLevel& bid_level = bid_iter->second;
+        if (bid_position >= bid_level.orders.size()) {
+            ++bid_iter;
+            bid_position = 0;
+            continue;
+        }
+        
+        double buy_number = bid_level.orders[bid_position];
+        uint32_t buy_owner = bid_level.owners[bid_position];
+        auto buy_iter = active_orders_.find(buy_number);
+        if (buy_iter == active_orders_.end()) {
+            book.remove(true, bid_price, buy_number, 0);
+            bid_iter = book.bids.lower_bound(bid_price);
+            continue;
+        }
+        MS_OE_REQUEST& buy = buy_iter->second;
+        // Orders without an owner carry 0, which must match nothing
+        uint32_t buy_key = (buy_owner != 0) ? buy_owner : std::numeric_limits<uint32_t>::max();
+        
+        // A bid rests like the asks, so it offers one tranche, or everything
+        // if all-or-none and the asks it may take can fill it
+        int32_t wanted = resting_fill_quantity(buy, volume);
+        if (wanted > 0 && buy.OrderFlags.AON &&
+            executable_volume(book.asks, true, price, false, wanted, buy_key, false, nullptr) < wanted) {
+            wanted = 0;
+        }
+        
+        bool buy_moved = false;
+        volume -= uncross_order(book.asks, book, buy, buy_key, price, wanted, fills, [&](int32_t quantity) {
+            buy_moved = fill_resting_order(book, true, bid_price, buy_owner, buy, quantity);
+        });
+        
+        // A bid that left its position is replaced there by the next one
+        if (buy_moved) {
+            bid_iter = book.bids.lower_bound(bid_price);
+        } else {
+            bid_position++;
+        }
+    }
+}
+
+// Fill one order of the auction against the opposite side of the book at
+// the equilibrium price, up to wanted, passing over the owner's own orders
+// and all-or-none orders too large to fill. fill_taker applies each fill to
+// the order itself. Returns the quantity filled.
+template <typename Levels, typename TakerFill>
+int32_t FakeNSEExchange::uncross_order(Levels& levels, OrderBook& book, const MS_OE_REQUEST& taker, uint32_t taker_key,
+                                       int32_t price, int32_t wanted, std::vector<AuctionFill>& fills, TakerFill fill_taker) {
+    bool is_buy = (taker.BuySellIndicator == 1);
+    int32_t filled = 0;
+    auto level_iter = levels.begin();
+    size_t position = 0;
+    while (wanted > 0 && level_iter != levels.end() && is_crossing(is_buy, price, level_iter->first)) {
+        int32_t level_price = level_iter->first;
+        PriceLevel& level = level_iter->second;
+        if (position >= level.orders.size()) {
+            ++level_iter;
+            position = 0;
+            continue;
+        }
+        
+        double resting_number = level.orders[position];
+        uint32_t resting_owner = level.owners[position];
+        auto resting_iter = active_orders_.find(resting_number);
+        if (resting_iter == active_orders_.end()) {
+            book.remove(!is_buy, level_price, resting_number, 0);
+            level_iter = levels.lower_bound(level_price);
+            continue;
+        }
+        MS_OE_REQUEST& resting = resting_iter->second;
+        
+        int32_t quantity = (resting_owner == taker_key) ? 0 : resting_fill_quantity(resting, wanted);
+        if (quantity == 0) {
+            position++;
+            continue;
+        }
+        if (fill_resting_order(book, !is_buy, level_price, resting_owner, resting, quantity)) {
+            level_iter = levels.lower_bound(level_price);
+        }
+        fill_taker(quantity);
+        wanted -= quantity;
+        filled += quantity;
+        
+        const MS_OE_REQUEST& buy = is_buy ? taker : resting;
+        const MS_OE_REQUEST& sell = is_buy ? resting : taker;
+        fills.push_back({buy.OrderNumber, sell.OrderNumber, quantity,
+                         buy.TotalVolumeRemaining, buy.VolumeFilledToday,
+                         sell.TotalVolumeRemaining, sell.VolumeFilledToday});
+    }
+    return filled;
+}
+
+// Record a fill and send a trade confirmation (2222) to each side.
+// Returns the fill number.
+int32_t FakeNSEExchange::report_fill(int32_t token, const CONTRACT_DESC& contract, const TradeSide& buy, const TradeSide& sell,
+                                     int32_t fill_quantity, int32_t fill_price, uint64_t ts) {
+    // Nothing traded: no fill number, statistics or confirmations
+    if (fill_quantity <= 0) {
+        return 0;
+    }
+    int32_t fill_number = next_fill_number_++;
+    
+    // Keep the trade for later trade modification/cancellation requests
+    MS_TRADE_INQ_DATA& trade = executed_trades_[fill_number];
+    memset(&trade, 0, sizeof(trade));
+    trade.TokenNo = token;
+    trade.ContractDesc = contract;
+    trade.FillNumber = fill_number;
+    trade.FillQuantity = fill_quantity;
+    trade.FillPrice = fill_price;
+    trade.MktType = '1';
+    trade.BuyOpenClose = buy.open_close;
+    trade.SellOpenClose = sell.open_close;
+    trade.TraderId = buy.trader_id;
+    memcpy(trade.BuyBrokerId, buy.broker_id, sizeof(trade.BuyBrokerId));
+    memcpy(trade.SellBrokerId, sell.broker_id, sizeof(trade.SellBrokerId));
+    memcpy(trade.BuyAccountNumber, buy.account_number, sizeof(trade.BuyAccountNumber));
+    memcpy(trade.SellAccountNumber, sell.account_number, sizeof(trade.SellAccountNumber));
+    memcpy(trade.BuyPAN, buy.pan, sizeof(trade.BuyPAN));
+    memcpy(trade.SellPAN, sell.pan, sizeof(trade.SellPAN));
+    
+    last_traded_prices_[token] = fill_price;
+    
+    std::cout << "Fill #" << fill_number << " on token " << token
+              << " - Qty: " << fill_quantity << ", Price: " << fill_price << std::endl;
+    
+    const TradeSide* sides[2] = { &buy, &sell };
+    for (int i = 0; i < 2; i++) {
+        const TradeSide& side = *sides[i];
+        const TradeSide& counter = *sides[1 - i];
+        
+        MS_TRADE_CONFIRM confirm;
+        memset(&confirm, 0, sizeof(confirm));
+        confirm.Header.TraderId = side.trader_id;
+        confirm.ResponseOrderNumber = side.order_number;
+        memcpy(confirm.BrokerId, side.broker_id, sizeof(confirm.BrokerId));
+        confirm.TraderNumber = side.trader_id;
+        memcpy(confirm.AccountNumber, side.account_number, sizeof(confirm.AccountNumber));
+        confirm.BuySellIndicator = side.buy_sell;
+        confirm.OriginalVolume = side.volume;
+        confirm.RemainingVolume = side.remaining_volume;
+        confirm.Price = side.price;
+        confirm.OrderFlags = side.order_flags;
+        confirm.GoodTillDate = side.good_till_date;
+        confirm.FillNumber = fill_number;
+        confirm.FillQuantity = fill_quantity;
+        confirm.FillPrice = fill_price;
+        confirm.VolumeFilledToday = side.volume_filled_today;
+        confirm.CounterTraderOrderNumber = counter.order_number;
+        memcpy(confirm.CounterBrokerId, counter.broker_id, sizeof(confirm.CounterBrokerId));
+        confirm.Token = token;
+        confirm.ContractDesc = contract;
+        confirm.OpenClose = side.open_close;
+        confirm.BookType = static_cast<char>(side.book_type);
+        memcpy(confirm.Participant, side.participant, sizeof(confirm.Participant));
+        confirm.AdditionalOrderFlags = side.additional_flags;
+        memcpy(confirm.PAN, side.pan, sizeof(confirm.PAN));
+        confirm.AlgoID = side.algo_id;
+        
+        send_trade_confirmation(confirm, ts);
+    }
+    
+    // Statistics, open interest, indices and the feed are updated once both
+    // confirmations are out
+    uint32_t slot = market_stats_.slot(token, contract);
+    market_stats_.record_trade(slot, fill_price, fill_quantity, ts);
+    if (market_stats_.record_open_interest(slot, buy.open_close, sell.open_close, fill_quantity) != 0) {
+        open_interest_tokens_.mark(token);
+    }
+    index_engine_.on_trade(token, fill_price);
+    update_price_band(token, fill_price);
+    record_ticker_fill(token, fill_price, fill_quantity);
+    
+    return fill_number;
+}
+
+// ===== Market Session Schedule =====
+
+// Restart the exchange clock. Timers keep their absolute deadlines, so a jump
+// forward fires whatever came due on the next poll. A jump backwards would leave
+// the wheel ahead of the clock, so the wheel is restarted instead.
+void FakeNSEExchange::set_exchange_clock(uint64_t start_us, double speed) {
+    exchange_clock_.set(start_us, speed);
+    if (start_us < timer_wheel_.now()) {
+        if (timer_wheel_.pending() > 0) {
+            std::cout << "Exchange clock moved backwards - dropping " << timer_wheel_.pending()
+                      << " pending timer(s)" << std::endl;
+        }
+        timer_wheel_.reset(start_us);
+        session_timers_.clear();
+    }
+    std::cout << "Exchange clock set to " << start_us / 1000000 << " running at "
+              << exchange_clock_.speed() << "x" << std::endl;
+}
+
+size_t FakeNSEExchange::poll_timers(size_t max_fired) {
+    return timer_wheel_.advance(exchange_clock_.now(), max_fired);
+}
+
+size_t FakeNSEExchange::advance_timers(uint64_t ts, size_t max_fired) {
+    return timer_wheel_.advance(ts, max_fired);
+}
+
+// Queue the day's transitions. Each one is stamped with its scheduled time
+// rather than the time the wheel got to it, so accelerated or coarsely polled
+// runs broadcast the same timestamps as a real-time one.
+void FakeNSEExchange::schedule_trading_day(uint64_t day_start_us, const SessionTimeline& timeline) {
+    cancel_trading_day();
+
+    if (!order_book_file_.empty()) {
+        uint64_t load_time = day_start_us + timeline.book_load;
+        session_timers_.push_back(timer_wheel_.schedule_at(load_time, [this, load_time](uint64_t) {
+            start_of_day(load_time);
+        }));
+    }
+
+    const std::pair<uint64_t, SessionPhase> transitions[] = {
+        {timeline.preopen_start, SessionPhase::PreOpen},
+        {timeline.preopen_end, SessionPhase::PreOpenEnded},
+        {timeline.normal_open, SessionPhase::Normal},
+        {timeline.normal_close, SessionPhase::NormalClosed},
+        {timeline.closing_start, SessionPhase::ClosingSession},
+        {timeline.closing_end, SessionPhase::PostClose}
+    };
+    for (const auto& transition : transitions) {
+        uint64_t when = day_start_us + transition.first;
+        SessionPhase phase = transition.second;
+        session_timers_.push_back(timer_wheel_.schedule_at(when, [this, phase, when](uint64_t) {
+            enter_session_phase(phase, when);
+        }));
+    }
+
+    uint64_t bhavcopy_time = day_start_us + timeline.bhavcopy;
+    char session_type = timeline.bhavcopy_session;
+    session_timers_.push_back(timer_wheel_.schedule_at(bhavcopy_time, [this, session_type, bhavcopy_time](uint64_t) {
+        generate_and_broadcast_bhavcopy(session_type, bhavcopy_time);
+        generate_and_broadcast_spread_bhavcopy(session_type, bhavcopy_time);
+    }));
+
+    uint64_t end_time = day_start_us + timeline.end_of_day;
+    session_timers_.push_back(timer_wheel_.schedule_at(end_time, [this, end_time](uint64_t) {
+        end_of_day(end_time);
+    }));
+
+    std::cout << "Scheduled trading day starting " << day_start_us / 1000000 << " with "
+              << session_timers_.size() << " session events" << std::endl;
+}
+
+void FakeNSEExchange::cancel_trading_day() {
+    size_t cancelled = 0;
+    for (TimerWheel::TimerId id : session_timers_) {
+        if (timer_wheel_.cancel(id)) {
+            cancelled++;
+        }
+    }
+    session_timers_.clear();
+    if (cancelled > 0) {
+        std::cout << "Cancelled " << cancelled << " pending session events" << std::endl;
+    }
+}
+
+// Apply a session transition and announce it
+void FakeNSEExchange::enter_session_phase(SessionPhase phase, uint64_t ts) {
+    session_phase_ = phase;
+    bool oddlot_open = (current_market_status_.Oddlot == 1);
+    bool spot_open = (current_market_status_.Spot == 1);
+    bool auction_open = (current_market_status_.Auction == 1);
+
+    switch (phase) {
+        case SessionPhase::PreOpen:
+            set_markets_opening(true);
+            start_preopen_session(ts);
+            send_broadcast_message("", "SYS", "Pre-open session for the Normal market has started", ts);
+            break;
+        case SessionPhase::PreOpenEnded:
+            end_preopen_session(ts);
+            send_market_status_broadcast(TransactionCodes::BC_PREOPEN_SHUTDOWN_MSG,
+                                         "Pre-open order entry for the Normal market is closed", ts);
+            send_market_status_broadcast(TransactionCodes::BC_NORMAL_MKT_PREOPEN_ENDED,
+                                         "Pre-open session for the Normal market has ended", ts);
+            break;
+        case SessionPhase::Normal:
+            set_markets_opening(false);
+            set_market_status(true, oddlot_open, spot_open, auction_open);
+            send_market_status_broadcast(TransactionCodes::BC_OPEN_MESSAGE, "Normal market is open", ts);
+            break;
+        case SessionPhase::NormalClosed:
+            set_market_status(false, oddlot_open, spot_open, auction_open);
+            send_market_status_broadcast(TransactionCodes::BC_CLOSE_MESSAGE, "Normal market is closed", ts);
+            break;
+        case SessionPhase::ClosingSession:
+            send_market_status_broadcast(TransactionCodes::BC_CLOSING_START, "Closing session has started", ts);
+            break;
+        case SessionPhase::PostClose:
+            send_market_status_broadcast(TransactionCodes::BC_CLOSING_END, "Closing session has ended", ts);
+            break;
+        case SessionPhase::Closed:
+            break;
+    }
+}
+
+// Market status change broadcast, repeated as a journal notice for trader workstations
+void FakeNSEExchange::send_market_status_broadcast(int16_t transaction_code, const std::string& message, uint64_t ts) {
+    MS_BCAST_VCT_MSGS msg;
+    memset(&msg, 0, sizeof(msg));
+
+    msg.Header.TransactionCode = transaction_code;
+    msg.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+    msg.Header.ErrorCode = 0;
+    msg.Header.MessageLength = sizeof(MS_BCAST_VCT_MSGS);
+
+    msg.MarketType = MarketTypes::MARKET_TYPE_NORMAL;
+    msg.BCASTDestination.TraderWorkstation = 1;
+    msg.BroadcastMessageLength = std::min(static_cast<int>(message.length()), 239);
+    memcpy(msg.BroadcastMessage, message.data(), msg.BroadcastMessageLength);
+
+    std::cout << "Sending market status broadcast (" << transaction_code << "): " << message << std::endl;
+
+    if (message_callback_) {
+        message_callback_(reinterpret_cast<const uint8_t*>(&msg), sizeof(msg));
+    }
+
+    send_broadcast_message("", "SYS", message, ts);
+}
+
+// ===== Order Book Carry-Over =====
+
+void FakeNSEExchange::set_order_book_file(const std::string& path) {
+    order_book_file_ = path;
+    std::cout << "Order book file set to " << path << std::endl;
+}
+
+// Close the day's book. A GTD order survives while its date is on or after
+// the next day; GTC orders always survive. Everything else is dropped, as
+// are all spread orders (those are day orders only). Orders still frozen
+// are cancelled as if rejected by the exchange. Without a book file the
+// survivors are booked again straight away. The day's statistics then roll
+// over. Returns the number of orders carried over.
+size_t FakeNSEExchange::end_of_day(uint64_t ts) {
+    for (uint64_t freeze_id : pending_freeze_ids()) {
+        reject_freeze(freeze_id, ts);
+    }
+
+    const uint64_t day_us = 86400ULL * 1000000ULL;
+    uint64_t next_day_start = (ts / day_us + 1) * day_us;
+
+    std::vector<MS_OE_REQUEST> live;
+    std::vector<MS_OE_REQUEST> expired;
+    size_t purged = 0;
+    for (const auto& entry : active_orders_) {
+        const MS_OE_REQUEST& order = entry.second;
+        if (order.TotalVolumeRemaining <= 0) {
+            continue;
+        }
+        if (order.OrderFlags.IOC) {
+            purged++;
+        } else if (order.GoodTillDate != 0) {
+            if (static_cast<uint64_t>(static_cast<uint32_t>(order.GoodTillDate)) * 1000000ULL >= next_day_start) {
+                live.push_back(order);
+            } else {
+                expired.push_back(order);
+            }
+        } else if (order.OrderFlags.GTC) {
+            live.push_back(order);
+        } else {
+            purged++;
+        }
+    }
+
+    if (!order_book_file_.empty()) {
+        std::ofstream file(order_book_file_, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cout << "Cannot write order book file " << order_book_file_ << std::endl;
+        } else {
+            BookFileHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "NNFBOOK1", sizeof(header.magic));
+            header.version = 1;
+            header.live_count = static_cast<uint32_t>(live.size());
+            header.expired_count = static_cast<uint32_t>(expired.size());
+            header.saved_at = ts;
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(live.data()), live.size() * sizeof(MS_OE_REQUEST));
+            file.write(reinterpret_cast<const char*>(expired.data()), expired.size() * sizeof(MS_OE_REQUEST));
+        }
+    }
+
+    active_orders_.clear();
+    order_books_.clear();
+    active_spread_orders_.clear();
+    spread_books_.clear();
+
+    if (order_book_file_.empty()) {
+        restore_orders(live, expired, ts);
+    }
+
+    roll_day_statistics();
+
+    std::cout << "End of day: " << live.size() << " orders carried over, " << expired.size()
+              << " GTD orders expired, " << purged << " day/IOC orders purged" << std::endl;
+    return live.size();
+}
+
+// Open the day with the book saved by end_of_day(). Carried-over orders keep
+// their order numbers and rejoin their levels in their saved order. Returns
+// the number of orders booked.
+size_t FakeNSEExchange::start_of_day(uint64_t ts) {
+    std::ifstream file(order_book_file_, std::ios::binary);
+    if (!file) {
+        std::cout << "No order book file to load at " << order_book_file_ << std::endl;
+        return 0;
+    }
+    BookFileHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        memcmp(header.magic, "NNFBOOK1", sizeof(header.magic)) != 0 || header.version != 1) {
+        std::cout << "Invalid order book file " << order_book_file_ << std::endl;
+        return 0;
+    }
+
+    std::vector<MS_OE_REQUEST> live(header.live_count);
+    std::vector<MS_OE_REQUEST> expired(header.expired_count);
+    if (!file.read(reinterpret_cast<char*>(live.data()), live.size() * sizeof(MS_OE_REQUEST)) ||
+        !file.read(reinterpret_cast<char*>(expired.data()), expired.size() * sizeof(MS_OE_REQUEST))) {
+        std::cout << "Truncated order book file " << order_book_file_ << std::endl;
+        return 0;
+    }
+
+    restore_orders(live, expired, ts);
+
+    std::cout << "Start of day: " << header.live_count << " orders reloaded, "
+              << header.expired_count << " expired orders cancelled" << std::endl;
+    return header.live_count;
+}
+
+// Book the carried-over orders again and batch cancel the expired ones
+void FakeNSEExchange::restore_orders(const std::vector<MS_OE_REQUEST>& live, const std::vector<MS_OE_REQUEST>& expired, uint64_t ts) {
+    for (const MS_OE_REQUEST& carried : live) {
+        MS_OE_REQUEST& order = active_orders_[carried.OrderNumber];
+        order = carried;
+        replenish_disclosed_volume(order);
+        book_order(order);
+    }
+    for (const MS_OE_REQUEST& order : expired) {
+        send_batch_order_cancel(order, ts);
+    }
+}
+
+// Close the day's statistics: last prices become previous closes, which
+// re-centre the price bands, and the day's totals, index highs and lows and
+// unsent ticker fills start again from nothing
+void FakeNSEExchange::roll_day_statistics() {
+    market_stats_.roll_day();
+    for (size_t index = 0; index < market_stats_.size(); index++) {
+        update_price_band(market_stats_.tokens[index], market_stats_.previous_close[index]);
+    }
+    spread_stats_.roll_day();
+    index_engine_.roll_day();
+    ticker_tokens_.clear();
+    ticker_updates_.clear();
+    open_interest_tokens_.clear();
+}
+
+// ===== Index Computation =====
+
+uint32_t FakeNSEExchange::add_index(const std::string& name, IndexEngine::Kind kind, int32_t base_value, const std::string& industry) {
+    uint32_t index_id = index_engine_.add_index(name, kind, base_value, industry);
+    std::cout << "Added index " << name << " (id " << index_id << ") at " << base_value << std::endl;
+    return index_id;
+}
+
+bool FakeNSEExchange::add_index_constituent(uint32_t index_id, int32_t token, double weight, double free_float, int32_t price) {
+    if (!index_engine_.add_constituent(index_id, token, weight, free_float, price)) {
+        std::cout << "Cannot add token " << token << " to index " << index_id << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void FakeNSEExchange::set_index_broadcast_interval(uint64_t interval_us) {
+    timer_wheel_.cancel(index_broadcast_timer_);
+    index_broadcast_timer_ = TimerWheel::INVALID_TIMER;
+    index_broadcast_interval_ = interval_us;
+    if (interval_us > 0) {
+        schedule_index_broadcast(timer_wheel_.now() + interval_us);
+    }
+    std::cout << "Index broadcast interval set to " << interval_us << "us" << std::endl;
+}
+
+// Periodic broadcast, rescheduled from its own scheduled time so the
+// interval does not drift with polling
+void FakeNSEExchange::schedule_index_broadcast(uint64_t when) {
+    index_broadcast_timer_ = timer_wheel_.schedule_at(when, [this, when](uint64_t) {
+        broadcast_indices(when);
+        if (index_broadcast_interval_ > 0) {
+            schedule_index_broadcast(when + index_broadcast_interval_);
+        }
+    });
+}
+
+// Broadcast Indices (7207) and Industry Indices (7203), packed to the
+// records each packet holds
+void FakeNSEExchange::broadcast_indices(uint64_t ts) {
+    std::vector<IndexEngine::Index>& indices = index_engine_.indices();
+
+    MS_BCAST_INDICES market_packet;
+    MS_BCAST_INDUSTRY_INDICES industry_packet;
+    const int16_t max_market_records = sizeof(market_packet.Indices) / sizeof(market_packet.Indices[0]);
+    const int16_t max_industry_records = sizeof(industry_packet.Indices) / sizeof(industry_packet.Indices[0]);
+    market_packet.NumberOfRecords = 0;
+    industry_packet.NoOfRecs = 0;
+
+    auto flush_market = [&]() {
+        if (market_packet.NumberOfRecords == 0) {
+            return;
+        }
+        market_packet.Header.TransactionCode = TransactionCodes::BCAST_INDICES;
+        market_packet.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+        market_packet.Header.MessageLength = sizeof(MS_BCAST_INDICES);
+        if (message_callback_) {
+            message_callback_(reinterpret_cast<const uint8_t*>(&market_packet), sizeof(market_packet));
+        }
+        market_packet.NumberOfRecords = 0;
+    };
+    auto flush_industry = [&]() {
+        if (industry_packet.NoOfRecs == 0) {
+            return;
+        }
+        industry_packet.Header.TransactionCode = TransactionCodes::BCAST_INDUSTRY_INDEX_UPDATE;
+        industry_packet.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+        industry_packet.Header.MessageLength = sizeof(MS_BCAST_INDUSTRY_INDICES);
+        if (message_callback_) {
+            message_callback_(reinterpret_cast<const uint8_t*>(&industry_packet), sizeof(industry_packet));
+        }
+        industry_packet.NoOfRecs = 0;
+    };
+
+    size_t market_count = 0;
+    size_t industry_count = 0;
+    for (IndexEngine::Index& index : indices) {
+        if (index.kind == IndexEngine::Kind::Market) {
+            if (market_packet.NumberOfRecords == 0) {
+                memset(&market_packet, 0, sizeof(market_packet));
+            }
+            MS_INDICES& record = market_packet.Indices[market_packet.NumberOfRecords++];
+            strncpy(record.IndexName, index.name.c_str(), sizeof(record.IndexName));
+            record.IndexValue = index.value;
+            record.HighIndexValue = index.high;
+            record.LowIndexValue = index.low;
+            record.OpeningIndex = index.open;
+            record.ClosingIndex = index.previous_close;
+            record.PercentChange = IndexEngine::percent_change(index);
+            record.NoOfUpmoves = index.up_moves;
+            record.NoOfDownmoves = index.down_moves;
+            record.MarketCapitalisation = index.market_cap;
+            record.NetChangeIndicator = (index.value > index.previous_close) ? '+' :
+                                        (index.value < index.previous_close) ? '-' : ' ';
+            market_count++;
+            if (market_packet.NumberOfRecords == max_market_records) {
+                flush_market();
+            }
+        } else if (index.kind == IndexEngine::Kind::Industry) {
+            if (industry_packet.NoOfRecs == 0) {
+                memset(&industry_packet, 0, sizeof(industry_packet));
+            }
+            INDUSTRY_INDICES& record = industry_packet.Indices[industry_packet.NoOfRecs++];
+            strncpy(record.IndustryName, index.name.c_str(), sizeof(record.IndustryName));
+            record.IndexValue = index.value;
+            industry_count++;
+            if (industry_packet.NoOfRecs == max_industry_records) {
+                flush_industry();
+            }
+        }
+        index.dirty = false;
+    }
+    flush_market();
+    flush_industry();
+
+    std::cout << "Broadcast " << market_count << " indices and " << industry_count << " industry indices" << std::endl;
+}
+
+// ===== Market Feed =====
+
+void FakeNSEExchange::set_market_feed_interval(uint64_t interval_us, bool enhanced) {
+    timer_wheel_.cancel(market_feed_timer_);
+    market_feed_timer_ = TimerWheel::INVALID_TIMER;
+    market_feed_interval_ = interval_us;
+    enhanced_market_feed_ = enhanced;
+    if (interval_us > 0) {
+        schedule_market_feed_sweep(timer_wheel_.now() + interval_us);
+    }
+    std::cout << "Market feed interval set to " << interval_us << "us"
+              << (enhanced ? " (enhanced)" : "") << std::endl;
+}
+
+void FakeNSEExchange::schedule_market_feed_sweep(uint64_t when) {
+    market_feed_timer_ = timer_wheel_.schedule_at(when, [this, when](uint64_t) {
+        broadcast_market_feed(when);
+        if (market_feed_interval_ > 0) {
+            schedule_market_feed_sweep(when + market_feed_interval_);
+        }
+    });
+}
+
+// Fills between sweeps collapse into one ticker record per token: the last
+// fill price and the volume traded since the previous sweep
+void FakeNSEExchange::record_ticker_fill(int32_t token, int32_t fill_price, int32_t fill_quantity) {
+    TickerUpdate& update = ticker_updates_[static_cast<uint32_t>(token)];
+    update.fill_price = fill_price;
+    update.fill_volume += fill_quantity;
+    ticker_tokens_.mark(token);
+    market_watch_tokens_.mark(token);
+}
+
+int64_t FakeNSEExchange::open_interest_of(int32_t token) const {
+    const uint32_t* slot = market_stats_.find(token);
+    return slot ? market_stats_.open_interest[*slot] : 0;
+}
+
+// Best bid/ask with the volume resting at each, and the last trade. The trade
+// direction flags compare the last trade with the previous close.
+void FakeNSEExchange::fill_market_wise_info(int32_t token, ST_MKT_WISE_INFO& info) const {
+    memset(&info, 0, sizeof(info));
+    auto book_iter = order_books_.find(token);
+    if (book_iter != order_books_.end()) {
+        const OrderBook& book = book_iter->second;
+        if (!book.bids.empty()) {
+            info.Indicator.Buy = 1;
+            info.BuyPrice = book.bids.begin()->first;
+            info.BuyVolume = static_cast<int32_t>(book.bids.begin()->second.total_volume);
+        }
+        if (!book.asks.empty()) {
+            info.Indicator.Sell = 1;
+            info.SellPrice = book.asks.begin()->first;
+            info.SellVolume = static_cast<int32_t>(book.asks.begin()->second.total_volume);
+        }
+    }
+    const uint32_t* slot = market_stats_.find(token);
+    if (slot && market_stats_.quantity_traded[*slot] > 0) {
+        int32_t last_price = market_stats_.close_price[*slot];
+        int32_t previous_close = market_stats_.previous_close[*slot];
+        info.LastTradePrice = last_price;
+        info.LastTradeTime = static_cast<int32_t>(market_stats_.last_trade_time[*slot] / 1000000);
+        if (previous_close > 0) {
+            info.Indicator.LastTradeMore = last_price > previous_close ? 1 : 0;
+            info.Indicator.LastTradeLess = last_price < previous_close ? 1 : 0;
+        }
+    }
+}
+
+// Send records as full packets of N, with the remainder in a last short one
+template <typename Packet, typename Record, size_t N>
+void FakeNSEExchange::send_packed_broadcast(int16_t transaction_code, const std::vector<Record>& records,
+                                            int16_t Packet::*count_field, Record (Packet::*record_field)[N], uint64_t ts) {
+    Packet packet;
+    for (size_t first = 0; first < records.size(); first += N) {
+        size_t count = std::min(N, records.size() - first);
+        memset(&packet, 0, sizeof(packet));
+        packet.Header.TransactionCode = transaction_code;
+        packet.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+        packet.Header.MessageLength = sizeof(Packet);
+        packet.*count_field = static_cast<int16_t>(count);
+        memcpy(packet.*record_field, &records[first], count * sizeof(Record));
+        if (message_callback_) {
+            message_callback_(reinterpret_cast<const uint8_t*>(&packet), sizeof(packet));
+        }
+    }
+}
+
+// The OI packets carry their header fields inline rather than in a BCAST_HEADER
+template <typename Packet, typename Record, size_t N>
+void FakeNSEExchange::send_open_interest_broadcast(int16_t transaction_code, const std::vector<Record>& records,
+                                                   Record (Packet::*record_field)[N], uint64_t ts) {
+    Packet packet;
+    for (size_t first = 0; first < records.size(); first += N) {
+        size_t count = std::min(N, records.size() - first);
+        memset(&packet, 0, sizeof(packet));
+        packet.LogTime = static_cast<int32_t>(ts / 1000000);
+        packet.TransactionCode = transaction_code;
+        packet.NoOfRecords = static_cast<int16_t>(count);
+        packet.TimeStamp = static_cast<int64_t>(ts);
+        packet.MessageLength = sizeof(Packet);
+        memcpy(packet.*record_field, &records[first], count * sizeof(Record));
+        if (message_callback_) {
+            message_callback_(reinterpret_cast<const uint8_t*>(&packet), sizeof(packet));
+        }
+    }
+}
+
+// One sweep: a ticker record for every token that traded and a market watch
+// record for every token whose book or last trade changed since the last sweep
+void FakeNSEExchange::broadcast_market_feed(uint64_t ts) {
+    broadcast_price_bands(ts);
+
+    size_t ticker_count = ticker_tokens_.tokens().size();
+    size_t market_watch_count = market_watch_tokens_.tokens().size();
+    if (ticker_count == 0 && market_watch_count == 0) {
+        return;
+    }
+
+    if (enhanced_market_feed_) {
+        enhanced_ticker_records_.resize(ticker_count);
+        for (size_t i = 0; i < ticker_count; i++) {
+            int32_t token = ticker_tokens_.tokens()[i];
+            const TickerUpdate* update = ticker_updates_.find(static_cast<uint32_t>(token));
+            ST_ENHNCD_TICKER_INDEX_INFO& record = enhanced_ticker_records_[i];
+            memset(&record, 0, sizeof(record));
+            record.Token = token;
+            record.MarketType = MarketTypes::MARKET_TYPE_NORMAL;
+            record.FillPrice = update->fill_price;
+            record.FillVolume = static_cast<int32_t>(std::min<int64_t>(update->fill_volume, INT32_MAX));
+            const uint32_t* slot = market_stats_.find(token);
+            if (slot) {
+                record.OpenInterest = market_stats_.open_interest[*slot];
+                record.DayHiOi = market_stats_.day_high_open_interest[*slot];
+                record.DayLoOi = market_stats_.day_low_open_interest[*slot];
+            }
+        }
+        send_packed_broadcast(TransactionCodes::BCAST_ENHNCD_TICKER_AND_MKT_INDEX, enhanced_ticker_records_,
+                              &MS_ENHNCD_TICKER_TRADE_DATA::Number_of_Records,
+                              &MS_ENHNCD_TICKER_TRADE_DATA::EnhancdTickerIndexInfo, ts);
+
+        enhanced_market_watch_records_.resize(market_watch_count);
+        for (size_t i = 0; i < market_watch_count; i++) {
+            int32_t token = market_watch_tokens_.tokens()[i];
+            ST_ENHNCD_MARKET_WATCH_BCAST& record = enhanced_market_watch_records_[i];
+            record.Token = token;
+            fill_market_wise_info(token, record.MarketWiseInfo);
+            record.OpenInterest = open_interest_of(token);
+        }
+        send_packed_broadcast(TransactionCodes::BCAST_ENHNCD_MW_ROUND_ROBIN, enhanced_market_watch_records_,
+                              &MS_ENHNCD_BCAST_INQ_RESP_2::NoOfRecords,
+                              &MS_ENHNCD_BCAST_INQ_RESP_2::EnhancdMarketWatchBCAST, ts);
+    } else {
+        ticker_records_.resize(ticker_count);
+        for (size_t i = 0; i < ticker_count; i++) {
+            int32_t token = ticker_tokens_.tokens()[i];
+            const TickerUpdate* update = ticker_updates_.find(static_cast<uint32_t>(token));
+            ST_TICKER_INDEX_INFO& record = ticker_records_[i];
+            memset(&record, 0, sizeof(record));
+            record.Token = token;
+            record.MarketType = MarketTypes::MARKET_TYPE_NORMAL;
+            record.FillPrice = update->fill_price;
+            record.FillVolume = static_cast<int32_t>(std::min<int64_t>(update->fill_volume, INT32_MAX));
+            const uint32_t* slot = market_stats_.find(token);
+            if (slot) {
+                record.OpenInterest = static_cast<uint32_t>(market_stats_.open_interest[*slot]);
+                record.DayHiOI = static_cast<uint32_t>(market_stats_.day_high_open_interest[*slot]);
+                record.DayLoOI = static_cast<uint32_t>(market_stats_.day_low_open_interest[*slot]);
+            }
+        }
+        send_packed_broadcast(TransactionCodes::BCAST_TICKER_AND_MKT_INDEX, ticker_records_,
+                              &MS_TICKER_TRADE_DATA::Number_of_Records,
+                              &MS_TICKER_TRADE_DATA::TickerIndexInfo, ts);
+
+        market_watch_records_.resize(market_watch_count);
+        for (size_t i = 0; i < market_watch_count; i++) {
+            int32_t token = market_watch_tokens_.tokens()[i];
+            ST_MARKET_WATCH_BCAST& record = market_watch_records_[i];
+            record.Token = token;
+            fill_market_wise_info(token, record.MarketWiseInfo);
+            record.OpenInterest = static_cast<uint32_t>(open_interest_of(token));
+        }
+        send_packed_broadcast(TransactionCodes::BCAST_MW_ROUND_ROBIN, market_watch_records_,
+                              &MS_BCAST_INQ_RESP_2::NoOfRecords,
+                              &MS_BCAST_INQ_RESP_2::MarketWatchBCAST, ts);
+    }
+
+    size_t open_interest_count = open_interest_tokens_.tokens().size();
+    if (enhanced_market_feed_) {
+        enhanced_open_interest_records_.resize(open_interest_count);
+        for (size_t i = 0; i < open_interest_count; i++) {
+            int32_t token = open_interest_tokens_.tokens()[i];
+            enhanced_open_interest_records_[i].TokenNo = token;
+            enhanced_open_interest_records_[i].CurrentOi = open_interest_of(token);
+        }
+        send_open_interest_broadcast(TransactionCodes::ENHNCD_MKT_MVMT_CM_OI_IN, enhanced_open_interest_records_,
+                                     &ENHNCD_CM_ASSET_OI::EnhncdOpenInterest, ts);
+    } else {
+        open_interest_records_.resize(open_interest_count);
+        for (size_t i = 0; i < open_interest_count; i++) {
+            int32_t token = open_interest_tokens_.tokens()[i];
+            open_interest_records_[i].TokenNo = token;
+            open_interest_records_[i].CurrentOi = static_cast<uint32_t>(open_interest_of(token));
+        }
+        send_open_interest_broadcast(TransactionCodes::MKT_MVMT_CM_OI_IN, open_interest_records_,
+                                     &CM_ASSET_OI::OpenInterest, ts);
+    }
+
+    std::cout << "Market feed sweep: " << ticker_count << " ticker, "
+              << market_watch_count << " market watch and "
+              << open_interest_count << " open interest records" << std::endl;
+
+    ticker_tokens_.clear();
+    ticker_updates_.clear();
+    market_watch_tokens_.clear();
+    open_interest_tokens_.clear();
+}
+
+// ===== Self-Trade Prevention =====
+
+void FakeNSEExchange::set_self_trade_prevention(SelfTradeKey key, SelfTradeAction action) {
+    self_trade_key_ = key;
+    self_trade_action_ = action;
+    std::cout << "Self-trade prevention key " << static_cast<int>(key)
+              << ", action " << static_cast<int>(action) << std::endl;
+}
+
+// Small integer standing for the order's owner under the current key, so the
+// match loop compares owners with one integer compare. 0 when prevention is
+// off or the identifying field is blank. The key is part of the interned
+// string, so ids from different keys never collide.
+uint32_t FakeNSEExchange::owner_id(const MS_OE_REQUEST& order) {
+    return owner_id(order.BrokerId, order.AccountNumber, order.PAN);
+}
+
+// Fields are fixed width and space padded, as in MS_OE_REQUEST
+uint32_t FakeNSEExchange::owner_id(const char* broker, const char* account_number, const char* pan) {
+    std::string owner;
+    switch (self_trade_key_) {
+        case SelfTradeKey::Off:
+            return 0;
+        case SelfTradeKey::Pan:
+            owner.assign(pan, sizeof(MS_OE_REQUEST::PAN));
+            break;
+        case SelfTradeKey::Account:
+            owner.assign(account_number, sizeof(MS_OE_REQUEST::AccountNumber));
+            break;
+        case SelfTradeKey::Broker:
+            break;
+    }
+    owner.erase(owner.find_last_not_of(std::string(" \0", 2)) + 1);
+    if (self_trade_key_ != SelfTradeKey::Broker && owner.empty()) {
+        return 0;
+    }
+    std::string broker_id(broker, sizeof(MS_OE_REQUEST::BrokerId));
+    broker_id.erase(broker_id.find_last_not_of(std::string(" \0", 2)) + 1);
+    if (broker_id.empty() && self_trade_key_ != SelfTradeKey::Pan) {
+        return 0;
+    }
+
+    std::string key(1, static_cast<char>('0' + static_cast<int>(self_trade_key_)));
+    if (self_trade_key_ != SelfTradeKey::Pan) {
+        key += broker_id;
+        key += '/';
+    }
+    key += owner;
+    auto inserted = owner_ids_.emplace(key, static_cast<uint32_t>(owner_ids_.size() + 1));
+    return inserted.first->second;
+}
+
+// Cancel an order's open quantity, as the kill switch does, and tell the
+// trader why (self trade, unfilled IOC remainder, fill-or-kill)
+void FakeNSEExchange::cancel_order_remainder(MS_OE_REQUEST& order, int16_t error_code, uint64_t ts) {
+    unbook_order(order);
+    order.Volume = 0;
+    order.TotalVolumeRemaining = 0;
+    order.LastModified = static_cast<int32_t>(ts / 1000000);
+    order.LastActivityReference = generate_activity_reference(ts);
+    std::cout << "Order " << order.OrderNumber << " open quantity cancelled (error " << error_code << ")" << std::endl;
+    send_cancellation_response(&order, ts, TransactionCodes::ORDER_CANCEL_CONFIRM_OUT, error_code);
+}
+
+// ===== Freeze Approval =====
+
+void FakeNSEExchange::set_contract_freeze_limits(int32_t token, int32_t freeze_quantity, int32_t freeze_low_price, int32_t freeze_high_price) {
+    FreezeLimits& limits = freeze_limits_[static_cast<uint32_t>(token)];
+    limits.quantity = freeze_quantity;
+    limits.low_price = freeze_low_price;
+    limits.high_price = freeze_high_price;
+    std::cout << "Freeze limits for token " << token << ": quantity " << freeze_quantity
+              << ", price " << freeze_low_price << "-" << freeze_high_price << std::endl;
+}
+
+void FakeNSEExchange::set_freeze_policy(FreezePolicy policy, uint64_t decision_delay_us) {
+    freeze_policy_ = std::move(policy);
+    freeze_decision_delay_ = decision_delay_us;
+}
+
+// QUANTITY_FREEZE or PRICE_FREEZE when the order breaches its contract's
+// freeze limits, 0 otherwise. Market orders have no price to freeze on.
+int16_t FakeNSEExchange::freeze_reason(int32_t token, int32_t volume, int32_t price, bool is_market) const {
+    const FreezeLimits* limits = freeze_limits_.find(static_cast<uint32_t>(token));
+    if (!limits) {
+        return 0;
+    }
+    if (limits->quantity > 0 && volume > limits->quantity) {
+        return ReasonCodes::QUANTITY_FREEZE;
+    }
+    if (!is_market && ((limits->low_price > 0 && price < limits->low_price) ||
+                       (limits->high_price > 0 && price > limits->high_price))) {
+        return ReasonCodes::PRICE_FREEZE;
+    }
+    return 0;
+}
+
+// Queue a frozen order and, under a policy, schedule its decision on the
+// timer wheel so the order path never waits on it
+uint64_t FakeNSEExchange::park_frozen_order(const PendingFreeze& pending, uint64_t ts) {
+    uint64_t freeze_id = next_freeze_id_++;
+    pending_freezes_[freeze_id] = pending;
+    std::cout << "Freeze " << freeze_id << " queued for order " << pending.order.OrderNumber
+              << " (reason " << pending.reason << ")" << std::endl;
+
+    if (freeze_policy_) {
+        uint64_t when = ts + freeze_decision_delay_;
+        timer_wheel_.schedule_at(when, [this, freeze_id, when](uint64_t) {
+            auto iter = pending_freezes_.find(freeze_id);
+            if (iter == pending_freezes_.end() || !freeze_policy_) {
+                return;
+            }
+            if (freeze_policy_(iter->second.order, iter->second.reason)) {
+                approve_freeze(freeze_id, when);
+            } else {
+                reject_freeze(freeze_id, when);
+            }
+        });
+    }
+    return freeze_id;
+}
+
+std::vector<uint64_t> FakeNSEExchange::pending_freeze_ids() const {
+    std::vector<uint64_t> ids;
+    ids.reserve(pending_freezes_.size());
+    for (const auto& entry : pending_freezes_) {
+        ids.push_back(entry.first);
+    }
+    return ids;
+}
+
+bool FakeNSEExchange::approve_freeze(uint64_t freeze_id, uint64_t ts) {
+    auto iter = pending_freezes_.find(freeze_id);
+    if (iter == pending_freezes_.end()) {
+        std::cout << "Freeze " << freeze_id << " not pending" << std::endl;
+        return false;
+    }
+    PendingFreeze pending = iter->second;
+    pending_freezes_.erase(iter);
+    std::cout << "Freeze " << freeze_id << " approved" << std::endl;
+
+    if (pending.is_modification) {
+        // The order may have traded out or been cancelled while frozen
+        auto order_iter = active_orders_.find(pending.modification.OrderNumber);
+        if (order_iter == active_orders_.end() || !is_valid_modification(order_iter->second, &pending.modification)) {
+            send_modification_response(&pending.modification, ts, TransactionCodes::ORDER_MOD_REJ_OUT, ErrorCodes::OE_ORD_CANNOT_MODIFY);
+            return true;
+        }
+        process_successful_modification(order_iter->second, &pending.modification, ts);
+        return true;
+    }
+
+    if (pending.is_spread) {
+        double order_number = pending.spread_order.OrderNumber1;
+        active_spread_orders_[order_number] = pending.spread_order;
+        send_spread_order_response(&pending.spread_order, ts, TransactionCodes::SP_ORDER_CONFIRMATION, ErrorCodes::SUCCESS);
+        match_spread_order(order_number, ts);
+        return true;
+    }
+
+    double order_number = pending.order.OrderNumber;
+    active_orders_[order_number] = pending.order;
+    send_freeze_approval(pending.order, ts);
+    match_order(order_number, ts);
+    return true;
+}
+
+bool FakeNSEExchange::reject_freeze(uint64_t freeze_id, uint64_t ts) {
+    auto iter = pending_freezes_.find(freeze_id);
+    if (iter == pending_freezes_.end()) {
+        std::cout << "Freeze " << freeze_id << " not pending" << std::endl;
+        return false;
+    }
+    PendingFreeze pending = iter->second;
+    pending_freezes_.erase(iter);
+    std::cout << "Freeze " << freeze_id << " cancelled" << std::endl;
+
+    int16_t error_code = (pending.reason == ReasonCodes::PRICE_FREEZE) ? ErrorCodes::OE_PRICE_FREEZE_CAN
+                                                                       : ErrorCodes::OE_QTY_FREEZE_CAN;
+    if (pending.is_spread) {
+        send_spread_order_response(&pending.spread_order, ts, TransactionCodes::SP_ORDER_ERROR, error_code, pending.reason);
+    } else if (pending.is_modification) {
+        send_modification_response(&pending.modification, ts, TransactionCodes::ORDER_MOD_REJ_OUT, error_code);
+    } else {
+        send_order_response(&pending.order, ts, TransactionCodes::ORDER_ERROR_OUT, error_code, pending.reason);
+    }
+    return true;
+}
+
+// ===== Limit Price Protection =====
+
+void FakeNSEExchange::set_price_band_width(int32_t width_bps) {
+    price_band_width_bps_ = width_bps;
+    std::cout << "Price band width set to " << width_bps << " bps" << std::endl;
+}
+
+void FakeNSEExchange::set_price_band(int32_t token, int32_t low, int32_t high) {
+    PriceBand& band = price_bands_[static_cast<uint32_t>(token)];
+    band.low = low;
+    band.high = high;
+    price_band_tokens_.mark(token);
+}
+
+void FakeNSEExchange::update_price_band(int32_t token, int32_t reference_price) {
+    if (price_band_width_bps_ <= 0 || reference_price <= 0) {
+        return;
+    }
+    int32_t offset = static_cast<int32_t>(static_cast<int64_t>(reference_price) * price_band_width_bps_ / 10000);
+    PriceBand& band = price_bands_[static_cast<uint32_t>(token)];
+    int32_t low = std::max(reference_price - offset, 1);
+    int32_t high = reference_price + offset;
+    if (band.low != low || band.high != high) {
+        band.low = low;
+        band.high = high;
+        price_band_tokens_.mark(token);
+    }
+}
+
+// Tokens without a band accept any price, as do market orders. The band
+// check itself is one unsigned compare: prices below low wrap around to
+// large values and fail the same test as prices above high.
+bool FakeNSEExchange::is_within_price_band(int32_t token, int32_t price, bool is_market) const {
+    const PriceBand* band = price_bands_.find(static_cast<uint32_t>(token));
+    if (!band) {
+        return true;
+    }
+    uint32_t offset = static_cast<uint32_t>(price) - static_cast<uint32_t>(band->low);
+    uint32_t span = static_cast<uint32_t>(band->high) - static_cast<uint32_t>(band->low);
+    return (offset <= span) | is_market;
+}
+
+// Limit Price Protection Range broadcast (7220) of the bands changed since the
+// last one, 25 to a packet
+void FakeNSEExchange::broadcast_price_bands(uint64_t ts) {
+    const std::vector<int32_t>& tokens = price_band_tokens_.tokens();
+    if (tokens.empty()) {
+        return;
+    }
+
+    MS_BCAST_LIMIT_PRICE_PROTECTION_RANGE packet;
+    LIMIT_PRICE_PROTECTION_RANGE_DATA& data = packet.LimitPriceProtectionRangeData;
+    const size_t max_records = sizeof(data.LimitPriceProtectionRangeDetails) / sizeof(data.LimitPriceProtectionRangeDetails[0]);
+    for (size_t first = 0; first < tokens.size(); first += max_records) {
+        size_t count = std::min(max_records, tokens.size() - first);
+        memset(&packet, 0, sizeof(packet));
+        packet.Header.TransactionCode = TransactionCodes::BCAST_LIMIT_PRICE_PROTECTION_RANGE;
+        packet.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+        packet.Header.MessageLength = sizeof(MS_BCAST_LIMIT_PRICE_PROTECTION_RANGE);
+        data.MsgCount = static_cast<int32_t>(count);
+        for (size_t i = 0; i < count; i++) {
+            int32_t token = tokens[first + i];
+            const PriceBand* band = price_bands_.find(static_cast<uint32_t>(token));
+            LIMIT_PRICE_PROTECTION_RANGE_DETAILS& record = data.LimitPriceProtectionRangeDetails[i];
+            record.TokenNumber = token;
+            record.HighExecBand = band->high;
+            record.LowExecBand = band->low;
+        }
+        if (message_callback_) {
+            message_callback_(reinterpret_cast<const uint8_t*>(&packet), sizeof(packet));
+        }
+    }
+
+    std::cout << "Broadcast " << tokens.size() << " price bands" << std::endl;
+    price_band_tokens_.clear();
+}
+
+// ===== Chapter 7: Unsolicited Messages Implementation =====
+
+// Send Stop Loss Notification (Transaction Code 2212)
+void FakeNSEExchange::send_stop_loss_notification(const MS_OE_REQUEST& order, uint64_t ts) {
+    TraderRoute route(*this, order.TraderId);
+    MS_TRADE_CONFIRM notification;
+    memset(&notification, 0, sizeof(notification));
+
+    // Set header
+    notification.Header.TransactionCode = TransactionCodes::ON_STOP_NOTIFICATION;
+    notification.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+    notification.Header.TraderId = order.TraderId;
+    notification.Header.ErrorCode = 0;
+    notification.Header.Timestamp = ts;
+    notification.Header.MessageLength = sizeof(MS_TRADE_CONFIRM);
+
+    // Set order details
+    notification.ResponseOrderNumber = order.OrderNumber;
+    memcpy(notification.BrokerId, order.BrokerId, sizeof(notification.BrokerId));
+    notification.TraderNumber = order.TraderId;
+    memcpy(notification.AccountNumber, order.AccountNumber, sizeof(notification.AccountNumber));
+    notification.BuySellIndicator = order.BuySellIndicator;
+    notification.OriginalVolume = order.Volume;
+    notification.DisclosedVolume = order.DisclosedVolume;
+    notification.RemainingVolume = order.TotalVolumeRemaining;
+    notification.DisclosedVolumeRemaining = order.DisclosedVolumeRemaining;
+    notification.Price = order.Price;
     notification.OrderFlags = order.OrderFlags;
     notification.OrderFlags.SL = 1;  // Mark as Stop Loss trigger
     notification.GoodTillDate = order.GoodTillDate;
@@ -2865,6 +5631,7 @@ void FakeNSEExchange::send_stop_loss_notification(const MS_OE_REQUEST& order, ui
 
 // Send Market If Touched Notification (Transaction Code 2212)
 void FakeNSEExchange::send_mit_notification(const MS_OE_REQUEST& order, uint64_t ts) {
+    TraderRoute route(*this, order.TraderId);
     MS_TRADE_CONFIRM notification;
     memset(&notification, 0, sizeof(notification));
 
@@ -2913,6 +5680,7 @@ void FakeNSEExchange::send_mit_notification(const MS_OE_REQUEST& order, uint64_t
 
 // Send Freeze Approval (Transaction Code 2073 - ORDER_CONFIRMATION_OUT)
 void FakeNSEExchange::send_freeze_approval(const MS_OE_REQUEST& order, uint64_t ts) {
+    TraderRoute route(*this, order.TraderId);
     MS_OE_REQUEST response;
     memcpy(&response, &order, sizeof(MS_OE_REQUEST));
 
@@ -2934,34 +5702,35 @@ void FakeNSEExchange::send_freeze_approval(const MS_OE_REQUEST& order, uint64_t
 
 // Send Trade Confirmation (Transaction Code 2222)
 void FakeNSEExchange::send_trade_confirmation(const MS_TRADE_CONFIRM& trade, uint64_t ts) {
-    MS_TRADE_CONFIRM confirmation;
-    memcpy(&confirmation, &trade, sizeof(MS_TRADE_CONFIRM));
-
-    // Set header for trade confirmation
-    confirmation.Header.TransactionCode = TransactionCodes::TRADE_CONFIRMATION;
-    confirmation.Header.LogTime = static_cast<int32_t>(ts / 1000000);
-    confirmation.Header.ErrorCode = 0;
-    confirmation.Header.Timestamp = ts;
-    confirmation.Header.MessageLength = sizeof(MS_TRADE_CONFIRM);
-
-    // Mark as traded
-    confirmation.OrderFlags.Traded = 1;
-    confirmation.ActivityType[0] = 'B';  // Or 'S' based on buy/sell
-    confirmation.ActivityType[1] = '\0';
-    confirmation.ActivityTime = static_cast<int32_t>(ts / 1000000);
-    confirmation.LastActivityReference = ts;
-
-    std::cout << "Sending trade confirmation: Fill #" << confirmation.FillNumber
-              << ", Qty=" << confirmation.FillQuantity
-              << ", Price=" << confirmation.FillPrice << std::endl;
-
-    if (message_callback_) {
-        message_callback_(reinterpret_cast<const uint8_t*>(&confirmation), sizeof(confirmation));
-    }
+    std::cout << "Sending trade confirmation: Fill #" << trade.FillNumber
+              << ", Qty=" << trade.FillQuantity
+              << ", Price=" << trade.FillPrice << std::endl;
+
+    // Each side's confirmation goes to the connection its trader signed on
+    // from, which for the resting side is not the one being parsed
+    TraderRoute route(*this, trade.TraderNumber);
+    emit_message<MS_TRADE_CONFIRM>([&](MS_TRADE_CONFIRM& confirmation) {
+        confirmation = trade;
+
+        // Set header for trade confirmation
+        confirmation.Header.TransactionCode = TransactionCodes::TRADE_CONFIRMATION;
+        confirmation.Header.LogTime = static_cast<int32_t>(ts / 1000000);
+        confirmation.Header.ErrorCode = 0;
+        confirmation.Header.Timestamp = ts;
+        confirmation.Header.MessageLength = sizeof(MS_TRADE_CONFIRM);
+
+        // Mark as traded
+        confirmation.OrderFlags.Traded = 1;
+        confirmation.ActivityType[0] = 'B';  // Or 'S' based on buy/sell
+        confirmation.ActivityType[1] = '\0';
+        confirmation.ActivityTime = static_cast<int32_t>(ts / 1000000);
+        confirmation.LastActivityReference = ts;
+    });
 }
 
 // Send Trade Modification Confirmation (Transaction Code 2287)
 void FakeNSEExchange::send_trade_modification_confirmation(const MS_TRADE_CONFIRM& trade, uint64_t ts) {
+    TraderRoute route(*this, trade.TraderNumber);
     MS_TRADE_CONFIRM confirmation;
     memcpy(&confirmation, &trade, sizeof(MS_TRADE_CONFIRM));
 
@@ -2983,6 +5752,7 @@ void FakeNSEExchange::send_trade_modification_confirmation(const MS_TRADE_CONFIR
 
 // Send Trade Modification Rejection (Transaction Code 2288)
 void FakeNSEExchange::send_trade_modification_rejection(const MS_TRADE_CONFIRM& trade, int16_t error_code, uint64_t ts) {
+    TraderRoute route(*this, trade.TraderNumber);
     MS_TRADE_CONFIRM rejection;
     memcpy(&rejection, &trade, sizeof(MS_TRADE_CONFIRM));
 
@@ -3001,6 +5771,7 @@ void FakeNSEExchange::send_trade_modification_rejection(const MS_TRADE_CONFIRM&
 
 // Send Trade Cancellation Confirmation (Transaction Code 2282)
 void FakeNSEExchange::send_trade_cancellation_confirmation(const MS_TRADE_CONFIRM& trade, uint64_t ts) {
+    TraderRoute route(*this, trade.TraderNumber);
     MS_TRADE_CONFIRM confirmation;
     memcpy(&confirmation, &trade, sizeof(MS_TRADE_CONFIRM));
 
@@ -3021,6 +5792,7 @@ void FakeNSEExchange::send_trade_cancellation_confirmation(const MS_TRADE_CONFIR
 
 // Send Trade Cancellation Rejection (Transaction Code 2286)
 void FakeNSEExchange::send_trade_cancellation_rejection(const MS_TRADE_CONFIRM& trade, int16_t error_code, uint64_t ts) {
+    TraderRoute route(*this, trade.TraderNumber);
     MS_TRADE_CONFIRM rejection;
     memcpy(&rejection, &trade, sizeof(MS_TRADE_CONFIRM));
 
@@ -3039,6 +5811,7 @@ void FakeNSEExchange::send_trade_cancellation_rejection(const MS_TRADE_CONFIRM&
 
 // Send User Order Limit Update (Transaction Code 5731)
 void FakeNSEExchange::send_user_order_limit_update(const MS_ORDER_VAL_LIMIT_DATA& limit_data, uint64_t ts) {
+    TraderRoute route(*this, limit_data.UserId);
     MS_ORDER_VAL_LIMIT_DATA update;
     memcpy(&update, &limit_data, sizeof(MS_ORDER_VAL_LIMIT_DATA));
 
@@ -3057,6 +5830,7 @@ void FakeNSEExchange::send_user_order_limit_update(const MS_ORDER_VAL_LIMIT_DATA
 
 // Send Dealer Limit Update (Transaction Code 5733)
 void FakeNSEExchange::send_dealer_limit_update(const DEALER_ORD_LMT& limit_data, uint64_t ts) {
+    TraderRoute route(*this, limit_data.UserId);
     DEALER_ORD_LMT update;
     memcpy(&update, &limit_data, sizeof(DEALER_ORD_LMT));
 
@@ -3075,6 +5849,7 @@ void FakeNSEExchange::send_dealer_limit_update(const DEALER_ORD_LMT& limit_data,
 
 // Send Spread Order Limit Update (Transaction Code 5772)
 void FakeNSEExchange::send_spread_order_limit_update(const SPD_ORD_LMT& limit_data, uint64_t ts) {
+    TraderRoute route(*this, limit_data.UserId);
     SPD_ORD_LMT update;
     memcpy(&update, &limit_data, sizeof(SPD_ORD_LMT));
 
@@ -3093,6 +5868,7 @@ void FakeNSEExchange::send_spread_order_limit_update(const SPD_ORD_LMT& limit_da
 
 // Send Control Message to Trader (Transaction Code 5295)
 void FakeNSEExchange::send_control_message(int32_t trader_id, const char* action_code, const std::string& message, uint64_t ts) {
+    TraderRoute route(*this, trader_id);
     MS_TRADER_INT_MSG msg;
     memset(&msg, 0, sizeof(msg));
 
@@ -3142,6 +5918,7 @@ void FakeNSEExchange::send_broadcast_message(const char* broker_id, const char*
 
 // Send Batch Order Cancel (Transaction Code 9002)
 void FakeNSEExchange::send_batch_order_cancel(const MS_OE_REQUEST& order, uint64_t ts) {
+    TraderRoute route(*this, order.TraderId);
     MS_OE_REQUEST response;
     memcpy(&response, &order, sizeof(MS_OE_REQUEST));
 
@@ -3161,6 +5938,7 @@ void FakeNSEExchange::send_batch_order_cancel(const MS_OE_REQUEST& order, uint64
 
 // Send Batch Spread Cancel (Transaction Code 9004)
 void FakeNSEExchange::send_batch_spread_cancel(const MS_SPD_OE_REQUEST& order, uint64_t ts) {
+    TraderRoute route(*this, order.Header.TraderId);
     MS_SPD_OE_REQUEST response;
     memcpy(&response, &order, sizeof(MS_SPD_OE_REQUEST));
 
@@ -3232,80 +6010,175 @@ void FakeNSEExchange::send_bhavcopy_header(char session_type, int32_t report_dat
 
 // Send Bhavcopy Data (Regular or Enhanced)
 void FakeNSEExchange::send_bhavcopy_data(char session_type, const std::vector<MKT_STATS_DATA>& stats, uint64_t ts, bool enhanced) {
-    char data_type;
+    BhavcopyStream stream;
+    stream.report = enhanced ? BhavcopyReport::EnhancedMarket : BhavcopyReport::Market;
+    stream.session_type = session_type;
+    build_bhavcopy_stream(stream, &stats, nullptr, ts);
+    send_bhavcopy_stream_packets(stream);
+}
+
+char FakeNSEExchange::bhavcopy_data_type(char session_type) {
     switch(session_type) {
-        case BhavcopyMessageTypes::HEADER_REGULAR:
-            data_type = BhavcopyMessageTypes::DATA_REGULAR;
-            break;
         case BhavcopyMessageTypes::HEADER_ADDITIONAL:
-            data_type = BhavcopyMessageTypes::DATA_ADDITIONAL;
-            break;
+            return BhavcopyMessageTypes::DATA_ADDITIONAL;
         case BhavcopyMessageTypes::HEADER_FINAL:
-            data_type = BhavcopyMessageTypes::DATA_FINAL;
-            break;
+            return BhavcopyMessageTypes::DATA_FINAL;
         default:
-            data_type = BhavcopyMessageTypes::DATA_REGULAR;
-    }
-
-    if (enhanced) {
-        size_t max_records = 4;
-        for (size_t i = 0; i < stats.size(); i += max_records) {
-            ENHNCD_MS_RP_MARKET_STATS packet;
-            memset(&packet, 0, sizeof(packet));
-
-            packet.Header.TransactionCode = TransactionCodes::ENHNCD_RPRT_MARKET_STATS_OUT_RPT;
-            packet.Header.LogTime = static_cast<int32_t>(ts / 1000000);
-            packet.Header.ErrorCode = 0;
-            packet.Header.Timestamp = ts;
-            packet.Header.MessageLength = sizeof(ENHNCD_MS_RP_MARKET_STATS);
-
-            packet.MessageType = data_type;
-            packet.NumberOfRecords = std::min(max_records, stats.size() - i);
-
-            for (size_t j = 0; j < packet.NumberOfRecords && (i + j) < stats.size(); j++) {
-                const MKT_STATS_DATA& src = stats[i + j];
-                ENHNCD_MKT_STATS_DATA& dst = packet.MarketStatsData[j];
-
-                dst.ContractDesc = src.ContractDesc;
-                dst.MarketType = src.MarketType;
-                dst.OpenPrice = src.OpenPrice;
-                dst.HighPrice = src.HighPrice;
-                dst.LowPrice = src.LowPrice;
-                dst.ClosingPrice = src.ClosingPrice;
-                dst.TotalQuantityTraded = src.TotalQuantityTraded;
-                dst.TotalValueTraded = src.TotalValueTraded;
-                dst.PreviousClosePrice = src.PreviousClosePrice;
-                dst.OpenInterest = src.OpenInterest;
-                dst.ChgOpenInterest = src.ChgOpenInterest;
-                memcpy(dst.Indicator, src.Indicator, 4);
-            }
+            return BhavcopyMessageTypes::DATA_REGULAR;
+    }
+}
 
-            if (message_callback_) {
-                message_callback_(reinterpret_cast<const uint8_t*>(&packet), sizeof(packet));
-            }
+// Pack records into consecutive packets of the stream's buffer, each filled to
+// records_per_packet except the last. fill_records(packet, first, count) writes
+// the records and their count.
+template <typename Packet, typename FillRecords>
+void FakeNSEExchange::pack_bhavcopy_packets(BhavcopyStream& stream, size_t record_count, size_t records_per_packet,
+                                            int16_t transaction_code, uint64_t ts, FillRecords fill_records) {
+    stream.packet_size = sizeof(Packet);
+    stream.record_count = record_count;
+    stream.packet_count = (record_count + records_per_packet - 1) / records_per_packet;
+    stream.buffer.resize(stream.packet_count * sizeof(Packet));
+
+    char data_type = bhavcopy_data_type(stream.session_type);
+    for (size_t i = 0; i < stream.packet_count; i++) {
+        Packet* packet = reinterpret_cast<Packet*>(stream.buffer.data() + i * sizeof(Packet));
+        memset(packet, 0, sizeof(Packet));
+
+        packet->Header.TransactionCode = transaction_code;
+        packet->Header.LogTime = static_cast<int32_t>(ts / 1000000);
+        packet->Header.ErrorCode = 0;
+        packet->Header.Timestamp = ts;
+        packet->Header.MessageLength = sizeof(Packet);
+        packet->MessageType = data_type;
+
+        size_t first = i * records_per_packet;
+        fill_records(*packet, first, std::min(records_per_packet, record_count - first));
+    }
+}
+
+// Build the data packets of one report. Only reads the statistics, so
+// different streams can be built concurrently.
+void FakeNSEExchange::build_bhavcopy_stream(BhavcopyStream& stream, const std::vector<MKT_STATS_DATA>* stats,
+                                            const std::vector<SPD_STATS_DATA>* spread_stats, uint64_t ts) const {
+    switch (stream.report) {
+        case BhavcopyReport::Market: {
+            size_t record_count = stats ? stats->size() : market_stats_.size();
+            pack_bhavcopy_packets<MS_RP_MARKET_STATS>(stream, record_count,
+                sizeof(MS_RP_MARKET_STATS::MarketStatsData) / sizeof(MKT_STATS_DATA),
+                TransactionCodes::RPRT_MARKET_STATS_OUT_RPT, ts,
+                [&](MS_RP_MARKET_STATS& packet, size_t first, size_t count) {
+                    packet.NumberOfRecords = static_cast<int16_t>(count);
+                    for (size_t j = 0; j < count; j++) {
+                        if (stats) {
+                            packet.MarketStatsData[j] = (*stats)[first + j];
+                        } else {
+                            market_stats_.fill_record(static_cast<uint32_t>(first + j), packet.MarketStatsData[j]);
+                        }
+                    }
+                });
+            break;
         }
-    } else {
-        for (const auto& stat : stats) {
-            MS_RP_MARKET_STATS packet;
-            memset(&packet, 0, sizeof(packet));
-
-            packet.Header.TransactionCode = TransactionCodes::RPRT_MARKET_STATS_OUT_RPT;
-            packet.Header.LogTime = static_cast<int32_t>(ts / 1000000);
-            packet.Header.ErrorCode = 0;
-            packet.Header.Timestamp = ts;
-            packet.Header.MessageLength = sizeof(MS_RP_MARKET_STATS);
-
-            packet.MessageType = data_type;
-            packet.NumberOfRecords = 1;
-            packet.MarketStatsData = stat;
-
-            if (message_callback_) {
-                message_callback_(reinterpret_cast<const uint8_t*>(&packet), sizeof(packet));
-            }
+        case BhavcopyReport::EnhancedMarket: {
+            size_t record_count = stats ? stats->size() : market_stats_.size();
+            pack_bhavcopy_packets<ENHNCD_MS_RP_MARKET_STATS>(stream, record_count,
+                sizeof(ENHNCD_MS_RP_MARKET_STATS::MarketStatsData) / sizeof(ENHNCD_MKT_STATS_DATA),
+                TransactionCodes::ENHNCD_RPRT_MARKET_STATS_OUT_RPT, ts,
+                [&](ENHNCD_MS_RP_MARKET_STATS& packet, size_t first, size_t count) {
+                    packet.NumberOfRecords = static_cast<int16_t>(count);
+                    for (size_t j = 0; j < count; j++) {
+                        ENHNCD_MKT_STATS_DATA& dst = packet.MarketStatsData[j];
+                        if (!stats) {
+                            market_stats_.fill_record(static_cast<uint32_t>(first + j), dst);
+                            continue;
+                        }
+                        const MKT_STATS_DATA& src = (*stats)[first + j];
+                        dst.ContractDesc = src.ContractDesc;
+                        dst.MarketType = src.MarketType;
+                        dst.OpenPrice = src.OpenPrice;
+                        dst.HighPrice = src.HighPrice;
+                        dst.LowPrice = src.LowPrice;
+                        dst.ClosingPrice = src.ClosingPrice;
+                        dst.TotalQuantityTraded = src.TotalQuantityTraded;
+                        dst.TotalValueTraded = src.TotalValueTraded;
+                        dst.PreviousClosePrice = src.PreviousClosePrice;
+                        dst.OpenInterest = src.OpenInterest;
+                        dst.ChgOpenInterest = src.ChgOpenInterest;
+                        memcpy(dst.Indicator, src.Indicator, 4);
+                    }
+                });
+            break;
+        }
+        case BhavcopyReport::Spread: {
+            size_t record_count = spread_stats ? spread_stats->size() : spread_stats_.size();
+            pack_bhavcopy_packets<RP_SPD_MKT_STATS>(stream, record_count,
+                sizeof(RP_SPD_MKT_STATS::SPDStatsData) / sizeof(SPD_STATS_DATA),
+                TransactionCodes::SPD_BC_JRNL_VCT_MSG, ts,
+                [&](RP_SPD_MKT_STATS& packet, size_t first, size_t count) {
+                    packet.NoOfRecords = static_cast<int16_t>(count);
+                    for (size_t j = 0; j < count; j++) {
+                        if (spread_stats) {
+                            packet.SPDStatsData[j] = (*spread_stats)[first + j];
+                        } else {
+                            spread_stats_.fill_record(static_cast<uint32_t>(first + j), packet.SPDStatsData[j]);
+                        }
+                    }
+                });
+            break;
+        }
+    }
+}
+
+// Build several streams, one worker per stream once there is enough to pack
+void FakeNSEExchange::build_bhavcopy_streams(std::vector<BhavcopyStream>& streams, uint64_t ts) const {
+    size_t total_records = 0;
+    for (const BhavcopyStream& stream : streams) {
+        total_records += (stream.report == BhavcopyReport::Spread) ? spread_stats_.size() : market_stats_.size();
+    }
+
+    const size_t RECORDS_PER_WORKER = 16384;
+    if (streams.size() < 2 || total_records < RECORDS_PER_WORKER) {
+        for (BhavcopyStream& stream : streams) {
+            build_bhavcopy_stream(stream, nullptr, nullptr, ts);
+        }
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < streams.size(); i++) {
+        workers.emplace_back([this, &streams, i, ts]() {
+            build_bhavcopy_stream(streams[i], nullptr, nullptr, ts);
+        });
+    }
+    build_bhavcopy_stream(streams[0], nullptr, nullptr, ts);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void FakeNSEExchange::send_bhavcopy_stream_packets(const BhavcopyStream& stream) {
+    if (message_callback_) {
+        for (size_t i = 0; i < stream.packet_count; i++) {
+            message_callback_(stream.buffer.data() + i * stream.packet_size, stream.packet_size);
         }
     }
 
-    std::cout << "Sent bhavcopy data: " << stats.size() << " records" << std::endl;
+    std::cout << "Sent " << (stream.report == BhavcopyReport::Spread ? "spread " : "") << "bhavcopy data: "
+              << stream.record_count << " records in " << stream.packet_count << " packets" << std::endl;
+}
+
+// Start notification, header, data packets and trailer for one built stream
+void FakeNSEExchange::broadcast_bhavcopy_stream(const BhavcopyStream& stream, uint64_t ts) {
+    bool is_spread = (stream.report == BhavcopyReport::Spread);
+    send_bhavcopy_start_notification(ts, is_spread);
+
+    int32_t report_date = static_cast<int32_t>(ts / 1000000);
+    send_bhavcopy_header(stream.session_type, report_date, ts, is_spread);
+    send_bhavcopy_stream_packets(stream);
+    send_bhavcopy_trailer(stream.session_type, static_cast<int32_t>(stream.packet_count), ts, is_spread);
+
+    if (is_spread) {
+        send_spread_bhavcopy_success(ts);
+    }
 }
 
 // Send Bhavcopy Trailer
@@ -3348,45 +6221,11 @@ void FakeNSEExchange::send_bhavcopy_trailer(char session_type, int32_t packet_co
 
 // Send Spread Bhavcopy Data
 void FakeNSEExchange::send_spread_bhavcopy_data(char session_type, const std::vector<SPD_STATS_DATA>& stats, uint64_t ts) {
-    char data_type;
-    switch(session_type) {
-        case BhavcopyMessageTypes::HEADER_REGULAR:
-            data_type = BhavcopyMessageTypes::DATA_REGULAR;
-            break;
-        case BhavcopyMessageTypes::HEADER_ADDITIONAL:
-            data_type = BhavcopyMessageTypes::DATA_ADDITIONAL;
-            break;
-        case BhavcopyMessageTypes::HEADER_FINAL:
-            data_type = BhavcopyMessageTypes::DATA_FINAL;
-            break;
-        default:
-            data_type = BhavcopyMessageTypes::DATA_REGULAR;
-    }
-
-    size_t max_records = 3;
-    for (size_t i = 0; i < stats.size(); i += max_records) {
-        RP_SPD_MKT_STATS packet;
-        memset(&packet, 0, sizeof(packet));
-
-        packet.Header.TransactionCode = TransactionCodes::SPD_BC_JRNL_VCT_MSG;
-        packet.Header.LogTime = static_cast<int32_t>(ts / 1000000);
-        packet.Header.ErrorCode = 0;
-        packet.Header.Timestamp = ts;
-        packet.Header.MessageLength = sizeof(RP_SPD_MKT_STATS);
-
-        packet.MessageType = data_type;
-        packet.NoOfRecords = std::min(max_records, stats.size() - i);
-
-        for (size_t j = 0; j < packet.NoOfRecords && (i + j) < stats.size(); j++) {
-            memcpy(&packet.SPDStatsData + j, &stats[i + j], sizeof(SPD_STATS_DATA));
-        }
-
-        if (message_callback_) {
-            message_callback_(reinterpret_cast<const uint8_t*>(&packet), sizeof(packet));
-        }
-    }
-
-    std::cout << "Sent spread bhavcopy data: " << stats.size() << " records" << std::endl;
+    BhavcopyStream stream;
+    stream.report = BhavcopyReport::Spread;
+    stream.session_type = session_type;
+    build_bhavcopy_stream(stream, nullptr, &stats, ts);
+    send_bhavcopy_stream_packets(stream);
 }
 
 // Send Spread Bhavcopy Success
@@ -3435,10 +6274,10 @@ void FakeNSEExchange::send_market_index_report(const std::string& index_name, co
     }
 }
 
-// Send Industry Index Report
+// Send Industry Index Report. IND_IDX_RPT_DATA holds a single record, so
+// each record is its own packet.
 void FakeNSEExchange::send_industry_index_report(const std::vector<INDUSTRY_INDEX>& industry_data, uint64_t ts) {
-    size_t max_records = 10;
-    for (size_t i = 0; i < industry_data.size(); i += max_records) {
+    for (const INDUSTRY_INDEX& record : industry_data) {
         IND_IDX_RPT_DATA report;
         memset(&report, 0, sizeof(report));
 
@@ -3449,11 +6288,8 @@ void FakeNSEExchange::send_industry_index_report(const std::vector<INDUSTRY_INDE
         report.Header.MessageLength = sizeof(IND_IDX_RPT_DATA);
 
         report.MessageType = BhavcopyMessageTypes::DATA_REGULAR;
-        report.NumberOfIndustryRecords = std::min(max_records, industry_data.size() - i);
-
-        if (report.NumberOfIndustryRecords > 0) {
-            report.IndustryIndex = industry_data[i];
-        }
+        report.NumberOfIndustryRecords = 1;
+        report.IndustryIndex = record;
 
         if (message_callback_) {
             message_callback_(reinterpret_cast<const uint8_t*>(&report), sizeof(report));
@@ -3463,10 +6299,10 @@ void FakeNSEExchange::send_industry_index_report(const std::vector<INDUSTRY_INDE
     std::cout << "Sent industry index report: " << industry_data.size() << " records" << std::endl;
 }
 
-// Send Sector Index Report
+// Send Sector Index Report. SECT_IDX_RPT_DATA holds a single record, so
+// each record is its own packet.
 void FakeNSEExchange::send_sector_index_report(const std::string& industry_name, const std::vector<INDEX_DATA>& sector_data, uint64_t ts) {
-    size_t max_records = 10;
-    for (size_t i = 0; i < sector_data.size(); i += max_records) {
+    for (const INDEX_DATA& record : sector_data) {
         SECT_IDX_RPT_DATA report;
         memset(&report, 0, sizeof(report));
 
@@ -3478,11 +6314,8 @@ void FakeNSEExchange::send_sector_index_report(const std::string& industry_name,
 
         report.MessageType = BhavcopyMessageTypes::DATA_REGULAR;
         strncpy(report.IndustryName, industry_name.c_str(), 15);
-        report.NumberOfIndustryRecords = std::min(max_records, sector_data.size() - i);
-
-        if (report.NumberOfIndustryRecords > 0) {
-            report.IndexData = sector_data[i];
-        }
+        report.NumberOfIndustryRecords = 1;
+        report.IndexData = record;
 
         if (message_callback_) {
             message_callback_(reinterpret_cast<const uint8_t*>(&report), sizeof(report));
@@ -3493,67 +6326,113 @@ void FakeNSEExchange::send_sector_index_report(const std::string& industry_name,
 }
 
 // Generate and Broadcast Complete Bhavcopy
-void FakeNSEExchange::generate_and_broadcast_bhavcopy(char session_type, uint64_t ts) {
+void FakeNSEExchange::generate_and_broadcast_bhavcopy(char session_type, uint64_t ts, bool enhanced) {
     std::cout << "=== Generating Bhavcopy (Session: " << session_type << ") ===" << std::endl;
+    auto started = std::chrono::steady_clock::now();
 
-    send_bhavcopy_start_notification(ts, false);
-
-    int32_t report_date = static_cast<int32_t>(ts / 1000000);
-    send_bhavcopy_header(session_type, report_date, ts, false);
-
-    std::vector<MKT_STATS_DATA> stats;
-    for (const auto& pair : market_statistics_) {
-        stats.push_back(pair.second);
-    }
-
-    if (!stats.empty()) {
-        send_bhavcopy_data(session_type, stats, ts, false);
-    }
-
-    int32_t packet_count = stats.empty() ? 0 : stats.size();
-    send_bhavcopy_trailer(session_type, packet_count, ts, false);
-
-    for (const auto& pair : market_indices_) {
-        send_market_index_report(pair.first, pair.second, ts);
-    }
-
-    for (const auto& pair : industry_indices_) {
-        if (!pair.second.empty()) {
-            send_industry_index_report(pair.second, ts);
-        }
-    }
+    bhavcopy_streams_.resize(1);
+    BhavcopyStream& stream = bhavcopy_streams_[0];
+    stream.report = enhanced ? BhavcopyReport::EnhancedMarket : BhavcopyReport::Market;
+    stream.session_type = session_type;
+    build_bhavcopy_stream(stream, nullptr, nullptr, ts);
+    broadcast_bhavcopy_stream(stream, ts);
 
-    for (const auto& pair : sector_indices_) {
-        if (!pair.second.empty()) {
-            send_sector_index_report(pair.first, pair.second, ts);
-        }
-    }
+    send_index_reports(ts);
 
-    std::cout << "=== Bhavcopy Complete ===" << std::endl;
+    auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started).count();
+    std::cout << "=== Bhavcopy Complete (" << market_stats_.size() << " contracts in " << elapsed_us << "us) ===" << std::endl;
 }
 
 // Generate and Broadcast Spread Bhavcopy
 void FakeNSEExchange::generate_and_broadcast_spread_bhavcopy(char session_type, uint64_t ts) {
     std::cout << "=== Generating Spread Bhavcopy (Session: " << session_type << ") ===" << std::endl;
 
-    send_bhavcopy_start_notification(ts, true);
+    bhavcopy_streams_.resize(1);
+    BhavcopyStream& stream = bhavcopy_streams_[0];
+    stream.report = BhavcopyReport::Spread;
+    stream.session_type = session_type;
+    build_bhavcopy_stream(stream, nullptr, nullptr, ts);
+    broadcast_bhavcopy_stream(stream, ts);
 
-    int32_t report_date = static_cast<int32_t>(ts / 1000000);
-    send_bhavcopy_header(session_type, report_date, ts, true);
+    std::cout << "=== Spread Bhavcopy Complete ===" << std::endl;
+}
 
-    std::vector<SPD_STATS_DATA> stats;
-    for (const auto& pair : spread_statistics_) {
-        stats.push_back(pair.second);
+// Generate and Broadcast every bhavcopy report for the given sessions
+void FakeNSEExchange::generate_and_broadcast_bhavcopy_reports(const std::string& session_types, uint64_t ts) {
+    std::cout << "=== Generating Bhavcopy Reports (Sessions: " << session_types << ") ===" << std::endl;
+    auto started = std::chrono::steady_clock::now();
+
+    const BhavcopyReport reports[] = { BhavcopyReport::Market, BhavcopyReport::EnhancedMarket, BhavcopyReport::Spread };
+    bhavcopy_streams_.resize(session_types.size() * 3);
+    size_t index = 0;
+    for (char session_type : session_types) {
+        for (BhavcopyReport report : reports) {
+            bhavcopy_streams_[index].report = report;
+            bhavcopy_streams_[index].session_type = session_type;
+            index++;
+        }
     }
 
-    if (!stats.empty()) {
-        send_spread_bhavcopy_data(session_type, stats, ts);
+    build_bhavcopy_streams(bhavcopy_streams_, ts);
+    auto built = std::chrono::steady_clock::now();
+
+    for (const BhavcopyStream& stream : bhavcopy_streams_) {
+        broadcast_bhavcopy_stream(stream, ts);
     }
+    send_index_reports(ts);
 
-    int32_t packet_count = 0;
-    send_bhavcopy_trailer(session_type, packet_count, ts, true);
+    auto build_us = std::chrono::duration_cast<std::chrono::microseconds>(built - started).count();
+    auto total_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started).count();
+    std::cout << "=== Bhavcopy Reports Complete (" << bhavcopy_streams_.size() << " reports, built in "
+              << build_us << "us, sent in " << total_us - build_us << "us) ===" << std::endl;
+}
 
-    send_spread_bhavcopy_success(ts);
+// End-of-day index reports, taken from the same index state as the broadcasts
+void FakeNSEExchange::send_index_reports(uint64_t ts) {
+    std::vector<INDUSTRY_INDEX> industry_data;
+    std::map<std::string, std::vector<INDEX_DATA>> sector_data;
+
+    for (const IndexEngine::Index& index : index_engine_.indices()) {
+        switch (index.kind) {
+            case IndexEngine::Kind::Market: {
+                MKT_INDEX data;
+                data.Opening = index.open;
+                data.High = index.high;
+                data.Low = index.low;
+                data.Closing = index.value;
+                data.Start = index.previous_close;
+                send_market_index_report(index.name, data, ts);
+                break;
+            }
+            case IndexEngine::Kind::Industry: {
+                INDUSTRY_INDEX data;
+                memset(&data, 0, sizeof(data));
+                memcpy(data.IndustryName, index.name.data(), std::min(index.name.size(), sizeof(data.IndustryName)));
+                data.Opening = index.open;
+                data.High = index.high;
+                data.Low = index.low;
+                data.Closing = index.value;
+                data.Start = index.previous_close;
+                industry_data.push_back(data);
+                break;
+            }
+            case IndexEngine::Kind::Sector: {
+                INDEX_DATA data;
+                memset(&data, 0, sizeof(data));
+                memcpy(data.SectorName, index.name.data(), std::min(index.name.size(), sizeof(data.SectorName)));
+                data.IndexValue = index.value;
+                sector_data[index.industry].push_back(data);
+                break;
+            }
+        }
+    }
 
-    std::cout << "=== Spread Bhavcopy Complete ===" << std::endl;
+    if (!industry_data.empty()) {
+        send_industry_index_report(industry_data, ts);
+    }
+    for (const auto& pair : sector_data) {
+        send_sector_index_report(pair.first, pair.second, ts);
+    }
 }
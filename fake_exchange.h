@@ -1,6 +1,13 @@
 #pragma once
 
 #include "nse_structs.h"
+#include "flat_hash.h"
+#include "order_book.h"
+#include "market_stats.h"
+#include "index_engine.h"
+#include "timer_wheel.h"
+#include "exchange_clock.h"
+#include "nnf_packet.h"
 #include <unordered_map>
 #include <vector>
 #include <memory>
@@ -8,6 +15,54 @@
 #include <functional>
 #include <map>
 #include <set>
+#include <string>
+
+// Phases of the trading day, in the order the session timeline moves through them
+enum class SessionPhase : uint8_t {
+    Closed = 0,
+    PreOpen = 1,
+    PreOpenEnded = 2,
+    Normal = 3,
+    NormalClosed = 4,
+    ClosingSession = 5,
+    PostClose = 6
+};
+
+// Self-trade prevention: which field identifies an order's owner, and which
+// side is cancelled when an order would trade against its own owner
+enum class SelfTradeKey : uint8_t {
+    Off = 0,
+    Pan = 1,
+    Account = 2,    // broker and account number
+    Broker = 3
+};
+
+enum class SelfTradeAction : uint8_t {
+    CancelIncoming = 0,
+    CancelResting = 1,
+    CancelBoth = 2
+};
+
+// Trading day schedule. Times are offsets from the start of the trading day
+// (midnight) in microseconds; the defaults follow the NSE timings.
+struct SessionTimeline {
+    uint64_t book_load = (8 * 3600ULL + 45 * 60) * 1000000ULL;        // 08:45, carried-over book reloaded
+    uint64_t preopen_start = (9 * 3600ULL) * 1000000ULL;              // 09:00
+    uint64_t preopen_end = (9 * 3600ULL + 8 * 60) * 1000000ULL;       // 09:08, auction uncrossed
+    uint64_t normal_open = (9 * 3600ULL + 15 * 60) * 1000000ULL;      // 09:15
+    uint64_t normal_close = (15 * 3600ULL + 30 * 60) * 1000000ULL;    // 15:30
+    uint64_t closing_start = (15 * 3600ULL + 40 * 60) * 1000000ULL;   // 15:40
+    uint64_t closing_end = (16 * 3600ULL) * 1000000ULL;               // 16:00
+    uint64_t bhavcopy = (16 * 3600ULL + 15 * 60) * 1000000ULL;        // 16:15
+    uint64_t end_of_day = (16 * 3600ULL + 30 * 60) * 1000000ULL;      // 16:30, book saved
+    char bhavcopy_session = BhavcopyMessageTypes::HEADER_REGULAR;
+};
+
+// Gateway a box is directed to by the gateway router
+struct GatewayEndpoint {
+    std::string ip;
+    int32_t port = 0;
+};
 
 // Fake NSE Exchange
 class FakeNSEExchange {
@@ -21,6 +76,68 @@ public:
     // Set the message callback for sending responses
     void set_message_callback(std::function<void(const uint8_t*, size_t)> callback);
 
+    // NNF packet framing on the trading connection. When enabled, parse() takes
+    // packets (length, sequence, MD5 checksum) and verifies them before any
+    // message is handled, and every outbound message is wrapped in a packet.
+    // Enabling it restarts both sequences at 1.
+    void set_packet_framing(bool enabled, NnfPacketCodec::ErrorPolicy policy = NnfPacketCodec::ErrorPolicy::Reject);
+    const NnfPacketCodec::Counters& packet_counters() const { return packet_codec_.counters(); }
+
+    // Connections. A network front end passes each read with the connection it
+    // arrived on and gets every outbound message back with the connection it
+    // belongs to. Messages about an order (responses, trade confirmations,
+    // freeze decisions, triggers, batch cancels) go to the connection its
+    // trader signed on from, or are dropped if there is none; a reply to a
+    // trader not signed on goes back to the connection the request came in
+    // on. Only broadcasts carry connection 0. Framing is up to the front end.
+    using ConnectionId = uint32_t;
+    using ConnectionCallback = std::function<void(ConnectionId, const uint8_t*, size_t)>;
+    size_t parse(ConnectionId connection, const uint8_t* buf, size_t buflen, uint64_t ts, bool& error);
+    void set_connection_callback(ConnectionCallback callback);
+    void connection_opened(ConnectionId connection, uint64_t ts);
+    void connection_closed(ConnectionId connection, uint64_t ts);
+
+    // Requests answered with a stream of messages (local database update,
+    // message download, exchange portfolio), which a front end may handle
+    // away from the order path. message is the start of one bare message.
+    static bool is_bulk_request(const uint8_t* message, size_t length);
+
+    // In-place responses. With a writer set, order path responses for a
+    // connection are not built on the stack and passed to the connection
+    // callback: the writer reserves length bytes in the connection's output,
+    // has fill(context, message) write the message there, and commits it.
+    // fill writes every byte of the message.
+    using MessageFill = void (*)(const void* context, uint8_t* message);
+    using ResponseWriter = std::function<void(ConnectionId, size_t length, MessageFill fill, const void* context)>;
+    void set_response_writer(ResponseWriter writer) { response_writer_ = writer; }
+
+    // Session liveness on the timer wheel. A connection that has sent nothing
+    // for heartbeat_interval_us gets a heartbeat (23506); one that has received
+    // nothing for idle_timeout_us is disconnected and its traders signed off.
+    // Messages only stamp the connection; its timers check the stamps when
+    // they fire, so traffic never touches the wheel. 0 disables either one.
+    using DisconnectCallback = std::function<void(ConnectionId)>;
+    void set_session_timeouts(uint64_t heartbeat_interval_us, uint64_t idle_timeout_us);
+    void set_disconnect_callback(DisconnectCallback callback);
+
+    // Gateway router. A GR request (2400) is answered (2401) with the gateway
+    // the box should connect to and a new session key; the box then registers
+    // (23008), signs on to that gateway with the key (23000) and later signs
+    // off (20322). The selector picks the gateway, if set; otherwise the
+    // endpoints are handed out in turn.
+    using GatewaySelector = std::function<bool(int16_t box_id, GatewayEndpoint& endpoint)>;
+    void add_gateway_endpoint(const std::string& ip, int32_t port);
+    void set_gateway_selector(GatewaySelector selector);
+
+    // Session encryption. When on, the GR response also carries a fresh
+    // AES-256-GCM key and IV for the box, and after a successful box sign-on
+    // everything on that connection is sealed in both directions. Sealing is
+    // up to the front end: the callback hands it the connection's keys once
+    // the sign-on response has gone out in the clear.
+    using SessionCipherCallback = std::function<void(ConnectionId, const uint8_t* key, const uint8_t* iv)>;
+    void set_session_encryption(bool enabled) { session_encryption_ = enabled; }
+    void set_session_cipher_callback(SessionCipherCallback callback);
+
     // Market status management
     void set_markets_opening(bool opening) { markets_are_opening_ = opening; }
     void set_market_status(bool normal_open, bool oddlot_open, bool spot_open, bool auction_open);
@@ -31,7 +148,102 @@ public:
     void set_broker_deactivated_status(const std::string& broker_id, bool is_deactivated);
     void set_broker_type(const std::string& broker_id, char broker_type);
 
+    // Trade modification/cancellation dedup management
+    void set_trade_request_dedup_limit(size_t max_entries);
+    void reset_trade_requests();
+
+    // Self-trade prevention wherever outright orders trade; cancelled orders
+    // get 2075 with e$order_cancelled_for_self_trade. Spread and 2L/3L orders
+    // never trade against their owner's outright orders, and in the pre-open
+    // uncross an owner's bid simply passes over its own asks.
+    void set_self_trade_prevention(SelfTradeKey key, SelfTradeAction action = SelfTradeAction::CancelIncoming);
+
+    // Let spread orders also trade against prices implied from the outright leg books
+    void set_spread_implied_matching(bool enabled);
+
+    // Contract master freeze limits. Orders above freeze_quantity or priced
+    // outside [freeze_low_price, freeze_high_price] are frozen (2170) and wait
+    // in the approval queue; 0 leaves a limit unset.
+    void set_contract_freeze_limits(int32_t token, int32_t freeze_quantity, int32_t freeze_low_price, int32_t freeze_high_price);
+
+    // Freeze approval queue. An operator approves (2073) or cancels
+    // (ORDER_ERROR_OUT) frozen orders by freeze id; a policy, if set, decides
+    // each one decision_delay_us of exchange time after it froze. Frozen
+    // spread orders are confirmed (2124) or rejected (SP_ORDER_ERROR).
+    using FreezePolicy = std::function<bool(const MS_OE_REQUEST& order, int16_t reason)>;
+    void set_freeze_policy(FreezePolicy policy, uint64_t decision_delay_us);
+    std::vector<uint64_t> pending_freeze_ids() const;
+    bool approve_freeze(uint64_t freeze_id, uint64_t ts);
+    bool reject_freeze(uint64_t freeze_id, uint64_t ts);
+
+    // Limit price protection: each token's band is set around its previous close
+    // and re-centred on every trade, width_bps either side (0 disables it).
+    // Changed bands go out with the market feed sweep (7220).
+    void set_price_band_width(int32_t width_bps);
+    void set_price_band(int32_t token, int32_t low, int32_t high);
+
+    // Previous close reported in the bhavcopy (and used as the close of untraded
+    // contracts); also centres the token's price band
+    void set_previous_close(int32_t token, const CONTRACT_DESC& contract, int32_t price);
+    void set_open_interest(int32_t token, const CONTRACT_DESC& contract, int64_t open_interest);
+
+    // Pre-open call auction: orders accumulate without matching until the session
+    // ends, then every crossed book is uncrossed at its equilibrium price, market
+    // orders first. What is left of IOC, market and stop-loss orders entered
+    // meanwhile is then cancelled, as in continuous matching, and bids still
+    // crossing the book are matched again as incoming orders.
+    void start_preopen_session(uint64_t ts);
+    void end_preopen_session(uint64_t ts);
+    bool is_preopen_session() const { return preopen_session_active_; }
+
+    // Exchange clock. Starts at the host's time; a speed above 1 runs it faster
+    // than real time. Moving it backwards drops all pending timers.
+    void set_exchange_clock(uint64_t start_us, double speed = 1.0);
+    uint64_t exchange_time() const { return exchange_clock_.now(); }
+
+    // Fire due timers, either at the exchange clock's time or at an explicit one.
+    // max_fired bounds the work done per call. Returns the number fired.
+    size_t poll_timers(size_t max_fired = SIZE_MAX);
+    size_t advance_timers(uint64_t ts, size_t max_fired = SIZE_MAX);
+
+    // Index engine: indices recomputed from constituent trades and broadcast
+    // every interval_us of exchange time (0 stops the broadcasts)
+    uint32_t add_index(const std::string& name, IndexEngine::Kind kind, int32_t base_value, const std::string& industry = "");
+    bool add_index_constituent(uint32_t index_id, int32_t token, double weight, double free_float, int32_t price);
+    void set_index_broadcast_interval(uint64_t interval_us);
+    void broadcast_indices(uint64_t ts);
+
+    // Ticker (7202) and market watch (7201) feed. Fills and book changes mark
+    // their token; every interval_us a sweep broadcasts the marked tokens packed
+    // into multi-record packets (17202/17201 when enhanced), along with open
+    // interest for the tokens whose OI moved (7130/17130). 0 stops the sweeps.
+    void set_market_feed_interval(uint64_t interval_us, bool enhanced = false);
+    void broadcast_market_feed(uint64_t ts);
+
+    // Market session schedule: queue one trading day's status transitions
+    // and its bhavcopy on the timer wheel
+    void schedule_trading_day(uint64_t day_start_us, const SessionTimeline& timeline = SessionTimeline());
+    void cancel_trading_day();
+    SessionPhase session_phase() const { return session_phase_; }
+
+    // Book carry-over between trading days. end_of_day() cancels pending
+    // freezes, expires GTD orders whose date has passed, drops day and IOC
+    // orders and writes the rest to the book file; start_of_day() books them
+    // again and sends a batch cancel (9002) for each order that expired.
+    // Without a book file end_of_day() does both itself. It also rolls the
+    // market, spread and index statistics over to the next day. The schedule
+    // runs end_of_day() every day and start_of_day() when a book file is set.
+    // GoodTillDate is in seconds on the exchange clock.
+    void set_order_book_file(const std::string& path);
+    size_t end_of_day(uint64_t ts);
+    size_t start_of_day(uint64_t ts);
+
     // Message handlers
+    void handle_gr_request(const MS_GR_REQUEST* req, uint64_t ts);
+    void handle_secure_box_registration(const MS_SECURE_BOX_REGISTRATION_REQUEST_IN* req, uint64_t ts);
+    void handle_box_sign_on_request(const MS_BOX_SIGN_ON_REQUEST_IN* req, uint64_t ts);
+    void handle_box_sign_off(const MS_BOX_SIGN_OFF* req, uint64_t ts);
+    void handle_heartbeat(const HEARTBEAT* req, uint64_t ts);
     void handle_signon_request(const MS_SIGNON_REQUEST_IN* req, uint64_t ts);
     void handle_signoff_request(const MS_SIGNOFF* req, uint64_t ts);
     void handle_system_info_request(const MS_SYSTEM_INFO_REQ* req, uint64_t ts);
@@ -82,16 +294,134 @@ public:
     void send_industry_index_report(const std::vector<INDUSTRY_INDEX>& industry_data, uint64_t ts);
     void send_sector_index_report(const std::string& industry_name, const std::vector<INDEX_DATA>& sector_data, uint64_t ts);
 
-    // Helper for generating complete bhavcopy
-    void generate_and_broadcast_bhavcopy(char session_type, uint64_t ts);
+    // Helper for generating complete bhavcopy from the day's trade statistics
+    void generate_and_broadcast_bhavcopy(char session_type, uint64_t ts, bool enhanced = false);
     void generate_and_broadcast_spread_bhavcopy(char session_type, uint64_t ts);
+    // Regular, enhanced and spread bhavcopy for each of the session types (e.g. "HX"),
+    // built in parallel and then broadcast in order
+    void generate_and_broadcast_bhavcopy_reports(const std::string& session_types, uint64_t ts);
 
 
 private:
+    enum class TradeRequestOp : uint8_t {
+        Modify = 0,
+        Cancel = 1
+    };
+
+    // One party to a fill, as reported in its trade confirmation
+    struct TradeSide {
+        double order_number;
+        int32_t trader_id;
+        const char* broker_id;       // 5 bytes
+        const char* account_number;  // 10 bytes
+        const char* participant;     // 12 bytes
+        const char* pan;             // 10 bytes
+        int16_t buy_sell;
+        int16_t book_type;
+        char open_close;
+        int32_t algo_id;
+        int32_t volume;
+        int32_t remaining_volume;
+        int32_t volume_filled_today;
+        int32_t price;
+        int32_t good_till_date;
+        ST_ORDER_FLAGS_SMALL_ENDIAN order_flags;
+        ADDITIONAL_ORDER_FLAGS_SMALL_ENDIAN additional_flags;
+    };
+
+    // Fill produced while uncrossing a book, with both orders' quantities as of that fill
+    struct AuctionFill {
+        double buy_order_number;
+        double sell_order_number;
+        int32_t quantity;
+        int32_t buy_remaining;
+        int32_t buy_filled;
+        int32_t sell_remaining;
+        int32_t sell_filled;
+    };
+
+    // Market orders entered during pre-open, with their owners, in entry order
+    struct AuctionMarketOrders {
+        std::vector<std::pair<double, uint32_t>> buys;
+        std::vector<std::pair<double, uint32_t>> sells;
+        int64_t buy_volume = 0;
+        int64_t sell_volume = 0;
+    };
+
     std::set<int32_t> logged_in_traders_;
     std::map<int32_t, int32_t> trader_last_logoff_time_;
 
     std::function<void(const uint8_t*, size_t)> message_callback_;
+    // Callback as set by the client; message_callback_ wraps it when framing
+    std::function<void(const uint8_t*, size_t)> client_callback_;
+
+    // NNF packet framing
+    bool packet_framing_;
+    NnfPacketCodec packet_codec_;
+    std::vector<NnfPacketCodec::Frame> inbound_frames_;
+
+    // Connections: the one outbound messages currently belong to, and the one
+    // each signed-on trader came in on. Connection 0 is a broadcast to every
+    // session; UNROUTED is a private message with nowhere to go, dropped.
+    static const ConnectionId UNROUTED = UINT32_MAX;
+    ConnectionCallback connection_callback_;
+    ResponseWriter response_writer_;
+    ConnectionId output_connection_;
+    std::map<int32_t, ConnectionId> trader_connections_;
+    int32_t request_trader_;  // trader of the message being parsed
+
+    // Private messages about a trader's orders go only to that trader's
+    // connection: for the scope of a TraderRoute, whatever is sent goes there
+    // (with connections in use; a single client gets everything anyway)
+    ConnectionId trader_connection(int32_t trader_id) const;
+    class TraderRoute {
+    public:
+        TraderRoute(FakeNSEExchange& exchange, int32_t trader_id)
+            : exchange_(exchange), previous_(exchange.output_connection_) {
+            if (exchange.connection_callback_) {
+                exchange.output_connection_ = exchange.trader_connection(trader_id);
+            }
+        }
+        ~TraderRoute() { exchange_.output_connection_ = previous_; }
+        TraderRoute(const TraderRoute&) = delete;
+        TraderRoute& operator=(const TraderRoute&) = delete;
+
+    private:
+        FakeNSEExchange& exchange_;
+        ConnectionId previous_;
+    };
+
+    // Liveness of each open connection
+    struct ConnectionState {
+        uint64_t last_received;
+        bool sent_since_heartbeat;
+        TimerWheel::TimerId heartbeat_timer;
+        TimerWheel::TimerId idle_timer;
+    };
+    std::unordered_map<ConnectionId, ConnectionState> connection_states_;
+    uint64_t heartbeat_interval_;
+    uint64_t idle_timeout_;
+    DisconnectCallback disconnect_callback_;
+
+    // Boxes routed by the gateway router, by box id
+    struct BoxSession {
+        std::string broker_id;
+        char session_key[8];
+        uint8_t crypto_key[NnfPacketCodec::KEY_SIZE];  // all zero without session encryption
+        uint8_t crypto_iv[NnfPacketCodec::IV_SIZE];
+        bool encrypted;
+        GatewayEndpoint gateway;
+        bool registered;
+        bool signed_on;
+        ConnectionId connection;
+    };
+    std::map<int16_t, BoxSession> boxes_;
+    std::vector<GatewayEndpoint> gateway_endpoints_;
+    size_t next_gateway_;
+    GatewaySelector gateway_selector_;
+    uint64_t session_key_seed_;
+    bool session_encryption_;
+    SessionCipherCallback session_cipher_callback_;
 
     std::map<std::string, bool> broker_closeout_status_;
     std::map<std::string, bool> broker_deactivated_status_;
@@ -99,26 +429,165 @@ private:
 
     std::map<double, MS_OE_REQUEST> active_orders_;
     std::map<double, MS_SPD_OE_REQUEST> active_spread_orders_;
-    std::map<std::pair<int32_t, int32_t>, MS_SPD_UPDATE_INFO> spread_combinations_;
+    // Spread combination master, keyed by packed (Token1, Token2)
+    FlatHashMap64<MS_SPD_UPDATE_INFO> spread_combinations_;
+
+    // Resting orders per token and per spread combination (same key as above)
+    std::unordered_map<int32_t, OrderBook> order_books_;
+    FlatHashMap64<OrderBook> spread_books_;
+    std::unordered_map<int32_t, int32_t> last_traded_prices_;
+    bool spread_implied_matching_;
+    bool preopen_session_active_;
+    std::vector<double> preopen_unbookable_orders_;  // IOC/market/SL orders entered during pre-open
 
     std::map<int32_t, MS_TRADE_INQ_DATA> executed_trades_;
-    std::set<std::string> trade_modification_requests_;
-    std::set<std::string> trade_cancellation_requests_;
+    int32_t next_fill_number_;
+
+    // Processed trade modification/cancellation requests, keyed by packed (fill, trader, op).
+    // With a dedup limit set, the current generation is retired once full and only the
+    // previous generation is kept alongside it.
+    FlatHashSet64 trade_requests_;
+    FlatHashSet64 trade_requests_previous_;
+    size_t trade_request_limit_;
+    uint64_t trade_request_day_;
 
     ST_MARKET_STATUS current_market_status_;
     ST_EX_MARKET_STATUS current_ex_market_status_;
     ST_PL_MARKET_STATUS current_pl_market_status_;
     bool markets_are_opening_;
 
-    // Bhavcopy data storage
-    std::map<std::string, MKT_STATS_DATA> market_statistics_;
-    std::map<std::string, SPD_STATS_DATA> spread_statistics_;
-    std::map<std::string, MKT_INDEX> market_indices_;
-    std::map<std::string, std::vector<INDUSTRY_INDEX>> industry_indices_;
-    std::map<std::string, std::vector<INDEX_DATA>> sector_indices_;
+    // Exchange clock and the timers running on it
+    ExchangeClock exchange_clock_;
+    TimerWheel timer_wheel_;
+    std::vector<TimerWheel::TimerId> session_timers_;
+    SessionPhase session_phase_;
+    std::string order_book_file_;
+
+    // Book file layout: this header, the surviving orders, then the expired ones
+    struct BookFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t live_count;
+        uint32_t expired_count;
+        uint64_t saved_at;
+    };
+    void restore_orders(const std::vector<MS_OE_REQUEST>& live, const std::vector<MS_OE_REQUEST>& expired, uint64_t ts);
+    void roll_day_statistics();
+
+    // Bhavcopy data storage; trade statistics are updated on every fill
+    MarketStatsTable market_stats_;
+    SpreadStatsTable spread_stats_;
+
+    // Data packets of one bhavcopy report, packed back to back into a buffer
+    // that is kept for the next report
+    enum class BhavcopyReport : uint8_t {
+        Market = 0,
+        EnhancedMarket = 1,
+        Spread = 2
+    };
+    struct BhavcopyStream {
+        BhavcopyReport report = BhavcopyReport::Market;
+        char session_type = BhavcopyMessageTypes::HEADER_REGULAR;
+        std::vector<uint8_t> buffer;
+        size_t packet_size = 0;
+        size_t packet_count = 0;
+        size_t record_count = 0;
+    };
+    std::vector<BhavcopyStream> bhavcopy_streams_;
+    IndexEngine index_engine_;
+    uint64_t index_broadcast_interval_;
+    TimerWheel::TimerId index_broadcast_timer_;
+
+    // Market feed state since the last sweep
+    struct TickerUpdate {
+        int32_t fill_price = 0;
+        int64_t fill_volume = 0;
+    };
+    DirtyTokenSet ticker_tokens_;
+    FlatHashMap64<TickerUpdate> ticker_updates_;
+    DirtyTokenSet market_watch_tokens_;
+    DirtyTokenSet open_interest_tokens_;
+
+    struct PriceBand {
+        int32_t low = 0;
+        int32_t high = 0;
+    };
+    FlatHashMap64<PriceBand> price_bands_;
+    DirtyTokenSet price_band_tokens_;
+    int32_t price_band_width_bps_;
+
+    struct FreezeLimits {
+        int32_t quantity = 0;
+        int32_t low_price = 0;
+        int32_t high_price = 0;
+    };
+    FlatHashMap64<FreezeLimits> freeze_limits_;
+
+    SelfTradeKey self_trade_key_;
+    SelfTradeAction self_trade_action_;
+    std::map<std::string, uint32_t> owner_ids_;
+
+    // A frozen order entry, or a frozen modification of a resting order
+    struct PendingFreeze {
+        bool is_modification = false;
+        bool is_spread = false;
+        MS_OE_REQUEST order;      // the frozen order, with the modified price/volume for modifications;
+                                  // for spread orders the frozen leg, as the policy sees it
+        PRICE_MOD modification;
+        MS_SPD_OE_REQUEST spread_order;
+        int16_t reason = 0;
+    };
+    std::map<uint64_t, PendingFreeze> pending_freezes_;
+    uint64_t next_freeze_id_;
+    FreezePolicy freeze_policy_;
+    uint64_t freeze_decision_delay_;
+    bool enhanced_market_feed_;
+    uint64_t market_feed_interval_;
+    TimerWheel::TimerId market_feed_timer_;
+    std::vector<ST_TICKER_INDEX_INFO> ticker_records_;
+    std::vector<ST_ENHNCD_TICKER_INDEX_INFO> enhanced_ticker_records_;
+    std::vector<ST_MARKET_WATCH_BCAST> market_watch_records_;
+    std::vector<ST_ENHNCD_MARKET_WATCH_BCAST> enhanced_market_watch_records_;
+    std::vector<OPEN_INTEREST> open_interest_records_;
+    std::vector<ENHNCD_OPEN_INTEREST> enhanced_open_interest_records_;
 
     size_t try_parse_message(const uint8_t* buf, size_t remaining, uint64_t ts, bool& error);
+    size_t parse_packets(const uint8_t* buf, size_t buflen, uint64_t ts, bool& error);
+    void install_message_callback();
+    void note_sent(ConnectionId connection);
+    void send_packet(const uint8_t* message, size_t length);
 
+    // Send a Message that fill(Message&) writes in full: in place through the
+    // response writer when there is one for the output connection, otherwise
+    // through the message callback
+    template <typename Message, typename Fill>
+    void emit_message(const Fill& fill) {
+        if (output_connection_ == UNROUTED) {
+            return;
+        }
+        if (response_writer_ && output_connection_ != 0) {
+            note_sent(output_connection_);
+            response_writer_(output_connection_, sizeof(Message), [](const void* context, uint8_t* message) {
+                (*static_cast<const Fill*>(context))(*reinterpret_cast<Message*>(message));
+            }, &fill);
+            return;
+        }
+        Message message;
+        fill(message);
+        if (message_callback_) {
+            message_callback_(reinterpret_cast<const uint8_t*>(&message), sizeof(message));
+        }
+    }
+
+    void send_gr_response(const MS_GR_REQUEST* req, const BoxSession* box, uint64_t ts, int16_t error_code);
+    bool fill_session_bytes(uint8_t* out, size_t length);
+    void send_secure_box_registration_response(const MS_SECURE_BOX_REGISTRATION_REQUEST_IN* req, uint64_t ts, int16_t error_code);
+    void send_box_sign_on_response(const MS_BOX_SIGN_ON_REQUEST_IN* req, uint64_t ts, int16_t error_code);
+    void send_box_sign_off_response(const MS_BOX_SIGN_OFF* req, uint64_t ts, int16_t error_code);
+    ConnectionState& track_connection(ConnectionId connection, uint64_t ts);
+    void schedule_heartbeat(ConnectionId connection, uint64_t when);
+    void schedule_idle_check(ConnectionId connection, uint64_t when);
+    void send_heartbeat(ConnectionId connection, uint64_t ts);
     void send_signon_response(const MS_SIGNON_REQUEST_IN* req, uint64_t ts, int16_t error_code);
     void send_signoff_response(const MS_SIGNOFF* req, uint64_t ts, int16_t error_code);
     void send_system_info_response(const MS_SYSTEM_INFO_REQ* req, uint64_t ts, int16_t error_code);
@@ -126,12 +595,12 @@ private:
     void send_update_local_database_response(const MS_UPDATE_LOCAL_DATABASE* req, uint64_t ts, int16_t error_code);
     void send_exchange_portfolio_response(const EXCH_PORTFOLIO_REQ* req, uint64_t ts, int16_t error_code);
     void send_message_download_response(const MS_MESSAGE_DOWNLOAD* req, uint64_t ts, int16_t error_code);
-    void send_order_response(const MS_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code = ReasonCodes::NORMAL_CONFIRMATION);
+    double send_order_response(const MS_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code = ReasonCodes::NORMAL_CONFIRMATION);
     void send_modification_response(const PRICE_MOD* req, uint64_t ts, int16_t transaction_code, int16_t error_code);
     void send_cancellation_response(const MS_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code);
     void send_kill_switch_response(const MS_OE_REQUEST* req, uint64_t ts, int16_t error_code, int32_t cancelled_count = 0);
-    void send_trade_modification_response(const MS_TRADE_INQ_DATA* req, uint64_t ts, int16_t transaction_code, int16_t error_code);
-    void send_trade_cancellation_response(const MS_TRADE_INQ_DATA* req, uint64_t ts, int16_t transaction_code, int16_t error_code);
+    void send_trade_modification_response(const MS_TRADE_INQ_DATA* req, uint64_t ts, int16_t error_code);
+    void send_trade_cancellation_response(const MS_TRADE_INQ_DATA* req, uint64_t ts, int16_t error_code);
     void send_spread_order_response(const MS_SPD_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code = ReasonCodes::NORMAL_CONFIRMATION);
     void send_2l_order_response(const MS_SPD_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code = ReasonCodes::NORMAL_CONFIRMATION);
     void send_3l_order_response(const MS_SPD_OE_REQUEST* req, uint64_t ts, int16_t transaction_code, int16_t error_code, int16_t reason_code = ReasonCodes::NORMAL_CONFIRMATION);
@@ -142,6 +611,12 @@ private:
     bool is_valid_closeout_order(const MS_OE_REQUEST* req) const;
     double generate_order_number(uint64_t ts);
     bool is_valid_modification(const MS_OE_REQUEST& original_order, const PRICE_MOD* modification) const;
+    bool is_within_price_band(int32_t token, int32_t price, bool is_market) const;
+    uint32_t owner_id(const MS_OE_REQUEST& order);
+    uint32_t owner_id(const char* broker, const char* account_number, const char* pan);
+    void cancel_order_remainder(MS_OE_REQUEST& order, int16_t error_code, uint64_t ts);
+    int16_t freeze_reason(int32_t token, int32_t volume, int32_t price, bool is_market) const;
+    uint64_t park_frozen_order(const PendingFreeze& pending, uint64_t ts);
     bool is_time_priority_lost(const MS_OE_REQUEST* original_order, const PRICE_MOD* modification) const;
     uint64_t generate_activity_reference(uint64_t ts);
     void process_successful_modification(MS_OE_REQUEST& original_order, const PRICE_MOD* req, uint64_t ts);
@@ -153,17 +628,92 @@ private:
     bool is_contract_match(const MS_OE_REQUEST* order, const CONTRACT_DESC* contract) const;
     bool is_valid_pro_order(int16_t pro_client_indicator, const std::string& account_number, const std::string& broker_id) const;
     bool is_valid_cli_order(int16_t pro_client_indicator, const std::string& account_number, const std::string& broker_id) const;
-    std::string generate_trade_request_key(int32_t fill_number, int32_t trader_id, const std::string& operation);
-    bool is_duplicate_trade_request(int32_t fill_number, int32_t trader_id, const std::string& operation);
-    void mark_trade_request(int32_t fill_number, int32_t trader_id, const std::string& operation);
+    static uint64_t generate_trade_request_key(int32_t fill_number, int32_t trader_id, TradeRequestOp operation);
+    bool is_duplicate_trade_request(int32_t fill_number, int32_t trader_id, TradeRequestOp operation) const;
+    void mark_trade_request(int32_t fill_number, int32_t trader_id, TradeRequestOp operation);
+    void roll_trade_request_day(uint64_t ts);
+    bool is_valid_trade_modification(const MS_TRADE_INQ_DATA* req) const;
     bool is_trade_owner(const MS_TRADE_INQ_DATA& trade, int32_t trader_id, const std::string& broker_id);
     bool is_valid_spread_modification(const MS_SPD_OE_REQUEST& original_order, const MS_SPD_OE_REQUEST* modification) const;
     bool is_valid_spread_activity_reference(const MS_SPD_OE_REQUEST* order, const MS_SPD_OE_REQUEST* modify_req) const;
-    void process_successful_spread_modification(MS_SPD_OE_REQUEST& original_order, const MS_SPD_OE_REQUEST* req, uint64_t ts);
+    bool process_successful_spread_modification(MS_SPD_OE_REQUEST& original_order, const MS_SPD_OE_REQUEST* req, uint64_t ts);
     void add_spread_combination(int32_t token1, int32_t token2, const MS_SPD_UPDATE_INFO& combination_info);
     void update_spread_combination(int32_t token1, int32_t token2, const MS_SPD_UPDATE_INFO& updated_info, uint64_t ts);
     bool is_valid_spread_combination(int32_t token1, int32_t token2) const;
     bool are_quantities_matching(const MS_SPD_OE_REQUEST* req, bool is_3l) const;
     bool are_tokens_same_stream(int32_t token1, int32_t token2, int32_t token3, bool is_3l) const;
     bool is_valid_2l_3l_order(const MS_SPD_OE_REQUEST* req, bool is_3l) const;
+
+    // Matching
+    static uint64_t spread_pair_key(int32_t token1, int32_t token2);
+    static bool is_crossing(bool is_buy, int32_t order_price, int32_t level_price);
+    static bool is_bookable(const MS_OE_REQUEST& order);
+    void book_order(const MS_OE_REQUEST& order);
+    void unbook_order(const MS_OE_REQUEST& order);
+    void match_order(double order_number, uint64_t ts);
+    template <typename Levels>
+    bool match_against_levels(MS_OE_REQUEST& order, Levels& levels, uint32_t incoming_owner, uint64_t ts);
+    void replenish_disclosed_volume(MS_OE_REQUEST& order);
+    void apply_order_fill(MS_OE_REQUEST& order, int32_t quantity);
+    static int32_t resting_fill_quantity(const MS_OE_REQUEST& resting, int64_t wanted);
+    bool fill_resting_order(OrderBook& book, bool is_buy, int32_t price, uint32_t owner, MS_OE_REQUEST& resting, int32_t quantity);
+    TradeSide make_trade_side(const MS_OE_REQUEST& order) const;
+    void book_spread_order(const MS_SPD_OE_REQUEST& order);
+    void unbook_spread_order(const MS_SPD_OE_REQUEST& order);
+    void match_spread_order(double order_number, uint64_t ts);
+    bool match_spread_against_legs(MS_SPD_OE_REQUEST& order, int32_t best_spread_price, bool has_spread_price, uint64_t ts);
+    void apply_spread_fill(MS_SPD_OE_REQUEST& order, int32_t quantity);
+    TradeSide make_spread_leg_side(const MS_SPD_OE_REQUEST& order, int leg) const;
+    int32_t reference_price(int32_t token) const;
+    template <typename Levels>
+    int64_t executable_volume(const Levels& levels, bool is_buy, int32_t price, bool is_market, int64_t cap,
+                              uint32_t taker_owner, bool stop_at_own, std::vector<double>* own_orders);
+    template <typename Levels>
+    void take_liquidity(Levels& levels, OrderBook& book, const CONTRACT_DESC& contract, bool is_buy, int32_t quantity,
+                        TradeSide taker, uint32_t taker_owner, uint64_t ts);
+    int32_t execute_multileg_ioc(MS_SPD_OE_REQUEST& order, int leg_count, uint64_t ts);
+    void uncross_book(OrderBook& book, int32_t price, int64_t volume, const AuctionMarketOrders& market,
+                      std::vector<AuctionFill>& fills);
+    template <typename Levels, typename TakerFill>
+    int32_t uncross_order(Levels& levels, OrderBook& book, const MS_OE_REQUEST& taker, uint32_t taker_key,
+                          int32_t price, int32_t wanted, std::vector<AuctionFill>& fills, TakerFill fill_taker);
+    size_t rematch_crossed_bids(int32_t token, uint64_t ts);
+    int32_t report_fill(int32_t token, const CONTRACT_DESC& contract, const TradeSide& buy, const TradeSide& sell,
+                        int32_t fill_quantity, int32_t fill_price, uint64_t ts);
+
+    // Bhavcopy emission. Streams are built from a caller's records or, when
+    // those are null, from the trade statistics.
+    static char bhavcopy_data_type(char session_type);
+    template <typename Packet, typename FillRecords>
+    static void pack_bhavcopy_packets(BhavcopyStream& stream, size_t record_count, size_t records_per_packet,
+                                      int16_t transaction_code, uint64_t ts, FillRecords fill_records);
+    void build_bhavcopy_stream(BhavcopyStream& stream, const std::vector<MKT_STATS_DATA>* stats,
+                               const std::vector<SPD_STATS_DATA>* spread_stats, uint64_t ts) const;
+    void build_bhavcopy_streams(std::vector<BhavcopyStream>& streams, uint64_t ts) const;
+    void send_bhavcopy_stream_packets(const BhavcopyStream& stream);
+    void broadcast_bhavcopy_stream(const BhavcopyStream& stream, uint64_t ts);
+    void send_index_reports(uint64_t ts);
+    void record_spread_trade(const MS_SPD_OE_REQUEST& order, int32_t price_diff, int32_t quantity);
+
+    void schedule_index_broadcast(uint64_t when);
+
+    // Limit price protection
+    void update_price_band(int32_t token, int32_t reference_price);
+    void broadcast_price_bands(uint64_t ts);
+
+    // Market feed
+    void record_ticker_fill(int32_t token, int32_t fill_price, int32_t fill_quantity);
+    void schedule_market_feed_sweep(uint64_t when);
+    void fill_market_wise_info(int32_t token, ST_MKT_WISE_INFO& info) const;
+    int64_t open_interest_of(int32_t token) const;
+    template <typename Packet, typename Record, size_t N>
+    void send_open_interest_broadcast(int16_t transaction_code, const std::vector<Record>& records,
+                                      Record (Packet::*record_field)[N], uint64_t ts);
+    template <typename Packet, typename Record, size_t N>
+    void send_packed_broadcast(int16_t transaction_code, const std::vector<Record>& records,
+                               int16_t Packet::*count_field, Record (Packet::*record_field)[N], uint64_t ts);
+
+    // Market session schedule
+    void enter_session_phase(SessionPhase phase, uint64_t ts);
+    void send_market_status_broadcast(int16_t transaction_code, const std::string& message, uint64_t ts);
 };
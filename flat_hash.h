@@ -0,0 +1,268 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+#include <utility>
+
+// Open-addressing hash containers keyed by 64-bit integers.
+// Linear probing over a power-of-two table. The set uses key 0 as its
+// empty-slot marker and tracks it out of band; the map keeps an occupancy
+// byte per slot instead.
+
+inline uint64_t mix_hash64(uint64_t key) {
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+class FlatHashSet64 {
+public:
+    explicit FlatHashSet64(size_t initial_capacity = 1024) {
+        size_t capacity = 16;
+        while (capacity < initial_capacity) {
+            capacity <<= 1;
+        }
+        slots_.assign(capacity, 0);
+    }
+
+    bool contains(uint64_t key) const {
+        if (key == 0) {
+            return has_zero_;
+        }
+        size_t mask = slots_.size() - 1;
+        for (size_t i = mix_hash64(key) & mask; ; i = (i + 1) & mask) {
+            uint64_t slot = slots_[i];
+            if (slot == key) {
+                return true;
+            }
+            if (slot == 0) {
+                return false;
+            }
+        }
+    }
+
+    // Returns true if the key was not already present
+    bool insert(uint64_t key) {
+        if (key == 0) {
+            bool inserted = !has_zero_;
+            has_zero_ = true;
+            size_ += inserted ? 1 : 0;
+            return inserted;
+        }
+        // Keep load factor at or below 1/2
+        if ((used_ + 1) * 2 > slots_.size()) {
+            grow();
+        }
+        size_t mask = slots_.size() - 1;
+        for (size_t i = mix_hash64(key) & mask; ; i = (i + 1) & mask) {
+            uint64_t slot = slots_[i];
+            if (slot == key) {
+                return false;
+            }
+            if (slot == 0) {
+                slots_[i] = key;
+                ++used_;
+                ++size_;
+                return true;
+            }
+        }
+    }
+
+    // Drops all keys but keeps the allocated table for reuse
+    void clear() {
+        if (used_ != 0) {
+            std::fill(slots_.begin(), slots_.end(), 0);
+        }
+        used_ = 0;
+        size_ = 0;
+        has_zero_ = false;
+    }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return slots_.size(); }
+    size_t memory_bytes() const { return slots_.size() * sizeof(uint64_t); }
+
+private:
+    std::vector<uint64_t> slots_;
+    size_t used_ = 0;
+    size_t size_ = 0;
+    bool has_zero_ = false;
+
+    void grow() {
+        std::vector<uint64_t> old;
+        old.swap(slots_);
+        slots_.assign(old.size() * 2, 0);
+        size_t mask = slots_.size() - 1;
+        for (uint64_t key : old) {
+            if (key == 0) {
+                continue;
+            }
+            size_t i = mix_hash64(key) & mask;
+            while (slots_[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            slots_[i] = key;
+        }
+    }
+};
+
+// Tokens in the order they were first marked, each listed once until clear()
+class DirtyTokenSet {
+public:
+    explicit DirtyTokenSet(size_t initial_capacity = 1024) : seen_(initial_capacity) {}
+
+    void mark(int32_t token) {
+        if (seen_.insert(static_cast<uint32_t>(token))) {
+            tokens_.push_back(token);
+        }
+    }
+
+    const std::vector<int32_t>& tokens() const { return tokens_; }
+    bool empty() const { return tokens_.empty(); }
+
+    void clear() {
+        seen_.clear();
+        tokens_.clear();
+    }
+
+private:
+    FlatHashSet64 seen_;
+    std::vector<int32_t> tokens_;
+};
+
+// Map counterpart of FlatHashSet64. Values live in a parallel array, so
+// pointers returned by find() are invalidated by any later insertion.
+template <typename V>
+class FlatHashMap64 {
+public:
+    explicit FlatHashMap64(size_t initial_capacity = 64) {
+        size_t capacity = 16;
+        while (capacity < initial_capacity) {
+            capacity <<= 1;
+        }
+        keys_.assign(capacity, 0);
+        values_.resize(capacity);
+        occupied_.assign(capacity, 0);
+    }
+
+    V* find(uint64_t key) {
+        size_t i = locate(key);
+        return occupied_[i] ? &values_[i] : nullptr;
+    }
+
+    const V* find(uint64_t key) const {
+        size_t i = locate(key);
+        return occupied_[i] ? &values_[i] : nullptr;
+    }
+
+    // Default-constructs the value on a miss
+    V& operator[](uint64_t key) {
+        if ((size_ + 1) * 2 > keys_.size()) {
+            grow();
+        }
+        size_t i = locate(key);
+        if (!occupied_[i]) {
+            keys_[i] = key;
+            values_[i] = V();
+            occupied_[i] = 1;
+            ++size_;
+        }
+        return values_[i];
+    }
+
+    // Backward-shift deletion keeps probe sequences intact without tombstones
+    bool erase(uint64_t key) {
+        size_t i = locate(key);
+        if (!occupied_[i]) {
+            return false;
+        }
+        size_t mask = keys_.size() - 1;
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; occupied_[j]; j = (j + 1) & mask) {
+            size_t home = mix_hash64(keys_[j]) & mask;
+            // Move j into the hole if its home slot does not lie in (hole, j]
+            if (((j - home) & mask) >= ((j - hole) & mask)) {
+                keys_[hole] = keys_[j];
+                values_[hole] = std::move(values_[j]);
+                hole = j;
+            }
+        }
+        occupied_[hole] = 0;
+        values_[hole] = V();
+        --size_;
+        return true;
+    }
+
+    template <typename F>
+    void for_each(F&& fn) {
+        for (size_t i = 0; i < keys_.size(); i++) {
+            if (occupied_[i]) {
+                fn(keys_[i], values_[i]);
+            }
+        }
+    }
+
+    template <typename F>
+    void for_each(F&& fn) const {
+        for (size_t i = 0; i < keys_.size(); i++) {
+            if (occupied_[i]) {
+                fn(keys_[i], values_[i]);
+            }
+        }
+    }
+
+    void clear() {
+        std::fill(occupied_.begin(), occupied_.end(), 0);
+        for (V& value : values_) {
+            value = V();
+        }
+        size_ = 0;
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+private:
+    std::vector<uint64_t> keys_;
+    std::vector<V> values_;
+    std::vector<uint8_t> occupied_;
+    size_t size_ = 0;
+
+    // Slot holding the key, or the empty slot where it would be inserted
+    size_t locate(uint64_t key) const {
+        size_t mask = keys_.size() - 1;
+        size_t i = mix_hash64(key) & mask;
+        while (occupied_[i] && keys_[i] != key) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void grow() {
+        std::vector<uint64_t> old_keys;
+        std::vector<V> old_values;
+        std::vector<uint8_t> old_occupied;
+        old_keys.swap(keys_);
+        old_values.swap(values_);
+        old_occupied.swap(occupied_);
+
+        size_t capacity = old_keys.size() * 2;
+        keys_.assign(capacity, 0);
+        values_.resize(capacity);
+        occupied_.assign(capacity, 0);
+        for (size_t i = 0; i < old_keys.size(); i++) {
+            if (old_occupied[i]) {
+                size_t slot = locate(old_keys[i]);
+                keys_[slot] = old_keys[i];
+                values_[slot] = std::move(old_values[i]);
+                occupied_[slot] = 1;
+            }
+        }
+    }
+};
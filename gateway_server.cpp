@@ -0,0 +1,1082 @@
+#include "gateway_server.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+const uint64_t WAKE_EVENT = UINT64_MAX;
+const uint64_t TIMER_EVENT = UINT64_MAX - 1;
+const size_t READ_CHUNK = 64 * 1024;
+
+// io_uring user data for connection operations: the connection's address
+// with the operation in the low bits
+const uint64_t OP_RECEIVE = 1;
+const uint64_t OP_SEND = 2;
+const uint64_t OP_CANCEL = 3;
+const uint64_t OP_MASK = 7;
+
+// Worker whose loop is running on this thread
+thread_local const void* current_worker = nullptr;
+
+void wake(int fd) {
+    uint64_t one = 1;
+    ssize_t written = write(fd, &one, sizeof(one));
+    (void)written;
+}
+
+// Pin the calling thread to cpu, unless it is -1
+void pin_thread(int cpu, const std::string& role) {
+    if (cpu < 0) {
+        return;
+    }
+    int error = pin_current_thread(cpu);
+    if (error != 0) {
+        std::cout << "Gateway server: cannot pin " << role << " to CPU " << cpu << ": " << strerror(error) << std::endl;
+    }
+}
+
+int listed_cpu(const std::vector<int>& cpus, size_t index) {
+    return index < cpus.size() ? cpus[index] : -1;
+}
+
+}  // namespace
+
+GatewayServer::GatewayServer(FakeNSEExchange& exchange, const GatewayServerConfig& config)
+    : exchange_(exchange), config_(config) {}
+
+GatewayServer::~GatewayServer() {
+    stop();
+}
+
+bool GatewayServer::start() {
+    if (running_) {
+        return false;
+    }
+
+    backend_ = config_.backend;
+    if (backend_ == GatewayBackend::IoUring && !uring_available()) {
+        std::cout << "Gateway server: io_uring unavailable, falling back to epoll" << std::endl;
+        backend_ = GatewayBackend::Epoll;
+    }
+
+    // io_uring reads the wake eventfd asynchronously, so it stays blocking there
+    int wake_flags = backend_ == GatewayBackend::Epoll ? EFD_NONBLOCK | EFD_CLOEXEC : EFD_CLOEXEC;
+    accept_wake_fd_ = eventfd(0, wake_flags);
+    if (backend_ == GatewayBackend::Epoll) {
+        accept_epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (accept_epoll_fd_ < 0 || accept_wake_fd_ < 0) {
+            std::cout << "Gateway server: cannot create epoll instance: " << strerror(errno) << std::endl;
+            stop();
+            return false;
+        }
+        epoll_event wake_event;
+        memset(&wake_event, 0, sizeof(wake_event));
+        wake_event.events = EPOLLIN;
+        wake_event.data.u64 = WAKE_EVENT;
+        epoll_ctl(accept_epoll_fd_, EPOLL_CTL_ADD, accept_wake_fd_, &wake_event);
+    } else {
+        accept_ring_.reset(new IoUring());
+        int error = accept_ring_->init(64);
+        if (error != 0 || accept_wake_fd_ < 0) {
+            std::cout << "Gateway server: cannot create io_uring instance: " << strerror(error != 0 ? -error : errno) << std::endl;
+            stop();
+            return false;
+        }
+    }
+
+    if (!open_listener(config_.router_port, ListenerKind::Router, 0)) {
+        stop();
+        return false;
+    }
+    for (size_t i = 0; i < config_.gateway_ports.size(); i++) {
+        std::unique_ptr<Gateway> gateway(new Gateway());
+        gateway->port = config_.gateway_ports[i];
+        gateways_.push_back(std::move(gateway));
+        if (!open_listener(config_.gateway_ports[i], ListenerKind::Gateway, i)) {
+            stop();
+            return false;
+        }
+    }
+
+    if (config_.lock_memory) {
+        // Before any thread starts, so their stacks are locked too
+        int error = lock_process_memory();
+        if (error != 0) {
+            std::cout << "Gateway server: cannot lock memory: " << strerror(error) << std::endl;
+        }
+    }
+
+    size_t worker_count = std::max<size_t>(1, config_.worker_threads);
+    for (size_t i = 0; i < worker_count; i++) {
+        std::unique_ptr<Worker> worker(new Worker());
+        worker->wake_fd = eventfd(0, wake_flags);
+        if (backend_ == GatewayBackend::IoUring) {
+            if (worker->wake_fd < 0 || !init_worker_ring(*worker)) {
+                workers_.push_back(std::move(worker));
+                stop();
+                return false;
+            }
+            workers_.push_back(std::move(worker));
+            continue;
+        }
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->epoll_fd < 0 || worker->wake_fd < 0) {
+            std::cout << "Gateway server: cannot create worker epoll instance: " << strerror(errno) << std::endl;
+            workers_.push_back(std::move(worker));
+            stop();
+            return false;
+        }
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &event);
+        workers_.push_back(std::move(worker));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(exchange_mutex_);
+        exchange_.set_gateway_selector([this](int16_t box_id, GatewayEndpoint& endpoint) {
+            return select_gateway(box_id, endpoint);
+        });
+        exchange_.set_connection_callback([this](FakeNSEExchange::ConnectionId connection, const uint8_t* message, size_t length) {
+            deliver(connection, message, length);
+        });
+        exchange_.set_response_writer([this](FakeNSEExchange::ConnectionId connection, size_t length,
+                                             FakeNSEExchange::MessageFill fill, const void* context) {
+            write_message(connection, length, fill, context);
+        });
+        exchange_.set_disconnect_callback([this](FakeNSEExchange::ConnectionId connection) {
+            disconnect(connection);
+        });
+        exchange_.set_session_cipher_callback([this](FakeNSEExchange::ConnectionId connection, const uint8_t* key, const uint8_t* iv) {
+            encrypt_session(connection, key, iv);
+        });
+        exchange_.set_session_encryption(config_.session_encryption);
+    }
+
+    running_ = true;
+    for (size_t i = 0; i < workers_.size(); i++) {
+        Worker* w = workers_[i].get();
+        w->thread = std::thread([this, w, i]() {
+            pin_thread(listed_cpu(config_.worker_cpus, i), "worker " + std::to_string(i));
+            worker_loop(*w);
+        });
+    }
+    for (size_t i = 0; i < config_.bulk_threads; i++) {
+        std::unique_ptr<BulkLane> lane(new BulkLane());
+        BulkLane* l = lane.get();
+        bulk_lanes_.push_back(std::move(lane));
+        l->thread = std::thread([this, l, i]() {
+            pin_thread(listed_cpu(config_.bulk_cpus, i), "bulk thread " + std::to_string(i));
+            bulk_loop(*l);
+        });
+    }
+    accept_thread_ = std::thread([this]() {
+        pin_thread(config_.accept_cpu, "accept thread");
+        accept_loop();
+    });
+
+    std::cout << "Gateway server: router on port " << config_.router_port << ", " << gateways_.size()
+              << " gateways, " << workers_.size() << " workers ("
+              << (backend_ == GatewayBackend::IoUring ? "io_uring" : "epoll") << "), " << bulk_lanes_.size()
+              << " bulk threads" << (config_.busy_poll ? ", busy-polling" : "") << std::endl;
+    return true;
+}
+
+void GatewayServer::stop() {
+    if (accept_epoll_fd_ < 0 && workers_.empty() && listeners_.empty()) {
+        return;
+    }
+    running_ = false;
+    if (accept_wake_fd_ >= 0) {
+        wake(accept_wake_fd_);
+    }
+    for (auto& worker : workers_) {
+        if (worker->wake_fd >= 0) {
+            wake(worker->wake_fd);
+        }
+    }
+    if (accept_thread_.joinable()) {
+        accept_thread_.join();
+    }
+    for (auto& worker : workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+    if (config_.busy_poll) {
+        for (size_t i = 0; i < workers_.size(); i++) {
+            LoopJitter::Summary jitter = workers_[i]->jitter.summary();
+            std::cout << "Worker " << i << ": " << jitter.passes << " passes, gap p50 " << jitter.p50_ns << " ns, p99 "
+                      << jitter.p99_ns << " ns, p99.9 " << jitter.p999_ns << " ns, max " << jitter.max_ns << " ns"
+                      << std::endl;
+        }
+    }
+    for (auto& lane : bulk_lanes_) {
+        {
+            std::lock_guard<std::mutex> lock(lane->mutex);
+            lane->ready.notify_all();
+        }
+        if (lane->thread.joinable()) {
+            lane->thread.join();
+        }
+    }
+    bulk_lanes_.clear();
+
+    // Threads are gone; close whatever is still connected
+    for (auto& worker : workers_) {
+        std::vector<std::shared_ptr<Connection>> remaining;
+        for (auto& entry : worker->connections) {
+            remaining.push_back(entry.second);
+        }
+        for (auto& connection : remaining) {
+            close_connection(*worker, *connection);
+        }
+        if (worker->epoll_fd >= 0) {
+            close(worker->epoll_fd);
+        }
+        if (worker->wake_fd >= 0) {
+            close(worker->wake_fd);
+        }
+        worker->ring.reset();
+    }
+    workers_.clear();
+
+    for (const Listener& listener : listeners_) {
+        close(listener.fd);
+    }
+    listeners_.clear();
+    gateways_.clear();
+    if (accept_epoll_fd_ >= 0) {
+        close(accept_epoll_fd_);
+        accept_epoll_fd_ = -1;
+    }
+    if (accept_wake_fd_ >= 0) {
+        close(accept_wake_fd_);
+        accept_wake_fd_ = -1;
+    }
+    accept_ring_.reset();
+
+    std::lock_guard<std::mutex> lock(exchange_mutex_);
+    exchange_.set_gateway_selector(nullptr);
+    exchange_.set_connection_callback(nullptr);
+    exchange_.set_response_writer(nullptr);
+    exchange_.set_disconnect_callback(nullptr);
+    exchange_.set_session_cipher_callback(nullptr);
+}
+
+std::vector<GatewayServer::GatewayLoad> GatewayServer::gateway_loads() const {
+    std::vector<GatewayLoad> loads;
+    for (const auto& gateway : gateways_) {
+        loads.push_back({gateway->port, gateway->sessions.load(), gateway->messages_in.load(), gateway->messages_out.load(),
+                         gateway->messages_dropped.load(), gateway->slow_disconnects.load()});
+    }
+    return loads;
+}
+
+std::vector<GatewayServer::WorkerLoad> GatewayServer::worker_loads() const {
+    std::vector<WorkerLoad> loads;
+    for (const auto& worker : workers_) {
+        loads.push_back({worker->sessions.load(), worker->messages_in.load(), worker->jitter.summary()});
+    }
+    return loads;
+}
+
+std::vector<GatewayServer::BulkLoad> GatewayServer::bulk_loads() const {
+    std::vector<BulkLoad> loads;
+    for (const auto& lane : bulk_lanes_) {
+        std::lock_guard<std::mutex> lock(lane->mutex);
+        loads.push_back({lane->queue.size(), lane->handled.load(), lane->overflowed.load()});
+    }
+    return loads;
+}
+
+bool GatewayServer::open_listener(uint16_t port, ListenerKind kind, size_t gateway) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cout << "Gateway server: cannot create socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, config_.bind_ip.c_str(), &address.sin_addr) != 1 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        std::cout << "Gateway server: cannot listen on " << config_.bind_ip << ":" << port
+                  << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return false;
+    }
+
+    Listener listener;
+    listener.fd = fd;
+    listener.kind = kind;
+    listener.gateway = gateway;
+    listener.port = port;
+    listeners_.push_back(listener);
+    if (accept_epoll_fd_ < 0) {
+        return true;
+    }
+
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = listeners_.size() - 1;
+    epoll_ctl(accept_epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+    return true;
+}
+
+void GatewayServer::accept_loop() {
+    if (backend_ == GatewayBackend::IoUring) {
+        uring_accept_loop();
+        return;
+    }
+    epoll_event events[16];
+    while (running_) {
+        int count = epoll_wait(accept_epoll_fd_, events, 16, -1);
+        for (int i = 0; i < count && running_; i++) {
+            if (events[i].data.u64 == WAKE_EVENT) {
+                continue;
+            }
+            accept_connections(listeners_[events[i].data.u64]);
+        }
+    }
+}
+
+void GatewayServer::accept_connections(const Listener& listener) {
+    for (;;) {
+        int fd = accept4(listener.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        add_connection(listener, fd);
+    }
+}
+
+// New connections go to the worker with the fewest sessions
+void GatewayServer::add_connection(const Listener& listener, int fd) {
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    size_t worker_index = 0;
+    for (size_t i = 1; i < workers_.size(); i++) {
+        if (workers_[i]->sessions < workers_[worker_index]->sessions) {
+            worker_index = i;
+        }
+    }
+    Worker& worker = *workers_[worker_index];
+
+    std::shared_ptr<Connection> connection = std::make_shared<Connection>();
+    connection->id = next_connection_id_++;
+    connection->fd = fd;
+    connection->kind = listener.kind;
+    connection->gateway = listener.gateway;
+    connection->worker = worker_index;
+    connection->inbound.set_error_policy(config_.packet_error_policy);
+
+    if (listener.kind == ListenerKind::Gateway) {
+        Gateway& gateway = *gateways_[listener.gateway];
+        gateway.sessions++;
+        size_t routed = gateway.routed.load();
+        while (routed > 0 && !gateway.routed.compare_exchange_weak(routed, routed - 1)) {
+        }
+    }
+    worker.sessions++;
+
+    {
+        std::lock_guard<std::mutex> lock(exchange_mutex_);
+        connections_[connection->id] = connection.get();
+        exchange_.connection_opened(connection->id, exchange_.exchange_time());
+    }
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.connections[connection->id] = connection;
+        if (backend_ == GatewayBackend::IoUring) {
+            // Only the worker touches its ring
+            worker.receive_queue.push_back(connection->id);
+        }
+    }
+
+    if (backend_ == GatewayBackend::IoUring) {
+        wake(worker.wake_fd);
+    } else {
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = connection.get();
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    std::cout << "Connection " << connection->id << " accepted on "
+              << (listener.kind == ListenerKind::Router ? "router" : "gateway") << " port " << listener.port
+              << " (worker " << worker_index << ")" << std::endl;
+}
+
+void GatewayServer::worker_loop(Worker& worker) {
+    if (backend_ == GatewayBackend::IoUring) {
+        uring_worker_loop(worker);
+        return;
+    }
+    bool runs_timers = &worker == workers_.front().get();
+    int timeout = config_.busy_poll ? 0 : runs_timers ? config_.timer_poll_ms : -1;
+    epoll_event events[64];
+    while (running_) {
+        int count = epoll_wait(worker.epoll_fd, events, 64, timeout);
+        for (int i = 0; i < count && running_; i++) {
+            Connection* connection = static_cast<Connection*>(events[i].data.ptr);
+            if (!connection) {
+                continue;
+            }
+            uint32_t flags = events[i].events;
+            if (flags & EPOLLOUT) {
+                flush_connection(worker, *connection);
+            }
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                read_connection(worker, *connection);
+            }
+        }
+        if (next_pass(worker) && runs_timers) {
+            std::lock_guard<std::mutex> lock(exchange_mutex_);
+            coalescing_ = true;
+            exchange_.poll_timers(config_.timers_per_poll);
+            flush_coalesced();
+        }
+    }
+}
+
+// End of a loop pass; true if the timers are to be polled. A sleeping loop
+// polls them every pass, as it wakes at least every timer_poll_ms. A
+// busy-polling one records the pass and polls them every timer_poll_ms, so
+// that it does not take the exchange lock on every turn.
+bool GatewayServer::next_pass(Worker& worker) {
+    if (!config_.busy_poll) {
+        return true;
+    }
+    uint64_t now = monotonic_ns();
+    worker.jitter.pass(now);
+    if (now < worker.next_timer_poll) {
+        return false;
+    }
+    worker.next_timer_poll = now + static_cast<uint64_t>(config_.timer_poll_ms) * 1000000ULL;
+    return true;
+}
+
+// One read per readiness event, so a busy connection cannot starve the rest
+// of the worker's connections. A read holding only whole packets is decoded
+// straight from the stack; only a partial packet is kept for the next read.
+void GatewayServer::read_connection(Worker& worker, Connection& connection) {
+    uint8_t chunk[READ_CHUNK];
+    ssize_t received = recv(connection.fd, chunk, sizeof(chunk), 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (received <= 0) {
+        close_connection(worker, connection);
+        return;
+    }
+    handle_input(worker, connection, chunk, static_cast<size_t>(received));
+}
+
+// Decode and handle what one read brought in. chunk only has to last for the
+// call: a trailing partial packet is copied into the connection's input.
+void GatewayServer::handle_input(Worker& worker, Connection& connection, uint8_t* chunk, size_t received) {
+    bool buffered = !connection.input.empty();
+    if (buffered) {
+        connection.input.insert(connection.input.end(), chunk, chunk + received);
+    }
+    uint8_t* data = buffered ? connection.input.data() : chunk;
+    size_t size = buffered ? connection.input.size() : static_cast<size_t>(received);
+
+    NnfPacketCodec::Status status;
+    connection.frames.clear();
+    size_t consumed = connection.inbound.decode(data, size, connection.frames, status);
+    bool drop = status != NnfPacketCodec::Status::Ok &&
+                connection.inbound.error_policy() == NnfPacketCodec::ErrorPolicy::Reject;
+    if (status != NnfPacketCodec::Status::Ok) {
+        std::cout << "Connection " << connection.id << ": bad NNF packet (status " << static_cast<int>(status)
+                  << ", expected sequence " << connection.inbound.expected_inbound_sequence() << ")" << std::endl;
+    }
+
+    // Sealed frames are opened before taking the lock; only those that came
+    // in the same read as the box sign-on are left to open under it
+    size_t usable = connection.frames.size();
+    size_t opened = 0;
+    if (connection.inbound.encrypted()) {
+        while (opened < usable && open_frame(connection, data, connection.frames[opened])) {
+            opened++;
+        }
+        if (opened < usable) {
+            usable = opened;
+            drop = true;
+        }
+    }
+
+    if (usable > 0) {
+        priority_waiters_++;
+        std::lock_guard<std::mutex> lock(exchange_mutex_);
+        priority_waiters_--;
+        coalescing_ = true;
+        uint64_t ts = exchange_.exchange_time();
+        for (size_t i = 0; i < usable; i++) {
+            NnfPacketCodec::Frame& frame = connection.frames[i];
+            if (i >= opened && connection.inbound.encrypted() && !open_frame(connection, data, frame)) {
+                drop = true;
+                break;
+            }
+            if (connection.kind == ListenerKind::Router) {
+                // The router only answers GR requests
+                int16_t transaction_code = 0;
+                if (frame.length >= sizeof(transaction_code)) {
+                    memcpy(&transaction_code, frame.message, sizeof(transaction_code));
+                }
+                if (transaction_code != TransactionCodes::GR_REQUEST) {
+                    std::cout << "Connection " << connection.id << ": transaction code " << transaction_code
+                              << " not accepted by the gateway router" << std::endl;
+                    continue;
+                }
+            } else if (FakeNSEExchange::is_bulk_request(frame.message, frame.length) && queue_bulk(connection, frame)) {
+                continue;
+            }
+            bool error = false;
+            exchange_.parse(connection.id, frame.message, frame.length, ts, error);
+            if (error) {
+                drop = true;
+                break;
+            }
+        }
+        flush_coalesced();
+    }
+    worker.messages_in += connection.frames.size();
+    if (connection.kind == ListenerKind::Gateway) {
+        gateways_[connection.gateway]->messages_in += connection.frames.size();
+    }
+
+    if (drop) {
+        close_connection(worker, connection);
+        return;
+    }
+    if (buffered) {
+        connection.input.erase(connection.input.begin(), connection.input.begin() + consumed);
+    } else {
+        connection.input.assign(chunk + consumed, chunk + size);
+    }
+}
+
+void GatewayServer::flush_connection(Worker& worker, Connection& connection) {
+    std::lock_guard<std::mutex> lock(connection.output_mutex);
+    if (!connection.output.empty()) {
+        ssize_t sent = send(connection.fd, connection.output.data(), connection.output.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent > 0) {
+            connection.output.consume(sent);
+        }
+    }
+    if (connection.output.empty()) {
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = &connection;
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+    }
+}
+
+void GatewayServer::close_connection(Worker& worker, Connection& connection) {
+    if (connection.closing) {
+        return;
+    }
+    connection.closing = true;
+    FakeNSEExchange::ConnectionId id = connection.id;
+    {
+        // Once this is done no exchange callback can reach the connection
+        std::lock_guard<std::mutex> lock(exchange_mutex_);
+        connections_.erase(id);
+        exchange_.connection_closed(id, exchange_.exchange_time());
+    }
+    if (connection.kind == ListenerKind::Gateway) {
+        gateways_[connection.gateway]->sessions--;
+    }
+    worker.sessions--;
+    std::cout << "Connection " << id << " closed" << std::endl;
+
+    if (current_worker == &worker && worker.ring) {
+        // The kernel may still hold the socket and the send buffer; the
+        // connection goes once every operation on it has completed
+        shutdown(connection.fd, SHUT_RDWR);
+        worker.ring->prep_cancel(reinterpret_cast<uint64_t>(&connection) | OP_RECEIVE,
+                                 reinterpret_cast<uint64_t>(&connection) | OP_CANCEL);
+        return;
+    }
+    if (worker.epoll_fd >= 0) {
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_DEL, connection.fd, nullptr);
+    }
+    release_connection(worker, connection);
+}
+
+// Under exchange_mutex_. False if the request is to be handled in line.
+bool GatewayServer::queue_bulk(Connection& connection, const NnfPacketCodec::Frame& frame) {
+    if (bulk_lanes_.empty()) {
+        return false;
+    }
+    BulkLane& lane = *bulk_lanes_[connection.id % bulk_lanes_.size()];
+    std::lock_guard<std::mutex> lock(lane.mutex);
+    if (lane.queue.size() >= config_.bulk_queue_limit) {
+        lane.overflowed++;
+        return false;
+    }
+    lane.queue.push_back({connection.id, std::vector<uint8_t>(frame.message, frame.message + frame.length)});
+    lane.ready.notify_one();
+    return true;
+}
+
+// One request per turn at the exchange, so a worker waits at most for the
+// request being handled
+void GatewayServer::bulk_loop(BulkLane& lane) {
+    while (running_) {
+        BulkRequest request;
+        {
+            std::unique_lock<std::mutex> lock(lane.mutex);
+            lane.ready.wait(lock, [&]() { return !running_ || !lane.queue.empty(); });
+            if (!running_) {
+                return;
+            }
+            request = std::move(lane.queue.front());
+            lane.queue.pop_front();
+        }
+        std::unique_lock<std::mutex> lock = lock_for_bulk();
+        if (connections_.find(request.connection) == connections_.end()) {
+            continue;  // closed while the request was queued
+        }
+        coalescing_ = true;
+        bool error = false;
+        exchange_.parse(request.connection, request.message.data(), request.message.size(),
+                        exchange_.exchange_time(), error);
+        flush_coalesced();
+        if (error) {
+            disconnect(request.connection);
+        }
+        lane.handled++;
+    }
+}
+
+// Take the exchange once no worker is waiting for it
+std::unique_lock<std::mutex> GatewayServer::lock_for_bulk() {
+    for (;;) {
+        while (priority_waiters_.load() != 0) {
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(exchange_mutex_);
+        if (priority_waiters_.load() == 0) {
+            return lock;
+        }
+    }
+}
+
+void GatewayServer::release_connection(Worker& worker, Connection& connection) {
+    close(connection.fd);
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.connections.erase(connection.id);
+}
+
+// Decrypt a decoded frame where it lies in data, the buffer it was decoded from
+bool GatewayServer::open_frame(Connection& connection, uint8_t* data, NnfPacketCodec::Frame& frame) {
+    uint8_t* message = data + (frame.message - data);
+    if (!connection.inbound.open(message, frame.length, frame.sequence)) {
+        std::cout << "Connection " << connection.id << ": packet " << frame.sequence << " failed to decrypt" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Fewest open plus routed-but-not-yet-connected sessions
+bool GatewayServer::select_gateway(int16_t box_id, GatewayEndpoint& endpoint) {
+    if (gateways_.empty()) {
+        return false;
+    }
+    size_t count = gateways_.size();
+    size_t best = static_cast<uint16_t>(box_id) % count;
+    for (size_t step = 1; step < count; step++) {
+        size_t i = (static_cast<uint16_t>(box_id) + step) % count;
+        if (gateways_[i]->sessions + gateways_[i]->routed < gateways_[best]->sessions + gateways_[best]->routed) {
+            best = i;
+        }
+    }
+    gateways_[best]->routed++;
+    endpoint.ip = config_.advertised_ip;
+    endpoint.port = gateways_[best]->port;
+    return true;
+}
+
+// Shut the socket down; its worker sees the hang-up and closes the connection
+void GatewayServer::disconnect(FakeNSEExchange::ConnectionId connection_id) {
+    auto it = connections_.find(connection_id);
+    if (it != connections_.end()) {
+        shutdown(it->second->fd, SHUT_RDWR);
+    }
+}
+
+// Runs inside the box sign-on parse, on the connection's own worker, so the
+// inbound codec is safe to switch here
+void GatewayServer::encrypt_session(FakeNSEExchange::ConnectionId connection_id, const uint8_t* key, const uint8_t* iv) {
+    auto it = connections_.find(connection_id);
+    if (it == connections_.end()) {
+        return;
+    }
+    Connection& connection = *it->second;
+    connection.inbound.enable_encryption(key, iv);
+    std::lock_guard<std::mutex> lock(connection.output_mutex);
+    connection.outbound.enable_encryption(key, iv);
+}
+
+// Connection 0 is everything not tied to a session; it goes to every gateway
+// session
+void GatewayServer::deliver(FakeNSEExchange::ConnectionId connection_id, const uint8_t* message, size_t length) {
+    if (connection_id == 0) {
+        for (auto& entry : connections_) {
+            if (entry.second->kind == ListenerKind::Gateway) {
+                send_packet(*entry.second, message, length);
+            }
+        }
+        return;
+    }
+    auto it = connections_.find(connection_id);
+    if (it != connections_.end()) {
+        send_packet(*it->second, message, length);
+    }
+}
+
+// The exchange writes the message straight into the connection's output,
+// where it is sealed and checksummed in place
+void GatewayServer::write_message(FakeNSEExchange::ConnectionId connection_id, size_t length,
+                                  FakeNSEExchange::MessageFill fill, const void* context) {
+    auto it = connections_.find(connection_id);
+    if (it != connections_.end()) {
+        send_packet(*it->second, length, fill, context);
+    }
+}
+
+void GatewayServer::send_packet(Connection& connection, const uint8_t* message, size_t length) {
+    std::pair<const uint8_t*, size_t> source(message, length);
+    send_packet(connection, length, [](const void* context, uint8_t* payload) {
+        auto source = static_cast<const std::pair<const uint8_t*, size_t>*>(context);
+        memcpy(payload, source->first, source->second);
+    }, &source);
+}
+
+// Packets are written straight away while the socket keeps up; the rest
+// waits in the connection's output for the owning worker to flush
+void GatewayServer::send_packet(Connection& connection, size_t length, FakeNSEExchange::MessageFill fill,
+                                const void* context) {
+    std::lock_guard<std::mutex> lock(connection.output_mutex);
+    if (length > connection.outbound.max_message_size()) {
+        std::cout << "Connection " << connection.id << ": message too large for an NNF packet" << std::endl;
+        return;
+    }
+    size_t pending = connection.output.size();
+    size_t size = connection.outbound.packet_size(length);
+    if (config_.output_high_water > 0 && pending + connection.sending.size() + size > config_.output_high_water) {
+        slow_consumer(connection);
+        return;
+    }
+    connection.dropping = false;
+    uint8_t* packet = connection.output.reserve(size);
+    fill(context, NnfPacketCodec::payload(packet));
+    connection.output.commit(connection.outbound.finish(packet, length));
+    if (connection.kind == ListenerKind::Gateway) {
+        gateways_[connection.gateway]->messages_out++;
+    }
+    if (backend_ == GatewayBackend::IoUring) {
+        // Submitted with the worker's next wait, together with everything
+        // else produced in the meantime
+        if (connection.send_queued || connection.send_in_flight) {
+            return;
+        }
+        connection.send_queued = true;
+        Worker& worker = *workers_[connection.worker];
+        {
+            std::lock_guard<std::mutex> queue_lock(worker.mutex);
+            worker.send_queue.push_back(connection.id);
+        }
+        if (current_worker != &worker) {
+            wake(worker.wake_fd);
+        }
+        return;
+    }
+    // Output already pending is either waiting for the socket or on the
+    // coalesced list
+    if (pending > 0) {
+        return;
+    }
+    if (coalescing_) {
+        coalesced_.push_back(&connection);
+        return;
+    }
+    write_output(connection);
+}
+
+// With output_mutex held
+void GatewayServer::write_output(Connection& connection) {
+    ssize_t sent = send(connection.fd, connection.output.data(), connection.output.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent > 0) {
+        connection.output.consume(sent);
+    }
+    if (!connection.output.empty()) {
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        event.data.ptr = &connection;
+        epoll_ctl(workers_[connection.worker]->epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+    }
+}
+
+// Everything a pass over the exchange produced goes out with one send per
+// connection. Still under exchange_mutex_, so every connection listed is open.
+void GatewayServer::flush_coalesced() {
+    coalescing_ = false;
+    for (Connection* connection : coalesced_) {
+        std::lock_guard<std::mutex> lock(connection->output_mutex);
+        if (!connection->output.empty()) {
+            write_output(*connection);
+        }
+    }
+    coalesced_.clear();
+}
+
+// With output_mutex held. The connection's backlog is over the high-water
+// mark: it is either cut off, and closed by its worker once the shutdown
+// wakes it, or loses messages until it catches up.
+void GatewayServer::slow_consumer(Connection& connection) {
+    Gateway* gateway = connection.kind == ListenerKind::Gateway ? gateways_[connection.gateway].get() : nullptr;
+    if (gateway) {
+        gateway->messages_dropped++;
+    }
+    if (config_.slow_consumer_policy == SlowConsumerPolicy::Disconnect) {
+        if (!connection.dropping) {
+            connection.dropping = true;
+            std::cout << "Connection " << connection.id << ": " << connection.output.size() + connection.sending.size()
+                      << " bytes not taken, disconnecting slow consumer" << std::endl;
+            if (gateway) {
+                gateway->slow_disconnects++;
+            }
+            shutdown(connection.fd, SHUT_RDWR);
+        }
+        return;
+    }
+    if (!connection.dropping) {
+        connection.dropping = true;
+        std::cout << "Connection " << connection.id << ": " << connection.output.size() + connection.sending.size()
+                  << " bytes not taken, dropping messages" << std::endl;
+    }
+}
+
+bool GatewayServer::uring_available() const {
+    IoUring probe;
+    return probe.init(8) == 0 && probe.init_buffers(0, 1, 4096) == 0;
+}
+
+bool GatewayServer::init_worker_ring(Worker& worker) {
+    unsigned buffers = 1;
+    while (buffers < config_.uring_buffers && buffers < 32768) {
+        buffers <<= 1;
+    }
+    worker.ring.reset(new IoUring());
+    int error = worker.ring->init(config_.uring_entries);
+    if (error == 0) {
+        error = worker.ring->init_buffers(0, buffers, config_.uring_buffer_size);
+    }
+    if (error != 0) {
+        std::cout << "Gateway server: cannot create worker io_uring instance: " << strerror(-error) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void GatewayServer::uring_accept_loop() {
+    IoUring& ring = *accept_ring_;
+    for (size_t i = 0; i < listeners_.size(); i++) {
+        ring.prep_accept_multishot(listeners_[i].fd, SOCK_NONBLOCK | SOCK_CLOEXEC, i);
+    }
+    ring.prep_read(accept_wake_fd_, &accept_wake_value_, sizeof(accept_wake_value_), WAKE_EVENT);
+    while (running_) {
+        ring.submit(1);
+        ring.drain([&](const io_uring_cqe& cqe) {
+            if (cqe.user_data == WAKE_EVENT) {
+                ring.prep_read(accept_wake_fd_, &accept_wake_value_, sizeof(accept_wake_value_), WAKE_EVENT);
+                return;
+            }
+            const Listener& listener = listeners_[cqe.user_data];
+            if (cqe.res >= 0 && running_) {
+                add_connection(listener, cqe.res);
+            } else if (cqe.res >= 0) {
+                close(cqe.res);
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE) && running_) {
+                ring.prep_accept_multishot(listener.fd, SOCK_NONBLOCK | SOCK_CLOEXEC, cqe.user_data);
+            }
+        });
+    }
+}
+
+// Completions are handled in one pass, then the receives for new connections
+// and every send they produced go into the submission queue, and the next
+// wait submits them all at once
+void GatewayServer::uring_worker_loop(Worker& worker) {
+    current_worker = &worker;
+    IoUring& ring = *worker.ring;
+    bool runs_timers = &worker == workers_.front().get();
+    ring.prep_read(worker.wake_fd, &worker.wake_value, sizeof(worker.wake_value), WAKE_EVENT);
+    if (runs_timers) {
+        worker.timer_interval.tv_sec = config_.timer_poll_ms / 1000;
+        worker.timer_interval.tv_nsec = static_cast<long long>(config_.timer_poll_ms % 1000) * 1000000;
+        ring.prep_timeout(&worker.timer_interval, TIMER_EVENT);
+    }
+    while (running_) {
+        // Busy-polling, this only enters the kernel when there is something
+        // to submit
+        ring.submit(config_.busy_poll ? 0 : 1);
+        ring.drain([&](const io_uring_cqe& cqe) {
+            uring_complete(worker, cqe);
+        });
+        if (next_pass(worker) && runs_timers) {
+            std::lock_guard<std::mutex> lock(exchange_mutex_);
+            exchange_.poll_timers(config_.timers_per_poll);
+        }
+        uring_start_queued(worker);
+    }
+    current_worker = nullptr;
+}
+
+void GatewayServer::uring_complete(Worker& worker, const io_uring_cqe& cqe) {
+    IoUring& ring = *worker.ring;
+    if (cqe.user_data == WAKE_EVENT) {
+        ring.prep_read(worker.wake_fd, &worker.wake_value, sizeof(worker.wake_value), WAKE_EVENT);
+        return;
+    }
+    if (cqe.user_data == TIMER_EVENT) {
+        ring.prep_timeout(&worker.timer_interval, TIMER_EVENT);
+        return;
+    }
+    uint64_t op = cqe.user_data & OP_MASK;
+    if (op == OP_CANCEL) {
+        return;
+    }
+    Connection& connection = *reinterpret_cast<Connection*>(cqe.user_data & ~OP_MASK);
+
+    if (op == OP_RECEIVE) {
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (!more) {
+            connection.pending_ops--;
+        }
+        if (cqe.res > 0) {
+            uint16_t buffer = IoUring::buffer_id(cqe);
+            if (!connection.closing) {
+                handle_input(worker, connection, ring.buffer(buffer), static_cast<size_t>(cqe.res));
+            }
+            ring.recycle_buffer(buffer);
+        } else if (cqe.res != -ENOBUFS) {
+            close_connection(worker, connection);
+        }
+        // The kernel ends a multishot receive when it runs out of buffers;
+        // the ones just recycled let it start again
+        if (!more && !connection.closing) {
+            ring.prep_recv_multishot(connection.fd, reinterpret_cast<uint64_t>(&connection) | OP_RECEIVE);
+            connection.pending_ops++;
+        }
+    } else if (op == OP_SEND) {
+        connection.pending_ops--;
+        uring_send_done(worker, connection, cqe.res);
+    }
+
+    if (connection.closing && connection.pending_ops == 0) {
+        release_connection(worker, connection);
+    }
+}
+
+// Start receiving on connections the accept thread has handed over, and send
+// what other threads and this pass have queued
+void GatewayServer::uring_start_queued(Worker& worker) {
+    std::vector<Connection*> receivers;
+    std::vector<Connection*> senders;
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        for (FakeNSEExchange::ConnectionId id : worker.receive_queue) {
+            auto it = worker.connections.find(id);
+            if (it != worker.connections.end()) {
+                receivers.push_back(it->second.get());
+            }
+        }
+        for (FakeNSEExchange::ConnectionId id : worker.send_queue) {
+            auto it = worker.connections.find(id);
+            if (it != worker.connections.end()) {
+                senders.push_back(it->second.get());
+            }
+        }
+        worker.receive_queue.clear();
+        worker.send_queue.clear();
+    }
+    for (Connection* connection : receivers) {
+        if (!connection->closing) {
+            worker.ring->prep_recv_multishot(connection->fd, reinterpret_cast<uint64_t>(connection) | OP_RECEIVE);
+            connection->pending_ops++;
+        }
+    }
+    for (Connection* connection : senders) {
+        std::lock_guard<std::mutex> lock(connection->output_mutex);
+        connection->send_queued = false;
+        uring_send(worker, *connection);
+    }
+}
+
+// With output_mutex held. The pending output becomes the in-flight buffer,
+// so sends never copy and later packets collect in output meanwhile.
+void GatewayServer::uring_send(Worker& worker, Connection& connection) {
+    if (connection.send_in_flight || connection.closing || connection.output.empty()) {
+        return;
+    }
+    connection.sending.swap(connection.output);
+    connection.send_in_flight = true;
+    worker.ring->prep_send(connection.fd, connection.sending.data(), connection.sending.size(), MSG_NOSIGNAL,
+                           reinterpret_cast<uint64_t>(&connection) | OP_SEND);
+    connection.pending_ops++;
+}
+
+void GatewayServer::uring_send_done(Worker& worker, Connection& connection, int result) {
+    bool failed = false;
+    {
+        std::lock_guard<std::mutex> lock(connection.output_mutex);
+        if (result < 0 || connection.closing) {
+            failed = result < 0;
+            connection.send_in_flight = false;
+            connection.sending.clear();
+        } else if (static_cast<size_t>(result) < connection.sending.size()) {
+            // Short send: the rest goes out before anything queued after it
+            connection.sending.consume(static_cast<size_t>(result));
+            worker.ring->prep_send(connection.fd, connection.sending.data(), connection.sending.size(), MSG_NOSIGNAL,
+                                   reinterpret_cast<uint64_t>(&connection) | OP_SEND);
+            connection.pending_ops++;
+        } else {
+            connection.sending.clear();
+            connection.send_in_flight = false;
+            uring_send(worker, connection);
+        }
+    }
+    if (failed) {
+        close_connection(worker, connection);
+    }
+}
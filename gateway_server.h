@@ -0,0 +1,294 @@
+#pragma once
+
+#include "fake_exchange.h"
+#include "hot_thread.h"
+#include "io_uring_ring.h"
+#include "nnf_packet.h"
+#include "output_buffer.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// TCP front end for the exchange. Boxes first connect to the gateway router
+// listener, which directs each one to the gateway listener with the fewest
+// sessions; they then sign on there. Accepted connections are spread over a
+// pool of worker threads, each running its own epoll loop, again by fewest
+// sessions. Every message travels in an NNF packet, framed per connection.
+//
+// The exchange is single-threaded, so workers take turns at it under one
+// lock. Socket I/O, framing and checksums run outside the lock. Whatever
+// one turn produces for a connection, a whole kill switch's cancellations
+// say, goes out in one write. A connection that stops reading is cut off or
+// loses messages once its backlog passes the high-water mark.
+//
+// Two event loop backends behave the same on the wire. Epoll reads and writes
+// each socket as it becomes ready. io_uring keeps a multishot accept on every
+// listener and a multishot receive on every connection, drawing from a ring
+// of buffers each worker registers, and queues the responses produced while
+// handling one batch of completions so they are submitted together with the
+// next wait: one system call per loop turn instead of one or more per
+// message. If io_uring is unavailable the server falls back to epoll.
+//
+// Requests answered with a stream of messages (local database updates,
+// message and portfolio downloads) are not handled in line: they are queued
+// for background bulk threads, a session's always to the same one so they
+// stay in order. Bulk threads take the exchange only while no worker is
+// waiting for it, so orders, modifications and cancellations never queue
+// behind a download; the download's messages are written to the session as
+// each request is handled.
+enum class GatewayBackend : uint8_t {
+    Epoll = 0,
+    IoUring = 1
+};
+
+// What happens to a connection whose unsent output passes the high-water
+// mark: it is disconnected, or messages for it are dropped until it drains
+enum class SlowConsumerPolicy : uint8_t {
+    Disconnect = 0,
+    Drop = 1
+};
+
+struct GatewayServerConfig {
+    std::string bind_ip = "127.0.0.1";
+    std::string advertised_ip = "127.0.0.1";   // gateway address handed out by the router
+    uint16_t router_port = 10000;
+    std::vector<uint16_t> gateway_ports = {10001, 10002};
+    size_t worker_threads = 2;
+    NnfPacketCodec::ErrorPolicy packet_error_policy = NnfPacketCodec::ErrorPolicy::Reject;
+    // The first worker also runs the exchange's timers (heartbeats, idle
+    // timeouts, feeds), waking at least every timer_poll_ms and firing at
+    // most timers_per_poll per pass so a burst of due timers is spread out
+    int timer_poll_ms = 1;
+    size_t timers_per_poll = 64;
+    // Hand out AES-256-GCM keys with GR responses and seal every session
+    // after box sign-on
+    bool session_encryption = false;
+    // Unsent bytes a connection may hold before it counts as a slow
+    // consumer; 0 for no limit
+    size_t output_high_water = 4 * 1024 * 1024;
+    SlowConsumerPolicy slow_consumer_policy = SlowConsumerPolicy::Disconnect;
+    GatewayBackend backend = GatewayBackend::Epoll;
+    // io_uring backend: submission queue depth, and the receive buffers each
+    // worker registers (the count is rounded up to a power of two)
+    unsigned uring_entries = 1024;
+    unsigned uring_buffers = 256;
+    size_t uring_buffer_size = 16 * 1024;
+    // Background threads for bulk requests, 0 to handle them in line, and
+    // the requests each may have queued. A request finding its queue full is
+    // handled in line.
+    size_t bulk_threads = 1;
+    size_t bulk_queue_limit = 256;
+    // Latency benchmark run mode. Workers never sleep: epoll is polled
+    // without a timeout and io_uring completions are reaped without entering
+    // the kernel, the timers still running every timer_poll_ms, and each
+    // worker records the gaps between its passes. Pinning works in either
+    // mode: worker i runs on worker_cpus[i] if listed, and likewise for the
+    // bulk threads; -1 or a short list leaves a thread unpinned. lock_memory
+    // locks and pre-faults the whole process's memory for its lifetime.
+    bool busy_poll = false;
+    std::vector<int> worker_cpus;
+    std::vector<int> bulk_cpus;
+    int accept_cpu = -1;
+    bool lock_memory = false;
+};
+
+class GatewayServer {
+public:
+    struct GatewayLoad {
+        uint16_t port;
+        size_t sessions;
+        uint64_t messages_in;
+        uint64_t messages_out;
+        uint64_t messages_dropped;   // over the high-water mark
+        uint64_t slow_disconnects;
+    };
+
+    struct WorkerLoad {
+        size_t sessions;
+        uint64_t messages_in;
+        LoopJitter::Summary jitter;  // busy-poll mode
+    };
+
+    struct BulkLoad {
+        size_t queued;
+        uint64_t handled;
+        uint64_t overflowed;   // handled in line, the queue being full
+    };
+
+    GatewayServer(FakeNSEExchange& exchange, const GatewayServerConfig& config);
+    ~GatewayServer();
+
+    // Bind every listener, hook the gateways into the exchange's router and
+    // start the threads. Returns false if a listener cannot be set up.
+    bool start();
+    void stop();
+
+    // The backend actually running, after any fallback
+    GatewayBackend backend() const { return backend_; }
+
+    std::vector<GatewayLoad> gateway_loads() const;
+    std::vector<WorkerLoad> worker_loads() const;
+    std::vector<BulkLoad> bulk_loads() const;
+
+    // Run fn(exchange) under the lock the workers use
+    template <typename Fn>
+    auto with_exchange(Fn&& fn) {
+        std::lock_guard<std::mutex> lock(exchange_mutex_);
+        return fn(exchange_);
+    }
+
+private:
+    enum class ListenerKind : uint8_t {
+        Router = 0,
+        Gateway = 1
+    };
+
+    struct Listener {
+        int fd = -1;
+        ListenerKind kind;
+        size_t gateway;  // index into gateways_, for gateway listeners
+        uint16_t port;
+    };
+
+    struct Gateway {
+        uint16_t port;
+        std::atomic<size_t> sessions{0};
+        std::atomic<size_t> routed{0};  // boxes sent here that have not connected yet
+        std::atomic<uint64_t> messages_in{0};
+        std::atomic<uint64_t> messages_out{0};
+        std::atomic<uint64_t> messages_dropped{0};
+        std::atomic<uint64_t> slow_disconnects{0};
+    };
+
+    struct Connection {
+        FakeNSEExchange::ConnectionId id;
+        int fd;
+        ListenerKind kind;
+        size_t gateway;
+        size_t worker;
+        NnfPacketCodec inbound;   // owning worker only
+        std::vector<uint8_t> input;
+        std::vector<NnfPacketCodec::Frame> frames;
+        std::mutex output_mutex;  // guards outbound, output and dropping
+        NnfPacketCodec outbound;
+        OutputBuffer output;  // packets the socket has not taken yet
+        bool dropping = false;    // over the high-water mark
+        bool closing = false;
+
+        // io_uring backend. The flags are under output_mutex; the rest belongs
+        // to the owning worker.
+        bool send_queued = false;     // on the worker's send queue
+        bool send_in_flight = false;
+        OutputBuffer sending;  // handed to the kernel by the send in flight
+        unsigned pending_ops = 0;     // submissions still owed a final completion
+    };
+
+    struct Worker {
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::thread thread;
+        std::mutex mutex;  // guards connections
+        std::unordered_map<FakeNSEExchange::ConnectionId, std::shared_ptr<Connection>> connections;
+        std::atomic<size_t> sessions{0};
+        std::atomic<uint64_t> messages_in{0};
+        LoopJitter jitter;
+        uint64_t next_timer_poll = 0;  // busy-poll mode, in monotonic_ns()
+
+        // io_uring backend
+        std::unique_ptr<IoUring> ring;
+        std::vector<FakeNSEExchange::ConnectionId> receive_queue;  // under mutex: new connections
+        std::vector<FakeNSEExchange::ConnectionId> send_queue;     // under mutex: connections with output
+        uint64_t wake_value = 0;
+        __kernel_timespec timer_interval;
+    };
+
+    struct BulkRequest {
+        FakeNSEExchange::ConnectionId connection;
+        std::vector<uint8_t> message;
+    };
+
+    struct BulkLane {
+        std::thread thread;
+        std::mutex mutex;  // guards queue
+        std::condition_variable ready;
+        std::deque<BulkRequest> queue;
+        std::atomic<uint64_t> handled{0};
+        std::atomic<uint64_t> overflowed{0};
+    };
+
+    FakeNSEExchange& exchange_;
+    GatewayServerConfig config_;
+    GatewayBackend backend_ = GatewayBackend::Epoll;
+    std::atomic<bool> running_{false};
+
+    // Held around every exchange call. Also guards connections_, which the
+    // exchange's connection callback reads.
+    std::mutex exchange_mutex_;
+    std::unordered_map<FakeNSEExchange::ConnectionId, Connection*> connections_;
+
+    // Workers about to take exchange_mutex_, for bulk threads to give way to
+    std::atomic<unsigned> priority_waiters_{0};
+
+    // While a worker has the exchange, epoll connections given output are
+    // listed here instead of written to, and written once when it is done.
+    // Under exchange_mutex_.
+    bool coalescing_ = false;
+    std::vector<Connection*> coalesced_;
+
+    std::vector<Listener> listeners_;
+    std::vector<std::unique_ptr<Gateway>> gateways_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::unique_ptr<BulkLane>> bulk_lanes_;
+    int accept_epoll_fd_ = -1;
+    int accept_wake_fd_ = -1;
+    std::unique_ptr<IoUring> accept_ring_;
+    uint64_t accept_wake_value_ = 0;
+    std::thread accept_thread_;
+    std::atomic<FakeNSEExchange::ConnectionId> next_connection_id_{1};
+
+    bool open_listener(uint16_t port, ListenerKind kind, size_t gateway);
+    void accept_loop();
+    void accept_connections(const Listener& listener);
+    void add_connection(const Listener& listener, int fd);
+    void worker_loop(Worker& worker);
+    bool next_pass(Worker& worker);
+    void read_connection(Worker& worker, Connection& connection);
+    void handle_input(Worker& worker, Connection& connection, uint8_t* chunk, size_t received);
+    void flush_connection(Worker& worker, Connection& connection);
+    void close_connection(Worker& worker, Connection& connection);
+    bool queue_bulk(Connection& connection, const NnfPacketCodec::Frame& frame);
+    void bulk_loop(BulkLane& lane);
+    std::unique_lock<std::mutex> lock_for_bulk();
+
+    // io_uring backend
+    bool uring_available() const;
+    bool init_worker_ring(Worker& worker);
+    void uring_accept_loop();
+    void uring_worker_loop(Worker& worker);
+    void uring_complete(Worker& worker, const io_uring_cqe& cqe);
+    void uring_start_queued(Worker& worker);
+    void uring_send(Worker& worker, Connection& connection);
+    void uring_send_done(Worker& worker, Connection& connection, int result);
+    void release_connection(Worker& worker, Connection& connection);
+    bool open_frame(Connection& connection, uint8_t* data, NnfPacketCodec::Frame& frame);
+
+    // Called by the exchange, under exchange_mutex_
+    bool select_gateway(int16_t box_id, GatewayEndpoint& endpoint);
+    void disconnect(FakeNSEExchange::ConnectionId connection_id);
+    void encrypt_session(FakeNSEExchange::ConnectionId connection_id, const uint8_t* key, const uint8_t* iv);
+    void deliver(FakeNSEExchange::ConnectionId connection_id, const uint8_t* message, size_t length);
+    void write_message(FakeNSEExchange::ConnectionId connection_id, size_t length, FakeNSEExchange::MessageFill fill,
+                       const void* context);
+    void send_packet(Connection& connection, const uint8_t* message, size_t length);
+    void send_packet(Connection& connection, size_t length, FakeNSEExchange::MessageFill fill, const void* context);
+    void write_output(Connection& connection);
+    void flush_coalesced();
+    void slow_consumer(Connection& connection);
+};
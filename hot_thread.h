@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Helpers for the busy-poll run mode used in latency benchmarks: front end
+// threads pinned to their own cores that never sleep, in a process whose
+// memory is locked, and a record of how evenly each loop actually turns.
+
+inline uint64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + static_cast<uint64_t>(now.tv_nsec);
+}
+
+// Pin the calling thread to one core. Returns 0 or an errno.
+inline int pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Lock every page the process has and will map, faulting each in as it is
+// mapped, so that a hot thread never takes a page fault. With a finite lock
+// limit that the process cannot exceed this is refused (EPERM) rather than
+// risking that later allocations fail. Returns 0 or an errno.
+inline int lock_process_memory() {
+    rlimit limit;
+    if (geteuid() != 0 && getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        return EPERM;
+    }
+    return mlockall(MCL_CURRENT | MCL_FUTURE) == 0 ? 0 : errno;
+}
+
+// Gaps between successive passes of one polling loop, in power-of-two
+// nanosecond buckets. A loop that never sleeps turns every few hundred
+// nanoseconds; anything far above that is the thread being preempted,
+// faulting or held up at a lock. Written by the loop's thread only, read by
+// any.
+class LoopJitter {
+public:
+    struct Summary {
+        uint64_t passes;
+        // Upper bounds of the buckets holding these quantiles
+        uint64_t p50_ns;
+        uint64_t p99_ns;
+        uint64_t p999_ns;
+        uint64_t max_ns;
+    };
+
+    void pass(uint64_t now_ns) {
+        if (last_ != 0 && now_ns >= last_) {
+            uint64_t gap = now_ns - last_;
+            std::atomic<uint64_t>& bucket = buckets_[bucket_of(gap)];
+            bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (gap > max_.load(std::memory_order_relaxed)) {
+                max_.store(gap, std::memory_order_relaxed);
+            }
+        }
+        last_ = now_ns;
+    }
+
+    Summary summary() const {
+        uint64_t counts[BUCKETS];
+        uint64_t passes = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            counts[i] = buckets_[i].load(std::memory_order_relaxed);
+            passes += counts[i];
+        }
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        return {passes, quantile(counts, passes, 500, max), quantile(counts, passes, 990, max),
+                quantile(counts, passes, 999, max), max};
+    }
+
+private:
+    static constexpr size_t BUCKETS = 64;
+
+    // Bucket i holds gaps below 2^i ns and at least 2^(i-1)
+    static size_t bucket_of(uint64_t gap) {
+        size_t bucket = gap == 0 ? 0 : 64 - __builtin_clzll(gap);
+        return bucket < BUCKETS ? bucket : BUCKETS - 1;
+    }
+
+    static uint64_t quantile(const uint64_t* counts, uint64_t passes, uint64_t per_mille, uint64_t max) {
+        if (passes == 0) {
+            return 0;
+        }
+        uint64_t rank = (passes * per_mille + 999) / 1000;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                uint64_t bound = i + 1 < BUCKETS ? 1ULL << i : UINT64_MAX;
+                return bound < max ? bound : max;
+            }
+        }
+        return max;
+    }
+
+    std::atomic<uint64_t> buckets_[BUCKETS] = {};
+    std::atomic<uint64_t> max_{0};
+    uint64_t last_ = 0;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "flat_hash.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Free-float market capitalisation weighted indices, kept current from
+// constituent trades. Each constituent contributes weight * free_float * price
+// to the market capitalisation of every index it belongs to; the index value
+// is that capitalisation over the index divisor. A trade only applies its
+// price change to the indices the token is in, so an update costs one term
+// per membership regardless of index size.
+//
+// Values are in hundredths, like prices (22000.00 is 2200000).
+class IndexEngine {
+public:
+    enum class Kind : uint8_t {
+        Market = 0,    // broadcast in MS_BCAST_INDICES
+        Industry = 1,  // broadcast in MS_BCAST_INDUSTRY_INDICES
+        Sector = 2     // reported under its industry at end of day
+    };
+
+    struct Index {
+        std::string name;
+        std::string industry;  // sector indices only
+        Kind kind;
+        double market_cap = 0.0;
+        double divisor = 0.0;
+        int32_t value = 0;
+        int32_t open = 0;
+        int32_t high = 0;
+        int32_t low = 0;
+        int32_t previous_close = 0;
+        int32_t up_moves = 0;
+        int32_t down_moves = 0;
+        bool traded = false;
+        bool dirty = false;
+    };
+
+    // New index starting at base_value (also taken as the previous close)
+    uint32_t add_index(const std::string& name, Kind kind, int32_t base_value, const std::string& industry = "") {
+        Index index;
+        index.name = name;
+        index.industry = industry;
+        index.kind = kind;
+        index.value = base_value;
+        index.open = base_value;
+        index.high = base_value;
+        index.low = base_value;
+        index.previous_close = base_value;
+        indices_.push_back(index);
+        return static_cast<uint32_t>(indices_.size() - 1);
+    }
+
+    // Add a constituent at its current price. The divisor is adjusted so the
+    // index value does not jump, as for a real index rebalance.
+    bool add_constituent(uint32_t index_id, int32_t token, double weight, double free_float, int32_t price) {
+        if (index_id >= indices_.size() || price <= 0) {
+            return false;
+        }
+        uint32_t slot = constituent_slot(token, price);
+        double factor = weight * free_float;
+        memberships_[slot].push_back({index_id, factor});
+
+        Index& index = indices_[index_id];
+        index.market_cap += factor * static_cast<double>(last_prices_[slot]);
+        index.divisor = index.market_cap / static_cast<double>(std::max(index.value, 1));
+        return true;
+    }
+
+    // Apply a constituent trade. Returns false if the token is in no index.
+    bool on_trade(int32_t token, int32_t price) {
+        const uint32_t* slot = slot_of_.find(static_cast<uint32_t>(token));
+        if (!slot) {
+            return false;
+        }
+        int64_t delta = static_cast<int64_t>(price) - last_prices_[*slot];
+        last_prices_[*slot] = price;
+        if (delta == 0) {
+            return true;
+        }
+        for (const Membership& membership : memberships_[*slot]) {
+            Index& index = indices_[membership.index_id];
+            index.market_cap += membership.factor * static_cast<double>(delta);
+            update_value(index);
+        }
+        return true;
+    }
+
+    // Start the next day: each index closes at its current value, which is
+    // also where it opens until the first constituent trade moves it
+    void roll_day() {
+        for (Index& index : indices_) {
+            index.previous_close = index.value;
+            index.open = index.value;
+            index.high = index.value;
+            index.low = index.value;
+            index.up_moves = 0;
+            index.down_moves = 0;
+            index.traded = false;
+            index.dirty = false;
+        }
+    }
+
+    const std::vector<Index>& indices() const { return indices_; }
+    std::vector<Index>& indices() { return indices_; }
+
+    // Percentage change from the previous close, in hundredths of a percent
+    static int32_t percent_change(const Index& index) {
+        if (index.previous_close == 0) {
+            return 0;
+        }
+        return static_cast<int32_t>(std::llround(
+            (static_cast<double>(index.value) - index.previous_close) * 10000.0 / index.previous_close));
+    }
+
+private:
+    struct Membership {
+        uint32_t index_id;
+        double factor;
+    };
+
+    std::vector<Index> indices_;
+    FlatHashMap64<uint32_t> slot_of_;
+    std::vector<int32_t> last_prices_;
+    std::vector<std::vector<Membership>> memberships_;
+
+    uint32_t constituent_slot(int32_t token, int32_t price) {
+        const uint32_t* found = slot_of_.find(static_cast<uint32_t>(token));
+        if (found) {
+            return *found;
+        }
+        uint32_t slot = static_cast<uint32_t>(last_prices_.size());
+        slot_of_[static_cast<uint32_t>(token)] = slot;
+        last_prices_.push_back(price);
+        memberships_.emplace_back();
+        return slot;
+    }
+
+    static void update_value(Index& index) {
+        if (index.divisor <= 0.0) {
+            return;
+        }
+        int32_t value = static_cast<int32_t>(std::llround(index.market_cap / index.divisor));
+        if (value > index.value) {
+            index.up_moves++;
+        } else if (value < index.value) {
+            index.down_moves++;
+        }
+        if (!index.traded) {
+            index.open = value;
+            index.high = value;
+            index.low = value;
+            index.traded = true;
+        }
+        index.value = value;
+        index.high = std::max(index.high, value);
+        index.low = std::min(index.low, value);
+        index.dirty = true;
+    }
+};
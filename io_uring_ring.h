@@ -0,0 +1,283 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Minimal io_uring ring over the raw system calls: one submission and one
+// completion queue, plus an optional provided buffer ring that multishot
+// receives pick their buffers from. The ring is not thread-safe; one thread
+// submits and reaps.
+class IoUring {
+public:
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+        if (sq_ring_ != MAP_FAILED) {
+            munmap(sq_ring_, sq_ring_size_);
+        }
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqes_size_);
+        }
+        if (buffer_ring_ != MAP_FAILED) {
+            munmap(buffer_ring_, buffer_ring_size_);
+        }
+        if (buffers_ != MAP_FAILED) {
+            munmap(buffers_, buffers_size_);
+        }
+    }
+
+    // Returns 0, or the negated errno of the call that failed
+    int init(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        // Multishot operations can post many completions per submission
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) {
+            return -errno;
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = sq_ring_size_ > cq_ring_size_ ? sq_ring_size_ : cq_ring_size_;
+        }
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            return -errno;
+        }
+        cq_ring_ = single_mmap ? sq_ring_
+                               : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) {
+            return -errno;
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) {
+            return -errno;
+        }
+
+        uint8_t* sq = static_cast<uint8_t*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries_; i++) {
+            array[i] = i;
+        }
+        sq_local_tail_ = *sq_tail_;
+
+        uint8_t* cq = static_cast<uint8_t*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return 0;
+    }
+
+    // Register count buffers of size bytes each as buffer group group; count
+    // must be a power of two. Returns 0 or a negated errno.
+    int init_buffers(uint16_t group, unsigned count, size_t size) {
+        buffer_group_ = group;
+        buffer_count_ = count;
+        buffer_size_ = size;
+        buffer_ring_size_ = count * sizeof(io_uring_buf);
+        buffer_ring_ = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (buffer_ring_ == MAP_FAILED) {
+            return -errno;
+        }
+        buffers_size_ = count * size;
+        buffers_ = mmap(nullptr, buffers_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (buffers_ == MAP_FAILED) {
+            return -errno;
+        }
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            return -errno;
+        }
+        for (unsigned i = 0; i < count; i++) {
+            stage_buffer(static_cast<uint16_t>(i), i);
+        }
+        publish_buffers(count);
+        return 0;
+    }
+
+    uint8_t* buffer(uint16_t id) { return static_cast<uint8_t*>(buffers_) + id * buffer_size_; }
+
+    // Hand a buffer back to the kernel once its data has been used
+    void recycle_buffer(uint16_t id) {
+        stage_buffer(id, 0);
+        publish_buffers(1);
+    }
+
+    // Next free submission entry, cleared. Submits what is queued if the
+    // queue is full.
+    io_uring_sqe* get_sqe() {
+        if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            submit(0);
+        }
+        io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + (sq_local_tail_ & sq_mask_);
+        sq_local_tail_++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Submit everything queued in one call, waiting for at least wait_for
+    // completions. Returns the number submitted or a negated errno.
+    int submit(unsigned wait_for) {
+        unsigned pending = sq_local_tail_ - *sq_tail_;
+        if (pending == 0 && wait_for == 0) {
+            return 0;
+        }
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+        for (;;) {
+            long submitted = syscall(__NR_io_uring_enter, fd_, pending, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (submitted >= 0) {
+                return static_cast<int>(submitted);
+            }
+            if (errno != EINTR) {
+                return -errno;
+            }
+            // Entries already taken by the kernel are not resubmitted
+            pending = 0;
+        }
+    }
+
+    // Call fn(cqe) for every completion posted so far. Returns the count.
+    template <typename Fn>
+    unsigned drain(Fn&& fn) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned seen = 0;
+        for (; head != tail; head++, seen++) {
+            fn(cqes_[head & cq_mask_]);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return seen;
+    }
+
+    void prep_accept_multishot(int fd, int flags, uint64_t user_data) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = static_cast<uint32_t>(flags);
+        sqe->user_data = user_data;
+    }
+
+    // Receives into buffers from the provided buffer ring until cancelled,
+    // out of buffers, or the peer is gone
+    void prep_recv_multishot(int fd, uint64_t user_data) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffer_group_;
+        sqe->user_data = user_data;
+    }
+
+    void prep_send(int fd, const void* data, size_t length, int flags, uint64_t user_data) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<uint32_t>(length);
+        sqe->msg_flags = static_cast<uint32_t>(flags);
+        sqe->user_data = user_data;
+    }
+
+    void prep_read(int fd, void* data, size_t length, uint64_t user_data) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<uint32_t>(length);
+        sqe->user_data = user_data;
+    }
+
+    // timeout must stay valid until the completion arrives
+    void prep_timeout(const __kernel_timespec* timeout, uint64_t user_data) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(timeout);
+        sqe->len = 1;
+        sqe->user_data = user_data;
+    }
+
+    void prep_cancel(uint64_t target, uint64_t user_data) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = user_data;
+    }
+
+    static uint16_t buffer_id(const io_uring_cqe& cqe) { return static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT); }
+
+private:
+    int fd_ = -1;
+    void* sq_ring_ = MAP_FAILED;
+    void* cq_ring_ = MAP_FAILED;
+    void* sqes_ = MAP_FAILED;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sq_local_tail_ = 0;  // entries queued but not yet published
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+
+    void* buffer_ring_ = MAP_FAILED;
+    void* buffers_ = MAP_FAILED;
+    size_t buffer_ring_size_ = 0;
+    size_t buffers_size_ = 0;
+    uint16_t buffer_group_ = 0;
+    unsigned buffer_count_ = 0;
+    size_t buffer_size_ = 0;
+
+    // The ring is an array of io_uring_buf whose first entry overlays the
+    // tail. Entries are indexed from the mapping itself: in C++ the header's
+    // flexible array member sits past an empty struct, at the wrong offset.
+    void stage_buffer(uint16_t id, unsigned offset) {
+        io_uring_buf_ring* ring = static_cast<io_uring_buf_ring*>(buffer_ring_);
+        io_uring_buf* entries = static_cast<io_uring_buf*>(buffer_ring_);
+        io_uring_buf& entry = entries[(ring->tail + offset) & (buffer_count_ - 1)];
+        entry.addr = reinterpret_cast<uint64_t>(buffer(id));
+        entry.len = static_cast<uint32_t>(buffer_size_);
+        entry.bid = id;
+    }
+
+    void publish_buffers(unsigned count) {
+        io_uring_buf_ring* ring = static_cast<io_uring_buf_ring*>(buffer_ring_);
+        __atomic_store_n(&ring->tail, static_cast<uint16_t>(ring->tail + count), __ATOMIC_RELEASE);
+    }
+};
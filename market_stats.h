@@ -0,0 +1,237 @@
+#pragma once
+
+#include "nse_structs.h"
+#include "flat_hash.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Day statistics per token, one array per field. Each token gets a dense slot
+// the first time it is seen; trades update their slot in O(1) and reports walk
+// the arrays in slot order without any per-record lookups.
+struct MarketStatsTable {
+    std::vector<int32_t> tokens;
+    std::vector<CONTRACT_DESC> contracts;
+    std::vector<int32_t> open_price;
+    std::vector<int32_t> high_price;
+    std::vector<int32_t> low_price;
+    std::vector<int32_t> close_price;       // last traded price
+    std::vector<uint64_t> last_trade_time;
+    std::vector<int32_t> previous_close;
+    std::vector<uint32_t> quantity_traded;
+    std::vector<double> value_traded;
+    std::vector<int64_t> open_interest;
+    std::vector<int64_t> day_start_open_interest;
+    std::vector<int64_t> day_high_open_interest;
+    std::vector<int64_t> day_low_open_interest;
+
+    // Slot for the token, allocated with its contract on first use
+    uint32_t slot(int32_t token, const CONTRACT_DESC& contract) {
+        uint64_t key = static_cast<uint32_t>(token);
+        const uint32_t* found = slot_of_.find(key);
+        if (found) {
+            return *found;
+        }
+        uint32_t index = static_cast<uint32_t>(tokens.size());
+        slot_of_[key] = index;
+        tokens.push_back(token);
+        contracts.push_back(contract);
+        open_price.push_back(0);
+        high_price.push_back(0);
+        low_price.push_back(0);
+        close_price.push_back(0);
+        last_trade_time.push_back(0);
+        previous_close.push_back(0);
+        quantity_traded.push_back(0);
+        value_traded.push_back(0.0);
+        open_interest.push_back(0);
+        day_start_open_interest.push_back(0);
+        day_high_open_interest.push_back(0);
+        day_low_open_interest.push_back(0);
+        return index;
+    }
+
+    const uint32_t* find(int32_t token) const {
+        return slot_of_.find(static_cast<uint32_t>(token));
+    }
+
+    void record_trade(uint32_t index, int32_t price, int32_t quantity, uint64_t ts) {
+        if (quantity_traded[index] == 0) {
+            open_price[index] = price;
+            high_price[index] = price;
+            low_price[index] = price;
+        } else {
+            high_price[index] = std::max(high_price[index], price);
+            low_price[index] = std::min(low_price[index], price);
+        }
+        close_price[index] = price;
+        last_trade_time[index] = ts;
+        quantity_traded[index] += static_cast<uint32_t>(quantity);
+        value_traded[index] += static_cast<double>(price) * quantity;
+    }
+
+    // Open interest carried into the day
+    void set_open_interest(uint32_t index, int64_t value) {
+        open_interest[index] = value;
+        day_start_open_interest[index] = value;
+        day_high_open_interest[index] = value;
+        day_low_open_interest[index] = value;
+    }
+
+    // Both sides opening adds the quantity to open interest and both closing
+    // removes it; one of each only moves existing positions. Fills without a
+    // valid flag on both sides leave it unchanged. Returns the change.
+    int64_t record_open_interest(uint32_t index, char buy_open_close, char sell_open_close, int32_t quantity) {
+        int opens = (buy_open_close == 'O') + (sell_open_close == 'O');
+        int closes = (buy_open_close == 'C') + (sell_open_close == 'C');
+        int64_t change = (opens + closes == 2) ? static_cast<int64_t>((opens - closes) / 2) * quantity : 0;
+        int64_t value = open_interest[index] + change;
+        open_interest[index] = value;
+        day_high_open_interest[index] = std::max(day_high_open_interest[index], value);
+        day_low_open_interest[index] = std::min(day_low_open_interest[index], value);
+        return change;
+    }
+
+    // Start the next day: the last traded price becomes the previous close
+    // (untraded contracts keep theirs), the day's prices and totals go back
+    // to zero and the open interest carried in is the current one
+    void roll_day() {
+        for (size_t index = 0; index < tokens.size(); index++) {
+            if (quantity_traded[index] > 0) {
+                previous_close[index] = close_price[index];
+            }
+            open_price[index] = 0;
+            high_price[index] = 0;
+            low_price[index] = 0;
+            close_price[index] = 0;
+            last_trade_time[index] = 0;
+            quantity_traded[index] = 0;
+            value_traded[index] = 0.0;
+            day_start_open_interest[index] = open_interest[index];
+            day_high_open_interest[index] = open_interest[index];
+            day_low_open_interest[index] = open_interest[index];
+        }
+    }
+
+    // Untraded contracts report the previous close as their closing price
+    void fill_record(uint32_t index, MKT_STATS_DATA& record) const {
+        memset(&record, 0, sizeof(record));
+        record.ContractDesc = contracts[index];
+        record.MarketType = MarketTypes::MARKET_TYPE_NORMAL;
+        record.OpenPrice = open_price[index];
+        record.HighPrice = high_price[index];
+        record.LowPrice = low_price[index];
+        record.ClosingPrice = quantity_traded[index] > 0 ? close_price[index] : previous_close[index];
+        record.TotalQuantityTraded = quantity_traded[index];
+        record.TotalValueTraded = value_traded[index];
+        record.PreviousClosePrice = previous_close[index];
+        record.OpenInterest = static_cast<uint32_t>(open_interest[index]);
+        record.ChgOpenInterest = static_cast<int32_t>(open_interest[index] - day_start_open_interest[index]);
+    }
+
+    void fill_record(uint32_t index, ENHNCD_MKT_STATS_DATA& record) const {
+        memset(&record, 0, sizeof(record));
+        record.ContractDesc = contracts[index];
+        record.MarketType = MarketTypes::MARKET_TYPE_NORMAL;
+        record.OpenPrice = open_price[index];
+        record.HighPrice = high_price[index];
+        record.LowPrice = low_price[index];
+        record.ClosingPrice = quantity_traded[index] > 0 ? close_price[index] : previous_close[index];
+        record.TotalQuantityTraded = quantity_traded[index];
+        record.TotalValueTraded = value_traded[index];
+        record.PreviousClosePrice = previous_close[index];
+        record.OpenInterest = open_interest[index];
+        record.ChgOpenInterest = open_interest[index] - day_start_open_interest[index];
+    }
+
+    size_t size() const { return tokens.size(); }
+
+private:
+    FlatHashMap64<uint32_t> slot_of_;
+};
+
+// Day statistics per spread combination, keyed like the spread books by the
+// packed (Token1, Token2) pair. Prices are price differences.
+struct SpreadStatsTable {
+    std::vector<int32_t> tokens1;
+    std::vector<int32_t> tokens2;
+    std::vector<CONTRACT_DESC> contracts1;
+    std::vector<CONTRACT_DESC> contracts2;
+    std::vector<int32_t> open_diff;
+    std::vector<int32_t> high_diff;
+    std::vector<int32_t> low_diff;
+    std::vector<int32_t> last_diff;
+    std::vector<int32_t> contracts_traded;
+
+    uint32_t slot(uint64_t pair_key, int32_t token1, int32_t token2,
+                  const CONTRACT_DESC& contract1, const CONTRACT_DESC& contract2) {
+        const uint32_t* found = slot_of_.find(pair_key);
+        if (found) {
+            return *found;
+        }
+        uint32_t index = static_cast<uint32_t>(tokens1.size());
+        slot_of_[pair_key] = index;
+        tokens1.push_back(token1);
+        tokens2.push_back(token2);
+        contracts1.push_back(contract1);
+        contracts2.push_back(contract2);
+        open_diff.push_back(0);
+        high_diff.push_back(0);
+        low_diff.push_back(0);
+        last_diff.push_back(0);
+        contracts_traded.push_back(0);
+        return index;
+    }
+
+    void record_trade(uint32_t index, int32_t price_diff, int32_t quantity) {
+        if (contracts_traded[index] == 0) {
+            open_diff[index] = price_diff;
+            high_diff[index] = price_diff;
+            low_diff[index] = price_diff;
+        } else {
+            high_diff[index] = std::max(high_diff[index], price_diff);
+            low_diff[index] = std::min(low_diff[index], price_diff);
+        }
+        last_diff[index] = price_diff;
+        contracts_traded[index] += quantity;
+    }
+
+    // Start the next day with no spread trades
+    void roll_day() {
+        std::fill(open_diff.begin(), open_diff.end(), 0);
+        std::fill(high_diff.begin(), high_diff.end(), 0);
+        std::fill(low_diff.begin(), low_diff.end(), 0);
+        std::fill(last_diff.begin(), last_diff.end(), 0);
+        std::fill(contracts_traded.begin(), contracts_traded.end(), 0);
+    }
+
+    void fill_record(uint32_t index, SPD_STATS_DATA& record) const {
+        memset(&record, 0, sizeof(record));
+        const CONTRACT_DESC& leg1 = contracts1[index];
+        const CONTRACT_DESC& leg2 = contracts2[index];
+        record.MARKETTYPE = MarketTypes::MARKET_TYPE_NORMAL;
+        memcpy(record.INSTRUMENTNAME1, leg1.InstrumentName, sizeof(record.INSTRUMENTNAME1));
+        memcpy(record.SYMBOL1, leg1.Symbol, sizeof(record.SYMBOL1));
+        record.EXPIRYDATE1 = leg1.ExpiryDate;
+        record.STRIKEPRICE1 = leg1.StrikePrice;
+        memcpy(record.OPTIONTYPE1, leg1.OptionType, sizeof(record.OPTIONTYPE1));
+        record.CALEVEL1 = leg1.CALevel;
+        memcpy(record.INSTRUMENTNAME2, leg2.InstrumentName, sizeof(record.INSTRUMENTNAME2));
+        memcpy(record.SYMBOL2, leg2.Symbol, sizeof(record.SYMBOL2));
+        record.EXPIRYDATE2 = leg2.ExpiryDate;
+        record.STRIKEPRICE2 = leg2.StrikePrice;
+        memcpy(record.OPTIONTYPE2, leg2.OptionType, sizeof(record.OPTIONTYPE2));
+        record.CALEVEL2 = leg2.CALevel;
+        record.OPENPD = open_diff[index];
+        record.HIPD = high_diff[index];
+        record.LOWPD = low_diff[index];
+        record.LASTTRADEDPD = last_diff[index];
+        record.NOOFCONTRACTSTRADED = contracts_traded[index];
+    }
+
+    size_t size() const { return tokens1.size(); }
+
+private:
+    FlatHashMap64<uint32_t> slot_of_;
+};
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// MD5 (RFC 1321). md5() hashes one buffer. Md5MultiBuffer hashes many
+// independent buffers together, one per 32-bit SIMD lane: within a message
+// MD5 is a serial chain of 64 dependent steps, but the chains of different
+// messages can run side by side, four to a register. Lanes are refilled as soon as their
+// message is done, so a batch of mixed lengths keeps every lane busy until
+// the batch runs out.
+
+namespace md5_detail {
+
+constexpr uint32_t K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+constexpr int SHIFT[4][4] = {
+    {7, 12, 17, 22},
+    {5, 9, 14, 20},
+    {4, 11, 16, 23},
+    {6, 10, 15, 21}
+};
+
+constexpr uint32_t IV[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+// Message word used by step i
+constexpr int word_index(int i) {
+    return i < 16 ? i : i < 32 ? (5 * i + 1) & 15 : i < 48 ? (3 * i + 5) & 15 : (7 * i) & 15;
+}
+
+inline uint32_t rotl(uint32_t x, int s) {
+    return (x << s) | (x >> (32 - s));
+}
+
+// One 64-byte block into state (little-endian host)
+inline void compress(uint32_t state[4], const uint8_t* block) {
+    uint32_t w[16];
+    memcpy(w, block, sizeof(w));
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+#pragma GCC unroll 64
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        if (i < 16) {
+            f = d ^ (b & (c ^ d));
+        } else if (i < 32) {
+            f = c ^ (d & (b ^ c));
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+        } else {
+            f = c ^ (b | ~d);
+        }
+        f += a + K[i] + w[word_index(i)];
+        a = d;
+        d = c;
+        c = b;
+        b += rotl(f, SHIFT[i >> 4][i & 3]);
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+// Final one or two blocks of a message: its trailing partial block, the 0x80
+// marker, zero fill and the bit length. Returns the number of blocks written.
+inline size_t pad_tail(const uint8_t* data, size_t length, uint8_t tail[128]) {
+    size_t partial = length & 63;
+    size_t blocks = partial < 56 ? 1 : 2;
+    memset(tail, 0, blocks * 64);
+    memcpy(tail, data + (length - partial), partial);
+    tail[partial] = 0x80;
+    uint64_t bits = static_cast<uint64_t>(length) << 3;
+    memcpy(tail + blocks * 64 - 8, &bits, sizeof(bits));
+    return blocks;
+}
+
+inline void store_digest(const uint32_t state[4], uint8_t digest[16]) {
+    memcpy(digest, state, 16);
+}
+
+}  // namespace md5_detail
+
+inline void md5(const uint8_t* data, size_t length, uint8_t digest[16]) {
+    uint32_t state[4] = {md5_detail::IV[0], md5_detail::IV[1], md5_detail::IV[2], md5_detail::IV[3]};
+    size_t full_blocks = length / 64;
+    for (size_t i = 0; i < full_blocks; i++) {
+        md5_detail::compress(state, data + i * 64);
+    }
+    uint8_t tail[128];
+    size_t tail_blocks = md5_detail::pad_tail(data, length, tail);
+    for (size_t i = 0; i < tail_blocks; i++) {
+        md5_detail::compress(state, tail + i * 64);
+    }
+    md5_detail::store_digest(state, digest);
+}
+
+class Md5MultiBuffer {
+public:
+    static constexpr size_t LANES = 4;
+
+    // Digest i (16 bytes at digests + 16 * i) = MD5 of data[i][0, lengths[i])
+    void hash(const uint8_t* const* data, const size_t* lengths, size_t count, uint8_t* digests) {
+#if defined(__SSE2__)
+        if (count < 2) {
+            if (count == 1) {
+                md5(data[0], lengths[0], digests);
+            }
+            return;
+        }
+        size_t next = 0;
+        size_t active = 0;
+        for (size_t lane = 0; lane < LANES; lane++) {
+            active += start_lane(lane, next, data, lengths, count);
+        }
+        const uint8_t* blocks[LANES];
+        while (active > 0) {
+            for (size_t lane = 0; lane < LANES; lane++) {
+                blocks[lane] = current_block(lane);
+            }
+            compress_lanes(blocks);
+            for (size_t lane = 0; lane < LANES; lane++) {
+                Lane& l = lanes_[lane];
+                if (l.message == NONE || ++l.block < l.full_blocks + l.tail_blocks) {
+                    continue;
+                }
+                uint32_t state[4] = {state_[0][lane], state_[1][lane], state_[2][lane], state_[3][lane]};
+                md5_detail::store_digest(state, digests + l.message * 16);
+                if (!start_lane(lane, next, data, lengths, count)) {
+                    active--;
+                }
+            }
+        }
+#else
+        for (size_t i = 0; i < count; i++) {
+            md5(data[i], lengths[i], digests + i * 16);
+        }
+#endif
+    }
+
+private:
+#if defined(__SSE2__)
+    static constexpr size_t NONE = SIZE_MAX;
+    static constexpr size_t GROUPS = LANES / 4;
+
+    struct Lane {
+        size_t message = NONE;
+        const uint8_t* data = nullptr;
+        size_t full_blocks = 0;
+        size_t tail_blocks = 0;
+        size_t block = 0;
+        uint8_t tail[128];
+    };
+
+    Lane lanes_[LANES];
+    alignas(16) uint32_t state_[4][LANES];  // state word, then lane
+    alignas(16) uint8_t idle_block_[64] = {};
+
+    // Load the next unhashed message into the lane. Returns false once the
+    // batch has none left.
+    bool start_lane(size_t lane, size_t& next, const uint8_t* const* data, const size_t* lengths, size_t count) {
+        Lane& l = lanes_[lane];
+        for (int word = 0; word < 4; word++) {
+            state_[word][lane] = md5_detail::IV[word];
+        }
+        if (next >= count) {
+            l.message = NONE;
+            return false;
+        }
+        l.message = next++;
+        l.data = data[l.message];
+        l.full_blocks = lengths[l.message] / 64;
+        l.tail_blocks = md5_detail::pad_tail(l.data, lengths[l.message], l.tail);
+        l.block = 0;
+        return true;
+    }
+
+    const uint8_t* current_block(size_t lane) const {
+        const Lane& l = lanes_[lane];
+        if (l.message == NONE) {
+            return idle_block_;
+        }
+        return l.block < l.full_blocks ? l.data + l.block * 64 : l.tail + (l.block - l.full_blocks) * 64;
+    }
+
+    static __m128i rotl_x4(__m128i x, int s) {
+        return _mm_or_si128(_mm_sll_epi32(x, _mm_cvtsi32_si128(s)), _mm_srl_epi32(x, _mm_cvtsi32_si128(32 - s)));
+    }
+
+    // One block per lane. Message words are transposed so that register j of
+    // a group holds word j of its four blocks. With more than one group the
+    // groups' steps are interleaved.
+    void compress_lanes(const uint8_t* const blocks[LANES]) {
+        __m128i w[GROUPS][16];
+        for (size_t g = 0; g < GROUPS; g++) {
+            const uint8_t* const* group_blocks = blocks + g * 4;
+            for (int q = 0; q < 4; q++) {
+                __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group_blocks[0] + q * 16));
+                __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group_blocks[1] + q * 16));
+                __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group_blocks[2] + q * 16));
+                __m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group_blocks[3] + q * 16));
+                __m128i t0 = _mm_unpacklo_epi32(v0, v1);
+                __m128i t1 = _mm_unpacklo_epi32(v2, v3);
+                __m128i t2 = _mm_unpackhi_epi32(v0, v1);
+                __m128i t3 = _mm_unpackhi_epi32(v2, v3);
+                w[g][q * 4 + 0] = _mm_unpacklo_epi64(t0, t1);
+                w[g][q * 4 + 1] = _mm_unpackhi_epi64(t0, t1);
+                w[g][q * 4 + 2] = _mm_unpacklo_epi64(t2, t3);
+                w[g][q * 4 + 3] = _mm_unpackhi_epi64(t2, t3);
+            }
+        }
+
+        const __m128i ones = _mm_set1_epi32(-1);
+        __m128i a[GROUPS], b[GROUPS], c[GROUPS], d[GROUPS];
+        for (size_t g = 0; g < GROUPS; g++) {
+            a[g] = _mm_load_si128(reinterpret_cast<const __m128i*>(state_[0] + g * 4));
+            b[g] = _mm_load_si128(reinterpret_cast<const __m128i*>(state_[1] + g * 4));
+            c[g] = _mm_load_si128(reinterpret_cast<const __m128i*>(state_[2] + g * 4));
+            d[g] = _mm_load_si128(reinterpret_cast<const __m128i*>(state_[3] + g * 4));
+        }
+#pragma GCC unroll 64
+        for (int i = 0; i < 64; i++) {
+            const __m128i k = _mm_set1_epi32(static_cast<int>(md5_detail::K[i]));
+            const int s = md5_detail::SHIFT[i >> 4][i & 3];
+            for (size_t g = 0; g < GROUPS; g++) {
+                __m128i f;
+                if (i < 16) {
+                    f = _mm_xor_si128(d[g], _mm_and_si128(b[g], _mm_xor_si128(c[g], d[g])));
+                } else if (i < 32) {
+                    f = _mm_xor_si128(c[g], _mm_and_si128(d[g], _mm_xor_si128(b[g], c[g])));
+                } else if (i < 48) {
+                    f = _mm_xor_si128(_mm_xor_si128(b[g], c[g]), d[g]);
+                } else {
+                    f = _mm_xor_si128(c[g], _mm_or_si128(b[g], _mm_xor_si128(d[g], ones)));
+                }
+                f = _mm_add_epi32(_mm_add_epi32(f, a[g]), _mm_add_epi32(k, w[g][md5_detail::word_index(i)]));
+                a[g] = d[g];
+                d[g] = c[g];
+                c[g] = b[g];
+                b[g] = _mm_add_epi32(b[g], rotl_x4(f, s));
+            }
+        }
+        for (size_t g = 0; g < GROUPS; g++) {
+            add_state(state_[0] + g * 4, a[g]);
+            add_state(state_[1] + g * 4, b[g]);
+            add_state(state_[2] + g * 4, c[g]);
+            add_state(state_[3] + g * 4, d[g]);
+        }
+    }
+
+    static void add_state(uint32_t* word, __m128i value) {
+        __m128i* p = reinterpret_cast<__m128i*>(word);
+        _mm_store_si128(p, _mm_add_epi32(_mm_load_si128(p), value));
+    }
+#endif
+};
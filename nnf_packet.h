@@ -0,0 +1,308 @@
+#pragma once
+
+#include "nse_structs.h"
+#include "md5.h"
+#include "aes_gcm.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// NNF TCP packet framing. Every message on the trading connection travels
+// behind an NNF_PACKET_HEADER; sequence numbers start at 1 and count up in
+// each direction independently.
+//
+// Inbound packets are split out of a read first and their checksums verified
+// together afterwards, so the MD5 work for all the small messages in one read
+// goes through the multi-buffer hasher instead of one chain at a time.
+//
+// Once session encryption is enabled every packet is sealed with AES-256-GCM
+// in both directions: the payload is the ciphertext followed by its 16-byte
+// tag, and Length counts the tag. The nonce is the session IV with the sending
+// side and the packet's sequence number folded in, and Length and
+// SequenceNumber are authenticated with the payload. The MD5 checksum covers
+// the sealed payload, so decode() still verifies it before anything is
+// decrypted; open() then decrypts a decoded frame in place.
+class NnfPacketCodec {
+public:
+    enum class Status : uint8_t {
+        Ok = 0,
+        BadLength = 1,
+        BadSequence = 2,
+        BadChecksum = 3
+    };
+
+    // Reject stops at the first bad packet so the connection can be dropped.
+    // Resync scans forward from a bad length or checksum to the next offset
+    // holding a packet that verifies, and follows the sender across a
+    // sequence gap.
+    enum class ErrorPolicy : uint8_t {
+        Reject = 0,
+        Resync = 1
+    };
+
+    static constexpr size_t HEADER_SIZE = sizeof(NNF_PACKET_HEADER);
+    static constexpr size_t MAX_PACKET_SIZE = 32767;  // Length is an int16
+    static constexpr size_t TAG_SIZE = AesGcm256::TAG_SIZE;
+    static constexpr size_t KEY_SIZE = AesGcm256::KEY_SIZE;
+    static constexpr size_t IV_SIZE = 16;
+
+    // Which end of the session this codec is; it picks the nonces
+    enum class Side : uint8_t {
+        Exchange = 0,
+        Box = 1
+    };
+
+    struct Frame {
+        const uint8_t* message;
+        size_t length;
+        int32_t sequence;
+        size_t end;  // offset just past the packet in the decoded buffer
+    };
+
+    struct Counters {
+        uint64_t packets = 0;
+        uint64_t length_errors = 0;
+        uint64_t sequence_errors = 0;
+        uint64_t checksum_errors = 0;
+        uint64_t bytes_skipped = 0;
+        uint64_t decrypt_errors = 0;
+    };
+
+    void set_error_policy(ErrorPolicy policy) { policy_ = policy; }
+    ErrorPolicy error_policy() const { return policy_; }
+
+    void enable_encryption(const uint8_t key[KEY_SIZE], const uint8_t iv[IV_SIZE], Side side = Side::Exchange) {
+        cipher_.set_key(key);
+        memcpy(iv_, iv, AesGcm256::NONCE_SIZE);
+        side_ = side;
+        encrypted_ = true;
+    }
+    void disable_encryption() { encrypted_ = false; }
+    bool encrypted() const { return encrypted_; }
+
+    // Bytes encode() writes for a message of length bytes
+    size_t packet_size(size_t length) const { return HEADER_SIZE + length + (encrypted_ ? TAG_SIZE : 0); }
+    size_t max_message_size() const { return MAX_PACKET_SIZE - HEADER_SIZE - (encrypted_ ? TAG_SIZE : 0); }
+
+    // Start both directions over at sequence 1
+    void reset() {
+        inbound_sequence_ = 1;
+        outbound_sequence_ = 1;
+    }
+
+    // Split buf into packets, appending each verified message to frames in
+    // order. status is the first error met (Ok if none). Returns the bytes
+    // consumed; a trailing partial packet is left for the next read, and under
+    // Reject so is the bad packet and everything after it.
+    size_t decode(const uint8_t* buf, size_t buflen, std::vector<Frame>& frames, Status& status) {
+        status = Status::Ok;
+        size_t pos = 0;
+        for (;;) {
+            // Split first
+            candidates_.clear();
+            size_t scan = pos;
+            bool bad_length = false;
+            while (buflen - scan >= HEADER_SIZE) {
+                size_t length = packet_length(buf + scan);
+                if (length == 0) {
+                    bad_length = true;
+                    break;
+                }
+                if (length > buflen - scan) {
+                    break;
+                }
+                candidates_.push_back({buf + scan + HEADER_SIZE, length - HEADER_SIZE, sequence_of(buf + scan), scan + length});
+                scan += length;
+            }
+
+            // Then verify the batch
+            verify_checksums(candidates_.size());
+            bool lost = false;
+            for (size_t i = 0; i < candidates_.size(); i++) {
+                const Frame& frame = candidates_[i];
+                const NNF_PACKET_HEADER* header = reinterpret_cast<const NNF_PACKET_HEADER*>(frame.message - HEADER_SIZE);
+                if (memcmp(header->Checksum, &digests_[i * 16], sizeof(header->Checksum)) != 0) {
+                    counters_.checksum_errors++;
+                    note(status, Status::BadChecksum);
+                    lost = true;
+                    break;
+                }
+                if (frame.sequence != inbound_sequence_) {
+                    counters_.sequence_errors++;
+                    note(status, Status::BadSequence);
+                    if (policy_ == ErrorPolicy::Reject) {
+                        return pos;
+                    }
+                }
+                inbound_sequence_ = frame.sequence + 1;
+                counters_.packets++;
+                frames.push_back(frame);
+                pos = frame.end;
+            }
+            if (!lost && bad_length) {
+                counters_.length_errors++;
+                note(status, Status::BadLength);
+                lost = true;
+            }
+
+            if (!lost || policy_ == ErrorPolicy::Reject) {
+                return pos;
+            }
+            // A bad checksum may mean a corrupt length as well, so never
+            // trust the packet's own length to skip it
+            size_t resume = resync(buf, buflen, pos + 1);
+            counters_.bytes_skipped += resume - pos;
+            pos = resume;
+        }
+    }
+
+    // Wrap message into packet, which must hold packet_size(length) bytes.
+    // Returns the packet size.
+    size_t encode(const uint8_t* message, size_t length, uint8_t* packet) {
+        memcpy(payload(packet), message, length);
+        return finish(packet, length);
+    }
+
+    // Where a message goes in packet, for writing it in place
+    static uint8_t* payload(uint8_t* packet) { return packet + HEADER_SIZE; }
+
+    // Complete a packet whose length-byte message has already been written
+    // at payload(packet): seal it, then fill in the header. Returns the
+    // packet size.
+    size_t finish(uint8_t* packet, size_t length) {
+        NNF_PACKET_HEADER header;
+        size_t size = packet_size(length);
+        header.Length = static_cast<int16_t>(size);
+        header.SequenceNumber = outbound_sequence_++;
+        uint8_t* payload = packet + HEADER_SIZE;
+        if (encrypted_) {
+            uint8_t nonce[AesGcm256::NONCE_SIZE];
+            uint8_t aad[AAD_SIZE];
+            make_nonce(side_, header.SequenceNumber, nonce);
+            make_aad(header.Length, header.SequenceNumber, aad);
+            cipher_.seal(nonce, aad, sizeof(aad), payload, length, payload + length);
+        }
+        md5(payload, size - HEADER_SIZE, header.Checksum);
+        memcpy(packet, &header, HEADER_SIZE);
+        return size;
+    }
+
+    // Decrypt a sealed frame in place. message is the frame's message in
+    // writable memory; on success length drops to the plaintext length.
+    // Returns false if the tag does not verify.
+    bool open(uint8_t* message, size_t& length, int32_t sequence) {
+        if (length < TAG_SIZE) {
+            counters_.decrypt_errors++;
+            return false;
+        }
+        size_t plain = length - TAG_SIZE;
+        uint8_t nonce[AesGcm256::NONCE_SIZE];
+        uint8_t aad[AAD_SIZE];
+        make_nonce(side_ == Side::Exchange ? Side::Box : Side::Exchange, sequence, nonce);
+        make_aad(static_cast<int16_t>(HEADER_SIZE + length), sequence, aad);
+        if (!cipher_.open(nonce, aad, sizeof(aad), message, plain, message + plain)) {
+            counters_.decrypt_errors++;
+            return false;
+        }
+        length = plain;
+        return true;
+    }
+
+    int32_t expected_inbound_sequence() const { return inbound_sequence_; }
+    int32_t next_outbound_sequence() const { return outbound_sequence_; }
+    const Counters& counters() const { return counters_; }
+
+private:
+    static constexpr size_t AAD_SIZE = sizeof(int16_t) + sizeof(int32_t);
+
+    ErrorPolicy policy_ = ErrorPolicy::Reject;
+    int32_t inbound_sequence_ = 1;
+    int32_t outbound_sequence_ = 1;
+    Counters counters_;
+    Md5MultiBuffer hasher_;
+    std::vector<Frame> candidates_;
+    std::vector<const uint8_t*> messages_;
+    std::vector<size_t> lengths_;
+    std::vector<uint8_t> digests_;
+    bool encrypted_ = false;
+    Side side_ = Side::Exchange;
+    AesGcm256 cipher_;
+    uint8_t iv_[AesGcm256::NONCE_SIZE];
+
+    // Packet length from the header, or 0 if it cannot be a packet
+    static size_t packet_length(const uint8_t* packet) {
+        int16_t length;
+        memcpy(&length, packet, sizeof(length));
+        if (length <= static_cast<int16_t>(HEADER_SIZE)) {
+            return 0;
+        }
+        return static_cast<size_t>(length);
+    }
+
+    static int32_t sequence_of(const uint8_t* packet) {
+        int32_t sequence;
+        memcpy(&sequence, packet + offsetof(NNF_PACKET_HEADER, SequenceNumber), sizeof(sequence));
+        return sequence;
+    }
+
+    // Each side numbers its own packets, so sender plus sequence never repeats
+    // under one key
+    void make_nonce(Side sender, int32_t sequence, uint8_t nonce[AesGcm256::NONCE_SIZE]) const {
+        memcpy(nonce, iv_, AesGcm256::NONCE_SIZE);
+        nonce[0] ^= static_cast<uint8_t>(sender);
+        uint32_t value = static_cast<uint32_t>(sequence);
+        for (int i = 0; i < 4; i++) {
+            nonce[AesGcm256::NONCE_SIZE - 1 - i] ^= static_cast<uint8_t>(value >> (8 * i));
+        }
+    }
+
+    static void make_aad(int16_t length, int32_t sequence, uint8_t aad[AAD_SIZE]) {
+        memcpy(aad, &length, sizeof(length));
+        memcpy(aad + sizeof(length), &sequence, sizeof(sequence));
+    }
+
+    static void note(Status& status, Status error) {
+        if (status == Status::Ok) {
+            status = error;
+        }
+    }
+
+    void verify_checksums(size_t count) {
+        messages_.resize(count);
+        lengths_.resize(count);
+        digests_.resize(count * 16);
+        for (size_t i = 0; i < count; i++) {
+            messages_[i] = candidates_[i].message;
+            lengths_[i] = candidates_[i].length;
+        }
+        hasher_.hash(messages_.data(), lengths_.data(), count, digests_.data());
+    }
+
+    // First offset at or after from holding a complete packet that verifies.
+    // Failing that, the first offset whose packet is still incomplete, or the
+    // point where too few bytes remain for a header; either way the scan picks
+    // up there once more data has arrived.
+    size_t resync(const uint8_t* buf, size_t buflen, size_t from) {
+        uint8_t digest[16];
+        size_t incomplete = buflen;
+        size_t pos = from;
+        for (; buflen - pos >= HEADER_SIZE; pos++) {
+            size_t length = packet_length(buf + pos);
+            if (length == 0) {
+                continue;
+            }
+            if (length > buflen - pos) {
+                incomplete = std::min(incomplete, pos);
+                continue;
+            }
+            const NNF_PACKET_HEADER* header = reinterpret_cast<const NNF_PACKET_HEADER*>(buf + pos);
+            md5(buf + pos + HEADER_SIZE, length - HEADER_SIZE, digest);
+            if (memcmp(header->Checksum, digest, sizeof(digest)) == 0) {
+                return pos;
+            }
+        }
+        return std::min(incomplete, pos);
+    }
+};
@@ -5,6 +5,14 @@
 
 #pragma pack(push, 1)
 
+// TCP packet wrapping each message on the trading connection. Length covers
+// the whole packet; Checksum is the MD5 of the message bytes that follow.
+struct NNF_PACKET_HEADER {
+    int16_t Length;
+    int32_t SequenceNumber;
+    uint8_t Checksum[16];
+};
+
 struct MESSAGE_HEADER {
     int16_t TransactionCode;
     int32_t LogTime;
@@ -773,16 +781,16 @@ struct MS_RP_MARKET_STATS {
     char MessageType;
     char Reserved1;
     int16_t NumberOfRecords;
-    MKT_STATS_DATA MarketStatsData;
+    MKT_STATS_DATA MarketStatsData[6];
 };
 
 
 struct MKT_INDEX {
-    int16_t Opening;
-    int16_t High;
-    int16_t Low;
-    int16_t Closing;
-    int16_t Start;
+    int32_t Opening;
+    int32_t High;
+    int32_t Low;
+    int32_t Closing;
+    int32_t Start;
 };
 
 
@@ -901,7 +909,7 @@ struct RP_SPD_MKT_STATS {
     char MessageType;
     char Reserved1;
     int16_t NoOfRecords;
-    SPD_STATS_DATA SPDStatsData;
+    SPD_STATS_DATA SPDStatsData[3];
 };
 
 
@@ -1112,7 +1120,7 @@ struct ST_TICKER_INDEX_INFO {
 struct MS_TICKER_TRADE_DATA {
     BCAST_HEADER Header;
     int16_t Number_of_Records;
-    ST_TICKER_INDEX_INFO TickerIndexInfo;
+    ST_TICKER_INDEX_INFO TickerIndexInfo[17];
 };
 
 
@@ -1130,7 +1138,7 @@ struct ST_ENHNCD_TICKER_INDEX_INFO {
 struct MS_ENHNCD_TICKER_TRADE_DATA {
     BCAST_HEADER Header;
     int16_t Number_of_Records;
-    ST_ENHNCD_TICKER_INDEX_INFO EnhancdTickerIndexInfo;
+    ST_ENHNCD_TICKER_INDEX_INFO EnhancdTickerIndexInfo[12];
 };
 
 
@@ -1289,7 +1297,7 @@ struct ST_MARKET_WATCH_BCAST {
 struct MS_BCAST_INQ_RESP_2 {
     BCAST_HEADER Header;
     int16_t NoOfRecords;
-    ST_MARKET_WATCH_BCAST MarketWatchBCAST;
+    ST_MARKET_WATCH_BCAST MarketWatchBCAST[5];
 };
 
 
@@ -1303,7 +1311,7 @@ struct ST_ENHNCD_MARKET_WATCH_BCAST {
 struct MS_ENHNCD_BCAST_INQ_RESP_2 {
     BCAST_HEADER Header;
     int16_t NoOfRecords;
-    ST_ENHNCD_MARKET_WATCH_BCAST EnhancdMarketWatchBCAST;
+    ST_ENHNCD_MARKET_WATCH_BCAST EnhancdMarketWatchBCAST[4];
 };
 
 
@@ -1338,7 +1346,7 @@ struct MS_INDICES {
 struct MS_BCAST_INDICES {
     BCAST_HEADER Header;
     int16_t NumberOfRecords;
-    MS_INDICES Indices;
+    MS_INDICES Indices[6];
 };
 
 
@@ -1351,7 +1359,7 @@ struct INDUSTRY_INDICES {
 struct MS_BCAST_INDUSTRY_INDICES {
     BCAST_HEADER Header;
     int16_t NoOfRecs;
-    INDUSTRY_INDICES Indices;
+    INDUSTRY_INDICES Indices[20];
 };
 
 
@@ -1470,7 +1478,7 @@ struct CM_ASSET_OI {
     int64_t TimeStamp;
     char Reserved4[8];
     int16_t MessageLength;
-    OPEN_INTEREST OpenInterest;
+    OPEN_INTEREST OpenInterest[58];
 };
 
 
@@ -1491,7 +1499,7 @@ struct ENHNCD_CM_ASSET_OI {
     int64_t TimeStamp;
     char Reserved4[8];
     int16_t MessageLength;
-    ENHNCD_OPEN_INTEREST EnhncdOpenInterest;
+    ENHNCD_OPEN_INTEREST EnhncdOpenInterest[38];
 };
 
 
@@ -2157,6 +2165,14 @@ struct MS_TRADE_CONFIRM_TR {
 
 // Transaction Codes
 namespace TransactionCodes {
+    const int16_t GR_REQUEST = 2400;
+    const int16_t GR_RESPONSE = 2401;
+    const int16_t SECURE_BOX_REGISTRATION_REQUEST_IN = 23008;
+    const int16_t SECURE_BOX_REGISTRATION_RESPONSE_OUT = 23009;
+    const int16_t BOX_SIGN_ON_REQUEST_IN = 23000;
+    const int16_t BOX_SIGN_ON_REQUEST_OUT = 23001;
+    const int16_t BOX_SIGN_OFF = 20322;
+    const int16_t HEARTBEAT = 23506;
     const int16_t SIGNON_REQUEST_IN = 2300;
     const int16_t SIGNON_REQUEST_OUT = 2301;
     const int16_t SIGN_OFF_REQUEST_IN = 2320;
@@ -2206,6 +2222,12 @@ namespace TransactionCodes {
     const int16_t SPD_ORD_LIMIT_UPDATE_OUT = 5772;
     const int16_t CTRL_MSG_TO_TRADER = 5295;
     const int16_t BCAST_JRNL_VCT_MSG = 6501;
+    const int16_t BC_OPEN_MESSAGE = 6511;
+    const int16_t BC_CLOSE_MESSAGE = 6521;
+    const int16_t BC_PREOPEN_SHUTDOWN_MSG = 6531;
+    const int16_t BC_NORMAL_MKT_PREOPEN_ENDED = 6571;
+    const int16_t BC_CLOSING_START = 6583;
+    const int16_t BC_CLOSING_END = 6584;
     const int16_t RPRT_MARKET_STATS_OUT_RPT = 1833;
     const int16_t ENHNCD_RPRT_MARKET_STATS_OUT_RPT = 11833;
     const int16_t MKT_IDX_RPT_DATA = 1836;
@@ -2223,6 +2245,15 @@ namespace TransactionCodes {
     const int16_t SP_ORDER_ERROR = 2154;
     const int16_t BATCH_SPREAD_CXL_OUT = 9004;
     const int16_t BCAST_SPD_MSTR_CHG = 7309;
+    const int16_t BCAST_INDICES = 7207;
+    const int16_t BCAST_LIMIT_PRICE_PROTECTION_RANGE = 7220;
+    const int16_t BCAST_MW_ROUND_ROBIN = 7201;
+    const int16_t BCAST_TICKER_AND_MKT_INDEX = 7202;
+    const int16_t BCAST_ENHNCD_MW_ROUND_ROBIN = 17201;
+    const int16_t BCAST_ENHNCD_TICKER_AND_MKT_INDEX = 17202;
+    const int16_t MKT_MVMT_CM_OI_IN = 7130;
+    const int16_t ENHNCD_MKT_MVMT_CM_OI_IN = 17130;
+    const int16_t BCAST_INDUSTRY_INDEX_UPDATE = 7203;
     const int16_t BCAST_SPD_MSTR_CHG_PERIODIC = 7341;
     const int16_t TWOL_BOARD_LOT_IN = 2102;
     const int16_t THRL_BOARD_LOT_IN = 2104;
@@ -2297,6 +2328,10 @@ namespace ErrorCodes {
     const int16_t e$order_cancelled_for_ssd = 16796;
     const int16_t e$fok_order_cancelled = 16388;
     const int16_t e$order_cancelled_for_self_trade = 17071;
+    const int16_t e$invalid_box_id = 16806;
+    const int16_t e$invalid_session_key = 16807;
+    const int16_t e$box_not_registered = 16808;
+    const int16_t e$no_gateway_available = 16809;
 }
 
 // Reason Codes
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <vector>
+
+// Resting orders at one price in time priority. Orders are referenced by
+// order number; the order records themselves stay with the exchange.
+struct PriceLevel {
+    int64_t total_volume = 0;
+    std::deque<double> orders;
+    std::deque<uint32_t> owners;  // interned owner of each order, for self-trade checks
+};
+
+// Price-time priority book for one contract or spread combination.
+// Bids are kept best (highest) first, asks best (lowest) first.
+struct OrderBook {
+    std::map<int32_t, PriceLevel, std::greater<int32_t>> bids;
+    std::map<int32_t, PriceLevel> asks;
+
+    // Queue an order at the back of its price level
+    void add(bool is_buy, int32_t price, double order_number, int32_t volume, uint32_t owner = 0) {
+        PriceLevel& level = is_buy ? bids[price] : asks[price];
+        level.orders.push_back(order_number);
+        level.owners.push_back(owner);
+        level.total_volume += volume;
+    }
+
+    // Take an order out of its level, dropping the level once it is empty.
+    // volume is the open quantity the order still contributes to the level.
+    bool remove(bool is_buy, int32_t price, double order_number, int32_t volume) {
+        return is_buy ? remove_from(bids, price, order_number, volume)
+                      : remove_from(asks, price, order_number, volume);
+    }
+
+    // Adjust the open volume of a level without touching queue position
+    // (partial fills and priority-preserving quantity reductions)
+    void reduce(bool is_buy, int32_t price, int32_t volume) {
+        if (is_buy) {
+            auto it = bids.find(price);
+            if (it != bids.end()) {
+                it->second.total_volume -= volume;
+            }
+        } else {
+            auto it = asks.find(price);
+            if (it != asks.end()) {
+                it->second.total_volume -= volume;
+            }
+        }
+    }
+
+    bool empty() const { return bids.empty() && asks.empty(); }
+
+private:
+    template <typename Levels>
+    static bool remove_from(Levels& levels, int32_t price, double order_number, int32_t volume) {
+        auto level_iter = levels.find(price);
+        if (level_iter == levels.end()) {
+            return false;
+        }
+        PriceLevel& level = level_iter->second;
+        for (auto it = level.orders.begin(); it != level.orders.end(); ++it) {
+            if (*it == order_number) {
+                level.owners.erase(level.owners.begin() + (it - level.orders.begin()));
+                level.orders.erase(it);
+                level.total_volume -= volume;
+                if (level.orders.empty()) {
+                    levels.erase(level_iter);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Scratch arrays for equilibrium price discovery, reused across books.
+// One array per quantity so the selection passes vectorize.
+struct AuctionScratch {
+    std::vector<int64_t> prices;      // candidate prices, ascending (widened to match the volumes)
+    std::vector<int64_t> buy_volume;  // bid volume at exactly this price
+    std::vector<int64_t> sell_volume; // ask volume at exactly this price
+    std::vector<int64_t> demand;      // bid volume at or above this price
+    std::vector<int64_t> supply;      // ask volume at or below this price
+    std::vector<int64_t> executable;
+    std::vector<int64_t> imbalance;
+};
+
+// Call auction equilibrium price: maximum executable volume, then minimum
+// imbalance, then closest to the reference price (lowest price on a full tie).
+// Market orders, which are not in the book, trade at any price: their volume
+// counts towards demand or supply everywhere and widens the candidate prices
+// to the far side of the book. With market orders alone the auction trades
+// at the reference price. Returns false when nothing can execute.
+inline bool find_equilibrium_price(const OrderBook& book, int32_t reference_price, AuctionScratch& scratch,
+                                   int32_t& price, int64_t& volume,
+                                   int64_t market_buy_volume = 0, int64_t market_sell_volume = 0) {
+    bool has_buys = !book.bids.empty() || market_buy_volume > 0;
+    bool has_sells = !book.asks.empty() || market_sell_volume > 0;
+    if (!has_buys || !has_sells) {
+        return false;
+    }
+    if (market_buy_volume == 0 && market_sell_volume == 0 && book.bids.begin()->first < book.asks.begin()->first) {
+        return false;
+    }
+
+    scratch.prices.clear();
+    scratch.buy_volume.clear();
+    scratch.sell_volume.clear();
+
+    if (book.bids.empty() && book.asks.empty()) {
+        if (reference_price <= 0) {
+            return false;
+        }
+        scratch.prices.push_back(reference_price);
+        scratch.buy_volume.push_back(0);
+        scratch.sell_volume.push_back(0);
+    } else {
+        // Limit orders execute between the best ask and the best bid; market
+        // orders reach the far end of the opposite side
+        int32_t low = !book.asks.empty() ? book.asks.begin()->first : book.bids.rbegin()->first;
+        int32_t high = !book.bids.empty() ? book.bids.begin()->first : book.asks.rbegin()->first;
+        if (market_sell_volume > 0 && !book.bids.empty()) {
+            low = std::min(low, book.bids.rbegin()->first);
+        }
+        if (market_buy_volume > 0 && !book.asks.empty()) {
+            high = std::max(high, book.asks.rbegin()->first);
+        }
+
+        // Merge ask prices (ascending) with bid prices (walked in reverse, so
+        // also ascending) into one grid
+        auto ask = book.asks.begin();
+        auto bid_rev = std::make_reverse_iterator(book.bids.upper_bound(low));  // lowest bid at or above low
+        auto bid_rend = book.bids.rend();
+        while ((ask != book.asks.end() && ask->first <= high) || bid_rev != bid_rend) {
+            bool take_ask = (ask != book.asks.end() && ask->first <= high);
+            bool take_bid = (bid_rev != bid_rend);
+            int32_t next_price;
+            if (take_ask && take_bid) {
+                next_price = std::min(ask->first, bid_rev->first);
+            } else {
+                next_price = take_ask ? ask->first : bid_rev->first;
+            }
+
+            int64_t buys = 0;
+            int64_t sells = 0;
+            if (take_ask && ask->first == next_price) {
+                sells = ask->second.total_volume;
+                ++ask;
+            }
+            if (take_bid && bid_rev->first == next_price) {
+                buys = bid_rev->second.total_volume;
+                ++bid_rev;
+            }
+            scratch.prices.push_back(next_price);
+            scratch.buy_volume.push_back(buys);
+            scratch.sell_volume.push_back(sells);
+        }
+    }
+
+    size_t n = scratch.prices.size();
+    scratch.demand.resize(n);
+    scratch.supply.resize(n);
+    scratch.executable.resize(n);
+    scratch.imbalance.resize(n);
+
+    // Cumulative curves; no bids lie above the grid and no asks below it,
+    // and market orders are on every price
+    int64_t running = market_buy_volume;
+    for (size_t i = n; i-- > 0; ) {
+        running += scratch.buy_volume[i];
+        scratch.demand[i] = running;
+    }
+    running = market_sell_volume;
+    for (size_t i = 0; i < n; i++) {
+        running += scratch.sell_volume[i];
+        scratch.supply[i] = running;
+    }
+
+    const int64_t* demand = scratch.demand.data();
+    const int64_t* supply = scratch.supply.data();
+    const int64_t* prices = scratch.prices.data();
+    int64_t* executable = scratch.executable.data();
+    int64_t* imbalance = scratch.imbalance.data();
+    const int64_t none = std::numeric_limits<int64_t>::max();
+
+    // Branch-free passes over plain arrays so the compiler can vectorize them
+    int64_t best_volume = 0;
+    for (size_t i = 0; i < n; i++) {
+        executable[i] = std::min(demand[i], supply[i]);
+        int64_t diff = demand[i] - supply[i];
+        imbalance[i] = diff < 0 ? -diff : diff;
+        best_volume = std::max(best_volume, executable[i]);
+    }
+    int64_t best_imbalance = none;
+    for (size_t i = 0; i < n; i++) {
+        best_imbalance = std::min(best_imbalance, executable[i] == best_volume ? imbalance[i] : none);
+    }
+    int64_t best_distance = none;
+    for (size_t i = 0; i < n; i++) {
+        int64_t diff = prices[i] - reference_price;
+        int64_t abs_diff = diff < 0 ? -diff : diff;
+        int64_t tied = (executable[i] == best_volume) ? imbalance[i] : none;
+        best_distance = std::min(best_distance, (tied == best_imbalance) ? abs_diff : none);
+    }
+
+    if (best_volume <= 0) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        int64_t diff = prices[i] - reference_price;
+        if (executable[i] == best_volume && imbalance[i] == best_imbalance && (diff < 0 ? -diff : diff) == best_distance) {
+            price = static_cast<int32_t>(prices[i]);
+            volume = best_volume;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+// Outbound bytes of one connection. Writers reserve space at the back and
+// fill it in place; the socket takes bytes off the front. Reserved space is
+// not initialised, and taking bytes off the front only moves an offset: the
+// unsent tail is moved back to the start only when a reservation would not
+// otherwise fit, and the offsets rewind whenever the buffer empties.
+class OutputBuffer {
+public:
+    OutputBuffer() = default;
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    // Space for length bytes after the pending ones, valid until the next
+    // reserve; commit makes them pending
+    uint8_t* reserve(size_t length) {
+        if (length > capacity_ - tail_) {
+            make_room(length);
+        }
+        return data_.get() + tail_;
+    }
+
+    void commit(size_t length) { tail_ += length; }
+
+    const uint8_t* data() const { return data_.get() + head_; }
+    size_t size() const { return tail_ - head_; }
+    bool empty() const { return head_ == tail_; }
+
+    // Drop length bytes from the front, once the socket has taken them
+    void consume(size_t length) {
+        head_ += length;
+        if (head_ == tail_) {
+            head_ = tail_ = 0;
+        }
+    }
+
+    void clear() { head_ = tail_ = 0; }
+
+    void swap(OutputBuffer& other) {
+        std::swap(data_, other.data_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(head_, other.head_);
+        std::swap(tail_, other.tail_);
+    }
+
+private:
+    std::unique_ptr<uint8_t[]> data_;
+    size_t capacity_ = 0;
+    size_t head_ = 0;
+    size_t tail_ = 0;
+
+    void make_room(size_t length) {
+        size_t pending = size();
+        if (pending + length <= capacity_) {
+            memmove(data_.get(), data_.get() + head_, pending);
+        } else {
+            size_t capacity = capacity_ == 0 ? 4096 : capacity_;
+            while (capacity < pending + length) {
+                capacity *= 2;
+            }
+            std::unique_ptr<uint8_t[]> data(new uint8_t[capacity]);
+            if (pending > 0) {
+                memcpy(data.get(), data_.get() + head_, pending);
+            }
+            data_ = std::move(data);
+            capacity_ = capacity;
+        }
+        head_ = 0;
+        tail_ = pending;
+    }
+};
@@ -0,0 +1,403 @@
+#include "shm_gateway.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <utility>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace shm_detail;
+
+ShmGateway::ShmGateway(FakeNSEExchange& exchange, const ShmGatewayConfig& config)
+    : exchange_(exchange), config_(config) {}
+
+ShmGateway::~ShmGateway() {
+    stop();
+}
+
+bool ShmGateway::start() {
+    if (running_) {
+        return false;
+    }
+    if (config_.sessions == 0 || config_.ring_size < 4096 || (config_.ring_size & (config_.ring_size - 1)) != 0) {
+        std::cout << "Shared memory gateway: ring size must be a power of two of at least 4096 bytes" << std::endl;
+        return false;
+    }
+
+    segment_size_ = segment_size(config_.sessions, config_.ring_size);
+    fd_ = memfd_create("nse-fake-exchange", MFD_CLOEXEC);
+    if (fd_ < 0 || ftruncate(fd_, static_cast<off_t>(segment_size_)) < 0) {
+        std::cout << "Shared memory gateway: cannot create segment: " << strerror(errno) << std::endl;
+        stop();
+        return false;
+    }
+    void* segment = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, 0);
+    if (segment == MAP_FAILED) {
+        std::cout << "Shared memory gateway: cannot map segment: " << strerror(errno) << std::endl;
+        stop();
+        return false;
+    }
+    segment_ = static_cast<uint8_t*>(segment);
+
+    header_ = new (segment_) SegmentHeader();
+    header_->sessions = static_cast<uint32_t>(config_.sessions);
+    header_->ring_size = config_.ring_size;
+    header_->doorbell.reset();
+    sessions_.assign(config_.sessions, Session());
+    for (size_t i = 0; i < config_.sessions; i++) {
+        uint8_t* slot = segment_ + slot_offset(i, config_.ring_size);
+        sessions_[i].slot = new (slot) SlotHeader();
+        sessions_[i].slot->state.store(SLOT_FREE, std::memory_order_relaxed);
+    }
+    // Clients check the magic before anything else
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = SEGMENT_MAGIC;
+
+    {
+        std::lock_guard<std::mutex> lock(exchange_mutex_);
+        exchange_.set_connection_callback([this](FakeNSEExchange::ConnectionId connection, const uint8_t* message, size_t length) {
+            deliver(connection, message, length);
+        });
+        exchange_.set_response_writer([this](FakeNSEExchange::ConnectionId connection, size_t length,
+                                             FakeNSEExchange::MessageFill fill, const void* context) {
+            write_message(connection, length, fill, context);
+        });
+        exchange_.set_disconnect_callback([this](FakeNSEExchange::ConnectionId connection) {
+            disconnect(connection);
+        });
+    }
+
+    if (config_.lock_memory) {
+        int error = lock_process_memory();
+        if (error != 0) {
+            std::cout << "Shared memory gateway: cannot lock memory: " << strerror(error) << std::endl;
+        }
+    }
+
+    running_ = true;
+    thread_ = std::thread([this]() {
+        if (config_.cpu >= 0) {
+            int error = pin_current_thread(config_.cpu);
+            if (error != 0) {
+                std::cout << "Shared memory gateway: cannot pin thread to CPU " << config_.cpu << ": " << strerror(error)
+                          << std::endl;
+            }
+        }
+        run();
+    });
+    std::cout << "Shared memory gateway: " << config_.sessions << " sessions, " << config_.ring_size
+              << " byte rings, " << (config_.wakeup == ShmWakeup::BusyPoll ? "busy-polling" : "futex wakeup")
+              << std::endl;
+    return true;
+}
+
+void ShmGateway::stop() {
+    bool was_running = running_.exchange(false);
+    if (was_running && header_) {
+        // A sleeping thread only wakes for a ring with sleepers counted
+        header_->doorbell.sequence.fetch_add(1, std::memory_order_release);
+        shm_futex_wake(&header_->doorbell.sequence);
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    if (was_running && config_.wakeup == ShmWakeup::BusyPoll) {
+        LoopJitter::Summary jitter = jitter_.summary();
+        std::cout << "Shared memory gateway: " << jitter.passes << " passes, gap p50 " << jitter.p50_ns << " ns, p99 "
+                  << jitter.p99_ns << " ns, p99.9 " << jitter.p999_ns << " ns, max " << jitter.max_ns << " ns"
+                  << std::endl;
+    }
+
+    if (was_running) {
+        std::lock_guard<std::mutex> lock(exchange_mutex_);
+        uint64_t ts = exchange_.exchange_time();
+        for (size_t i = 0; i < sessions_.size(); i++) {
+            if (sessions_[i].active) {
+                close_session(i, ts, SLOT_DISCONNECTED);
+            }
+        }
+        exchange_.set_connection_callback(nullptr);
+        exchange_.set_response_writer(nullptr);
+        exchange_.set_disconnect_callback(nullptr);
+    }
+    sessions_.clear();
+
+    if (segment_) {
+        munmap(segment_, segment_size_);
+        segment_ = nullptr;
+        header_ = nullptr;
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+ShmGateway::Counters ShmGateway::counters() const {
+    return {open_sessions_.load(), messages_in_.load(), messages_out_.load(), messages_dropped_.load(),
+            jitter_.summary()};
+}
+
+void ShmGateway::run() {
+    unsigned idle_passes = 0;
+    bool busy_poll = config_.wakeup == ShmWakeup::BusyPoll;
+    while (running_) {
+        if (busy_poll) {
+            jitter_.pass(monotonic_ns());
+        }
+        if (poll_sessions()) {
+            idle_passes = 0;
+            continue;
+        }
+        if (busy_poll || ++idle_passes < config_.spin_polls) {
+            shm_cpu_relax();
+            continue;
+        }
+        idle_passes = 0;
+        header_->doorbell.wait([this]() { return running_ && !has_input(); }, config_.timer_poll_ms);
+    }
+}
+
+// One pass: notice sessions opening and closing, hand each open one's
+// records to the exchange, run due timers, then wake clients that were sent
+// something. Returns true if there was anything to do.
+bool ShmGateway::poll_sessions() {
+    bool busy = false;
+    std::lock_guard<std::mutex> lock(exchange_mutex_);
+    uint64_t ts = exchange_.exchange_time();
+
+    for (size_t i = 0; i < sessions_.size(); i++) {
+        Session& session = sessions_[i];
+        uint32_t state = session.slot->state.load(std::memory_order_acquire);
+        if (!session.active) {
+            if (state == SLOT_OPEN) {
+                open_session(i, ts);
+                busy = true;
+            } else if (state == SLOT_CLOSING) {
+                // Left before it was ever picked up
+                session.slot->state.store(SLOT_FREE, std::memory_order_release);
+            }
+            if (!session.active) {
+                continue;
+            }
+        }
+        if (state == SLOT_CLOSING) {
+            close_session(i, ts, SLOT_FREE);
+            busy = true;
+            continue;
+        }
+
+        FakeNSEExchange::ConnectionId connection = static_cast<FakeNSEExchange::ConnectionId>(i + 1);
+        size_t length;
+        for (size_t n = 0; n < config_.records_per_pass && !session.dropped; n++) {
+            const uint8_t* message = session.inbound.peek(length);
+            if (!message) {
+                break;
+            }
+            bool error = false;
+            exchange_.parse(connection, message, length, ts, error);
+            session.inbound.consume(length);
+            messages_in_++;
+            busy = true;
+            if (error) {
+                std::cout << "Shared memory session " << connection << ": message rejected, closing" << std::endl;
+                session.dropped = true;
+            }
+        }
+    }
+
+    exchange_.poll_timers(config_.timers_per_poll);
+
+    for (size_t i = 0; i < sessions_.size(); i++) {
+        Session& session = sessions_[i];
+        if (session.active && session.dropped) {
+            close_session(i, ts, SLOT_DISCONNECTED);
+        }
+        if (session.notify) {
+            session.notify = false;
+            session.outbound.doorbell().ring();
+        }
+    }
+    return busy;
+}
+
+// Checked with the sleeper flag up, so a client writing after it returns
+// false rings the doorbell
+bool ShmGateway::has_input() {
+    for (Session& session : sessions_) {
+        uint32_t state = session.slot->state.load(std::memory_order_acquire);
+        if (session.active ? state != SLOT_OPEN || !session.inbound.empty() : state == SLOT_OPEN) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ShmGateway::open_session(size_t index, uint64_t ts) {
+    Session& session = sessions_[index];
+    uint8_t* slot = segment_ + slot_offset(index, config_.ring_size);
+    session.inbound.attach_consumer(slot + sizeof(SlotHeader), config_.ring_size);
+    session.outbound.attach_producer(slot + sizeof(SlotHeader) + ShmRing::footprint(config_.ring_size), config_.ring_size);
+    session.active = true;
+    session.dropped = false;
+    session.notify = false;
+    open_sessions_++;
+    FakeNSEExchange::ConnectionId connection = static_cast<FakeNSEExchange::ConnectionId>(index + 1);
+    exchange_.connection_opened(connection, ts);
+    std::cout << "Shared memory session " << connection << " opened" << std::endl;
+}
+
+// state is what the slot is left in: free once the client has gone,
+// disconnected while it may still be attached
+void ShmGateway::close_session(size_t index, uint64_t ts, uint32_t state) {
+    Session& session = sessions_[index];
+    session.active = false;
+    session.dropped = false;
+    open_sessions_--;
+    FakeNSEExchange::ConnectionId connection = static_cast<FakeNSEExchange::ConnectionId>(index + 1);
+    exchange_.connection_closed(connection, ts);
+    // A client leaving at the same moment has nobody left to free the slot
+    uint32_t open = SLOT_OPEN;
+    if (state == SLOT_FREE || !session.slot->state.compare_exchange_strong(open, state, std::memory_order_acq_rel)) {
+        session.slot->state.store(SLOT_FREE, std::memory_order_release);
+    }
+    session.notify = false;
+    session.outbound.doorbell().ring();
+    std::cout << "Shared memory session " << connection << " closed" << std::endl;
+}
+
+void ShmGateway::deliver(FakeNSEExchange::ConnectionId connection_id, const uint8_t* message, size_t length) {
+    auto copy = [](const void* context, uint8_t* payload) {
+        auto source = static_cast<const std::pair<const uint8_t*, size_t>*>(context);
+        memcpy(payload, source->first, source->second);
+    };
+    std::pair<const uint8_t*, size_t> source(message, length);
+    if (connection_id == 0) {
+        for (size_t i = 0; i < sessions_.size(); i++) {
+            if (sessions_[i].active) {
+                write_record(i, length, copy, &source);
+            }
+        }
+        return;
+    }
+    write_message(connection_id, length, copy, &source);
+}
+
+void ShmGateway::write_message(FakeNSEExchange::ConnectionId connection_id, size_t length,
+                               FakeNSEExchange::MessageFill fill, const void* context) {
+    size_t index = connection_id - 1;
+    if (index < sessions_.size() && sessions_[index].active) {
+        write_record(index, length, fill, context);
+    }
+}
+
+// A client that leaves its return ring full loses the messages that do not fit
+void ShmGateway::write_record(size_t index, size_t length, FakeNSEExchange::MessageFill fill, const void* context) {
+    Session& session = sessions_[index];
+    uint8_t* record = session.outbound.reserve(length);
+    if (!record) {
+        if (messages_dropped_++ == 0) {
+            std::cout << "Shared memory session " << index + 1 << ": return ring full, dropping messages" << std::endl;
+        }
+        return;
+    }
+    fill(context, record);
+    session.outbound.commit(length);
+    session.notify = true;
+    messages_out_++;
+}
+
+// Closed at the end of the pass; the exchange may be in the middle of a
+// timer or a parse for it
+void ShmGateway::disconnect(FakeNSEExchange::ConnectionId connection_id) {
+    size_t index = connection_id - 1;
+    if (index < sessions_.size() && sessions_[index].active) {
+        sessions_[index].dropped = true;
+    }
+}
+
+// ===== Client =====
+
+ShmClient::~ShmClient() {
+    detach();
+}
+
+bool ShmClient::attach(int fd) {
+    detach();
+    struct stat info;
+    if (fstat(fd, &info) < 0 || static_cast<size_t>(info.st_size) < sizeof(SegmentHeader)) {
+        return false;
+    }
+    segment_size_ = static_cast<size_t>(info.st_size);
+    void* segment = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (segment == MAP_FAILED) {
+        return false;
+    }
+    segment_ = static_cast<uint8_t*>(segment);
+    header_ = reinterpret_cast<SegmentHeader*>(segment_);
+    if (header_->magic != SEGMENT_MAGIC || segment_size(header_->sessions, header_->ring_size) > segment_size_) {
+        detach();
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    size_t ring_size = header_->ring_size;
+    for (size_t i = 0; i < header_->sessions; i++) {
+        uint8_t* slot = segment_ + slot_offset(i, ring_size);
+        SlotHeader* slot_header = reinterpret_cast<SlotHeader*>(slot);
+        uint32_t expected = SLOT_FREE;
+        if (!slot_header->state.compare_exchange_strong(expected, SLOT_OPENING, std::memory_order_acq_rel)) {
+            continue;
+        }
+        // Nobody else touches the rings until the slot is open
+        uint8_t* to_exchange = slot + sizeof(SlotHeader);
+        uint8_t* to_client = to_exchange + ShmRing::footprint(ring_size);
+        reinterpret_cast<ShmRingHeader*>(to_exchange)->reset();
+        reinterpret_cast<ShmRingHeader*>(to_client)->reset();
+        outbound_.attach_producer(to_exchange, ring_size);
+        inbound_.attach_consumer(to_client, ring_size);
+        slot_ = slot_header;
+        slot_->state.store(SLOT_OPEN, std::memory_order_release);
+        header_->doorbell.ring();
+        return true;
+    }
+    detach();
+    return false;
+}
+
+void ShmClient::detach() {
+    if (slot_) {
+        // An open slot is left for the exchange to close; one the exchange
+        // has already dropped is simply freed
+        uint32_t open = SLOT_OPEN;
+        if (slot_->state.compare_exchange_strong(open, SLOT_CLOSING, std::memory_order_acq_rel)) {
+            header_->doorbell.ring();
+        } else {
+            slot_->state.store(SLOT_FREE, std::memory_order_release);
+        }
+        slot_ = nullptr;
+    }
+    if (segment_) {
+        munmap(segment_, segment_size_);
+        segment_ = nullptr;
+        header_ = nullptr;
+    }
+}
+
+bool ShmClient::connected() const {
+    return slot_ && slot_->state.load(std::memory_order_acquire) == SLOT_OPEN;
+}
+
+bool ShmClient::send(const void* message, size_t length) {
+    if (!outbound_.write(message, length)) {
+        return false;
+    }
+    header_->doorbell.ring();
+    return true;
+}
+
+void ShmClient::wait(int timeout_ms) {
+    inbound_.doorbell().wait([this]() { return inbound_.empty() && connected(); }, timeout_ms);
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include "fake_exchange.h"
+#include "hot_thread.h"
+#include "shm_ring.h"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Shared-memory front end for clients on the same host, such as strategy
+// tests that want latency measurements without loopback TCP in them.
+//
+// One memfd segment holds a fixed number of session slots, each with a ring
+// to the exchange and a ring back. A client maps the segment (the fd is
+// inherited or passed over a Unix socket), claims a free slot and writes one
+// message per record: bare exchange messages, no NNF packet, since nothing
+// on the way can corrupt or reorder them. A single thread polls every open
+// slot, hands each record to the exchange's per-connection parse() where it
+// lies, and has responses written in place into the slot's return ring.
+//
+// The thread either busy-polls or, after spin_polls empty passes, sleeps on
+// a futex the clients ring; clients can likewise spin or sleep on their
+// return ring. The thread also runs the exchange's timers.
+//
+// This takes the exchange's connection callbacks, so it is used instead of a
+// GatewayServer on the same exchange, not alongside one.
+enum class ShmWakeup : uint8_t {
+    BusyPoll = 0,
+    Futex = 1
+};
+
+struct ShmGatewayConfig {
+    size_t sessions = 8;
+    size_t ring_size = 1 << 20;      // bytes per direction per session, a power of two
+    ShmWakeup wakeup = ShmWakeup::BusyPoll;
+    unsigned spin_polls = 1000;      // empty passes before sleeping, futex mode
+    int timer_poll_ms = 1;           // longest sleep, so timers still run
+    size_t timers_per_poll = 64;
+    size_t records_per_pass = 64;    // per session, so one client cannot starve the rest
+    // Core for the thread, -1 for none, and whether to lock and pre-fault
+    // the process's memory for its lifetime (see GatewayServerConfig)
+    int cpu = -1;
+    bool lock_memory = false;
+};
+
+namespace shm_detail {
+
+const uint32_t SEGMENT_MAGIC = 0x4e534531;  // "NSE1"
+
+enum SlotState : uint32_t {
+    SLOT_FREE = 0,
+    SLOT_OPENING = 1,       // claimed by a client setting up its rings
+    SLOT_OPEN = 2,
+    SLOT_CLOSING = 3,       // client has left
+    SLOT_DISCONNECTED = 4   // dropped by the exchange; the client frees it
+};
+
+struct SegmentHeader {
+    uint32_t magic;
+    uint32_t sessions;
+    uint64_t ring_size;
+    alignas(64) ShmDoorbell doorbell;  // rung by clients for a sleeping exchange thread
+};
+
+struct SlotHeader {
+    alignas(64) std::atomic<uint32_t> state;
+};
+
+// Slot i starts at slot_offset(i): its header, the ring to the exchange,
+// then the ring to the client
+inline size_t slot_size(size_t ring_size) {
+    return sizeof(SlotHeader) + 2 * ShmRing::footprint(ring_size);
+}
+
+inline size_t slot_offset(size_t index, size_t ring_size) {
+    return sizeof(SegmentHeader) + index * slot_size(ring_size);
+}
+
+inline size_t segment_size(size_t sessions, size_t ring_size) {
+    return slot_offset(sessions, ring_size);
+}
+
+}  // namespace shm_detail
+
+class ShmGateway {
+public:
+    struct Counters {
+        size_t sessions;
+        uint64_t messages_in;
+        uint64_t messages_out;
+        uint64_t messages_dropped;  // return ring full
+        LoopJitter::Summary jitter;  // gaps between passes, busy-polling
+    };
+
+    ShmGateway(FakeNSEExchange& exchange, const ShmGatewayConfig& config);
+    ~ShmGateway();
+
+    // Create the segment, hook into the exchange and start the thread.
+    // Returns false if the segment cannot be created.
+    bool start();
+    void stop();
+
+    // The segment, for clients to map
+    int fd() const { return fd_; }
+
+    Counters counters() const;
+
+    // Run fn(exchange) under the lock the thread uses
+    template <typename Fn>
+    auto with_exchange(Fn&& fn) {
+        std::lock_guard<std::mutex> lock(exchange_mutex_);
+        return fn(exchange_);
+    }
+
+private:
+    struct Session {
+        bool active = false;
+        bool dropped = false;   // disconnected by the exchange, to be closed
+        bool notify = false;    // return ring written this pass
+        shm_detail::SlotHeader* slot = nullptr;
+        ShmRing inbound;
+        ShmRing outbound;
+    };
+
+    FakeNSEExchange& exchange_;
+    ShmGatewayConfig config_;
+    std::atomic<bool> running_{false};
+    std::mutex exchange_mutex_;
+
+    int fd_ = -1;
+    uint8_t* segment_ = nullptr;
+    size_t segment_size_ = 0;
+    shm_detail::SegmentHeader* header_ = nullptr;
+    std::vector<Session> sessions_;  // by slot; the connection id is slot + 1
+    std::thread thread_;
+
+    std::atomic<size_t> open_sessions_{0};
+    std::atomic<uint64_t> messages_in_{0};
+    std::atomic<uint64_t> messages_out_{0};
+    std::atomic<uint64_t> messages_dropped_{0};
+    LoopJitter jitter_;
+
+    void run();
+    bool poll_sessions();
+    bool has_input();
+    void open_session(size_t index, uint64_t ts);
+    void close_session(size_t index, uint64_t ts, uint32_t state);
+
+    // Called by the exchange, under exchange_mutex_
+    void deliver(FakeNSEExchange::ConnectionId connection_id, const uint8_t* message, size_t length);
+    void write_message(FakeNSEExchange::ConnectionId connection_id, size_t length, FakeNSEExchange::MessageFill fill,
+                       const void* context);
+    void write_record(size_t index, size_t length, FakeNSEExchange::MessageFill fill, const void* context);
+    void disconnect(FakeNSEExchange::ConnectionId connection_id);
+};
+
+// Client end of one session, in the same or another process
+class ShmClient {
+public:
+    ShmClient() = default;
+    ShmClient(const ShmClient&) = delete;
+    ShmClient& operator=(const ShmClient&) = delete;
+    ~ShmClient();
+
+    // Map the segment behind fd and claim a free session. Returns false if
+    // fd is not a segment or every session is taken.
+    bool attach(int fd);
+    void detach();
+
+    // False once the exchange has dropped the session
+    bool connected() const;
+
+    // Queue one message; false if the ring to the exchange is full
+    bool send(const void* message, size_t length);
+
+    // Call fn(message, length) for each message waiting, in place. Returns
+    // how many there were.
+    template <typename Fn>
+    size_t poll(Fn&& fn) {
+        size_t count = 0;
+        size_t length;
+        while (const uint8_t* message = inbound_.peek(length)) {
+            fn(message, length);
+            inbound_.consume(length);
+            count++;
+        }
+        return count;
+    }
+
+    // Sleep until a message arrives or timeout_ms passes
+    void wait(int timeout_ms);
+
+private:
+    uint8_t* segment_ = nullptr;
+    size_t segment_size_ = 0;
+    shm_detail::SegmentHeader* header_ = nullptr;
+    shm_detail::SlotHeader* slot_ = nullptr;
+    ShmRing outbound_;  // to the exchange
+    ShmRing inbound_;   // from the exchange
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Single-producer single-consumer ring of variable-length records, laid out
+// in memory that may be shared between processes. Each record is an 8-byte
+// header (the payload length) followed by the payload, padded to 8 bytes, so
+// every payload starts 8-byte aligned and is contiguous: a record that would
+// run past the end is preceded by a wrap marker and written at the start.
+//
+// Writers reserve a record, fill it in place and commit it; readers look at
+// the oldest record where it lies and consume it when done. Positions only
+// grow; each side publishes its own and caches the other's, so the shared
+// cache lines move only when a side runs out of what it last saw.
+//
+// A side with nothing to do can sleep on its ring's doorbell, a futex word
+// the other side bumps only when it sees the sleeper flag set.
+
+// Spin-wait hint for busy-polling loops
+inline void shm_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Futex calls on words that may be shared between processes
+inline void shm_futex_wait(std::atomic<uint32_t>* word, uint32_t expected, int timeout_ms) {
+    timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = static_cast<long>(timeout_ms % 1000) * 1000000;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, timeout_ms < 0 ? nullptr : &timeout,
+            nullptr, 0);
+}
+
+inline void shm_futex_wake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+// A sleeper sets sleepers before its last look for work; a waker publishes
+// its work, then rings only if someone may be asleep
+struct ShmDoorbell {
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> sleepers;
+
+    void reset() {
+        sequence.store(0, std::memory_order_relaxed);
+        sleepers.store(0, std::memory_order_relaxed);
+    }
+
+    void ring() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) != 0) {
+            sequence.fetch_add(1, std::memory_order_release);
+            shm_futex_wake(&sequence);
+        }
+    }
+
+    // Sleep until rung or timeout_ms passes, unless idle() turns false once
+    // the sleeper flag is up
+    template <typename Idle>
+    void wait(Idle&& idle, int timeout_ms) {
+        uint32_t sequence_seen = sequence.load(std::memory_order_acquire);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        if (idle()) {
+            shm_futex_wait(&sequence, sequence_seen, timeout_ms);
+        }
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
+
+struct ShmRingHeader {
+    alignas(64) std::atomic<uint64_t> head;   // consumer
+    alignas(64) std::atomic<uint64_t> tail;   // producer
+    alignas(64) ShmDoorbell doorbell;         // rung by the producer for a sleeping consumer
+
+    void reset() {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        doorbell.reset();
+    }
+};
+
+class ShmRing {
+public:
+    static constexpr size_t RECORD_HEADER = 8;
+
+    // Bytes a ring of capacity bytes (a power of two) takes
+    static size_t footprint(size_t capacity) { return sizeof(ShmRingHeader) + capacity; }
+
+    ShmRing() = default;
+
+    // memory holds footprint(capacity) bytes, already reset by whoever set up
+    // the ring
+    void attach(void* memory, size_t capacity) {
+        header_ = static_cast<ShmRingHeader*>(memory);
+        data_ = static_cast<uint8_t*>(memory) + sizeof(ShmRingHeader);
+        capacity_ = capacity;
+        position_ = 0;
+        cached_ = 0;
+    }
+
+    // Producer side: continue from wherever the ring's producer position is
+    void attach_producer(void* memory, size_t capacity) {
+        attach(memory, capacity);
+        position_ = header_->tail.load(std::memory_order_relaxed);
+        cached_ = header_->head.load(std::memory_order_acquire);
+    }
+
+    // Consumer side
+    void attach_consumer(void* memory, size_t capacity) {
+        attach(memory, capacity);
+        position_ = header_->head.load(std::memory_order_relaxed);
+        cached_ = header_->tail.load(std::memory_order_acquire);
+    }
+
+    static size_t record_size(size_t length) { return RECORD_HEADER + ((length + 7) & ~static_cast<size_t>(7)); }
+
+    // Largest payload that can ever fit
+    size_t max_record() const { return capacity_ / 2 - RECORD_HEADER; }
+
+    // Producer: space for a length-byte payload, or nullptr if the ring is
+    // too full. The record becomes visible at commit; a wrap marker written
+    // for a reservation that is never committed is simply skipped later.
+    uint8_t* reserve(size_t length) {
+        if (length > max_record()) {
+            return nullptr;
+        }
+        size_t size = record_size(length);
+        size_t offset = position_ & (capacity_ - 1);
+        size_t skip = offset + size > capacity_ ? capacity_ - offset : 0;
+        if (position_ + skip + size - cached_ > capacity_) {
+            cached_ = header_->head.load(std::memory_order_acquire);
+            if (position_ + skip + size - cached_ > capacity_) {
+                return nullptr;
+            }
+        }
+        if (skip > 0) {
+            uint64_t marker = WRAP_MARKER;
+            memcpy(data_ + offset, &marker, sizeof(marker));
+            position_ += skip;
+            offset = 0;
+        }
+        return data_ + offset + RECORD_HEADER;
+    }
+
+    void commit(size_t length) {
+        uint64_t header = length;
+        memcpy(data_ + (position_ & (capacity_ - 1)), &header, sizeof(header));
+        position_ += record_size(length);
+        header_->tail.store(position_, std::memory_order_release);
+    }
+
+    bool write(const void* payload, size_t length) {
+        uint8_t* record = reserve(length);
+        if (!record) {
+            return false;
+        }
+        memcpy(record, payload, length);
+        commit(length);
+        return true;
+    }
+
+    // Consumer: the oldest record, or nullptr if there is none
+    const uint8_t* peek(size_t& length) {
+        for (;;) {
+            if (position_ == cached_) {
+                cached_ = header_->tail.load(std::memory_order_acquire);
+                if (position_ == cached_) {
+                    return nullptr;
+                }
+            }
+            size_t offset = position_ & (capacity_ - 1);
+            uint64_t header;
+            memcpy(&header, data_ + offset, sizeof(header));
+            if (header == WRAP_MARKER) {
+                position_ += capacity_ - offset;
+                continue;
+            }
+            length = static_cast<size_t>(header);
+            return data_ + offset + RECORD_HEADER;
+        }
+    }
+
+    void consume(size_t length) {
+        position_ += record_size(length);
+        header_->head.store(position_, std::memory_order_release);
+    }
+
+    bool empty() {
+        size_t length;
+        return peek(length) == nullptr;
+    }
+
+    ShmDoorbell& doorbell() { return header_->doorbell; }
+
+private:
+    static constexpr uint64_t WRAP_MARKER = UINT64_MAX;
+
+    ShmRingHeader* header_ = nullptr;
+    uint8_t* data_ = nullptr;
+    size_t capacity_ = 0;
+    uint64_t position_ = 0;  // own position: tail for the producer, head for the consumer
+    uint64_t cached_ = 0;    // the other side's position as last seen
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Hierarchical timer wheel. Four levels of 256 slots each cover 2^32 ticks;
+// timers further out are parked in the top level and re-filed when it turns.
+// Scheduling and cancelling are O(1); advancing costs one step per elapsed
+// tick plus one cascade per timer per level it passes through.
+//
+// Timers live in a pooled node array linked into per-slot lists, so a
+// cancelled timer's node is reused by the next schedule. Callbacks may
+// schedule or cancel other timers while running.
+class TimerWheel {
+public:
+    using TimerId = uint64_t;
+    using Callback = std::function<void(uint64_t now)>;
+
+    static constexpr TimerId INVALID_TIMER = 0;
+
+    explicit TimerWheel(uint64_t tick_us = 1000, uint64_t start_us = 0)
+        : tick_us_(tick_us == 0 ? 1 : tick_us),
+          current_tick_(start_us / (tick_us == 0 ? 1 : tick_us)),
+          now_us_(start_us) {}
+
+    // Fire cb once the wheel reaches when_us (immediately on the next advance
+    // if that time has already passed)
+    TimerId schedule_at(uint64_t when_us, Callback cb) {
+        uint32_t index = allocate_node();
+        Node& node = nodes_[index];
+        node.when_tick = (when_us + tick_us_ - 1) / tick_us_;
+        node.callback = std::move(cb);
+        node.armed = true;
+        insert(index);
+        ++pending_;
+        return make_id(index, node.generation);
+    }
+
+    TimerId schedule_after(uint64_t delay_us, Callback cb) {
+        return schedule_at(now_us_ + delay_us, std::move(cb));
+    }
+
+    // Returns false if the timer already fired or was cancelled
+    bool cancel(TimerId id) {
+        uint32_t index = static_cast<uint32_t>(id & 0xffffffffULL);
+        uint32_t generation = static_cast<uint32_t>(id >> 32);
+        if (id == INVALID_TIMER || index >= nodes_.size()) {
+            return false;
+        }
+        Node& node = nodes_[index];
+        if (!node.armed || node.generation != generation) {
+            return false;
+        }
+        unlink(index);
+        release_node(index);
+        --pending_;
+        return true;
+    }
+
+    // Fire every timer due at or before now_us, in deadline order. At most
+    // max_fired callbacks run per call; the rest stay due for the next call.
+    // Returns the number of callbacks run.
+    size_t advance(uint64_t now_us, size_t max_fired = std::numeric_limits<size_t>::max()) {
+        uint64_t target_tick = now_us / tick_us_;
+        if (now_us > now_us_) {
+            now_us_ = now_us;
+        }
+
+        size_t fired = 0;
+        for (;;) {
+            Slot& slot = slots_[0][current_tick_ & SLOT_MASK];
+            while (slot.head != NIL) {
+                if (fired >= max_fired) {
+                    return fired;
+                }
+                uint32_t index = slot.head;
+                unlink(index);
+                Callback cb = std::move(nodes_[index].callback);
+                release_node(index);
+                --pending_;
+                ++fired;
+                cb(now_us_);
+            }
+            if (current_tick_ >= target_tick) {
+                break;
+            }
+            if (pending_ == 0) {
+                // Nothing to fire on the way; jump straight there
+                current_tick_ = target_tick;
+                continue;
+            }
+            ++current_tick_;
+            if ((current_tick_ & SLOT_MASK) == 0) {
+                cascade(1);
+            }
+        }
+        return fired;
+    }
+
+    // Drop every timer and restart the wheel at start_us. Ids handed out
+    // before the reset stay invalid.
+    void reset(uint64_t start_us) {
+        for (auto& level : slots_) {
+            for (auto& slot : level) {
+                slot = Slot();
+            }
+        }
+        for (uint32_t index = 0; index < nodes_.size(); index++) {
+            if (nodes_[index].armed) {
+                release_node(index);
+            }
+        }
+        pending_ = 0;
+        current_tick_ = start_us / tick_us_;
+        now_us_ = start_us;
+    }
+
+    uint64_t now() const { return now_us_; }
+    uint64_t tick_us() const { return tick_us_; }
+    size_t pending() const { return pending_; }
+
+private:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 8;
+    static constexpr uint64_t SLOTS = 1ULL << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+    static constexpr uint32_t NIL = std::numeric_limits<uint32_t>::max();
+
+    struct Node {
+        uint64_t when_tick = 0;
+        Callback callback;
+        uint32_t prev = NIL;
+        uint32_t next = NIL;
+        uint32_t generation = 1;
+        uint8_t level = 0;
+        uint16_t slot = 0;
+        bool armed = false;
+    };
+
+    struct Slot {
+        uint32_t head = NIL;
+        uint32_t tail = NIL;
+    };
+
+    uint64_t tick_us_;
+    uint64_t current_tick_;
+    uint64_t now_us_;
+    size_t pending_ = 0;
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> free_nodes_;
+    Slot slots_[LEVELS][SLOTS];
+
+    static TimerId make_id(uint32_t index, uint32_t generation) {
+        return (static_cast<uint64_t>(generation) << 32) | index;
+    }
+
+    uint32_t allocate_node() {
+        if (!free_nodes_.empty()) {
+            uint32_t index = free_nodes_.back();
+            free_nodes_.pop_back();
+            return index;
+        }
+        nodes_.emplace_back();
+        return static_cast<uint32_t>(nodes_.size() - 1);
+    }
+
+    void release_node(uint32_t index) {
+        Node& node = nodes_[index];
+        node.callback = nullptr;
+        node.armed = false;
+        // Generation 0 would make a zero id possible; skip it on wrap
+        if (++node.generation == 0) {
+            node.generation = 1;
+        }
+        free_nodes_.push_back(index);
+    }
+
+    // File a node under the level whose span covers its distance from now
+    void insert(uint32_t index) {
+        Node& node = nodes_[index];
+        uint64_t when = node.when_tick < current_tick_ ? current_tick_ : node.when_tick;
+        uint64_t delta = when - current_tick_;
+
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1)))) {
+            ++level;
+        }
+        if (delta >= (1ULL << (SLOT_BITS * LEVELS))) {
+            // Beyond the wheel's range: park it one turn of the top level out
+            when = current_tick_ + (SLOT_MASK << (SLOT_BITS * (LEVELS - 1)));
+        }
+        uint16_t slot_index = static_cast<uint16_t>((when >> (SLOT_BITS * level)) & SLOT_MASK);
+
+        node.level = static_cast<uint8_t>(level);
+        node.slot = slot_index;
+        node.next = NIL;
+        Slot& slot = slots_[level][slot_index];
+        node.prev = slot.tail;
+        if (slot.tail != NIL) {
+            nodes_[slot.tail].next = index;
+        } else {
+            slot.head = index;
+        }
+        slot.tail = index;
+    }
+
+    void unlink(uint32_t index) {
+        Node& node = nodes_[index];
+        Slot& slot = slots_[node.level][node.slot];
+        if (node.prev != NIL) {
+            nodes_[node.prev].next = node.next;
+        } else {
+            slot.head = node.next;
+        }
+        if (node.next != NIL) {
+            nodes_[node.next].prev = node.prev;
+        } else {
+            slot.tail = node.prev;
+        }
+        node.prev = NIL;
+        node.next = NIL;
+    }
+
+    // Re-file the timers of the level's current slot into the levels below,
+    // turning the next level first when this one wraps
+    void cascade(int level) {
+        if (level >= LEVELS) {
+            return;
+        }
+        uint64_t slot_index = (current_tick_ >> (SLOT_BITS * level)) & SLOT_MASK;
+        if (slot_index == 0) {
+            cascade(level + 1);
+        }
+        Slot& slot = slots_[level][slot_index];
+        uint32_t index = slot.head;
+        slot = Slot();
+        while (index != NIL) {
+            uint32_t next = nodes_[index].next;
+            insert(index);
+            index = next;
+        }
+    }
+};